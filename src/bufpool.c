@@ -0,0 +1,149 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#include "config.h"
+
+#include "bufpool.h"
+
+#include "hugemem.h"
+#include "log.h"
+
+#include <stdlib.h>
+
+#define CACHE_LINE      64
+
+struct bufpool {
+  char*         base;
+  size_t        slot_size;
+  uint32_t      slots;
+  uint32_t*     next;           /* free stack links */
+  uint32_t      top __attribute__ ((aligned (CACHE_LINE)));
+};
+
+/* Any thread.  The stack is safe from ABA because only one thread
+ * pops: nothing can take the top away and put it back while that
+ * thread is looking at it. */
+static void push (struct bufpool *pool, uint32_t h)
+{
+  uint32_t top = __atomic_load_n (&pool->top, __ATOMIC_RELAXED);
+
+  do
+    {
+      pool->next[h] = top;
+    }
+  while ( ! __atomic_compare_exchange_n (&pool->top, &top, h, 1,
+                                         __ATOMIC_RELEASE,
+                                         __ATOMIC_RELAXED) );
+}
+
+static uint32_t pop (struct bufpool *pool)
+{
+  uint32_t top = __atomic_load_n (&pool->top, __ATOMIC_ACQUIRE);
+
+  while ( top != BUFPOOL_NONE
+          && ! __atomic_compare_exchange_n (&pool->top, &top,
+                                            pool->next[top], 1,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_ACQUIRE) )
+    ;
+  return top;
+}
+
+struct bufpool* bufpool_create (size_t slots, size_t slot_size, FILE *log)
+{
+  struct bufpool *pool;
+  uint32_t i;
+
+  if ( slots == 0 || slots >= BUFPOOL_NONE )
+    {
+      LOG_ER (log, "Can't make a buffer pool of %lu slots.\n",
+              (unsigned long) slots);
+      return NULL;
+    }
+
+  pool = (struct bufpool *) calloc (1, sizeof (*pool));
+  if ( pool == NULL )
+    {
+      LOG_ER (log, "Failed to allocate %lu bytes for a buffer pool.\n",
+              (unsigned long) sizeof (*pool));
+      return NULL;
+    }
+
+  pool->slots = slots;
+  pool->slot_size = (slot_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+  pool->next = (uint32_t *) malloc (slots * sizeof (uint32_t));
+  pool->base = (char *) hugemem_alloc (slots * pool->slot_size, log);
+  if ( pool->next == NULL || pool->base == NULL )
+    {
+      LOG_ER (log, "Failed to allocate %lu slots of %lu bytes for a "
+              "buffer pool.\n", (unsigned long) slots,
+              (unsigned long) pool->slot_size);
+      bufpool_destroy (pool);
+      return NULL;
+    }
+
+  /* slot 0 on top */
+  pool->top = BUFPOOL_NONE;
+  for ( i = slots; i-- > 0; )
+    {
+      push (pool, i);
+    }
+
+  return pool;
+}
+
+void bufpool_destroy (struct bufpool *pool)
+{
+  if ( pool == NULL )
+    {
+      return;
+    }
+  if ( pool->base != NULL )
+    {
+      hugemem_free (pool->base, (size_t) pool->slots * pool->slot_size);
+    }
+  free (pool->next);
+  free (pool);
+}
+
+void* bufpool_get (struct bufpool *pool)
+{
+  uint32_t h = pop (pool);
+
+  if ( h == BUFPOOL_NONE )
+    {
+      return NULL;
+    }
+  return pool->base + (size_t) h * pool->slot_size;
+}
+
+void bufpool_release (struct bufpool *pool, void *buf)
+{
+  push (pool, bufpool_handle (pool, buf));
+}
+
+uint32_t bufpool_handle (struct bufpool *pool, const void *buf)
+{
+  return (uint32_t) (((const char *) buf - pool->base) / pool->slot_size);
+}
+
+void* bufpool_buf (struct bufpool *pool, uint32_t handle)
+{
+  return pool->base + (size_t) handle * pool->slot_size;
+}
+
+int bufpool_owns (struct bufpool *pool, const void *buf)
+{
+  return (const char *) buf >= pool->base
+         && (const char *) buf < pool->base
+                                 + (size_t) pool->slots * pool->slot_size;
+}
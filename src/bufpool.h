@@ -0,0 +1,51 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#ifndef BUFPOOL_DOT_H
+#define BUFPOOL_DOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Pool of fixed size message buffers.
+ *
+ * One block of memory from hugemem_alloc(), cut into slots of the slot
+ * size rounded up to a cache line.  Free slots
+ * are kept on a stack, so the most recently used, cache and TLB warm
+ * slots are handed out first and memory that is never needed is never
+ * touched.
+ *
+ * A slot has one owner at a time: whoever took it, or the thread it
+ * was handed to, gives it back with bufpool_release().  Releases may
+ * come from any thread, but only one thread may take slots.
+ */
+
+#define BUFPOOL_NONE        UINT32_MAX
+
+struct bufpool;
+
+struct bufpool* bufpool_create (size_t slots, size_t slot_size, FILE *log);
+void            bufpool_destroy (struct bufpool *pool);
+
+/* Take a slot, NULL if the pool is empty. */
+void*           bufpool_get (struct bufpool *pool);
+void            bufpool_release (struct bufpool *pool, void *buf);
+
+/* Slots are passed between threads by handle. */
+uint32_t        bufpool_handle (struct bufpool *pool, const void *buf);
+void*           bufpool_buf (struct bufpool *pool, uint32_t handle);
+
+/* Is buf one of the pool's slots? */
+int             bufpool_owns (struct bufpool *pool, const void *buf);
+
+#endif /* BUFPOOL_DOT_H */
@@ -103,6 +103,10 @@ uint64_t header_receipt_time(const char* header) {
   return header_uint64(header+RECEIPT_TIME_OFFSET);
 }
 
+uint32_t header_sender_ip(const char* header) {
+  return header_uint32(header+SENDER_IP_OFFSET);
+}
+
 const char* header_sender_ip_formatted(const char* header) {
   struct in_addr addr = { header_uint32(header+SENDER_IP_OFFSET) };
   return inet_ntoa(addr);
@@ -54,6 +54,7 @@ extern int  toknam_eq(const unsigned char* toknam, const unsigned char* nam) ;
 
 uint16_t    header_payload_length(const char* header);       /* Size of message body. */
 uint64_t    header_receipt_time(const char* header);         /* Now in msec. */
+uint32_t    header_sender_ip(const char* header);            /* Sender IP address, as in_addr.s_addr. */
 const char* header_sender_ip_formatted(const char* header);  /* Sender IP address, formatted. do not free(). */
 uint16_t    header_sender_port(const char* header);          /* Sender port number. */
 uint16_t    header_site_id(const char* header);              /* Site ID number */
@@ -61,5 +62,6 @@ uint16_t    header_site_id(const char* header);              /* Site ID number *
 /* The character at the beginning of the string is the length byte.
    Strings in events are Pascal style. */
 #define ROTATE_COMMAND    "\017Command::Rotate"
+#define HEARTBEAT_EVENT   "\021System::Heartbeat"
 
 #endif /* HEADER_DOT_H */
@@ -0,0 +1,85 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+
+#include "config.h"
+
+#include "hugemem.h"
+
+#include "log.h"
+#include "opt.h"
+#include "perror.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static size_t round_size (size_t size)
+{
+  size_t page = arg_hugepages ? HUGEMEM_PAGE : (size_t) getpagesize ();
+
+  return (size + page - 1) & ~(page - 1);
+}
+
+void* hugemem_alloc (size_t size, FILE *log)
+{
+  static int told = 0;
+  size_t len = round_size (size);
+  void *mem;
+
+#ifdef MAP_HUGETLB
+  if ( arg_hugepages )
+    {
+      mem = mmap (NULL, len, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if ( mem != MAP_FAILED )
+        {
+          return mem;
+        }
+      if ( ! told )
+        {
+          LOG_INF (log, "Not enough reserved huge pages, trying transparent "
+                   "ones.\n");
+        }
+    }
+#endif
+
+  mem = mmap (NULL, len, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if ( mem == MAP_FAILED )
+    {
+      PERROR (log, "mmap");
+      return NULL;
+    }
+
+  if ( arg_hugepages )
+    {
+#ifdef MADV_HUGEPAGE
+      if ( madvise (mem, len, MADV_HUGEPAGE) < 0 && ! told )
+#else
+      if ( ! told )
+#endif
+        {
+          LOG_WARN (log, "No huge pages, using ordinary pages.\n");
+        }
+      told = 1;
+    }
+
+  return mem;
+}
+
+void hugemem_free (void *mem, size_t size)
+{
+  if ( mem != NULL )
+    {
+      munmap (mem, round_size (size));
+    }
+}
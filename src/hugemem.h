@@ -0,0 +1,36 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+
+#ifndef HUGEMEM_DOT_H
+#define HUGEMEM_DOT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Memory for the buffers events are copied through.
+ *
+ * With --hugepages it comes in 2MB pages, to take TLB misses off the
+ * copy paths: reserved huge pages (MAP_HUGETLB, vm.nr_hugepages) if
+ * there are enough, transparent huge pages if not, and ordinary pages
+ * if the kernel has neither.  Without, it is ordinary anonymous memory.
+ */
+
+#define HUGEMEM_PAGE    (2*1024*1024)
+
+/* Zeroed memory of at least size bytes, NULL on failure. */
+void*   hugemem_alloc (size_t size, FILE *log);
+
+/* Free what hugemem_alloc() returned, with the size it was asked for. */
+void    hugemem_free (void *mem, size_t size);
+
+#endif /* HUGEMEM_DOT_H */
@@ -16,6 +16,7 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <time.h>
 
 /* Journal methods:
  *
@@ -29,6 +30,23 @@
  * write() -- writes "count" bytes from "buf" into a journal, return
  * the number of bytes written on success, -1 on error
  *
+ * backlog() -- tells the journal how many events are waiting to be
+ * written, sampled every --depth-interval; a gz journal trades ratio
+ * for speed while it is high (--gz-adaptive-depth), and a journal
+ * whose disk is filling moves (--min-free-mb).  Returns 1 if the
+ * journal went on in a new file, else 0
+ *
+ * set_range() -- the next close names the journal for the events
+ * received from "start" up to "end" (--rotate-on-event-time), rather
+ * than for when it was opened and closed
+ *
+ * written() -- bytes written since the journal was opened, as events,
+ * or with "on_disk" as far as they have reached the file, compressed
+ *
+ * lost() -- events write() took, then lost as a later write or the
+ * close failed, since the last call; only a journal which holds events
+ * back (delta) loses any
+ *
  */
 
 struct journal;
@@ -41,6 +59,10 @@ struct journal_vtbl {
 
   int   (*read)         (struct journal* this_journal, void* buf, size_t count);
   int   (*write)        (struct journal* this_journal, void* buf, size_t count);
+  int   (*backlog)      (struct journal* this_journal, int pending, FILE *log);
+  void  (*set_range)    (struct journal* this_journal, time_t start, time_t end);
+  long long (*written)  (struct journal* this_journal, int on_disk);
+  int   (*lost)         (struct journal* this_journal);
 };
 
 struct journal {
@@ -0,0 +1,299 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#include "config.h"
+
+#include "journal.h"
+#include "journal_delta.h"
+
+#include "header.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DELTA_BLOCK     (64*1024)   /* record bytes per block */
+#define VARINT_MAX      10
+
+struct priv {
+  struct journal  inner;            /* the journal it goes to */
+  int             writing;
+  int             magic;            /* still to be written */
+
+  unsigned char   senders[JOURNAL_DELTA_SENDERS_MAX]
+                         [JOURNAL_DELTA_SENDER_LENGTH];
+  int             nsenders;
+  int             last;             /* sender of the previous record */
+  uint64_t        prev;             /* receipt time of the previous record */
+  uint32_t        nrec;
+  long long       nbytes_written;   /* as events, since the open */
+  int             lost;             /* records of blocks which failed */
+
+  unsigned char*  body;             /* the block's records */
+  size_t          bodylen;
+};
+
+static unsigned char* put_varint(unsigned char* p, uint64_t v)
+{
+  while ( v >= 0x80 )
+    {
+      *p++ = (unsigned char)(v | 0x80);
+      v >>= 7;
+    }
+  *p++ = (unsigned char)v;
+  return p;
+}
+
+/* The index of the sender in the block, -1 if the block has no room. */
+static int sender(struct priv* ppriv, const unsigned char* s)
+{
+  int i;
+
+  if ( ppriv->nsenders > 0
+       && memcmp(ppriv->senders[ppriv->last], s,
+                 JOURNAL_DELTA_SENDER_LENGTH) == 0 )
+    {
+      return ppriv->last;
+    }
+  for ( i = 0; i < ppriv->nsenders; ++i )
+    {
+      if ( memcmp(ppriv->senders[i], s, JOURNAL_DELTA_SENDER_LENGTH) == 0 )
+        {
+          return ppriv->last = i;
+        }
+    }
+  if ( ppriv->nsenders == JOURNAL_DELTA_SENDERS_MAX )
+    {
+      return -1;
+    }
+  memcpy(ppriv->senders[i], s, JOURNAL_DELTA_SENDER_LENGTH);
+  return ppriv->last = ppriv->nsenders++;
+}
+
+/* Writes the block out, the records it held are lost if that fails. */
+static int flush_block(struct priv* ppriv)
+{
+  unsigned char head[sizeof(JOURNAL_DELTA_MAGIC) + 2 * VARINT_MAX
+                     + sizeof(ppriv->senders)];
+  unsigned char* p = head;
+  size_t len;
+  int ret = 0;
+
+  if ( ppriv->nrec == 0 )
+    {
+      return 0;
+    }
+
+  if ( ppriv->magic )
+    {
+      memcpy(p, JOURNAL_DELTA_MAGIC, sizeof(JOURNAL_DELTA_MAGIC) - 1);
+      p += sizeof(JOURNAL_DELTA_MAGIC) - 1;
+      ppriv->magic = 0;
+    }
+  p = put_varint(p, ppriv->nrec);
+  p = put_varint(p, ppriv->nsenders);
+  len = (size_t)ppriv->nsenders * JOURNAL_DELTA_SENDER_LENGTH;
+  memcpy(p, ppriv->senders, len);
+  p += len;
+
+  if ( ppriv->inner.vtbl->write(&ppriv->inner, head, p - head)
+         != (int)(p - head)
+       || ppriv->inner.vtbl->write(&ppriv->inner, ppriv->body,
+                                   ppriv->bodylen) != (int)ppriv->bodylen )
+    {
+      ppriv->lost += ppriv->nrec;
+      ret = -1;
+    }
+
+  ppriv->nrec = 0;
+  ppriv->nsenders = 0;
+  ppriv->last = 0;
+  ppriv->prev = 0;
+  ppriv->bodylen = 0;
+  return ret;
+}
+
+static int xclose(struct journal* this_journal, FILE *log)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+  int ret = 0;
+
+  if ( ppriv->writing )
+    {
+      ret = flush_block(ppriv);
+      ppriv->writing = 0;
+    }
+  if ( ppriv->inner.vtbl->close(&ppriv->inner, log) < 0 )
+    {
+      ret = -1;
+    }
+  return ret;
+}
+
+static void destructor(struct journal* this_journal, FILE *log)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  if ( ppriv->writing )
+    {
+      xclose(this_journal, log);
+    }
+  ppriv->inner.vtbl->destructor(&ppriv->inner, log);
+
+  free(ppriv->body);
+  free(ppriv);
+
+  this_journal->vtbl = 0;
+  this_journal->priv = 0;
+}
+
+static int xopen(struct journal* this_journal, int flags, FILE *log)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  if ( ppriv->inner.vtbl->open(&ppriv->inner, flags, log) < 0 )
+    return -1;
+
+  if ( flags == O_WRONLY )
+    {
+      ppriv->writing = 1;
+      ppriv->magic = 1;
+      ppriv->nbytes_written = 0;
+    }
+  return 0;
+}
+
+/* Encoded journals are read back with journal_reader. */
+static int xread(struct journal* this_journal, void* ptr, size_t size)
+{
+  (void)this_journal;  /* appease -Wall -Werror */
+  (void)ptr;           /* appease -Wall -Werror */
+  (void)size;          /* appease -Wall -Werror */
+
+  return -1;
+}
+
+static int xwrite(struct journal* this_journal, void* ptr, size_t size)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+  const unsigned char* hdr = (const unsigned char*)ptr;
+  unsigned char* p;
+  uint64_t ts, delta;
+  size_t len;
+  int s;
+
+  if ( ! ppriv->writing || size < HEADER_LENGTH
+       || (len = size - HEADER_LENGTH) > 0xffff )
+    return -1;
+
+  /* A full block goes out before this record is added, so should that
+   * fail this record is the caller's to count, the block's are lost(). */
+  if ( ppriv->bodylen >= DELTA_BLOCK && flush_block(ppriv) < 0 )
+    return -1;
+
+  if ( (s = sender(ppriv, hdr + SENDER_IP_OFFSET)) < 0 )
+    {
+      if ( flush_block(ppriv) < 0 )
+        return -1;
+      s = sender(ppriv, hdr + SENDER_IP_OFFSET);
+    }
+
+  /* zigzag, so a clock stepping back costs a few bytes, not ten */
+  ts = header_receipt_time(ptr);
+  delta = ts - ppriv->prev;
+  delta = (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+  ppriv->prev = ts;
+
+  p = ppriv->body + ppriv->bodylen;
+  p = put_varint(p, s);
+  p = put_varint(p, delta);
+  p = put_varint(p, len);
+  memcpy(p, hdr + HEADER_LENGTH, len);
+  ppriv->bodylen = p + len - ppriv->body;
+  ++ppriv->nrec;
+  ppriv->nbytes_written += size;
+
+  return size;
+}
+
+/* The journal may move to a new file (--min-free-mb).  Blocks stand
+ * alone, so the one being filled simply goes to the new file once it
+ * is full, after the magic the new file needs. */
+static int xbacklog(struct journal* this_journal, int pending, FILE *log)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  if ( ppriv->inner.vtbl->backlog(&ppriv->inner, pending, log) )
+    {
+      ppriv->magic = 1;
+      return 1;
+    }
+  return 0;
+}
+
+static void xset_range(struct journal* this_journal, time_t start, time_t end)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  ppriv->inner.vtbl->set_range(&ppriv->inner, start, end);
+}
+
+static long long xwritten(struct journal* this_journal, int on_disk)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  return on_disk ? ppriv->inner.vtbl->written(&ppriv->inner, 1)
+                 : ppriv->nbytes_written;
+}
+
+static int xlost(struct journal* this_journal)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+  int lost = ppriv->lost + ppriv->inner.vtbl->lost(&ppriv->inner);
+
+  ppriv->lost = 0;
+  return lost;
+}
+
+int journal_delta_ctor(struct journal* this_journal, FILE *log)
+{
+  static struct journal_vtbl vtbl = {
+      destructor,
+      xopen, xclose,
+      xread, xwrite,
+      xbacklog,
+      xset_range,
+      xwritten,
+      xlost
+  };
+
+  struct priv* ppriv;
+
+  ppriv = (struct priv*)calloc(1, sizeof(struct priv));
+  if ( 0 == ppriv
+       || 0 == (ppriv->body = (unsigned char*)malloc(DELTA_BLOCK + 0xffff
+                                                     + 3 * VARINT_MAX)) )
+    {
+      LOG_ER(log, "Malloc failed attempting to allocate %d bytes.\n",
+                   sizeof(*ppriv) + DELTA_BLOCK);
+      free(ppriv);
+      return -1;
+    }
+
+  /* this_journal is left as it was until nothing can fail */
+  ppriv->inner = *this_journal;
+  this_journal->vtbl = &vtbl;
+  this_journal->priv = ppriv;
+
+  return 0;
+}
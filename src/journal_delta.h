@@ -0,0 +1,57 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+
+#ifndef JOURNAL_DELTA_DOT_H
+#define JOURNAL_DELTA_DOT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* With --journal-encoding=delta the stream of headers and events a
+ * journal holds (before its own compression, if any) is encoded in
+ * blocks, each of which stands alone:
+ *
+ *   "LJDH"   magic, once at the start of the journal
+ *
+ *   varint   number of records in the block
+ *   varint   number of senders in the block
+ *   ...      the senders, JOURNAL_DELTA_SENDER_LENGTH bytes each: IP,
+ *            port, site ID and extension as in the header
+ *   ...      the records:
+ *              varint  sender, an index into the block's senders
+ *              varint  receipt time less the previous record's, zigzag
+ *                      encoded, the first of a block less 0
+ *              varint  payload length
+ *              ...     payload
+ *
+ * Varints are little endian base 128.  A record is 4-5 bytes of header
+ * rather than HEADER_LENGTH, and journal_reader gives back the
+ * standard headers.
+ *
+ * A block is built in memory, up to 64KB of records which the journal
+ * underneath, its --journal-sync-mb and --journal-sync-ms included, has
+ * not seen yet: a crash loses them, and when the block fails to be
+ * written they are counted by lost() rather than by the write.
+ */
+
+#define JOURNAL_DELTA_MAGIC           "LJDH"
+#define JOURNAL_DELTA_SENDER_LENGTH   12
+#define JOURNAL_DELTA_SENDERS_MAX     64
+
+struct journal;
+
+/* Encodes what goes into the journal already made in this_journal,
+ * which it takes over. */
+int journal_delta_ctor (struct journal* this_journal, FILE *log);
+
+#endif /* JOURNAL_DELTA_DOT_H */
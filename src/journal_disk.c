@@ -0,0 +1,380 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+
+#define _GNU_SOURCE     /* fallocate(), sync_file_range() */
+#include "config.h"
+
+#include "journal_disk.h"
+
+#include "live_stats.h"
+#include "log.h"
+#include "opt.h"
+#include "perror.h"
+#include "rename_journal.h"
+#include "time_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if HAVE_SYS_STATVFS_H
+#include <sys/statvfs.h>
+#endif
+
+#define MB  (1024*1024LL)
+
+/* What the next journal is likely to take. */
+static long long expected (struct journal_disk* disk)
+{
+  long long max = 0;
+  int i;
+
+  for ( i = 0; i < JOURNAL_DISK_HISTORY; ++i )
+    {
+      if ( disk->sizes[i] > max )
+        {
+          max = disk->sizes[i];
+        }
+    }
+  return max;
+}
+
+/* Bytes free in the directory of path, -1 if that can't be told. */
+long long journal_disk_free (const char* path)
+{
+#if HAVE_SYS_STATVFS_H
+  char dir[PATH_MAX];
+  const char* slash = strrchr(path, '/');
+  struct statvfs st;
+  unsigned long bsize;
+
+  if ( slash == NULL )
+    {
+      strcpy(dir, ".");
+    }
+  else
+    {
+      snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path + 1), path);
+    }
+  if ( statvfs(dir, &st) < 0 )
+    {
+      return -1;
+    }
+
+  /* tmpfs give f_bsize==0 */
+  bsize = st.f_frsize ? st.f_frsize : st.f_bsize ? st.f_bsize : 4096;
+  return (long long)st.f_bavail * bsize;
+#else
+  (void)path;  /* appease -Wall -Werror */
+  return -1;
+#endif
+}
+
+int journal_disk_init (struct journal_disk* disk, const char* path, FILE *log)
+{
+  memset(disk, 0, sizeof(*disk));
+
+  if ( 0 == (disk->path = strdup(path)) )
+    {
+      LOG_ER(log, "Failed attempting to dup \"%s\"\n", path);
+      return -1;
+    }
+  disk->current = disk->path;
+  disk->fd = -1;
+
+  if ( arg_fallback_journal_dir )
+    {
+      const char* name = strrchr(path, '/');
+      size_t len;
+
+      name = name ? name + 1 : path;
+      len = strlen(arg_fallback_journal_dir) + strlen(name) + 2;
+      if ( 0 == (disk->fallback = (char*)malloc(len)) )
+        {
+          LOG_ER(log, "Failed to allocate %d bytes.\n", len);
+          free(disk->path);
+          return -1;
+        }
+      snprintf(disk->fallback, len, "%s/%s", arg_fallback_journal_dir, name);
+    }
+
+  return 0;
+}
+
+void journal_disk_destroy (struct journal_disk* disk)
+{
+  free(disk->path);
+  free(disk->fallback);
+  disk->path = disk->fallback = NULL;
+  disk->current = NULL;
+}
+
+const char* journal_disk_choose (struct journal_disk* disk, FILE *log)
+{
+  long long need = expected(disk) + arg_min_free_mb * MB;
+  long long avail = journal_disk_free(disk->path);
+
+  disk->checked = 0;
+
+  if ( avail < 0 )
+    {
+      LOG_WARN(log,"Unable to determine free space available for %s.\n",
+               disk->path);
+      disk->current = disk->path;
+      return disk->current;
+    }
+
+  if ( expected(disk) > avail / 2 )
+    {
+      LOG_WARN(log,"Low on disk space for new log %s.\n", disk->path);
+      LOG_WARN(log,"Available space is %lld bytes.\n", avail);
+      LOG_WARN(log,"Largest recent log file contained %lld bytes.\n",
+               expected(disk));
+    }
+
+  if ( arg_min_free_mb > 0 && avail < need )
+    {
+      if ( disk->fallback && journal_disk_free(disk->fallback) >= need )
+        {
+          if ( disk->current != disk->fallback )
+            {
+              LOG_ER(log, "Only %lld MB free for %s, journalling to %s.\n",
+                     avail / MB, disk->path, disk->fallback);
+            }
+          disk->current = disk->fallback;
+          return disk->current;
+        }
+      LOG_ER(log, "Only %lld MB free for %s, and no fallback with more.\n",
+             avail / MB, disk->path);
+    }
+  else if ( disk->current != disk->path )
+    {
+      LOG_INF(log, "%lld MB free for %s again, journalling there.\n",
+              avail / MB, disk->path);
+    }
+
+  disk->current = disk->path;
+  return disk->current;
+}
+
+int journal_disk_create (struct journal_disk* disk, FILE *log)
+{
+  int fd = open(disk->current, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  long long len = expected(disk);
+
+  disk->fd = fd;
+  disk->log = log;
+  disk->sync_failed = 0;
+  disk->started = disk->dropped = 0;
+  disk->sync_bytes = 0;
+  disk->sync_due = millis_now () + arg_journal_sync_ms;
+  disk->syncs = 0;
+  disk->sync_max = disk->sync_total = 0;
+
+  if ( fd < 0 || ! arg_journal_preallocate || len == 0 )
+    {
+      return fd;
+    }
+
+#if HAVE_FALLOCATE
+  /* The size stays what has been written, for anything reading the
+   * journal while it is written; the blocks are taken now. */
+  len += len / 8;
+  if ( fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len) < 0 )
+    {
+      LOG_WARN(log, "Failed to preallocate %lld bytes for %s: %s\n",
+               len, disk->current, strerror(errno));
+    }
+#else
+  (void)log;  /* appease -Wall -Werror */
+#endif
+  return fd;
+}
+
+int journal_disk_full (struct journal_disk* disk, long long nbytes,
+                       FILE *log)
+{
+  long long min = arg_min_free_mb * MB;
+  long long avail;
+
+  if ( arg_min_free_mb <= 0 || disk->fallback == NULL
+       || disk->current == disk->fallback
+       || nbytes - disk->checked < JOURNAL_DISK_CHECK )
+    {
+      return 0;
+    }
+  disk->checked = nbytes;
+
+  if ( (avail = journal_disk_free(disk->current)) < 0 || avail >= min
+       || journal_disk_free(disk->fallback) < min )
+    {
+      return 0;
+    }
+
+  LOG_ER(log, "Only %lld MB free for %s, moving to %s.\n",
+         avail / MB, disk->current, disk->fallback);
+  return 1;
+}
+
+/* The journal is still written, its write-back is left to the kernel
+ * until the next one. */
+static void sync_failed (struct journal_disk* disk, const char* what,
+                         FILE *log)
+{
+  PERROR(log, what);
+  LOG_WARN(log, "No more syncs of %s, write-back is left to the kernel.\n",
+           disk->current);
+  disk->sync_failed = 1;
+}
+
+/* Waits for the write-back the previous sync started and drops those
+ * pages, then starts write-back of what has been written since, so
+ * each sync waits only on I/O which has had a whole interval to go. */
+static void sync_disk (struct journal_disk* disk, FILE *log)
+{
+  struct timeval t0, t1;
+  unsigned long long usec;
+  off_t end;
+
+  if ( disk->fd < 0 || disk->sync_failed
+       || (end = lseek(disk->fd, 0, SEEK_CUR)) < 0 )
+    {
+      return;
+    }
+
+  micro_now (&t0);
+#if HAVE_SYNC_FILE_RANGE
+  if ( disk->started > disk->dropped
+       && sync_file_range(disk->fd, disk->dropped,
+                          disk->started - disk->dropped,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                          | SYNC_FILE_RANGE_WAIT_AFTER) < 0 )
+    {
+      sync_failed(disk, "sync_file_range", log);
+      return;
+    }
+#if HAVE_POSIX_FADVISE
+  if ( disk->started > disk->dropped )
+    {
+      posix_fadvise(disk->fd, disk->dropped, disk->started - disk->dropped,
+                    POSIX_FADV_DONTNEED);
+    }
+#endif
+  disk->dropped = disk->started;
+  if ( end > disk->started
+       && sync_file_range(disk->fd, disk->started, end - disk->started,
+                          SYNC_FILE_RANGE_WRITE) < 0 )
+    {
+      sync_failed(disk, "sync_file_range", log);
+      return;
+    }
+  disk->started = end;
+#else
+  /* without sync_file_range() the whole file, waited for */
+  if ( fdatasync(disk->fd) < 0 )
+    {
+      sync_failed(disk, "fdatasync", log);
+      return;
+    }
+#if HAVE_POSIX_FADVISE
+  posix_fadvise(disk->fd, disk->dropped, end - disk->dropped,
+                POSIX_FADV_DONTNEED);
+#endif
+  disk->started = disk->dropped = end;
+#endif
+  micro_now (&t1);
+
+  usec = micro_timediff (&t0, &t1);
+  ++disk->syncs;
+  disk->sync_total += usec;
+  disk->sync_max = usec > disk->sync_max ? usec : disk->sync_max;
+  live_histogram_record_shared (&gbl_live_stats->sync, usec / 1000);
+}
+
+void journal_disk_written (struct journal_disk* disk, long long nbytes)
+{
+  if ( arg_journal_sync_mb > 0
+       && nbytes - disk->sync_bytes >= arg_journal_sync_mb * MB )
+    {
+      disk->sync_bytes = nbytes;
+      sync_disk(disk, disk->log);
+    }
+}
+
+void journal_disk_tick (struct journal_disk* disk, FILE *log)
+{
+  unsigned long long now;
+
+  if ( arg_journal_sync_ms > 0 && (now = millis_now ()) >= disk->sync_due )
+    {
+      disk->sync_due = now + arg_journal_sync_ms;
+      sync_disk(disk, log);
+    }
+}
+
+void journal_disk_closed (struct journal_disk* disk, FILE *log)
+{
+  struct stat st;
+
+  disk->fd = -1;
+  if ( disk->syncs > 0 )
+    {
+      LOG_INF(log, "Synced %s %d times, %0.2f ms at most, %0.2f ms in all.\n",
+              disk->current, disk->syncs, disk->sync_max / 1000.,
+              disk->sync_total / 1000.);
+    }
+
+  if ( stat(disk->current, &st) < 0 )
+    {
+      return;
+    }
+  disk->sizes[disk->next] = st.st_size;
+  disk->next = (disk->next + 1) % JOURNAL_DISK_HISTORY;
+
+  /* what fallocate() took past the end goes with a truncate to the end */
+  if ( arg_journal_preallocate && truncate(disk->current, st.st_size) < 0 )
+    {
+      PERROR(log, disk->current);
+    }
+}
+
+int journal_disk_rename (struct journal_disk* disk, time_t* last_rotate,
+                         FILE *log)
+{
+  time_t start = disk->range_start;
+  time_t end = disk->range_end;
+
+  if ( end == 0 )
+    {
+      return rename_journal(disk->current, last_rotate, log);
+    }
+  disk->range_start = disk->range_end = 0;
+  return rename_journal_range(disk->current, start, end, log);
+}
+
+long long journal_disk_size (struct journal_disk* disk)
+{
+  off_t end;
+
+  if ( disk->fd < 0 || (end = lseek(disk->fd, 0, SEEK_CUR)) < 0 )
+    {
+      return 0;
+    }
+  return end;
+}
@@ -0,0 +1,104 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+
+#ifndef JOURNAL_DISK_DOT_H
+#define JOURNAL_DISK_DOT_H
+
+#include <stdio.h>
+#include <time.h>
+
+#define JOURNAL_DISK_HISTORY  4     /* journal sizes kept for sizing */
+#define JOURNAL_DISK_CHECK    (1024*1024)
+
+/* Where a journal writes and how much disk it takes, for the journal
+ * types which write files:
+ *
+ * With --journal-preallocate a new journal gets fallocate()d room for
+ * the largest of the last JOURNAL_DISK_HISTORY journals and an eighth,
+ * so it lands in a few large extents rather than growing one small
+ * append at a time, and the room it didn't use is given back at close.
+ *
+ * With --min-free-mb a journal goes to --fallback-journal-dir while its
+ * own filesystem has less than that free, counting the room the next
+ * journal will take.  It is checked at open, and from backlog() once
+ * JOURNAL_DISK_CHECK more bytes are written, so a filling disk makes
+ * a journal move rather than drop events.
+ *
+ * With --journal-sync-mb or --journal-sync-ms write-back of what has
+ * reached the file is started every so often with sync_file_range(),
+ * rather than left to the kernel to do in one large stall, and what an
+ * earlier sync started is waited for and dropped from the page cache,
+ * which journals would otherwise fill with pages nobody reads again.
+ */
+
+struct journal_disk {
+  char*       path;                 /* as configured */
+  char*       fallback;             /* the same name in the fallback dir */
+  const char* current;              /* one of the two */
+  long long   sizes[JOURNAL_DISK_HISTORY];
+  int         next;
+  long long   checked;              /* bytes written at the last check */
+
+  int         fd;                   /* of the journal being written */
+  FILE*       log;                  /* given to journal_disk_create() */
+  int         sync_failed;          /* write-back left to the kernel */
+  long long   started;              /* file offset write-back started to */
+  long long   dropped;              /* file offset dropped from the cache to */
+  long long   sync_bytes;           /* bytes written at the last sync */
+  unsigned long long sync_due;      /* millis_now() of the next sync */
+  int         syncs;                /* since open */
+  unsigned long long sync_max;      /* microseconds */
+  unsigned long long sync_total;
+
+  time_t      range_start;          /* set_range(), end 0 if not set */
+  time_t      range_end;
+};
+
+int  journal_disk_init (struct journal_disk* disk, const char* path,
+                        FILE *log);
+void journal_disk_destroy (struct journal_disk* disk);
+
+/* Picks where the next journal goes, returns disk->current. */
+const char* journal_disk_choose (struct journal_disk* disk, FILE *log);
+
+/* Creates disk->current for writing, preallocated; the descriptor or
+ * -1 with errno set. */
+int  journal_disk_create (struct journal_disk* disk, FILE *log);
+
+/* True when the journal should move to the fallback directory now,
+ * nbytes written so far. */
+int  journal_disk_full (struct journal_disk* disk, long long nbytes,
+                        FILE *log);
+
+/* For --journal-sync-mb, nbytes written so far.  From write(), which
+ * has no log, so failures go to the one given to create. */
+void journal_disk_written (struct journal_disk* disk, long long nbytes);
+
+/* For --journal-sync-ms, from backlog(). */
+void journal_disk_tick (struct journal_disk* disk, FILE *log);
+
+/* After disk->current is closed, gives back what wasn't used. */
+void journal_disk_closed (struct journal_disk* disk, FILE *log);
+
+/* Renames disk->current once closed, for its set_range() if it had
+ * one, else for when it was written from *last_rotate to now. */
+int  journal_disk_rename (struct journal_disk* disk, time_t* last_rotate,
+                          FILE *log);
+
+/* Bytes of the journal being written which have reached the file. */
+long long journal_disk_size (struct journal_disk* disk);
+
+/* Bytes free in the directory of path, -1 if that can't be told. */
+long long journal_disk_free (const char* path);
+
+#endif /* JOURNAL_DISK_DOT_H */
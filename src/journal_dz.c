@@ -0,0 +1,518 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#include "config.h"
+
+#include "journal.h"
+#include "journal_dz.h"
+#include "journal_gz.h"
+#include "journal_reader.h"
+
+#include "header.h"
+#include "hugemem.h"
+#include "journal_disk.h"
+#include "rename_journal.h"
+#include "log.h"
+#include "opt.h"
+#include "perror.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if HAVE_LIBZ
+
+#include <zlib.h>
+
+#define DZ_TYPES        64          /* event types sampled */
+#define DZ_EXEMPLAR_MAX 1024        /* longer events are cut */
+#define DZ_SAMPLE_EVERY 16          /* events per sample */
+#define DZ_OUT_BUFFER   (128*1024)
+
+/* The latest sampled event of one type. */
+struct exemplar {
+  uint32_t      hash;               /* of the event name */
+  uint32_t      count;              /* samples, halved at each training */
+  uint32_t      len;
+  unsigned char data[DZ_EXEMPLAR_MAX];
+};
+
+struct priv {
+  struct journal_disk disk;     /* disk.current is the file */
+  char* dict_path;
+  int fd;
+  struct journal_reader* rd;
+  z_stream zs;
+  unsigned char* out;
+  size_t outsize;
+  time_t ot;
+  long long nbytes_written;
+  int level;
+
+  /* the dictionary of the journal open now */
+  unsigned char dict[JOURNAL_DZ_DICT_MAX];
+  uint32_t dictlen;
+
+  unsigned long nevents;
+  int ntypes;
+  struct exemplar types[DZ_TYPES];
+};
+
+static int write_full(int fd, const void* buf, size_t len)
+{
+  size_t have = 0;
+
+  while ( have < len )
+    {
+      ssize_t n = write(fd, (const char*)buf + have, len - have);
+      if ( n < 0 )
+        {
+          return -1;
+        }
+      have += n;
+    }
+  return 0;
+}
+
+static void sample(struct priv* ppriv, const unsigned char* ptr, size_t size)
+{
+  const unsigned char* name = ptr + HEADER_LENGTH;
+  uint32_t hash = 2166136261u;
+  struct exemplar* e = NULL;
+  int i;
+
+  if ( ++ppriv->nevents % DZ_SAMPLE_EVERY != 0
+       || size <= HEADER_LENGTH || size < HEADER_LENGTH + 1u + name[0] )
+    {
+      return;
+    }
+
+  /* FNV-1a of the name, with its length byte */
+  for ( i = 0; i <= name[0]; ++i )
+    {
+      hash = (hash ^ name[i]) * 16777619u;
+    }
+
+  for ( i = 0; i < ppriv->ntypes; ++i )
+    {
+      if ( ppriv->types[i].hash == hash )
+        {
+          e = &ppriv->types[i];
+          break;
+        }
+    }
+  if ( e == NULL )
+    {
+      if ( ppriv->ntypes == DZ_TYPES )
+        {
+          return;
+        }
+      e = &ppriv->types[ppriv->ntypes++];
+      e->hash = hash;
+      e->count = 0;
+    }
+
+  ++e->count;
+  e->len = size < DZ_EXEMPLAR_MAX ? size : DZ_EXEMPLAR_MAX;
+  memcpy(e->data, ptr, e->len);
+}
+
+static int by_count(const void* a, const void* b)
+{
+  const struct exemplar* ea = *(const struct exemplar* const*)a;
+  const struct exemplar* eb = *(const struct exemplar* const*)b;
+
+  return ea->count < eb->count ? 1 : ea->count > eb->count ? -1 : 0;
+}
+
+/* The next dictionary: exemplars of the most sampled types that fit,
+ * the most common last, where deflate reaches them with the shortest
+ * distances.  Counts are halved so the mix follows the traffic. */
+static void train(struct priv* ppriv, FILE *log)
+{
+  struct exemplar* order[DZ_TYPES];
+  uint32_t len = 0;
+  int i, n = 0, keep = 0;
+
+  if ( ppriv->ntypes == 0 )
+    {
+      return;
+    }
+
+  for ( i = 0; i < ppriv->ntypes; ++i )
+    {
+      order[i] = &ppriv->types[i];
+    }
+  qsort(order, ppriv->ntypes, sizeof(order[0]), by_count);
+
+  while ( n < ppriv->ntypes && len + order[n]->len <= JOURNAL_DZ_DICT_MAX )
+    {
+      len += order[n++]->len;
+    }
+  ppriv->dictlen = len;
+  for ( i = 0; i < n; ++i )
+    {
+      len -= order[i]->len;
+      memcpy(ppriv->dict + len, order[i]->data, order[i]->len);
+    }
+
+  for ( i = 0; i < ppriv->ntypes; ++i )
+    {
+      struct exemplar* e = &ppriv->types[i];
+      if ( (e->count /= 2) > 0 )
+        {
+          if ( keep != i )
+            {
+              ppriv->types[keep] = *e;
+            }
+          ++keep;
+        }
+    }
+  ppriv->ntypes = keep;
+
+  LOG_INF(log, "Trained a %u byte dictionary from %d event types.\n",
+          ppriv->dictlen, n);
+}
+
+static void load_dict(struct priv* ppriv, FILE *log)
+{
+  int fd = open(ppriv->dict_path, O_RDONLY);
+  ssize_t n;
+
+  if ( fd < 0 )
+    {
+      return;
+    }
+  n = read(fd, ppriv->dict, JOURNAL_DZ_DICT_MAX);
+  ppriv->dictlen = n > 0 ? n : 0;
+  close(fd);
+  LOG_INF(log, "Using the %u byte dictionary in %s.\n",
+          ppriv->dictlen, ppriv->dict_path);
+}
+
+/* Written aside and renamed, so a crash never leaves half of one. */
+static void save_dict(struct priv* ppriv, FILE *log)
+{
+  char tmp[PATH_MAX];
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", ppriv->dict_path);
+  if ( (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 )
+    {
+      PERROR(log, tmp);
+      return;
+    }
+  if ( write_full(fd, ppriv->dict, ppriv->dictlen) < 0
+       || close(fd) < 0
+       || rename(tmp, ppriv->dict_path) < 0 )
+    {
+      PERROR(log, ppriv->dict_path);
+      unlink(tmp);
+    }
+}
+
+static int flush_out(struct priv* ppriv)
+{
+  size_t n = ppriv->outsize - ppriv->zs.avail_out;
+
+  ppriv->zs.next_out = ppriv->out;
+  ppriv->zs.avail_out = ppriv->outsize;
+  return n > 0 ? write_full(ppriv->fd, ppriv->out, n) : 0;
+}
+
+static void destructor(struct journal* this_journal, FILE *log)
+{
+  struct priv* ppriv;
+
+  this_journal->vtbl->close(this_journal, log);
+
+  ppriv = (struct priv*)this_journal->priv;
+  hugemem_free(ppriv->out, ppriv->outsize);
+  journal_disk_destroy(&ppriv->disk);
+  free(ppriv->dict_path);
+  free(ppriv);
+
+  this_journal->vtbl = 0;
+  this_journal->priv = 0;
+}
+
+static int xopen(struct journal* this_journal, int flags, FILE *log)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+  const char* path;
+  unsigned char hdr[8];
+  struct stat stbuf;
+  time_t epoch = 0; /* Crashed files may include data from the past. */
+
+  /* If this journal is already open, return an error. */
+  if ( ppriv->fd >= 0 || ppriv->rd )
+    return -1;
+
+  if ( flags == O_RDONLY )
+    {
+      ppriv->rd = journal_reader_open(ppriv->disk.path, 0);
+      return ppriv->rd ? 0 : -1;
+    }
+  if ( flags != O_WRONLY )
+    return -1;
+
+  path = journal_disk_choose(&ppriv->disk, log);
+  if ( 0 == stat(path, &stbuf) ) {
+    epoch = stbuf.st_ctime;
+    if (stbuf.st_size > 0) rename_journal(path, &epoch, log);
+  }
+
+  ppriv->fd = journal_disk_create(&ppriv->disk, log);
+  if ( ppriv->fd < 0 )
+    return -1;
+
+  memcpy(hdr, JOURNAL_DZ_MAGIC, 4);
+  hdr[4] = ppriv->dictlen >> 24;
+  hdr[5] = ppriv->dictlen >> 16;
+  hdr[6] = ppriv->dictlen >> 8;
+  hdr[7] = ppriv->dictlen;
+
+  memset(&ppriv->zs, 0, sizeof(ppriv->zs));
+  if ( write_full(ppriv->fd, hdr, sizeof(hdr)) < 0
+       || write_full(ppriv->fd, ppriv->dict, ppriv->dictlen) < 0
+       || deflateInit2(&ppriv->zs, arg_gz_level, Z_DEFLATED, 15, 8,
+                       journal_gz_strategy()) != Z_OK )
+    {
+      close(ppriv->fd);
+      ppriv->fd = -1;
+      return -1;
+    }
+  if ( ppriv->dictlen > 0 )
+    {
+      deflateSetDictionary(&ppriv->zs, ppriv->dict, ppriv->dictlen);
+    }
+  ppriv->zs.next_out = ppriv->out;
+  ppriv->zs.avail_out = ppriv->outsize;
+
+  ppriv->ot = time(NULL);
+  ppriv->nbytes_written = 0;
+  ppriv->level = arg_gz_level;
+
+  return 0;
+}
+
+static int xclose(struct journal* this_journal, FILE *log)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+  int ret, err = 0;
+
+  if ( ppriv->rd )
+    {
+      journal_reader_close(ppriv->rd);
+      ppriv->rd = NULL;
+      return 0;
+    }
+  if ( ppriv->fd < 0 )
+    {
+      return -1;
+    }
+
+  do
+    {
+      ret = deflate(&ppriv->zs, Z_FINISH);
+      if ( flush_out(ppriv) < 0 )
+        {
+          err = 1;
+          break;
+        }
+    }
+  while ( ret == Z_OK || ret == Z_BUF_ERROR );
+  deflateEnd(&ppriv->zs);
+
+  if ( close(ppriv->fd) < 0 || err || ret != Z_STREAM_END )
+    {
+      ppriv->fd = -1;
+      return -1;
+    }
+  ppriv->fd = -1;
+
+  train(ppriv, log);
+  save_dict(ppriv, log);
+
+  journal_disk_closed(&ppriv->disk, log);
+  journal_disk_rename(&ppriv->disk, &ppriv->ot, log);
+  return 0;
+}
+
+static int xread(struct journal* this_journal, void* ptr, size_t size)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  return ppriv->rd ? journal_reader_read(ppriv->rd, ptr, size) : -1;
+}
+
+static int xwrite(struct journal* this_journal, void* ptr, size_t size)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  if ( ppriv->fd < 0 )
+    return -1;
+
+  sample(ppriv, (const unsigned char*)ptr, size);
+
+  ppriv->zs.next_in = (Bytef*)ptr;
+  ppriv->zs.avail_in = size;
+  while ( ppriv->zs.avail_in > 0 )
+    {
+      if ( deflate(&ppriv->zs, Z_NO_FLUSH) != Z_OK )
+        return -1;
+      if ( ppriv->zs.avail_out == 0 && flush_out(ppriv) < 0 )
+        return -1;
+    }
+
+  ppriv->nbytes_written += size;
+  journal_disk_written(&ppriv->disk, ppriv->nbytes_written);
+  return size;
+}
+
+static int xbacklog(struct journal* this_journal, int pending, FILE *log)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+  int level;
+
+  if ( ppriv->fd < 0 )
+    return 0;
+
+  journal_disk_tick(&ppriv->disk, log);
+  if ( journal_disk_full(&ppriv->disk, ppriv->nbytes_written, log) )
+    {
+      if ( xclose(this_journal, log) < 0
+           || xopen(this_journal, O_WRONLY, log) < 0 )
+        LOG_ER(log, "Failed to move the journal to %s.\n",
+               ppriv->disk.fallback);
+      return 1;
+    }
+
+  if ( (level = journal_gz_level(ppriv->level, pending)) == ppriv->level )
+    return 0;
+
+  /* deflateParams() may emit a block, give it the whole buffer */
+  if ( flush_out(ppriv) < 0
+       || deflateParams(&ppriv->zs, level, journal_gz_strategy()) != Z_OK )
+    {
+      LOG_WARN(log, "Failed to set compression level %d for %s.\n",
+               level, ppriv->disk.current);
+      return 0;
+    }
+  LOG_INF(log, "Compressing %s at level %d, %d events waiting.\n",
+          ppriv->disk.current, level, pending);
+  ppriv->level = level;
+  return 0;
+}
+
+static void xset_range(struct journal* this_journal, time_t start, time_t end)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  ppriv->disk.range_start = start;
+  ppriv->disk.range_end = end;
+}
+
+static long long xwritten(struct journal* this_journal, int on_disk)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  return on_disk ? journal_disk_size(&ppriv->disk) : ppriv->nbytes_written;
+}
+
+static int xlost(struct journal* this_journal)
+{
+  (void)this_journal; /* appease -Wall -Werror */
+
+  return 0;
+}
+
+int journal_dz_ctor(struct journal* this_journal, const char* path, FILE *log)
+{
+  static struct journal_vtbl vtbl = {
+      destructor,
+      xopen, xclose,
+      xread, xwrite,
+      xbacklog,
+      xset_range,
+      xwritten,
+      xlost
+  };
+
+  struct priv* ppriv;
+  size_t len = strlen(path);
+
+  this_journal->vtbl = 0;
+  this_journal->priv = 0;
+
+  if ( len < sizeof(JOURNAL_DZ_EXT) - 1
+       || strcmp(path + len - (sizeof(JOURNAL_DZ_EXT) - 1), JOURNAL_DZ_EXT) )
+    {
+      LOG_WARN(log, "Dictionary compressed journal file (\"%s\") doesn't "
+                    "end with expected extension (\"%s\").\n",
+                    path, JOURNAL_DZ_EXT);
+    }
+
+  ppriv = (struct priv*)calloc(1, sizeof(struct priv));
+  if ( 0 == ppriv )
+    {
+      LOG_ER(log, "Malloc failed attempting to allocate %d bytes.\n",
+                   sizeof(*ppriv));
+      return -1;
+    }
+  ppriv->fd = -1;
+  ppriv->outsize = arg_journal_buffer > 0 ? (size_t)arg_journal_buffer
+                                          : DZ_OUT_BUFFER;
+
+  if ( journal_disk_init(&ppriv->disk, path, log) < 0 )
+    {
+      free(ppriv);
+      return -1;
+    }
+  if ( 0 == (ppriv->dict_path = (char*)malloc(len + sizeof(".dict")))
+       || 0 == (ppriv->out = (unsigned char*)hugemem_alloc(ppriv->outsize,
+                                                            log)) )
+    {
+      LOG_ER(log, "Failed to allocate the journal \"%s\".\n", path);
+      journal_disk_destroy(&ppriv->disk);
+      free(ppriv->dict_path);
+      free(ppriv);
+      return -1;
+    }
+  snprintf(ppriv->dict_path, len + sizeof(".dict"), "%s.dict", path);
+  load_dict(ppriv, log);
+
+  this_journal->vtbl = &vtbl;
+  this_journal->priv = ppriv;
+
+  return 0;
+}
+
+#else  /* if HAVE_LIBZ */
+
+int journal_dz_ctor(struct journal* this_journal, const char* path, FILE *log)
+{
+  this_journal->vtbl = 0;
+  this_journal->priv = 0;
+  (void)path;  /* appease -Wall -Werror */
+  (void)log;   /* appease -Wall -Werror */
+
+  return -1;
+}
+
+#endif /* HAVE_LIBZ */
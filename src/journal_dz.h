@@ -0,0 +1,45 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+
+#ifndef JOURNAL_DZ_DOT_H
+#define JOURNAL_DZ_DOT_H
+
+#include <stdint.h>
+
+#define JOURNAL_DZ_EXT ".dz"
+
+/* A dz journal is a zlib stream compressed with a preset dictionary,
+ * after the dictionary itself:
+ *
+ *   "LJDZ"   magic
+ *   uint32   dictionary length, big endian, at most JOURNAL_DZ_DICT_MAX
+ *   ...      dictionary
+ *   ...      zlib stream (RFC 1950), its header carries the dictionary
+ *            adler32 as the dictionary ID
+ *
+ * Events of one type repeat the same attribute names, so the
+ * dictionary is recent events, one of each of the most common types:
+ * deflate then finds most of every event in the dictionary from the
+ * first event on, where gzip has to see each type once per 32KB
+ * window first.  It is trained while a journal is written and used
+ * for the next one, and kept in "<journal>.dict" for the next start.
+ */
+
+#define JOURNAL_DZ_MAGIC      "LJDZ"
+#define JOURNAL_DZ_DICT_MAX   32768
+
+int journal_dz_ctor (struct journal* this_journal,
+                     const char* full_path_to_journal_file,
+                     FILE *log);
+
+#endif /* JOURNAL_DZ_DOT_H */
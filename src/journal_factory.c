@@ -15,6 +15,8 @@
 
 #include "journal.h"
 #include "journal_gz.h"
+#include "journal_dz.h"
+#include "journal_delta.h"
 #include "journal_file.h"
 
 #include "log.h"
@@ -42,13 +44,29 @@ int journal_factory(struct journal* jrn, const char* name, FILE *log)
           return -1;
         }
     }
+  else if ( strcmp(arg_journ_type, ARG_DZ) == 0 )
+    {
+      if ( journal_dz_ctor(jrn, name, log) < 0 )
+        {
+          LOG_ER(log,"Failed to create a dictionary compressed journal.\n");
+          return -1;
+        }
+    }
   else
     {
       LOG_ER(log,"Unrecognized journal type \"%s\", try \""
-             ARG_FILE "\" or \"" ARG_GZ "\".\n",
+             ARG_FILE "\", \"" ARG_GZ "\" or \"" ARG_DZ "\".\n",
              arg_journ_type);
       return -1;
     }
 
+  if ( strcmp(arg_journal_encoding, ARG_ENC_DELTA) == 0
+       && journal_delta_ctor(jrn, log) < 0 )
+    {
+      LOG_ER(log,"Failed to create a delta encoded journal.\n");
+      jrn->vtbl->destructor(jrn, log);
+      return -1;
+    }
+
   return 0;
 }
@@ -16,6 +16,8 @@
 #include "journal.h"
 #include "journal_file.h"
 
+#include "hugemem.h"
+#include "journal_disk.h"
 #include "rename_journal.h"
 #include "log.h"
 #include "opt.h"
@@ -29,13 +31,11 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#if HAVE_SYS_STATVFS_H
-#include <sys/statvfs.h>
-#endif
-
 struct priv {
-  char* path;
+  struct journal_disk disk;     /* disk.current is the file */
   FILE* fp;
+  int writing;
+  char* iobuf;                  /* --journal-buffer bytes, or NULL */
   time_t ot;
   long long nbytes_written;
 };
@@ -48,7 +48,8 @@ static void destructor(struct journal* this_journal, FILE *log)
 
   ppriv = (struct priv*)this_journal->priv;
 
-  free(ppriv->path);
+  hugemem_free(ppriv->iobuf, arg_journal_buffer);
+  journal_disk_destroy(&ppriv->disk);
   free(ppriv);
 
   this_journal->vtbl = 0;
@@ -58,6 +59,7 @@ static void destructor(struct journal* this_journal, FILE *log)
 static int xopen(struct journal* this_journal, int flags, FILE *log)
 {
   struct priv* ppriv = (struct priv*)this_journal->priv;
+  const char* path = ppriv->disk.path;
   const char* mode;
   struct stat buf;
   time_t epoch = 0; /* Crashed files may include data from the past. */
@@ -76,9 +78,10 @@ static int xopen(struct journal* this_journal, int flags, FILE *log)
 
       case O_WRONLY:
         mode = "wb";
-        if ( 0 == stat(ppriv->path, &buf) )
+        path = journal_disk_choose(&ppriv->disk, log);
+        if ( 0 == stat(path, &buf) )
           {
-            rename_journal(ppriv->path, &epoch, log);
+            rename_journal(path, &epoch, log);
           }
         break;
 
@@ -90,42 +93,39 @@ static int xopen(struct journal* this_journal, int flags, FILE *log)
         return -1;
     }
 
-  ppriv->fp = fopen(ppriv->path, mode);
+  if ( flags == O_WRONLY )
+    {
+      int fd = journal_disk_create(&ppriv->disk, log);
+      if ( fd >= 0 && ! (ppriv->fp = fdopen(fd, mode)) )
+        {
+          close(fd);
+        }
+    }
+  else
+    {
+      ppriv->fp = fopen(path, mode);
+    }
 
   if ( ! ppriv->fp )
     {
       return -1;
     }
 
-#if HAVE_SYS_STATVFS_H
-  if ( flags == O_WRONLY )
+  if ( arg_journal_buffer > 0 )
     {
-      struct statvfs stfsbuf;
-
-      if ( -1 == statvfs(ppriv->path, &stfsbuf) )
+      if ( ! ppriv->iobuf )
         {
-          LOG_WARN(log,"Unable to determine free space available for %s.\n",
-                   ppriv->path);
+          ppriv->iobuf = (char*)hugemem_alloc(arg_journal_buffer, log);
         }
-      else
+      if ( ppriv->iobuf )
         {
-          /* Check free space. */
-          /* tmpfs give f_bsize==0 */
-          long bsize = (stfsbuf.f_bsize!=0) ? stfsbuf.f_bsize : 4096 ;
-          long lsz = ppriv->nbytes_written / bsize ;
-
-          if ( lsz > (stfsbuf.f_bavail / 2.) )
-            {
-              LOG_WARN(log,"Low on disk space for new log %s.\n", ppriv->path);
-              LOG_WARN(log,"Available space is %d blocks of %d bytes each.\n", stfsbuf.f_bavail, bsize);
-              LOG_WARN(log,"Last log file contained %lld bytes.\n", ppriv->nbytes_written);
-            }
+          setvbuf(ppriv->fp, ppriv->iobuf, _IOFBF, arg_journal_buffer);
         }
     }
-#endif
 
   ppriv->ot = time(NULL);
   ppriv->nbytes_written = 0;
+  ppriv->writing = flags == O_WRONLY;
 
   return 0;
 }
@@ -144,9 +144,13 @@ static int xclose(struct journal* this_journal, FILE *log)
       ppriv->fp = 0;
       return -1;
     }
-
-  rename_journal(ppriv->path, &ppriv->ot, log);
   ppriv->fp = 0;
+
+  if ( ppriv->writing )
+    {
+      journal_disk_closed(&ppriv->disk, log);
+    }
+  journal_disk_rename(&ppriv->disk, &ppriv->ot, log);
   return 0;
 }
 
@@ -162,15 +166,68 @@ static int xwrite(struct journal* this_journal, void* ptr, size_t size)
 
   size_t ret = fwrite(ptr, size, 1, ((struct priv*)this_journal->priv)->fp);
   ppriv->nbytes_written += ret * size;
+  journal_disk_written(&ppriv->disk, ppriv->nbytes_written);
   return (int)ret * size;
 }
 
+static int xbacklog(struct journal* this_journal, int pending, FILE *log)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  (void)pending;      /* appease -Wall -Werror */
+
+  if ( ! ppriv->fp || ! ppriv->writing )
+    {
+      return 0;
+    }
+  journal_disk_tick(&ppriv->disk, log);
+  if ( ! journal_disk_full(&ppriv->disk, ppriv->nbytes_written, log) )
+    {
+      return 0;
+    }
+  if ( xclose(this_journal, log) < 0
+       || xopen(this_journal, O_WRONLY, log) < 0 )
+    {
+      LOG_ER(log, "Failed to move the journal to %s.\n",
+             ppriv->disk.fallback);
+    }
+  return 1;
+}
+
+static void xset_range(struct journal* this_journal, time_t start, time_t end)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  ppriv->disk.range_start = start;
+  ppriv->disk.range_end = end;
+}
+
+/* Nothing is compressed, on disk the journal is the events written. */
+static long long xwritten(struct journal* this_journal, int on_disk)
+{
+  (void)on_disk;      /* appease -Wall -Werror */
+
+  return ((struct priv*)this_journal->priv)->nbytes_written;
+}
+
+/* Every event goes to the file as it is written. */
+static int xlost(struct journal* this_journal)
+{
+  (void)this_journal; /* appease -Wall -Werror */
+
+  return 0;
+}
+
 int journal_file_ctor(struct journal* this_journal, const char* path, FILE *log)
 {
   static struct journal_vtbl vtbl = {
     destructor,
     xopen, xclose,
-    xread, xwrite
+    xread, xwrite,
+    xbacklog,
+    xset_range,
+    xwritten,
+    xlost
   };
 
   struct priv* ppriv;
@@ -187,7 +244,7 @@ int journal_file_ctor(struct journal* this_journal, const char* path, FILE *log)
     }
   memset(ppriv, 0, sizeof(*ppriv));
 
-  if ( 0 == (ppriv->path = strdup(path)) )
+  if ( journal_disk_init(&ppriv->disk, path, log) < 0 )
     {
       free(ppriv);
       return -1;
@@ -16,6 +16,7 @@
 #include "journal.h"
 #include "journal_gz.h"
 
+#include "journal_disk.h"
 #include "rename_journal.h"
 #include "log.h"
 #include "opt.h"
@@ -29,21 +30,45 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#if HAVE_SYS_STATVFS_H
-#include <sys/statvfs.h>
-#endif
-
 #if HAVE_LIBZ
 
 #include <zlib.h>
 
 struct priv {
-  char* path;
+  struct journal_disk disk;     /* disk.current is the file */
   gzFile fp;
   time_t ot;
   long long nbytes_written;
+  int writing;
+  int level;                    /* now, it drops under a backlog */
 };
 
+/* The gzopen() mode letter for --gz-strategy. */
+static const char* strategy_mode(void)
+{
+  if ( strcmp(arg_gz_strategy, ARG_GZ_FILTERED) == 0 )
+    return "f";
+  if ( strcmp(arg_gz_strategy, ARG_GZ_HUFFMAN) == 0 )
+    return "h";
+  if ( strcmp(arg_gz_strategy, ARG_GZ_RLE) == 0 )
+    return "R";
+  return "";
+}
+
+int journal_gz_strategy(void)
+{
+  switch ( strategy_mode()[0] ) {
+  case 'f':
+    return Z_FILTERED;
+  case 'h':
+    return Z_HUFFMAN_ONLY;
+  case 'R':
+    return Z_RLE;
+  default:
+    return Z_DEFAULT_STRATEGY;
+  }
+}
+
 static void destructor(struct journal* this_journal, FILE *log)
 {
   struct priv* ppriv;
@@ -51,7 +76,7 @@ static void destructor(struct journal* this_journal, FILE *log)
   this_journal->vtbl->close(this_journal, log);
 
   ppriv = (struct priv*)this_journal->priv;
-  free(ppriv->path);
+  journal_disk_destroy(&ppriv->disk);
   free(ppriv);
 
   this_journal->vtbl = 0;
@@ -61,7 +86,9 @@ static void destructor(struct journal* this_journal, FILE *log)
 static int xopen(struct journal* this_journal, int flags, FILE *log)
 {
   struct priv* ppriv = (struct priv*)this_journal->priv;
+  const char* path = ppriv->disk.path;
   const char* mode;
+  char wmode[8];
   struct stat stbuf;
   time_t epoch = 0; /* Crashed files may include data from the past. */
 
@@ -75,10 +102,12 @@ static int xopen(struct journal* this_journal, int flags, FILE *log)
     break;
 
   case O_WRONLY:
-    mode = "wb";
-    if ( 0 == stat(ppriv->path, &stbuf) ) {
+    snprintf(wmode, sizeof(wmode), "wb%d%s", arg_gz_level, strategy_mode());
+    mode = wmode;
+    path = journal_disk_choose(&ppriv->disk, log);
+    if ( 0 == stat(path, &stbuf) ) {
       epoch = stbuf.st_ctime;
-      if (stbuf.st_size > 0) rename_journal(ppriv->path, &epoch, log);
+      if (stbuf.st_size > 0) rename_journal(path, &epoch, log);
     }
     break;
 
@@ -90,44 +119,30 @@ static int xopen(struct journal* this_journal, int flags, FILE *log)
     return -1;
   }
 
-  ppriv->fp = gzopen(ppriv->path, mode);
+  if ( flags == O_WRONLY )
+    {
+      int fd = journal_disk_create(&ppriv->disk, log);
+      if ( fd >= 0 && ! (ppriv->fp = gzdopen(fd, mode)) )
+        close(fd);
+    }
+  else
+    {
+      ppriv->fp = gzopen(path, mode);
+    }
 
   if ( ! ppriv->fp )
     return -1;
 
-#if HAVE_SYS_STATVFS_H
-  if ( flags == O_WRONLY )
-    {
-      struct statvfs stfsbuf;
-
-      if ( -1 == statvfs(ppriv->path, &stfsbuf) )
-        {
-          LOG_WARN(log,"Unable to determine free space available for %s.\n",
-                   ppriv->path);
-        }
-      else
-        {
-          /* Check free space. */
-
-          /* tmpfs give f_bsize==0 */
-          long bsize = (stfsbuf.f_bsize!=0) ? stfsbuf.f_bsize : 4096 ;
-          long lsz = ppriv->nbytes_written / bsize ;
-
-          if ( lsz > (abs(stfsbuf.f_bavail) / 2.) )
-            {
-              LOG_WARN(log,"Low on disk space for new gz log %s.\n",
-                       ppriv->path);
-              LOG_WARN(log,"Available space is %d blocks of %d bytes each.\n",
-                       stfsbuf.f_bavail, bsize);
-              LOG_WARN(log,"Last log file contained %lld bytes.\n",
-                       ppriv->nbytes_written);
-            }
-        }
-    }
+#if HAVE_GZBUFFER
+  /* before anything is read or written, zlib sizes its buffers then */
+  if ( arg_journal_buffer > 0 )
+    gzbuffer(ppriv->fp, arg_journal_buffer);
 #endif
 
   ppriv->ot = time(NULL);
   ppriv->nbytes_written = 0;
+  ppriv->writing = flags != O_RDONLY;
+  ppriv->level = arg_gz_level;
 
   return 0;
 }
@@ -146,9 +161,11 @@ static int xclose(struct journal* this_journal, FILE *log)
       ppriv->fp = 0;
       return -1;
     }
-
-  rename_journal(ppriv->path, &ppriv->ot, log);
   ppriv->fp = 0;
+
+  if ( ppriv->writing )
+    journal_disk_closed(&ppriv->disk, log);
+  journal_disk_rename(&ppriv->disk, &ppriv->ot, log);
   return 0;
 }
 
@@ -164,9 +181,58 @@ static int xwrite(struct journal* this_journal, void* ptr, size_t size)
   int ret = gzwrite(ppriv->fp, ptr, size);
   if ( ret > 0 )
     ppriv->nbytes_written += ret;
+  journal_disk_written(&ppriv->disk, ppriv->nbytes_written);
   return ret;
 }
 
+/* Compress faster while events back up, rather than drop them later,
+ * back to --gz-level once the backlog is down to half the threshold. */
+int journal_gz_level(int level, int pending)
+{
+  if ( arg_gz_adaptive_depth <= 0 )
+    return level;
+  if ( pending >= arg_gz_adaptive_depth )
+    return arg_gz_burst_level;
+  if ( pending < arg_gz_adaptive_depth / 2 )
+    return arg_gz_level;
+  return level;
+}
+
+/* gzsetparams() only flushes what is pending to the old level, so a
+ * change costs one short deflate block. */
+static int xbacklog(struct journal* this_journal, int pending, FILE *log)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+  int level;
+
+  if ( ! ppriv->fp || ! ppriv->writing )
+    return 0;
+
+  journal_disk_tick(&ppriv->disk, log);
+  if ( journal_disk_full(&ppriv->disk, ppriv->nbytes_written, log) )
+    {
+      if ( xclose(this_journal, log) < 0
+           || xopen(this_journal, O_WRONLY, log) < 0 )
+        LOG_ER(log, "Failed to move the journal to %s.\n",
+               ppriv->disk.fallback);
+      return 1;
+    }
+
+  if ( (level = journal_gz_level(ppriv->level, pending)) == ppriv->level )
+    return 0;
+
+  if ( gzsetparams(ppriv->fp, level, journal_gz_strategy()) != Z_OK )
+    {
+      LOG_WARN(log, "Failed to set compression level %d for %s.\n",
+               level, ppriv->disk.current);
+      return 0;
+    }
+  LOG_INF(log, "Compressing %s at level %d, %d events waiting.\n",
+          ppriv->disk.current, level, pending);
+  ppriv->level = level;
+  return 0;
+}
+
 static int tailmatch(const char* str, const char* tail)
 {
   size_t strsz = strlen(str);
@@ -178,12 +244,38 @@ static int tailmatch(const char* str, const char* tail)
   return strcmp(str + (strsz - tailsz), tail) == 0;
 }
 
+static void xset_range(struct journal* this_journal, time_t start, time_t end)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  ppriv->disk.range_start = start;
+  ppriv->disk.range_end = end;
+}
+
+static long long xwritten(struct journal* this_journal, int on_disk)
+{
+  struct priv* ppriv = (struct priv*)this_journal->priv;
+
+  return on_disk ? journal_disk_size(&ppriv->disk) : ppriv->nbytes_written;
+}
+
+static int xlost(struct journal* this_journal)
+{
+  (void)this_journal; /* appease -Wall -Werror */
+
+  return 0;
+}
+
 int journal_gz_ctor(struct journal* this_journal, const char* path, FILE *log)
 {
   static struct journal_vtbl vtbl = {
       destructor,
       xopen, xclose,
-      xread, xwrite
+      xread, xwrite,
+      xbacklog,
+      xset_range,
+      xwritten,
+      xlost
   };
 
   struct priv* ppriv;
@@ -207,10 +299,8 @@ int journal_gz_ctor(struct journal* this_journal, const char* path, FILE *log)
     }
   memset(ppriv, 0, sizeof(*ppriv));
 
-  if ( 0 == (ppriv->path = strdup(path)) )
+  if ( journal_disk_init(&ppriv->disk, path, log) < 0 )
     {
-      LOG_ER(log,"The strdup() function failed attempting to dup \"%s\".\n",
-                  path);
       free(ppriv);
       return -1;
     }
@@ -20,4 +20,13 @@ int journal_gz_ctor (struct journal* this_journal,
                      const char* full_path_to_journal_file,
                      FILE *log);
 
+#if HAVE_LIBZ
+/* The zlib strategy for --gz-strategy. */
+int journal_gz_strategy (void);
+
+/* The compression level for a journal at "level" with "pending" events
+ * waiting, see --gz-adaptive-depth. */
+int journal_gz_level (int level, int pending);
+#endif
+
 #endif /* JOURNAL_GZ_DOT_H */
@@ -0,0 +1,168 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+
+#include "config.h"
+
+#include "journal_place.h"
+
+#include "journal_disk.h"
+#include "log.h"
+#include "opt.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct place_stat {
+  int                 open;
+  time_t              down_until;
+  double              cost;         /* usec per KB written, 0 untried */
+  long long           bytes;        /* since it was opened */
+  unsigned long long  usec;
+};
+
+int journal_place_init (struct journal_place* place, struct journal* jrn,
+                        int n, FILE *log)
+{
+  place->jrn = jrn;
+  place->n = n;
+  place->next = 0;
+  place->lost = 0;
+  place->st = (struct place_stat*)calloc(n, sizeof(struct place_stat));
+  if ( 0 == place->st )
+    {
+      LOG_ER(log, "Failed to allocate %d bytes for journal placement.\n",
+             n * sizeof(struct place_stat));
+      return -1;
+    }
+  return 0;
+}
+
+void journal_place_destroy (struct journal_place* place)
+{
+  free(place->st);
+  place->st = 0;
+}
+
+/* Higher is better.  Journals never tried go first for latency, so
+ * each gets measured. */
+static double score (struct journal_place* place, int j)
+{
+  if ( strcmp(arg_journal_placement, ARG_PLACE_SPACE) == 0 )
+    {
+      return (double)journal_disk_free(arg_journalls[j]);
+    }
+  if ( strcmp(arg_journal_placement, ARG_PLACE_LATENCY) == 0 )
+    {
+      return -place->st[j].cost;
+    }
+  return 0;
+}
+
+static int pick (struct journal_place* place)
+{
+  time_t now = time(NULL);
+  double best_score = 0;
+  int best = -1;
+  int i;
+
+  /* in round robin order, so ties go the old way */
+  for ( i = 0; i < place->n; ++i )
+    {
+      int j = (place->next + i) % place->n;
+      double s;
+
+      if ( place->st[j].open || place->st[j].down_until > now )
+        {
+          continue;
+        }
+      if ( strcmp(arg_journal_placement, ARG_PLACE_RR) == 0 )
+        {
+          best = j;
+          break;
+        }
+      s = score(place, j);
+      if ( best < 0 || s > best_score )
+        {
+          best_score = s;
+          best = j;
+        }
+    }
+
+  if ( best >= 0 )
+    {
+      place->next = (best + 1) % place->n;
+    }
+  return best;
+}
+
+int journal_place_open (struct journal_place* place, FILE *log)
+{
+  int j;
+
+  while ( (j = pick(place)) >= 0 )
+    {
+      struct journal* jrn = &place->jrn[j];
+
+      if ( jrn->vtbl->open(jrn, O_WRONLY, log) == 0 )
+        {
+          place->st[j].open = 1;
+          place->st[j].bytes = 0;
+          place->st[j].usec = 0;
+          return j;
+        }
+      LOG_ER(log, "Failed to open the journal \"%s\", leaving it out for "
+             "%d seconds.\n", arg_journalls[j], arg_journal_cooldown);
+      place->st[j].down_until = time(NULL) + arg_journal_cooldown;
+    }
+  return -1;
+}
+
+void journal_place_close (struct journal_place* place, int j, FILE *log)
+{
+  struct place_stat* st = &place->st[j];
+
+  if ( place->jrn[j].vtbl->close(&place->jrn[j], log) < 0 )
+    {
+      LOG_ER(log, "Can't close journal \"%s\", leaving it out for "
+             "%d seconds.\n", arg_journalls[j], arg_journal_cooldown);
+      st->down_until = time(NULL) + arg_journal_cooldown;
+    }
+  place->lost += place->jrn[j].vtbl->lost(&place->jrn[j]);
+  st->open = 0;
+
+  /* a quarter weight for each journal's own cost */
+  if ( st->bytes > 0 )
+    {
+      double cost = st->usec * 1024. / st->bytes;
+      st->cost = st->cost > 0 ? (3 * st->cost + cost) / 4 : cost;
+    }
+}
+
+void journal_place_failed (struct journal_place* place, int j, FILE *log)
+{
+  LOG_ER(log, "Journal \"%s\" failed, leaving it out for %d seconds.\n",
+         arg_journalls[j], arg_journal_cooldown);
+  place->jrn[j].vtbl->close(&place->jrn[j], log);
+  place->lost += place->jrn[j].vtbl->lost(&place->jrn[j]);
+  place->st[j].open = 0;
+  place->st[j].down_until = time(NULL) + arg_journal_cooldown;
+}
+
+void journal_place_record (struct journal_place* place, int j,
+                           long long bytes, unsigned long long usec)
+{
+  place->st[j].bytes += bytes;
+  place->st[j].usec += usec;
+}
@@ -0,0 +1,59 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+
+#ifndef JOURNAL_PLACE_DOT_H
+#define JOURNAL_PLACE_DOT_H
+
+#include <stdio.h>
+
+#include "journal.h"
+
+/* Which of the journals on the command line is written next.  At each
+ * rotation a journal is picked by --journal-placement:
+ *
+ *   rr       the next one after the last picked, as ever
+ *   space    the one with the most free disk
+ *   latency  the one which has written fastest, per byte, lately
+ *
+ * A journal which fails to open, close or write is left out for
+ * --journal-cooldown seconds and another one is picked in its place,
+ * so one bad disk costs its journals rather than the journaller.
+ * Journals already open (--journal-stripe) are never picked twice.
+ */
+
+struct journal_place {
+  struct journal*     jrn;
+  int                 n;
+  int                 next;         /* where rr goes on */
+  struct place_stat*  st;
+  int                 lost;         /* events lost() at close, to count */
+};
+
+int  journal_place_init (struct journal_place* place, struct journal* jrn,
+                         int n, FILE *log);
+void journal_place_destroy (struct journal_place* place);
+
+/* Picks a journal and opens it for writing, its index or -1 if none
+ * could be opened. */
+int  journal_place_open (struct journal_place* place, FILE *log);
+
+void journal_place_close (struct journal_place* place, int j, FILE *log);
+
+/* Closes journal j, which failed, and leaves it out for a while. */
+void journal_place_failed (struct journal_place* place, int j, FILE *log);
+
+/* bytes went to journal j in usec microseconds. */
+void journal_place_record (struct journal_place* place, int j,
+                           long long bytes, unsigned long long usec);
+
+#endif /* JOURNAL_PLACE_DOT_H */
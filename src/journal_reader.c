@@ -0,0 +1,473 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#include "config.h"
+
+#include "journal_reader.h"
+
+#include "header.h"
+#include "journal.h"
+#include "journal_delta.h"
+#include "journal_dz.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_LIBZ
+
+#include <zlib.h>
+
+#define READ_BUFFER     (256*1024)
+#define DELTA_BUFFER    (64*1024)
+
+struct journal_reader {
+  gzFile          gz;           /* anything but dz */
+
+  int             fd;
+  z_stream        zs;
+  unsigned char*  in;
+  size_t          insize;
+  int             eof;
+  int             end;          /* of the zlib stream */
+  unsigned char   dict[JOURNAL_DZ_DICT_MAX];
+  uint32_t        dictlen;
+
+  /* what was read to look for the delta encoding magic, or the
+   * decoded stream of a delta encoded journal */
+  unsigned char*  buf;
+  size_t          bufpos;
+  size_t          buflen;
+
+  int             delta;
+  int             error;
+  uint32_t        nrec;         /* left in the block */
+  int             nsenders;
+  unsigned char   senders[JOURNAL_DELTA_SENDERS_MAX]
+                         [JOURNAL_DELTA_SENDER_LENGTH];
+  uint64_t        prev;
+  unsigned char   hdr[HEADER_LENGTH];
+  int             hdrpos;       /* HEADER_LENGTH when it is all out */
+  uint32_t        payload;      /* left of the record */
+};
+
+static int read_full (int fd, void *buf, size_t len)
+{
+  size_t have = 0;
+
+  while ( have < len )
+    {
+      ssize_t n = read (fd, (char *)buf + have, len - have);
+      if ( n <= 0 )
+        {
+          return -1;
+        }
+      have += n;
+    }
+  return 0;
+}
+
+static struct journal_reader* raw_open (const char *path, size_t bufsize)
+{
+  struct journal_reader *r;
+  unsigned char hdr[8];
+
+  if ( bufsize == 0 )
+    {
+      bufsize = READ_BUFFER;
+    }
+
+  r = (struct journal_reader *) calloc (1, sizeof (*r));
+  if ( r == NULL )
+    {
+      return NULL;
+    }
+  if ( (r->fd = open (path, O_RDONLY)) < 0 )
+    {
+      free (r);
+      return NULL;
+    }
+
+  if ( read_full (r->fd, hdr, sizeof (hdr)) < 0
+       || memcmp (hdr, JOURNAL_DZ_MAGIC, 4) != 0 )
+    {
+      /* gzip, or plain, which gzread() passes through */
+      if ( lseek (r->fd, 0, SEEK_SET) < 0
+           || (r->gz = gzdopen (r->fd, "rb")) == NULL )
+        {
+          close (r->fd);
+          free (r);
+          return NULL;
+        }
+      gzbuffer (r->gz, bufsize);
+      return r;
+    }
+
+  r->dictlen = (uint32_t)hdr[4] << 24 | (uint32_t)hdr[5] << 16
+             | (uint32_t)hdr[6] << 8 | hdr[7];
+  r->insize = bufsize;
+  if ( r->dictlen > JOURNAL_DZ_DICT_MAX
+       || read_full (r->fd, r->dict, r->dictlen) < 0
+       || (r->in = (unsigned char *) malloc (r->insize)) == NULL
+       || inflateInit (&r->zs) != Z_OK )
+    {
+      free (r->in);
+      close (r->fd);
+      free (r);
+      return NULL;
+    }
+
+  return r;
+}
+
+/* The journal as it is stored, less its compression. */
+static int raw_read (struct journal_reader *r, void *buf, unsigned len)
+{
+  if ( r->gz != NULL )
+    {
+      return gzread (r->gz, buf, len);
+    }
+
+  if ( len == 0 )
+    {
+      return 0;
+    }
+
+  r->zs.next_out = (Bytef *) buf;
+  r->zs.avail_out = len;
+
+  while ( r->zs.avail_out > 0 && ! r->end )
+    {
+      int ret;
+
+      if ( r->zs.avail_in == 0 && ! r->eof )
+        {
+          ssize_t n = read (r->fd, r->in, r->insize);
+          if ( n < 0 )
+            {
+              return -1;
+            }
+          r->eof = n == 0;
+          r->zs.next_in = r->in;
+          r->zs.avail_in = n;
+        }
+
+      ret = inflate (&r->zs, Z_NO_FLUSH);
+      if ( ret == Z_NEED_DICT )
+        {
+          /* fails if the stream was made with another dictionary */
+          ret = inflateSetDictionary (&r->zs, r->dict, r->dictlen);
+        }
+      if ( ret == Z_STREAM_END )
+        {
+          r->end = 1;
+        }
+      else if ( ret == Z_BUF_ERROR && r->eof && r->zs.avail_in == 0 )
+        {
+          /* truncated, a journal which was never closed */
+          break;
+        }
+      else if ( ret != Z_OK && ret != Z_BUF_ERROR )
+        {
+          return -1;
+        }
+    }
+
+  if ( r->zs.avail_out == len && ! r->end )
+    {
+      return -1;
+    }
+  return len - r->zs.avail_out;
+}
+
+struct journal_reader* journal_reader_open (const char *path, size_t bufsize)
+{
+  struct journal_reader *r = raw_open (path, bufsize);
+  int n;
+
+  if ( r == NULL )
+    {
+      return NULL;
+    }
+  r->hdrpos = HEADER_LENGTH;
+  if ( (r->buf = (unsigned char *) malloc (DELTA_BUFFER)) == NULL
+       || (n = raw_read (r, r->buf, sizeof (JOURNAL_DELTA_MAGIC) - 1)) < 0 )
+    {
+      journal_reader_close (r);
+      return NULL;
+    }
+
+  if ( n == sizeof (JOURNAL_DELTA_MAGIC) - 1
+       && memcmp (r->buf, JOURNAL_DELTA_MAGIC, n) == 0 )
+    {
+      r->delta = 1;
+    }
+  else
+    {
+      /* given back before the rest of the journal */
+      r->buflen = n;
+    }
+  return r;
+}
+
+/* The number of bytes, 0 at the end, -1 on error. */
+static int fill (struct journal_reader *r)
+{
+  int n = raw_read (r, r->buf, DELTA_BUFFER);
+
+  if ( n > 0 )
+    {
+      r->bufpos = 0;
+      r->buflen = n;
+    }
+  return n;
+}
+
+/* 0, 1 at the end of the journal, -1 on error. */
+static int get_varint (struct journal_reader *r, uint64_t *v)
+{
+  unsigned char c;
+  int shift = 0;
+  int n;
+
+  *v = 0;
+  do
+    {
+      if ( r->bufpos == r->buflen && (n = fill (r)) <= 0 )
+        {
+          return shift == 0 && n == 0 ? 1 : -1;
+        }
+      c = r->buf[r->bufpos++];
+      *v |= (uint64_t)(c & 0x7f) << shift;
+      shift += 7;
+    }
+  while ( (c & 0x80) && shift < 64 );
+
+  return c & 0x80 ? -1 : 0;
+}
+
+static int get_bytes (struct journal_reader *r, void *out, size_t len)
+{
+  while ( len > 0 )
+    {
+      size_t n = r->buflen - r->bufpos;
+
+      if ( n == 0 )
+        {
+          if ( fill (r) <= 0 )
+            {
+              return -1;
+            }
+          continue;
+        }
+      if ( n > len )
+        {
+          n = len;
+        }
+      memcpy (out, r->buf + r->bufpos, n);
+      r->bufpos += n;
+      out = (char *)out + n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* The header of the next record into r->hdr: 0, 1 at the end of the
+ * journal, -1 on error. */
+static int next_record (struct journal_reader *r)
+{
+  uint64_t n, s, delta, len;
+  int ret, i;
+
+  if ( r->nrec == 0 )
+    {
+      if ( (ret = get_varint (r, &n)) != 0 )
+        {
+          return ret;
+        }
+      if ( n == 0 || n > UINT32_MAX
+           || get_varint (r, &s) != 0 || s > JOURNAL_DELTA_SENDERS_MAX
+           || get_bytes (r, r->senders,
+                         (size_t)s * JOURNAL_DELTA_SENDER_LENGTH) < 0 )
+        {
+          return -1;
+        }
+      r->nrec = n;
+      r->nsenders = s;
+      r->prev = 0;
+    }
+
+  if ( get_varint (r, &s) != 0 || s >= (uint64_t)r->nsenders
+       || get_varint (r, &delta) != 0
+       || get_varint (r, &len) != 0 || len > 0xffff )
+    {
+      return -1;
+    }
+  r->prev += (delta >> 1) ^ (~(delta & 1) + 1);
+  --r->nrec;
+
+  r->hdr[0] = len >> 8;
+  r->hdr[1] = len;
+  for ( i = 0; i < 8; ++i )
+    {
+      r->hdr[RECEIPT_TIME_OFFSET + i] = r->prev >> (56 - 8 * i);
+    }
+  memcpy (r->hdr + SENDER_IP_OFFSET, r->senders[s],
+          JOURNAL_DELTA_SENDER_LENGTH);
+  r->hdrpos = 0;
+  r->payload = len;
+  return 0;
+}
+
+/* Standard headers, each followed by its payload. */
+static int delta_read (struct journal_reader *r, void *buf, unsigned len)
+{
+  unsigned char *out = (unsigned char *) buf;
+  unsigned done = 0;
+
+  while ( done < len && ! r->error )
+    {
+      size_t n;
+
+      if ( r->hdrpos < HEADER_LENGTH )
+        {
+          n = HEADER_LENGTH - r->hdrpos;
+          if ( n > len - done )
+            {
+              n = len - done;
+            }
+          memcpy (out + done, r->hdr + r->hdrpos, n);
+          r->hdrpos += n;
+          done += n;
+        }
+      else if ( r->payload > 0 )
+        {
+          n = r->payload < len - done ? r->payload : len - done;
+          if ( get_bytes (r, out + done, n) < 0 )
+            {
+              r->error = 1;
+              break;
+            }
+          r->payload -= n;
+          done += n;
+        }
+      else
+        {
+          int ret = next_record (r);
+          if ( ret > 0 )
+            {
+              break;
+            }
+          if ( ret < 0 )
+            {
+              r->error = 1;
+            }
+        }
+    }
+
+  if ( r->error && done == 0 )
+    {
+      return -1;
+    }
+  return done;
+}
+
+int journal_reader_read (struct journal_reader *r, void *buf, unsigned len)
+{
+  unsigned n;
+  int ret;
+
+  if ( r->delta )
+    {
+      return delta_read (r, buf, len);
+    }
+
+  /* what was read looking for the magic, then the rest */
+  n = r->buflen - r->bufpos;
+  if ( n > len )
+    {
+      n = len;
+    }
+  memcpy (buf, r->buf + r->bufpos, n);
+  r->bufpos += n;
+  if ( n == len )
+    {
+      return n;
+    }
+
+  ret = raw_read (r, (char *)buf + n, len - n);
+  if ( ret < 0 )
+    {
+      return n > 0 ? (int)n : -1;
+    }
+  return n + ret;
+}
+
+int journal_reader_delta (struct journal_reader *r)
+{
+  return r->delta;
+}
+
+void journal_reader_close (struct journal_reader *r)
+{
+  if ( r == NULL )
+    {
+      return;
+    }
+  if ( r->gz != NULL )
+    {
+      gzclose (r->gz);
+    }
+  else
+    {
+      inflateEnd (&r->zs);
+      free (r->in);
+      close (r->fd);
+    }
+  free (r->buf);
+  free (r);
+}
+
+#else  /* if HAVE_LIBZ */
+
+struct journal_reader* journal_reader_open (const char *path, size_t bufsize)
+{
+  (void)path;     /* appease -Wall -Werror */
+  (void)bufsize;  /* appease -Wall -Werror */
+
+  return NULL;
+}
+
+int journal_reader_read (struct journal_reader *r, void *buf, unsigned len)
+{
+  (void)r;        /* appease -Wall -Werror */
+  (void)buf;      /* appease -Wall -Werror */
+  (void)len;      /* appease -Wall -Werror */
+
+  return -1;
+}
+
+int journal_reader_delta (struct journal_reader *r)
+{
+  (void)r;        /* appease -Wall -Werror */
+
+  return 0;
+}
+
+void journal_reader_close (struct journal_reader *r)
+{
+  (void)r;        /* appease -Wall -Werror */
+}
+
+#endif /* HAVE_LIBZ */
@@ -0,0 +1,43 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+
+#ifndef JOURNAL_READER_DOT_H
+#define JOURNAL_READER_DOT_H
+
+#include <stddef.h>
+
+/* Reads any journal back as the stream of headers and events it holds:
+ * dictionary compressed (journal type "dz") journals, and through
+ * zlib's gz functions gzip and plain ones, with either encoding:
+ * delta encoded records come back with standard headers.  For the
+ * journal tools, which used gzopen()/gzread() directly before there
+ * was more than one compressed format.
+ */
+
+struct journal_reader;
+
+/* NULL if path can't be opened or is not a journal.  bufsize is the
+ * read buffer size, 0 for the default. */
+struct journal_reader* journal_reader_open (const char *path, size_t bufsize);
+
+/* As gzread(): the number of bytes read, less than len only at the end
+ * of the journal, 0 at the end, -1 on error or a truncated journal. */
+int  journal_reader_read (struct journal_reader *r, void *buf, unsigned len);
+
+/* Whether the events are delta encoded, so the journal's compressed
+ * bytes are not events with headers. */
+int  journal_reader_delta (struct journal_reader *r);
+
+void journal_reader_close (struct journal_reader *r);
+
+#endif /* JOURNAL_READER_DOT_H */
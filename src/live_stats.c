@@ -0,0 +1,672 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include "live_stats.h"
+
+#include "log.h"
+#include "opt.h"
+#include "perror.h"
+#include "sig.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+static struct live_stats  private_page;
+struct live_stats*        gbl_live_stats = &private_page;
+
+static char               shm_name[NAME_MAX];
+static int                shm_mapped = 0;
+
+#if HAVE_PTHREAD_H
+static pthread_t          server_tid;
+static int                server_running = 0;
+#endif
+static int                server_fd = -1;
+static int                metrics_fd = -1;
+
+static const uint64_t     hist_bounds[LIVE_HIST_BUCKETS-1] = LIVE_HIST_BOUNDS;
+
+static void live_stats_init_page (struct live_stats *page)
+{
+  memset (page, 0, sizeof (*page));
+  page->magic      = LIVE_STATS_MAGIC;
+  page->version    = LIVE_STATS_VERSION;
+  page->size       = sizeof (*page);
+  page->pid        = getpid ();
+  page->start_time = time (NULL);
+}
+
+int live_stats_open (int create, FILE *log)
+{
+  struct live_stats *page;
+  struct stat st;
+  int fd;
+
+  if ( private_page.magic == 0 )
+    {
+      live_stats_init_page (&private_page);
+    }
+
+  if ( arg_stats_shm != NULL && strcmp (arg_stats_shm, "none") == 0 )
+    {
+      return 0;
+    }
+
+  if ( arg_stats_shm != NULL )
+    {
+      snprintf (shm_name, sizeof (shm_name), "%s", arg_stats_shm);
+    }
+  else
+    {
+      snprintf (shm_name, sizeof (shm_name), "%s.stats", arg_queue_name);
+    }
+
+  fd = shm_open (shm_name, O_RDWR|O_CREAT, 0644);
+  if ( fd < 0 )
+    {
+      PERROR (log, "shm_open");
+      LOG_WARN (log, "Live stats are not shared, unable to open \"%s\".\n",
+                shm_name);
+      return -1;
+    }
+
+  if ( fstat (fd, &st) < 0
+       || ( (size_t)st.st_size < sizeof (*page)
+            && ftruncate (fd, sizeof (*page)) < 0 ) )
+    {
+      PERROR (log, "ftruncate");
+      close (fd);
+      return -1;
+    }
+
+  page = (struct live_stats *) mmap (NULL, sizeof (*page),
+                                     PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if ( page == MAP_FAILED )
+    {
+      PERROR (log, "mmap");
+      return -1;
+    }
+
+  /* a restarted enqueuer or dequeuer keeps counting from where the
+   * page is, so the totals scrapers see never go backwards */
+  if ( create || page->magic != LIVE_STATS_MAGIC
+       || page->version != LIVE_STATS_VERSION
+       || page->size != sizeof (*page) )
+    {
+      live_stats_init_page (page);
+    }
+
+  gbl_live_stats = page;
+  shm_mapped = 1;
+  LOG_INF (log, "Live stats in shared memory \"%s\".\n", shm_name);
+
+  return 0;
+}
+
+void live_stats_close (int destroy, FILE *log)
+{
+  if ( shm_mapped )
+    {
+      struct live_stats *page = gbl_live_stats;
+      gbl_live_stats = &private_page;
+      munmap (page, sizeof (*page));
+      shm_mapped = 0;
+      if ( destroy && shm_unlink (shm_name) < 0 )
+        {
+          PERROR (log, "shm_unlink");
+        }
+    }
+}
+
+void live_histogram_record (struct live_histogram *h, uint64_t ms)
+{
+  int b = 0;
+
+  while ( b < LIVE_HIST_BUCKETS-1 && ms > hist_bounds[b] )
+    {
+      ++b;
+    }
+  LIVE_ADD (h->bucket[b], 1);
+  LIVE_ADD (h->sum_ms, ms);
+}
+
+void live_histogram_record_shared (struct live_histogram *h, uint64_t ms)
+{
+  int b = 0;
+
+  while ( b < LIVE_HIST_BUCKETS-1 && ms > hist_bounds[b] )
+    {
+      ++b;
+    }
+  __atomic_fetch_add (&h->bucket[b], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&h->sum_ms, ms, __ATOMIC_RELAXED);
+}
+
+#define LIVE_LINE(prefix, block, field)                                   \
+  do {                                                                    \
+    int r = snprintf (buf + n, n < len ? len - n : 0,                     \
+                      prefix #field " %llu\n",                            \
+                      (unsigned long long) LIVE_GET (block.field));       \
+    if ( r > 0 ) n += r;                                                  \
+  } while (0)
+
+int live_stats_snapshot (char *buf, size_t len)
+{
+  struct live_stats *s = gbl_live_stats;
+  size_t n = 0;
+  int r;
+
+  r = snprintf (buf, len,
+                "pid %u\n"
+                "uptime %llu\n",
+                s->pid,
+                (unsigned long long)(time (NULL) - s->start_time));
+  if ( r > 0 ) n += r;
+
+  LIVE_LINE ("enqueuer_", s->enq, packets_received_total);
+  LIVE_LINE ("enqueuer_", s->enq, bytes_received_total);
+  LIVE_LINE ("enqueuer_", s->enq, socket_errors_total);
+  LIVE_LINE ("enqueuer_", s->enq, packets_received_since_last_rotate);
+  LIVE_LINE ("enqueuer_", s->enq, bytes_received_since_last_rotate);
+  LIVE_LINE ("enqueuer_", s->enq, socket_errors_since_last_rotate);
+  LIVE_LINE ("enqueuer_", s->enq, rotations);
+  LIVE_LINE ("enqueuer_", s->enq, last_rotate);
+  LIVE_LINE ("enqueuer_", s->enq, socket_backlog_bytes);
+  LIVE_LINE ("enqueuer_", s->enq, socket_drops_total);
+  LIVE_LINE ("enqueuer_", s->enq, shaped_dropped_total);
+  LIVE_LINE ("enqueuer_", s->enq, shaped_diverted_total);
+
+  LIVE_LINE ("dequeuer_", s->deq, packets_written_total);
+  LIVE_LINE ("dequeuer_", s->deq, bytes_written_total);
+  LIVE_LINE ("dequeuer_", s->deq, loss_total);
+  LIVE_LINE ("dequeuer_", s->deq, packets_written_since_last_rotate);
+  LIVE_LINE ("dequeuer_", s->deq, bytes_written_since_last_rotate);
+  LIVE_LINE ("dequeuer_", s->deq, loss_since_last_rotate);
+  LIVE_LINE ("dequeuer_", s->deq, queue_depth);
+  LIVE_LINE ("dequeuer_", s->deq, hiq_since_last_rotate);
+  LIVE_LINE ("dequeuer_", s->deq, rotations);
+  LIVE_LINE ("dequeuer_", s->deq, last_rotate);
+
+  n += senders_snapshot (buf + n, n < len ? len - n : 0);
+
+  return (int) n;
+}
+
+#define OM_APPEND(...)                                                    \
+  do {                                                                    \
+    int r = snprintf (buf + n, n < len ? len - n : 0, __VA_ARGS__);       \
+    if ( r > 0 ) n += r;                                                  \
+  } while (0)
+
+#define OM_COUNTER(name, help, value)                                     \
+  OM_APPEND ("# TYPE lwes_journaller_" name " counter\n"                  \
+             "# HELP lwes_journaller_" name " " help "\n"                 \
+             "lwes_journaller_" name "_total %llu\n",                     \
+             (unsigned long long) (value))
+
+#define OM_GAUGE(name, help, value)                                       \
+  OM_APPEND ("# TYPE lwes_journaller_" name " gauge\n"                    \
+             "# HELP lwes_journaller_" name " " help "\n"                 \
+             "lwes_journaller_" name " %llu\n",                           \
+             (unsigned long long) (value))
+
+static size_t om_histogram (char *buf, size_t n, size_t len,
+                            const char *name, const char *help,
+                            struct live_histogram *h)
+{
+  unsigned long long count = 0;
+  int b;
+
+  OM_APPEND ("# TYPE lwes_journaller_%s histogram\n"
+             "# HELP lwes_journaller_%s %s\n"
+             "# UNIT lwes_journaller_%s seconds\n",
+             name, name, help, name);
+  for ( b = 0; b < LIVE_HIST_BUCKETS; ++b )
+    {
+      count += LIVE_GET (h->bucket[b]);
+      if ( b < LIVE_HIST_BUCKETS-1 )
+        {
+          OM_APPEND ("lwes_journaller_%s_bucket{le=\"%g\"} %llu\n",
+                     name, hist_bounds[b] / 1000., count);
+        }
+      else
+        {
+          OM_APPEND ("lwes_journaller_%s_bucket{le=\"+Inf\"} %llu\n",
+                     name, count);
+        }
+    }
+  OM_APPEND ("lwes_journaller_%s_count %llu\n"
+             "lwes_journaller_%s_sum %g\n",
+             name, count, name, LIVE_GET (h->sum_ms) / 1000.);
+
+  return n;
+}
+
+int live_stats_openmetrics (char *buf, size_t len)
+{
+  struct live_stats *s = gbl_live_stats;
+  struct live_enqueuer *e = &s->enq;
+  struct live_dequeuer *d = &s->deq;
+  size_t n = 0;
+
+  if ( len > 0 )
+    {
+      buf[0] = '\0';
+    }
+
+  OM_GAUGE ("start_time_seconds",
+            "When the journaller started.", s->start_time);
+
+  OM_COUNTER ("enqueuer_packets_received",
+              "Packets received from the transport.",
+              LIVE_GET (e->packets_received_total));
+  OM_COUNTER ("enqueuer_bytes_received",
+              "Bytes received from the transport.",
+              LIVE_GET (e->bytes_received_total));
+  OM_COUNTER ("enqueuer_socket_errors",
+              "Failed transport reads.",
+              LIVE_GET (e->socket_errors_total));
+  OM_GAUGE ("enqueuer_packets_received_since_last_rotate",
+            "Packets received since the enqueuer last rotated.",
+            LIVE_GET (e->packets_received_since_last_rotate));
+  OM_GAUGE ("enqueuer_bytes_received_since_last_rotate",
+            "Bytes received since the enqueuer last rotated.",
+            LIVE_GET (e->bytes_received_since_last_rotate));
+  OM_COUNTER ("enqueuer_rotations",
+              "Enqueuer stats rotations.",
+              LIVE_GET (e->rotations));
+  OM_GAUGE ("enqueuer_last_rotate_timestamp_seconds",
+            "When the enqueuer last rotated.",
+            LIVE_GET (e->last_rotate));
+  OM_GAUGE ("socket_backlog_bytes",
+            "Bytes waiting in the receive socket, as the kernel accounts them.",
+            LIVE_GET (e->socket_backlog_bytes));
+  OM_COUNTER ("socket_drops",
+              "Packets the kernel dropped because the receive socket was full.",
+              LIVE_GET (e->socket_drops_total));
+  OM_COUNTER ("enqueuer_shaped_dropped",
+              "Events over their sender or event type rate, dropped.",
+              LIVE_GET (e->shaped_dropped_total));
+  OM_COUNTER ("enqueuer_shaped_diverted",
+              "Events over their sender or event type rate, written to the overflow journal.",
+              LIVE_GET (e->shaped_diverted_total));
+
+  OM_COUNTER ("dequeuer_packets_written",
+              "Packets written to journals.",
+              LIVE_GET (d->packets_written_total));
+  OM_COUNTER ("dequeuer_bytes_written",
+              "Bytes written to journals, headers excluded.",
+              LIVE_GET (d->bytes_written_total));
+  OM_COUNTER ("dequeuer_loss",
+              "Packets which could not be written to a journal.",
+              LIVE_GET (d->loss_total));
+  OM_GAUGE ("dequeuer_packets_written_since_last_rotate",
+            "Packets written to the current journal.",
+            LIVE_GET (d->packets_written_since_last_rotate));
+  OM_GAUGE ("dequeuer_bytes_written_since_last_rotate",
+            "Bytes written to the current journal.",
+            LIVE_GET (d->bytes_written_since_last_rotate));
+  OM_GAUGE ("queue_depth",
+            "Packets pending in the queue after the latest read.",
+            LIVE_GET (d->queue_depth));
+  OM_GAUGE ("queue_depth_max_since_last_rotate",
+            "Highest queue depth since the last rotation.",
+            LIVE_GET (d->hiq_since_last_rotate));
+  OM_COUNTER ("dequeuer_rotations",
+              "Journal rotations.",
+              LIVE_GET (d->rotations));
+  OM_GAUGE ("dequeuer_last_rotate_timestamp_seconds",
+            "When the journal was last rotated.",
+            LIVE_GET (d->last_rotate));
+
+  n = om_histogram (buf, n, len, "event_latency_seconds",
+                    "Time from receipt of an event to its journal write.",
+                    &d->latency);
+  n = om_histogram (buf, n, len, "rotation_duration_seconds",
+                    "Time taken to close a journal and open the next one.",
+                    &d->rotate);
+  n = om_histogram (buf, n, len, "journal_sync_duration_seconds",
+                    "Time taken by a journal write-back sync.",
+                    &s->sync);
+
+  n += senders_openmetrics (buf + n, n < len ? len - n : 0);
+
+  OM_APPEND ("# EOF\n");
+
+  return (int) n;
+}
+
+#if HAVE_PTHREAD_H
+
+static void write_all (int fd, const char *buf, size_t len)
+{
+  size_t off = 0;
+
+  while ( off < len )
+    {
+      ssize_t w = write (fd, buf + off, len - off);
+      if ( w <= 0 )
+        {
+          break;
+        }
+      off += w;
+    }
+}
+
+static void live_stats_serve (int fd)
+{
+  /* room for the heaviest senders too; only the server thread is here */
+  static char buf[65536];
+  int len = live_stats_snapshot (buf, sizeof (buf));
+
+  if ( len > (int) sizeof (buf) - 1 )
+    {
+      len = sizeof (buf) - 1;
+    }
+  write_all (fd, buf, len);
+}
+
+/* Just enough HTTP/1.0 for a scraper: "GET /metrics", one response,
+ * then close. */
+static void live_stats_serve_http (int fd)
+{
+  static const char not_found[] =
+    "HTTP/1.0 404 Not Found\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 10\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Not Found\n";
+  char req[1024];
+  static char body[65536];
+  char head[256];
+  size_t got = 0;
+  struct timeval tv = { 1, 0 };
+  int blen, hlen;
+
+  /* a client which never sends its request holds up other scrapers for
+   * at most a second */
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+  while ( got < sizeof (req) - 1 )
+    {
+      ssize_t r = read (fd, req + got, sizeof (req) - 1 - got);
+      if ( r <= 0 )
+        {
+          break;
+        }
+      got += r;
+      req[got] = '\0';
+      if ( strstr (req, "\r\n\r\n") || strstr (req, "\n\n") )
+        {
+          break;
+        }
+    }
+  req[got] = '\0';
+
+  if ( strncmp (req, "GET /metrics", 12) != 0
+       || ( req[12] != ' ' && req[12] != '?' ) )
+    {
+      write_all (fd, not_found, sizeof (not_found) - 1);
+      return;
+    }
+
+  blen = live_stats_openmetrics (body, sizeof (body));
+  if ( blen > (int) sizeof (body) - 1 )
+    {
+      blen = sizeof (body) - 1;
+    }
+  hlen = snprintf (head, sizeof (head),
+                   "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: application/openmetrics-text; "
+                   "version=1.0.0; charset=utf-8\r\n"
+                   "Content-Length: %d\r\n"
+                   "Connection: close\r\n"
+                   "\r\n", blen);
+  write_all (fd, head, hlen);
+  write_all (fd, body, blen);
+}
+
+static void* live_stats_server (void *arg)
+{
+  struct pollfd pfd[2];
+  int nfds = 0;
+  (void)arg; /* appease -Wall -Werror */
+
+#ifdef HAVE_PTHREAD_SETNAME_NP_2
+  pthread_setname_np (pthread_self(), "live_stats");
+#endif
+#ifdef HAVE_PTHREAD_SETNAME_NP_1
+  pthread_setname_np ("live_stats");
+#endif
+
+  if ( server_fd >= 0 )
+    {
+      pfd[nfds].fd = server_fd;
+      pfd[nfds++].events = POLLIN;
+    }
+  if ( metrics_fd >= 0 )
+    {
+      pfd[nfds].fd = metrics_fd;
+      pfd[nfds++].events = POLLIN;
+    }
+
+  while ( ! gbl_done )
+    {
+      int i;
+
+      if ( poll (pfd, nfds, arg_wakeup_interval_ms) <= 0 )
+        {
+          continue;
+        }
+      for ( i = 0; i < nfds; ++i )
+        {
+          int client;
+
+          if ( ! (pfd[i].revents & POLLIN) )
+            {
+              continue;
+            }
+          client = accept (pfd[i].fd, NULL, NULL);
+          if ( client < 0 )
+            {
+              continue;
+            }
+          if ( pfd[i].fd == metrics_fd )
+            {
+              live_stats_serve_http (client);
+            }
+          else
+            {
+              live_stats_serve (client);
+            }
+          close (client);
+        }
+    }
+
+  return NULL;
+}
+
+static int open_stats_socket (FILE *log)
+{
+  struct sockaddr_un addr;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if ( strlen (arg_stats_socket) >= sizeof (addr.sun_path) )
+    {
+      LOG_ER (log, "Stats socket path \"%s\" is too long.\n",
+              arg_stats_socket);
+      return -1;
+    }
+  strcpy (addr.sun_path, arg_stats_socket);
+
+  server_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if ( server_fd < 0 )
+    {
+      PERROR (log, "socket");
+      return -1;
+    }
+  unlink (arg_stats_socket);
+  if ( bind (server_fd, (struct sockaddr *)&addr, sizeof (addr)) < 0
+       || listen (server_fd, 16) < 0 )
+    {
+      PERROR (log, "bind");
+      LOG_ER (log, "Unable to listen on stats socket \"%s\".\n",
+              arg_stats_socket);
+      close (server_fd);
+      server_fd = -1;
+      return -1;
+    }
+
+  LOG_INF (log, "Serving live stats on \"%s\".\n", arg_stats_socket);
+  return 0;
+}
+
+static int open_metrics_socket (FILE *log)
+{
+  struct sockaddr_in addr;
+  int one = 1;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (arg_metrics_port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  metrics_fd = socket (AF_INET, SOCK_STREAM, 0);
+  if ( metrics_fd < 0 )
+    {
+      PERROR (log, "socket");
+      return -1;
+    }
+  setsockopt (metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  if ( bind (metrics_fd, (struct sockaddr *)&addr, sizeof (addr)) < 0
+       || listen (metrics_fd, 16) < 0 )
+    {
+      PERROR (log, "bind");
+      LOG_ER (log, "Unable to listen on metrics port %d.\n",
+              arg_metrics_port);
+      close (metrics_fd);
+      metrics_fd = -1;
+      return -1;
+    }
+
+  LOG_INF (log, "Serving metrics on http://127.0.0.1:%d/metrics.\n",
+           arg_metrics_port);
+  return 0;
+}
+
+static void close_sockets (void)
+{
+  if ( server_fd >= 0 )
+    {
+      close (server_fd);
+      server_fd = -1;
+      unlink (arg_stats_socket);
+    }
+  if ( metrics_fd >= 0 )
+    {
+      close (metrics_fd);
+      metrics_fd = -1;
+    }
+}
+
+int live_stats_server_start (FILE *log)
+{
+  sigset_t all, old;
+
+  if ( arg_stats_socket != NULL && open_stats_socket (log) < 0 )
+    {
+      close_sockets ();
+      return -1;
+    }
+  if ( arg_metrics_port > 0 && open_metrics_socket (log) < 0 )
+    {
+      close_sockets ();
+      return -1;
+    }
+  if ( server_fd < 0 && metrics_fd < 0 )
+    {
+      return 0;
+    }
+
+  /* signals are for the threads of the process model in use, never
+   * for this one */
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if ( pthread_create (&server_tid, NULL, live_stats_server, NULL) != 0 )
+    {
+      PERROR (log, "pthread_create(live_stats)");
+      pthread_sigmask (SIG_SETMASK, &old, NULL);
+      close_sockets ();
+      return -1;
+    }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  server_running = 1;
+
+  return 0;
+}
+
+void live_stats_server_stop (FILE *log)
+{
+  if ( server_running )
+    {
+      if ( pthread_join (server_tid, NULL) != 0 )
+        {
+          PERROR (log, "pthread_join(live_stats)");
+        }
+      server_running = 0;
+    }
+  close_sockets ();
+}
+
+#else
+
+int live_stats_server_start (FILE *log)
+{
+  if ( arg_stats_socket != NULL || arg_metrics_port > 0 )
+    {
+      LOG_WARN (log, "No POSIX thread support, --stats-socket and "
+                "--metrics-port ignored.\n");
+    }
+  return 0;
+}
+
+void live_stats_server_stop (FILE *log)
+{
+  (void)log;
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#ifndef LIVE_STATS_DOT_H
+#define LIVE_STATS_DOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "senders.h"
+
+/* Live counters, readable at any time without waiting for a rotation.
+ *
+ * The page lives in POSIX shared memory (--stats-shm, by default the
+ * queue name with ".stats" appended) so the enqueuer and dequeuer
+ * processes of the process model share it and an external scraper can
+ * map it read-only.  It can also be read as text from a Unix socket
+ * (--stats-socket) or in OpenMetrics format over HTTP from
+ * http://127.0.0.1:<--metrics-port>/metrics.
+ *
+ * Every block has exactly one writer (the enqueuer or the dequeuer
+ * thread) and starts on its own cache line, so the writers never share
+ * a line with each other.  Writers use relaxed atomic stores, readers
+ * relaxed atomic loads: every counter read is a value that was really
+ * stored, but different counters may be from slightly different moments.
+ * The journal sync histogram is the exception: the overflow journal is
+ * written by the enqueuer, so it takes atomic adds from either side.
+ */
+
+#define LIVE_STATS_MAGIC    0x4c4a4c53    /* "LJLS" */
+#define LIVE_STATS_VERSION  6
+#define LIVE_STATS_LINE     64
+
+/* Histogram bucket upper bounds in milliseconds, one more bucket past
+ * the last bound collects everything slower. */
+#define LIVE_HIST_BOUNDS    { 1, 2, 5, 10, 25, 50, 100, 250, 500, \
+                              1000, 2500, 5000, 10000 }
+#define LIVE_HIST_BUCKETS   14
+
+/* Buckets are not cumulative, readers add them up; the count is the sum
+ * of the buckets so it always agrees with them. */
+struct live_histogram {
+  uint64_t bucket[LIVE_HIST_BUCKETS];
+  uint64_t sum_ms;
+};
+
+struct live_enqueuer {
+  uint64_t packets_received_total;
+  uint64_t bytes_received_total;
+  uint64_t socket_errors_total;
+  uint64_t packets_received_since_last_rotate;
+  uint64_t bytes_received_since_last_rotate;
+  uint64_t socket_errors_since_last_rotate;
+  uint64_t rotations;
+  uint64_t last_rotate;           /* seconds since the epoch */
+  uint64_t socket_backlog_bytes;  /* latest sample, kernel accounting */
+  uint64_t socket_drops_total;    /* dropped by the kernel */
+  uint64_t shaped_dropped_total;  /* over their rate, dropped */
+  uint64_t shaped_diverted_total; /* over their rate, to --overflow-journal */
+} __attribute__ ((aligned (LIVE_STATS_LINE)));
+
+struct live_dequeuer {
+  uint64_t packets_written_total;
+  uint64_t bytes_written_total;
+  uint64_t loss_total;
+  uint64_t packets_written_since_last_rotate;
+  uint64_t bytes_written_since_last_rotate;
+  uint64_t loss_since_last_rotate;
+  uint64_t queue_depth;           /* pending after the latest read */
+  uint64_t hiq_since_last_rotate;
+  uint64_t rotations;
+  uint64_t last_rotate;           /* seconds since the epoch */
+  struct live_histogram latency;  /* receipt to journal write */
+  struct live_histogram rotate;   /* journal close and reopen */
+} __attribute__ ((aligned (LIVE_STATS_LINE)));
+
+struct live_stats {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;                  /* sizeof(struct live_stats) */
+  uint32_t pid;
+  uint64_t start_time;            /* seconds since the epoch */
+  struct live_enqueuer enq;
+  struct live_dequeuer deq;
+  struct live_histogram sync      /* journal write-back, any writer */
+    __attribute__ ((aligned (LIVE_STATS_LINE)));
+  struct sender_table senders;    /* written by the enqueuer */
+} __attribute__ ((aligned (LIVE_STATS_LINE)));
+
+/* Always valid, points at a private page until live_stats_open() maps
+ * the shared one. */
+extern struct live_stats *gbl_live_stats;
+
+#define LIVE_GET(field)      __atomic_load_n (&(field), __ATOMIC_RELAXED)
+#define LIVE_SET(field, v)   __atomic_store_n (&(field), (v), __ATOMIC_RELAXED)
+/* Only for the single writer of field, so no read-modify-write needed. */
+#define LIVE_ADD(field, n)   LIVE_SET (field, (field) + (n))
+
+/* Only for the single writer of h. */
+void live_histogram_record (struct live_histogram *h, uint64_t ms);
+/* For h with more than one writer. */
+void live_histogram_record_shared (struct live_histogram *h, uint64_t ms);
+
+/* Map the shared page, create != 0 (the main process) also resets it.
+ * Returns 0 on success, -1 if it fell back to the private page. */
+int  live_stats_open (int create, FILE *log);
+void live_stats_close (int destroy, FILE *log);
+
+/* Format the current counters as "name value" lines into buf, returns
+ * the length as snprintf does. */
+int  live_stats_snapshot (char *buf, size_t len);
+
+/* Format the current counters in OpenMetrics text format. */
+int  live_stats_openmetrics (char *buf, size_t len);
+
+/* Serve snapshots on --stats-socket and --metrics-port until gbl_done,
+ * from a thread of its own which never touches the pipeline's data. */
+int  live_stats_server_start (FILE *log);
+void live_stats_server_stop (FILE *log);
+
+#endif /* LIVE_STATS_DOT_H */
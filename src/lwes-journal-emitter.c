@@ -11,13 +11,16 @@
  *======================================================================*/
 
 #define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
 #include <unistd.h>
-#include <zlib.h>
 #include <lwes.h>
 
 #include <sys/socket.h>
@@ -25,8 +28,35 @@
 #include <arpa/inet.h>
 
 #include "header.h"
+#include "journal_reader.h"
 #include "time_utils.h"
 
+/* The read-ahead thread decompresses into a ring of NBATCHES batches,
+ * each holding up to BATCH_EVENTS payloads in BATCH_BYTES of memory.
+ */
+#define NBATCHES        32
+#define BATCH_EVENTS    4096
+#define BATCH_BYTES     (4*1024*1024)
+#define GZ_BUFFER       (256*1024)
+
+/* At most this many datagrams go out in one sendmmsg(2) call */
+#define SEND_BATCH      64
+
+/* Each destination has its own sender thread fed through a ring of
+ * DEST_SLOTS events whose payloads are copied into DEST_BYTES.
+ */
+#define MAX_DESTS       64
+#define DEST_SLOTS      65536
+#define DEST_BYTES      (16*1024*1024)
+
+/* Waits longer than this sleep until SPIN_NS before the deadline and
+ * busy-poll the rest, which keeps pacing error in the low microseconds
+ * without burning a core at low rates.
+ */
+#define SPIN_NS         200000ULL
+
+#define NS_PER_SEC      1000000000ULL
+
 /* prototypes */
 static void signal_handler(int sig);
 
@@ -50,19 +80,35 @@ static const char help[] =
   "           if ip is a multicast ip, then datagrams are sent via"    "\n"
   "           multicast, otherwise they are sent via UDP."             "\n"
   ""                                                                   "\n"
+  "       May be given more than once, each output gets its own"       "\n"
+  "       sender thread and buffers.  With more than one output,"     "\n"
+  "       events for an output which cannot keep up are dropped"       "\n"
+  "       (and counted) rather than slowing down the others."          "\n"
+  ""                                                                   "\n"
+  "    -s all|hash|rr"                                                 "\n"
+  "       How events are spread over the outputs: every event to"      "\n"
+  "       every output (all, the default), by a hash of the event"     "\n"
+  "       name (hash) or round-robin (rr)."                            "\n"
+  ""                                                                   "\n"
   "    -n [one argument]"                                              "\n"
   "       The number of events from file to emit."                     "\n"
   ""                                                                   "\n"
   "    -r [one argument]"                                              "\n"
   "       The number of events per second to attempt to emit."         "\n"
-  "       Smooth delivery is attempted, but not guaranteed"            "\n"
+  "       Events are sent on an absolute schedule, so short stalls"    "\n"
+  "       are caught up rather than lowering the average rate."        "\n"
   ""                                                                   "\n"
   "    -d"                                                             "\n"
   "       When finished with journal (or journals), start over at"     "\n"
   "       at the first journal"                                        "\n"
   ""                                                                   "\n"
-  "    -t"                                                             "\n"
+  "    -t [optional argument]"                                         "\n"
   "       Attempt to use timings of events from file when emitting."   "\n"
+  "       An optional speed multiplier replays faster (-t 10) or"      "\n"
+  "       slower (-t 0.5) than the original, the default is 1."        "\n"
+  ""                                                                   "\n"
+  "    -p [one argument]"                                              "\n"
+  "       Report emit rate and lag every this many seconds."           "\n"
   ""                                                                   "\n"
   "    -h"                                                             "\n"
   "       show this message"                                           "\n"
@@ -198,24 +244,572 @@ handle_transport_arg (const char *arg)
 
 
 
-int main(int argc, char **argv)
-{
-  gzFile file;
+
+/* A slice of a journal, filled by the read-ahead thread and drained by
+ * the sender.  Payloads are stored back to back in data, the header is
+ * only kept for its receipt time.
+ */
+struct batch {
   const char *filename;
+  bool first;             /* first batch of a journal */
+  bool last;              /* last batch of a journal */
+  bool end;               /* nothing follows this batch */
+  bool error;
+  int n;
+  size_t len;
+  unsigned int off[BATCH_EVENTS];
+  unsigned short size[BATCH_EVENTS];
+  unsigned long long ts[BATCH_EVENTS];
+  unsigned char *data;
+};
+
+struct reader {
+  char **files;
+  int nfiles;
+  bool repeat;
+  struct batch ring[NBATCHES];
+  unsigned long head;     /* next batch for the pacer */
+  unsigned long tail;     /* next batch for the reader */
+  bool stop;
+  unsigned long long stalls;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+/* How events are spread over the -o destinations (-s). */
+typedef enum {
+  SHARD_ALL, SHARD_HASH, SHARD_RR
+} shard_t;
+
+struct lag_stats {
+  unsigned long long events;
+  unsigned long long sum_ns;
+  unsigned long long max_ns;
+  unsigned long long late;     /* more than a millisecond behind */
+};
+
+/* An event copied out of the read-ahead batches for one destination, so
+ * a destination which falls behind holds none of the shared batches.
+ * pos is a running byte count, the payload is at pos % DEST_BYTES.
+ */
+struct slot {
+  unsigned long long pos;
+  unsigned long long due;
+  unsigned short size;
+};
+
+/* Everything the sender needs for one destination.
+ *
+ * The pacer (main thread) is the only producer and the sender thread
+ * the only consumer of the ring, so it needs no lock, the mutex is for
+ * sleeping while the ring is empty and for the stats.
+ */
+struct dest {
+  const char *name;
+  struct lwes_emitter *emitter;
+  pthread_t tid;
+  struct slot *slots;
+  unsigned char *data;
+  unsigned long head;              /* next slot for the sender */
+  unsigned long tail;              /* next slot for the pacer */
+  unsigned long long data_head;    /* bytes released by the sender */
+  unsigned long long data_tail;    /* bytes used by the pacer */
+  int sleeping;
+  bool stop;
+  volatile bool failed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  struct mmsghdr msgs[SEND_BATCH];
+  struct iovec iov[SEND_BATCH];
+  unsigned long long dropped;      /* pacer only */
+  unsigned long long reported_dropped;
+  /* protected by lock */
+  unsigned long long sent;
+  unsigned long long reported_sent;
+  struct lag_stats lag[2];         /* whole run and current interval */
+};
+
+static unsigned long long now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* Sleep for most of the wait and spin for the end of it. */
+static unsigned long long wait_until (unsigned long long due)
+{
+  unsigned long long now = now_ns ();
+  if (due > now + SPIN_NS)
+    {
+      struct timespec ts;
+      unsigned long long wake = due - SPIN_NS;
+      ts.tv_sec = wake / NS_PER_SEC;
+      ts.tv_nsec = wake % NS_PER_SEC;
+      while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+             == EINTR && ! gbl_sig)
+        ;
+      now = now_ns ();
+    }
+  while (now < due && ! gbl_sig)
+    {
+      now = now_ns ();
+    }
+  return now;
+}
+
+static struct batch *reader_acquire (struct reader *rd)
+{
+  struct batch *b = NULL;
+  pthread_mutex_lock (&rd->lock);
+  while (! rd->stop && rd->tail - rd->head >= NBATCHES)
+    {
+      pthread_cond_wait (&rd->not_full, &rd->lock);
+    }
+  if (! rd->stop)
+    {
+      b = &rd->ring[rd->tail % NBATCHES];
+    }
+  pthread_mutex_unlock (&rd->lock);
+  if (b != NULL)
+    {
+      b->filename = NULL;
+      b->first = b->last = b->end = b->error = false;
+      b->n = 0;
+      b->len = 0;
+    }
+  return b;
+}
+
+static void reader_publish (struct reader *rd)
+{
+  pthread_mutex_lock (&rd->lock);
+  rd->tail++;
+  pthread_cond_signal (&rd->not_empty);
+  pthread_mutex_unlock (&rd->lock);
+}
+
+static void *reader_main (void *arg)
+{
+  struct reader *rd = (struct reader *)arg;
+  struct batch *b;
   char header[22];
-  unsigned char buf[65535];
+  int offset = 0;
+  bool done = false;
+
+  while (! done)
+    {
+      const char *filename = rd->files[offset];
+      struct journal_reader *file;
+
+      /* deal with multiple files and repeating */
+      if (! rd->repeat && offset == (rd->nfiles - 1))
+        {
+          done = true; /* last file and we are not repeating,
+                          so done after it's processed */
+        }
+      offset = (offset + 1) % rd->nfiles;
+
+      if ((b = reader_acquire (rd)) == NULL)
+        {
+          return NULL;
+        }
+      b->filename = filename;
+      b->first = true;
+
+      file = journal_reader_open (filename, GZ_BUFFER);
+      if (file == NULL)
+        {
+          fprintf (stderr, "ERROR: unable to open %s\n", filename);
+          b->error = b->last = true;
+          reader_publish (rd);
+          break;
+        }
+
+      /* read a header from the file */
+      while (journal_reader_read (file, header, 22) == 22)
+        {
+          unsigned short size = header_payload_length (header);
+
+          if (b->n == BATCH_EVENTS || b->len + size > BATCH_BYTES)
+            {
+              reader_publish (rd);
+              if ((b = reader_acquire (rd)) == NULL)
+                {
+                  journal_reader_close (file);
+                  return NULL;
+                }
+              b->filename = filename;
+            }
+
+          /* read an event from the file */
+          if (journal_reader_read (file, b->data + b->len, size) != size)
+            {
+              fprintf (stderr, "ERROR: failure reading journal\n");
+              b->error = true;
+              done = true;
+              break;
+            }
+          b->off[b->n] = b->len;
+          b->size[b->n] = size;
+          b->ts[b->n] = (unsigned long long)(header_receipt_time (header));
+          b->len += size;
+          b->n++;
+        }
+      journal_reader_close (file);
+      b->last = true;
+      reader_publish (rd);
+    }
+
+  if ((b = reader_acquire (rd)) != NULL)
+    {
+      b->end = true;
+      reader_publish (rd);
+    }
+  return NULL;
+}
 
-  const char *args = "n:o:r:tdh";
+static struct batch *batch_next (struct reader *rd)
+{
+  struct batch *b;
+  pthread_mutex_lock (&rd->lock);
+  if (rd->head == rd->tail)
+    {
+      rd->stalls++;
+      while (rd->head == rd->tail)
+        {
+          pthread_cond_wait (&rd->not_empty, &rd->lock);
+        }
+    }
+  b = &rd->ring[rd->head % NBATCHES];
+  pthread_mutex_unlock (&rd->lock);
+  return b;
+}
+
+static void batch_release (struct reader *rd)
+{
+  pthread_mutex_lock (&rd->lock);
+  rd->head++;
+  pthread_cond_signal (&rd->not_full);
+  pthread_mutex_unlock (&rd->lock);
+}
+
+static void reader_stop (struct reader *rd)
+{
+  pthread_mutex_lock (&rd->lock);
+  rd->stop = true;
+  pthread_cond_broadcast (&rd->not_full);
+  pthread_mutex_unlock (&rd->lock);
+}
+
+static int reader_fill (struct reader *rd)
+{
+  pthread_mutex_lock (&rd->lock);
+  int fill = (int)(rd->tail - rd->head);
+  pthread_mutex_unlock (&rd->lock);
+  return fill;
+}
+
+static void lag_record (struct lag_stats *lag, unsigned long long ns)
+{
+  lag->events++;
+  lag->sum_ns += ns;
+  if (ns > lag->max_ns)
+    {
+      lag->max_ns = ns;
+    }
+  if (ns > 1000000ULL)
+    {
+      lag->late++;
+    }
+}
+
+static int dest_init (struct dest *d, const char *name,
+                      struct lwes_emitter *emitter)
+{
+  int i;
+  memset (d, 0, sizeof (*d));
+  d->name = name;
+  d->emitter = emitter;
+  d->slots = (struct slot *) calloc (DEST_SLOTS, sizeof (struct slot));
+  d->data = (unsigned char *) malloc (DEST_BYTES);
+  if (d->slots == NULL || d->data == NULL)
+    {
+      free (d->slots);
+      free (d->data);
+      return -1;
+    }
+  for (i = 0; i < SEND_BATCH; i++)
+    {
+      d->msgs[i].msg_hdr.msg_name = &emitter->connection->mcast_addr;
+      d->msgs[i].msg_hdr.msg_namelen =
+        sizeof (emitter->connection->mcast_addr);
+      d->msgs[i].msg_hdr.msg_iov = &d->iov[i];
+      d->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+  pthread_mutex_init (&d->lock, NULL);
+  pthread_cond_init (&d->not_empty, NULL);
+  return 0;
+}
+
+static void dest_dtor (struct dest *d)
+{
+  if (d->emitter != NULL)
+    {
+      lwes_emitter_destroy (d->emitter);
+    }
+  free (d->slots);
+  free (d->data);
+}
+
+static bool dest_full (struct dest *d, unsigned long long pos,
+                       unsigned short size)
+{
+  return d->tail - __atomic_load_n (&d->head, __ATOMIC_ACQUIRE) >= DEST_SLOTS
+      || pos + size - __atomic_load_n (&d->data_head, __ATOMIC_ACQUIRE)
+         > DEST_BYTES;
+}
+
+/* Copy an event onto d's ring.  When the ring is full the event is
+ * dropped, so one slow destination never holds up the others, unless
+ * block is set (there is only one destination), then we wait for it. */
+static void dest_queue (struct dest *d, const unsigned char *payload,
+                        unsigned short size, unsigned long long due,
+                        bool block)
+{
+  unsigned long long pos = d->data_tail;
+  struct slot *s;
+
+  /* payloads never wrap, skip to the start of the buffer instead */
+  if (pos % DEST_BYTES + size > DEST_BYTES)
+    {
+      pos += DEST_BYTES - pos % DEST_BYTES;
+    }
+  while (block && dest_full (d, pos, size) && ! d->failed && ! gbl_sig)
+    {
+      sched_yield ();
+    }
+  if (dest_full (d, pos, size))
+    {
+      d->dropped++;
+      return;
+    }
+
+  memcpy (d->data + pos % DEST_BYTES, payload, size);
+  s = &d->slots[d->tail % DEST_SLOTS];
+  s->pos = pos;
+  s->size = size;
+  s->due = due;
+  d->data_tail = pos + size;
+
+  /* the store of tail and load of sleeping pair with the store of
+   * sleeping and load of tail in dest_main, so no wakeup is lost */
+  __atomic_store_n (&d->tail, d->tail + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&d->sleeping, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock (&d->lock);
+      pthread_cond_signal (&d->not_empty);
+      pthread_mutex_unlock (&d->lock);
+    }
+}
+
+static void *dest_main (void *arg)
+{
+  struct dest *d = (struct dest *)arg;
+  unsigned long head = 0;
+
+  while (! d->failed)
+    {
+      unsigned long tail = __atomic_load_n (&d->tail, __ATOMIC_SEQ_CST);
+      unsigned long long now;
+      int n, sent = 0;
+      int i;
+
+      if (head == tail)
+        {
+          bool stop;
+          pthread_mutex_lock (&d->lock);
+          __atomic_store_n (&d->sleeping, 1, __ATOMIC_SEQ_CST);
+          while (head == __atomic_load_n (&d->tail, __ATOMIC_SEQ_CST)
+                 && ! d->stop)
+            {
+              pthread_cond_wait (&d->not_empty, &d->lock);
+            }
+          __atomic_store_n (&d->sleeping, 0, __ATOMIC_SEQ_CST);
+          stop = d->stop && head == __atomic_load_n (&d->tail,
+                                                     __ATOMIC_SEQ_CST);
+          pthread_mutex_unlock (&d->lock);
+          if (stop)
+            {
+              break;
+            }
+          continue;
+        }
+
+      n = tail - head < SEND_BATCH ? (int)(tail - head) : SEND_BATCH;
+      for (i = 0; i < n; i++)
+        {
+          const struct slot *s = &d->slots[(head + i) % DEST_SLOTS];
+          d->iov[i].iov_base = d->data + s->pos % DEST_BYTES;
+          d->iov[i].iov_len = s->size;
+        }
+      while (sent < n)
+        {
+          int r = sendmmsg (d->emitter->connection->socketfd,
+                            d->msgs + sent, n - sent, 0);
+          if (r < 0)
+            {
+              /* a full socket buffer just means we are going fast */
+              if (errno == EINTR || errno == EAGAIN || errno == ENOBUFS)
+                {
+                  continue;
+                }
+              fprintf (stderr, "ERROR: failure emitting to %s : %s\n",
+                       d->name, strerror (errno));
+              d->failed = true;
+              break;
+            }
+          sent += r;
+        }
+
+      now = now_ns ();
+      pthread_mutex_lock (&d->lock);
+      for (i = 0; i < sent; i++)
+        {
+          const struct slot *s = &d->slots[(head + i) % DEST_SLOTS];
+          /* unpaced events are never late */
+          if (s->due > 0ULL)
+            {
+              unsigned long long l = now > s->due ? now - s->due : 0ULL;
+              lag_record (&d->lag[0], l);
+              lag_record (&d->lag[1], l);
+            }
+        }
+      d->sent += sent;
+      pthread_mutex_unlock (&d->lock);
+
+      {
+        const struct slot *s = &d->slots[(head + n - 1) % DEST_SLOTS];
+        __atomic_store_n (&d->data_head, s->pos + s->size, __ATOMIC_RELEASE);
+      }
+      head += n;
+      __atomic_store_n (&d->head, head, __ATOMIC_RELEASE);
+    }
+  return NULL;
+}
+
+static void dest_stop (struct dest *d)
+{
+  pthread_mutex_lock (&d->lock);
+  d->stop = true;
+  pthread_cond_signal (&d->not_empty);
+  pthread_mutex_unlock (&d->lock);
+}
+
+static void report (const char *what, const char *name,
+                    unsigned long long events, unsigned long long dropped,
+                    unsigned long long elapsed_ns, const struct lag_stats *lag)
+{
+  double secs = elapsed_ns / 1e9;
+  fprintf (stderr,
+           "%s: %s %llu events (%llu dropped) in %.3f s, %.0f events/s, "
+           "lag avg %.3f ms max %.3f ms, %llu late\n",
+           what, name, events, dropped, secs, secs > 0 ? events / secs : 0.,
+           lag->events ? lag->sum_ns / 1e6 / lag->events : 0.,
+           lag->max_ns / 1e6, lag->late);
+}
+
+/* Report every destination, interval is 0 for the totals of the whole
+ * run and 1 for the per interval figures (which are then reset). */
+static void report_dests (const char *what, struct dest *dests, int ndests,
+                          int interval, unsigned long long elapsed_ns,
+                          struct reader *rd)
+{
+  int i;
+  for (i = 0; i < ndests; i++)
+    {
+      struct dest *d = &dests[i];
+      struct lag_stats lag;
+      unsigned long long sent, dropped;
+
+      dropped = d->dropped - (interval ? d->reported_dropped : 0ULL);
+      pthread_mutex_lock (&d->lock);
+      lag = d->lag[interval];
+      sent = d->sent - (interval ? d->reported_sent : 0ULL);
+      if (interval)
+        {
+          memset (&d->lag[1], 0, sizeof (d->lag[1]));
+          d->reported_sent = d->sent;
+        }
+      pthread_mutex_unlock (&d->lock);
+      if (interval)
+        {
+          d->reported_dropped = d->dropped;
+        }
+
+      report (what, d->name, sent, dropped, elapsed_ns, &lag);
+    }
+  fprintf (stderr, "%s: read-ahead %d/%d batches, %llu reader stalls\n",
+           what, reader_fill (rd), NBATCHES, rd->stalls);
+}
+
+static bool is_number (const char *s)
+{
+  char *end;
+  if (s == NULL || *s == '\0')
+    {
+      return false;
+    }
+  strtod (s, &end);
+  return *end == '\0';
+}
+
+/* FNV-1a of the event name, which leads the serialized event as a one
+ * byte length followed by the name. */
+static unsigned int event_name_hash (const unsigned char *payload,
+                                     unsigned short size)
+{
+  unsigned int h = 2166136261U;
+  unsigned int len = size > 0 ? payload[0] : 0;
+  unsigned int i;
+  if (len >= size)
+    {
+      len = size > 0 ? size - 1 : 0;
+    }
+  for (i = 1; i <= len; i++)
+    {
+      h ^= payload[i];
+      h *= 16777619U;
+    }
+  return h;
+}
+
+int main(int argc, char **argv)
+{
+  const char *args = "n:o:r:t::dp:s:h";
   int number = 0;            /* (n) total number to emit */
-  struct lwes_emitter *emitter = NULL; /* (o) where to send the events */
+  struct dest dests[MAX_DESTS]; /* (o) where to send the events */
+  int ndests = 0;
+  int nstarted = 0;
+  shard_t shard = SHARD_ALL; /* (s) how events are spread over dests */
   int rate = 0;              /* (r) number per second for emission */
   bool use_timings = false;  /* (t) using timings from file */
+  double speed = 1.0;        /* (t) multiplier applied to those timings */
   bool repeat = false;       /* (d) rerun journals over and over */
+  int progress = 0;          /* (p) seconds between reports */
 
   int ret = 0;
+  int i;
   LWES_INT_64 start  = 0LL;
   LWES_INT_64 stop   = 0LL;
 
+  struct reader rd;
+  pthread_t reader_tid;
+  bool reader_started = false;
+
+  memset (&rd, 0, sizeof (rd));
+
   /* turn off error messages, I'll handle them */
   opterr = 0;
   while (1)
@@ -237,10 +831,48 @@ int main(int argc, char **argv)
             break;
 
           case 'o':
-            emitter = handle_transport_arg (optarg);
-            if (emitter == NULL)
+            {
+              struct lwes_emitter *emitter;
+              if (ndests == MAX_DESTS)
+                {
+                  fprintf (stderr, "ERROR: at most %d outputs\n", MAX_DESTS);
+                  ret = 1;
+                  goto cleanup;
+                }
+              emitter = handle_transport_arg (optarg);
+              if (emitter == NULL)
+                {
+                  fprintf (stderr, "ERROR: problem with emitter\n");
+                  ret = 1;
+                  goto cleanup;
+                }
+              if (dest_init (&dests[ndests], optarg, emitter) < 0)
+                {
+                  fprintf (stderr, "ERROR: unable to allocate send buffers\n");
+                  lwes_emitter_destroy (emitter);
+                  ret = 1;
+                  goto cleanup;
+                }
+              ndests++;
+            }
+            break;
+
+          case 's':
+            if (strcmp (optarg, "all") == 0)
+              {
+                shard = SHARD_ALL;
+              }
+            else if (strcmp (optarg, "hash") == 0)
               {
-                fprintf (stderr, "ERROR: problem with emitter\n");
+                shard = SHARD_HASH;
+              }
+            else if (strcmp (optarg, "rr") == 0)
+              {
+                shard = SHARD_RR;
+              }
+            else
+              {
+                fprintf (stderr, "ERROR: unknown -s mode %s\n", optarg);
                 ret = 1;
                 goto cleanup;
               }
@@ -248,12 +880,31 @@ int main(int argc, char **argv)
 
           case 't':
             use_timings = true;
+            /* accept both -t10 and -t 10, journals never look numeric */
+            if (optarg == NULL && optind < argc && is_number (argv[optind]))
+              {
+                optarg = argv[optind++];
+              }
+            if (optarg != NULL)
+              {
+                speed = atof (optarg);
+                if (speed <= 0.)
+                  {
+                    fprintf (stderr, "ERROR: -t multiplier must be > 0\n");
+                    ret = 1;
+                    goto cleanup;
+                  }
+              }
             break;
 
           case 'd':
             repeat = true;
             break;
 
+          case 'p':
+            progress = atoi(optarg);
+            break;
+
           case 'h':
             fprintf (stderr, "%s", help);
             ret = 1;
@@ -273,129 +924,144 @@ int main(int argc, char **argv)
       goto cleanup;
     }
 
-  /* setup sigint/sigkill/sigpipe handler */
-  setup_sig_handler();
+  if (ndests == 0)
+    {
+      fprintf (stderr, "ERROR: an output (-o) is required\n");
+      ret = 1;
+      goto cleanup;
+    }
+
+  rd.files = argv + optind;
+  rd.nfiles = argc - optind;
+  rd.repeat = repeat;
+  pthread_mutex_init (&rd.lock, NULL);
+  pthread_cond_init (&rd.not_empty, NULL);
+  pthread_cond_init (&rd.not_full, NULL);
+  for (i = 0; i < NBATCHES; i++)
+    {
+      rd.ring[i].data = (unsigned char *) malloc (BATCH_BYTES);
+      if (rd.ring[i].data == NULL)
+        {
+          fprintf (stderr, "ERROR: unable to allocate read-ahead buffers\n");
+          ret = 1;
+          goto cleanup;
+        }
+    }
+
+  /* setup sigint/sigkill/sigpipe handler, the reader and senders are
+   * started with everything blocked so signals are only seen here */
+  {
+    sigset_t fullset;
+    sigfillset (&fullset);
+    sigprocmask (SIG_SETMASK, &fullset, NULL);
+    if (pthread_create (&reader_tid, NULL, reader_main, &rd))
+      {
+        fprintf (stderr, "ERROR: unable to start reader thread\n");
+        ret = 1;
+        goto cleanup;
+      }
+    reader_started = true;
+    for (nstarted = 0; nstarted < ndests; nstarted++)
+      {
+        if (pthread_create (&dests[nstarted].tid, NULL,
+                            dest_main, &dests[nstarted]))
+          {
+            fprintf (stderr, "ERROR: unable to start sender thread\n");
+            ret = 1;
+            goto cleanup;
+          }
+      }
+    setup_sig_handler();
+  }
   start = currentTimeMillisLongLong ();
 
-  int start_index = optind;
-  int num_files = argc - optind;
-  int offset = 0;
   int total_count = 0;
-  int this_second_count = 0;
-  unsigned long long delay_micros = rate > 0 ? 1000000 / rate : 0;
+  unsigned int rr_next = 0;
+  unsigned long long run_start_ns = now_ns ();
+  unsigned long long rate_start_ns = 0ULL;
+  unsigned long long interval_start_ns = run_start_ns;
+  unsigned long long progress_ns = (unsigned long long)progress * NS_PER_SEC;
+  unsigned long long file_start_ns = 0ULL;
+  unsigned long long start_file_timestamp = 0ULL;
+  unsigned long long end_file_timestamp = 0ULL;
+  int file_count = 0;
 
   bool done = false;
   while (! done)
     {
-      /* deal with multiple files and repeating */
-      filename = argv[start_index + offset];
-      if (! repeat && offset == (num_files - 1))
+      struct batch *b = batch_next (&rd);
+      unsigned long long now = now_ns ();
+
+      if (b->end)
         {
-          done = true; /* last file and we are not repeating,
-                          so done after it's processed */
+          batch_release (&rd);
+          break;
         }
-      offset = (offset + 1) % num_files; /* skip to next file if available */
-
-      file = gzopen (filename, "rb");
-      struct timeval start_emit_time;
-      micro_now (&start_emit_time);
-      struct timeval current_emit_time = { 0, 0 };
-      struct timeval previous_emit_time = { 0, 0 };
-      unsigned long long time_between_emit_events = 0ULL;
-      unsigned long long start_file_timestamp = 0ULL;
-      unsigned long long end_file_timestamp = 0ULL;
-      int file_count = 0;
-      unsigned long long time_to_sleep = 0ULL;
 
-      /* read a header from the file */
-      while (gzread (file, header, 22) == 22)
+      if (b->first)
         {
-          unsigned short size = header_payload_length (header);
-          unsigned long long cur_file_timestamp =
-            (unsigned long long)(header_receipt_time (header));
-          if (start_file_timestamp == 0ULL)
-            {
-              start_file_timestamp = cur_file_timestamp;
-            }
-          end_file_timestamp = cur_file_timestamp;
+          file_start_ns = now;
+          start_file_timestamp = b->n > 0 ? b->ts[0] : 0ULL;
+          end_file_timestamp = start_file_timestamp;
+          file_count = 0;
+        }
 
-          /* read an event from the file */
-          if (gzread (file, buf, size) != size)
+      for (i = 0; i < b->n && ! done; i++)
+        {
+          const unsigned char *payload = b->data + b->off[i];
+          unsigned long long due = 0ULL;
+          int d;
+
+          /* if we are using timings the event is due at the same offset
+           * from the start of the file as it was originally received */
+          if (use_timings && b->ts[i] > start_file_timestamp)
             {
-              fprintf (stderr, "ERROR: failure reading journal\n");
-              done = true;
-              ret=1;
-              break;
+              due = file_start_ns
+                + (unsigned long long)((b->ts[i] - start_file_timestamp)
+                                       * 1e6 / speed);
             }
 
-          /* keep track of the current emit time */
-          micro_now (&current_emit_time);
-
-          /* if we are using timings determine how long to sleep before
-           * emitting the next event */
-          if (use_timings)
+          /* if we are trying to meet a rate, event k of the run is due
+           * k/rate seconds after the first one */
+          if (rate > 0)
             {
-              unsigned long long time_between_file_events = 0ULL;
-
-              time_between_file_events =
-                (cur_file_timestamp - start_file_timestamp) * 1000ULL;
-              time_between_emit_events =
-                micro_timediff (&start_emit_time, &current_emit_time);
-
-              time_to_sleep =
-                time_between_file_events > time_between_emit_events
-                ? time_between_file_events - time_between_emit_events
-                : 0ULL;
-
-              /* sleep some number of microseconds */
-              if (time_to_sleep > 0)
+              unsigned long long rdue;
+              if (rate_start_ns == 0ULL)
                 {
-                  usleep (time_to_sleep);
+                  rate_start_ns = now;
                 }
+              rdue = rate_start_ns
+                + (unsigned long long)total_count * NS_PER_SEC / rate;
+              due = rdue > due ? rdue : due;
             }
 
-          /* if we are trying to meet a rate, determine how long to sleep
-           * before next call
-           */
-          if (rate > 0)
+          if (due > now)
             {
-              if (previous_emit_time.tv_sec != 0)
-                {
-                  /* the difference in micros alway includes the time slept,
-                   * so to figure out how much time we should sleep we subtract
-                   * the previous slept time from how much time it's actually
-                   * been since the last emit.  In other words sleep time plus
-                   * processing time should equal delay_ms
-                   */
-
-                  unsigned long long diff =
-                    micro_timediff (&previous_emit_time, &current_emit_time)
-                    - time_to_sleep;
-                  time_to_sleep =
-                    delay_micros > diff
-                    ? delay_micros - diff
-                    : 0ULL;
-                  if (time_to_sleep > 0)
-                    {
-                      usleep (time_to_sleep);
-                    }
-                }
+              now = wait_until (due);
             }
 
-          /* then emit the event */
-          if (lwes_emitter_emit_bytes (emitter, buf, size) != size)
+          switch (shard)
             {
-              fprintf (stderr, "ERROR: failure emitting\n");
-              done = true;
-              ret=1;
-              break;
+              case SHARD_ALL:
+                for (d = 0; d < ndests; d++)
+                  {
+                    dest_queue (&dests[d], payload, b->size[i], due, ndests == 1);
+                  }
+                break;
+              case SHARD_HASH:
+                d = event_name_hash (payload, b->size[i]) % ndests;
+                dest_queue (&dests[d], payload, b->size[i], due, ndests == 1);
+                break;
+              case SHARD_RR:
+                d = rr_next++ % ndests;
+                dest_queue (&dests[d], payload, b->size[i], due, ndests == 1);
+                break;
             }
 
           /* keep track of some counts */
+          end_file_timestamp = b->ts[i];
           file_count++;
           total_count++;
-          this_second_count++;
-          previous_emit_time = current_emit_time;
 
           /* if we are emitting a limited number we will be done if we hit
            * that number
@@ -404,23 +1070,60 @@ int main(int argc, char **argv)
             {
               done = true;
               ret=2;
-              break;
             }
           if (gbl_sig)
             {
               done = true;
               ret=3;
-              break;
             }
         }
-      gzclose (file);
-      fprintf (stderr,
-               "emitted %d events from %s representing %lld file time "
-               "in %llu milliseconds\n",
-               file_count, filename,
-               (end_file_timestamp - start_file_timestamp),
-               micro_timediff (&start_emit_time, &current_emit_time) / 1000ULL);
+
+      for (i = 0; i < ndests; i++)
+        {
+          if (dests[i].failed)
+            {
+              done = true;
+              ret = 1;
+            }
+        }
+
+      if (b->error)
+        {
+          done = true;
+          ret = 1;
+        }
+
+      if (b->last || done)
+        {
+          fprintf (stderr,
+                   "emitted %d events from %s representing %lld file time "
+                   "in %llu milliseconds\n",
+                   file_count, b->filename,
+                   (end_file_timestamp - start_file_timestamp),
+                   (now_ns () - file_start_ns) / 1000000ULL);
+        }
+      batch_release (&rd);
+
+      if (progress_ns > 0)
+        {
+          now = now_ns ();
+          if (now - interval_start_ns >= progress_ns)
+            {
+              report_dests ("progress", dests, ndests, 1,
+                            now - interval_start_ns, &rd);
+              interval_start_ns = now;
+            }
+        }
+    }
+
+  /* let the senders drain what was queued */
+  for (i = 0; i < nstarted; i++)
+    {
+      dest_stop (&dests[i]);
+      pthread_join (dests[i].tid, NULL);
     }
+  nstarted = 0;
+
   /* if we hit the count limit (2) it is not an error */
   if (ret == 2)
     {
@@ -429,10 +1132,25 @@ int main(int argc, char **argv)
   stop = currentTimeMillisLongLong ();
   fprintf (stderr, "emitted %d events in %ld milliseconds\n",
            total_count, (stop - start));
+  report_dests ("total", dests, ndests, 0, now_ns () - run_start_ns, &rd);
 cleanup:
-  if (emitter != NULL)
+  for (i = 0; i < nstarted; i++)
+    {
+      dest_stop (&dests[i]);
+      pthread_join (dests[i].tid, NULL);
+    }
+  if (reader_started)
+    {
+      reader_stop (&rd);
+      pthread_join (reader_tid, NULL);
+    }
+  for (i = 0; i < NBATCHES; i++)
+    {
+      free (rd.ring[i].data);
+    }
+  for (i = 0; i < ndests; i++)
     {
-      lwes_emitter_destroy (emitter);
+      dest_dtor (&dests[i]);
     }
   exit (ret);
 }
@@ -0,0 +1,616 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <lwes.h>
+
+#include "header.h"
+#include "journal_reader.h"
+#include "time_utils.h"
+#include "uthash.h"
+
+#define MAX_INPUTS      1024
+
+/* Each input is decompressed by its own thread into NBATCHES batches
+ * of up to BATCH_BYTES, which bounds the read-ahead to 8MB per input.
+ */
+#define NBATCHES        8
+#define BATCH_BYTES     (1024*1024)
+#define BATCH_EVENTS    (BATCH_BYTES/HEADER_LENGTH)
+#define GZ_BUFFER       (256*1024)
+
+/* Merged events are handed to the writer thread in OUT_BYTES chunks. */
+#define NOUT            4
+#define OUT_BYTES       (1024*1024)
+
+static const char help[] =
+  "lwes-journal-merge [options] -o <journal> <journal(s)>"             "\n"
+  ""                                                                   "\n"
+  "  where options are:"                                               "\n"
+  ""                                                                   "\n"
+  "    -o [one argument]"                                              "\n"
+  "       The merged journal to write."                                "\n"
+  ""                                                                   "\n"
+  "    -w [one argument]"                                              "\n"
+  "       Drop events whose payload is identical to one already"       "\n"
+  "       written less than this many milliseconds earlier, as seen"   "\n"
+  "       when redundant journallers receive the same event.  0, the"  "\n"
+  "       default, keeps everything."                                  "\n"
+  ""                                                                   "\n"
+  "    -z [one argument]"                                              "\n"
+  "       gzip compression level (1-9) of the output."                 "\n"
+  ""                                                                   "\n"
+  "    -h"                                                             "\n"
+  "       show this message"                                           "\n"
+  ""                                                                   "\n"
+  "  Events are merged by receipt time, each input is expected to be"  "\n"
+  "  in receipt time order as written by the journaller."              "\n"
+  ""                                                                   "\n"
+  "  arguments are specified as -option <value> or -option<value>"     "\n"
+  ""                                                                   "\n";
+
+/* Whole events (header and payload) back to back, plus where each
+ * one starts. */
+struct batch {
+  size_t len;
+  int n;
+  unsigned int off[BATCH_EVENTS];
+  unsigned char data[BATCH_BYTES];
+};
+
+struct input {
+  const char *filename;
+  pthread_t tid;
+  struct batch *ring;
+  unsigned long head;          /* next batch for the merge */
+  unsigned long tail;          /* next batch for the reader */
+  bool eof;                    /* no more batches after tail */
+  bool error;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  /* merge side */
+  struct batch *cur;
+  int idx;
+  unsigned long long ts;       /* receipt time of the current event */
+  unsigned long long events;
+};
+
+struct output {
+  gzFile file;
+  const char *filename;
+  pthread_t tid;
+  unsigned char *bufs[NOUT];
+  size_t lens[NOUT];
+  unsigned long head;
+  unsigned long tail;
+  bool done;
+  bool error;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+/* A payload written within the last window milliseconds, from input.
+ * It is keyed by its own bytes, so uthash compares them in full and a
+ * hash collision is never taken for a duplicate.  uthash keeps the
+ * entries in insertion order, which is time order, so expiring is just
+ * deleting from the front. */
+struct seen {
+  unsigned long long ts;
+  int input;
+  unsigned short size;
+  UT_hash_handle hh;
+  unsigned char payload[1];
+};
+
+static void *reader_main (void *arg)
+{
+  struct input *in = (struct input *)arg;
+  struct journal_reader *file = journal_reader_open (in->filename, GZ_BUFFER);
+  struct batch *b = NULL;
+  unsigned char header[HEADER_LENGTH];
+  bool error = false;
+
+  if (file == NULL)
+    {
+      fprintf (stderr, "ERROR: unable to open %s\n", in->filename);
+      error = true;
+      goto done;
+    }
+
+  while (journal_reader_read (file, header, HEADER_LENGTH) == HEADER_LENGTH)
+    {
+      unsigned short size = header_payload_length ((const char *)header);
+
+      if (b != NULL && (b->n == BATCH_EVENTS
+                        || b->len + HEADER_LENGTH + size > BATCH_BYTES))
+        {
+          pthread_mutex_lock (&in->lock);
+          in->tail++;
+          pthread_cond_signal (&in->not_empty);
+          pthread_mutex_unlock (&in->lock);
+          b = NULL;
+        }
+      if (b == NULL)
+        {
+          pthread_mutex_lock (&in->lock);
+          while (in->tail - in->head >= NBATCHES)
+            {
+              pthread_cond_wait (&in->not_full, &in->lock);
+            }
+          b = &in->ring[in->tail % NBATCHES];
+          pthread_mutex_unlock (&in->lock);
+          b->len = 0;
+          b->n = 0;
+        }
+
+      memcpy (b->data + b->len, header, HEADER_LENGTH);
+      if (journal_reader_read (file, b->data + b->len + HEADER_LENGTH, size)
+          != size)
+        {
+          fprintf (stderr, "ERROR: failure reading journal %s\n",
+                   in->filename);
+          error = true;
+          break;
+        }
+      b->off[b->n++] = b->len;
+      b->len += HEADER_LENGTH + size;
+    }
+  journal_reader_close (file);
+
+done:
+  pthread_mutex_lock (&in->lock);
+  if (b != NULL && b->n > 0)
+    {
+      in->tail++;
+    }
+  in->eof = true;
+  in->error = error;
+  pthread_cond_signal (&in->not_empty);
+  pthread_mutex_unlock (&in->lock);
+  return NULL;
+}
+
+/* Move in to its next event, returns false when it has none left. */
+static bool input_advance (struct input *in)
+{
+  if (in->cur != NULL && ++in->idx < in->cur->n)
+    {
+      in->ts = header_receipt_time
+        ((const char *)(in->cur->data + in->cur->off[in->idx]));
+      return true;
+    }
+
+  pthread_mutex_lock (&in->lock);
+  if (in->cur != NULL)
+    {
+      in->head++;
+      pthread_cond_signal (&in->not_full);
+      in->cur = NULL;
+    }
+  while (in->head == in->tail && ! in->eof)
+    {
+      pthread_cond_wait (&in->not_empty, &in->lock);
+    }
+  if (in->head != in->tail)
+    {
+      in->cur = &in->ring[in->head % NBATCHES];
+    }
+  pthread_mutex_unlock (&in->lock);
+
+  if (in->cur == NULL)
+    {
+      return false;
+    }
+  in->idx = 0;
+  in->ts = header_receipt_time ((const char *)(in->cur->data
+                                               + in->cur->off[0]));
+  return true;
+}
+
+/* Binary min-heap of inputs on (ts, input order), so events with the
+ * same receipt time keep the order of the inputs on the command line. */
+static bool input_less (const struct input *a, const struct input *b)
+{
+  return a->ts < b->ts || (a->ts == b->ts && a < b);
+}
+
+static void heap_down (struct input **heap, int n, int i)
+{
+  while (1)
+    {
+      int l = 2*i + 1, r = l + 1, m = i;
+      struct input *t;
+      if (l < n && input_less (heap[l], heap[m]))
+        {
+          m = l;
+        }
+      if (r < n && input_less (heap[r], heap[m]))
+        {
+          m = r;
+        }
+      if (m == i)
+        {
+          return;
+        }
+      t = heap[i];
+      heap[i] = heap[m];
+      heap[m] = t;
+      i = m;
+    }
+}
+
+static void *writer_main (void *arg)
+{
+  struct output *out = (struct output *)arg;
+  while (1)
+    {
+      unsigned char *buf;
+      size_t len;
+
+      pthread_mutex_lock (&out->lock);
+      while (out->head == out->tail && ! out->done)
+        {
+          pthread_cond_wait (&out->not_empty, &out->lock);
+        }
+      if (out->head == out->tail)
+        {
+          pthread_mutex_unlock (&out->lock);
+          break;
+        }
+      buf = out->bufs[out->head % NOUT];
+      len = out->lens[out->head % NOUT];
+      pthread_mutex_unlock (&out->lock);
+
+      if (! out->error && gzwrite (out->file, buf, len) != (int)len)
+        {
+          fprintf (stderr, "ERROR: failure writing journal %s\n",
+                   out->filename);
+          out->error = true;
+        }
+
+      pthread_mutex_lock (&out->lock);
+      out->head++;
+      pthread_cond_signal (&out->not_full);
+      pthread_mutex_unlock (&out->lock);
+    }
+  return NULL;
+}
+
+/* The buffer the merge should append to, after handing the current one
+ * to the writer if it cannot take need more bytes. */
+static unsigned char *output_reserve (struct output *out, size_t need)
+{
+  /* only the merge moves tail, so it can be read without the lock */
+  if (out->lens[out->tail % NOUT] + need > OUT_BYTES)
+    {
+      pthread_mutex_lock (&out->lock);
+      out->tail++;
+      pthread_cond_signal (&out->not_empty);
+      while (out->tail - out->head >= NOUT)
+        {
+          pthread_cond_wait (&out->not_full, &out->lock);
+        }
+      pthread_mutex_unlock (&out->lock);
+      out->lens[out->tail % NOUT] = 0;
+    }
+  return out->bufs[out->tail % NOUT] + out->lens[out->tail % NOUT];
+}
+
+static void output_finish (struct output *out)
+{
+  pthread_mutex_lock (&out->lock);
+  if (out->lens[out->tail % NOUT] > 0)
+    {
+      out->tail++;
+    }
+  out->done = true;
+  pthread_cond_signal (&out->not_empty);
+  pthread_mutex_unlock (&out->lock);
+}
+
+int main(int argc, char **argv)
+{
+  const char *args = "o:w:z:h";
+  const char *outname = NULL;     /* (o) merged journal */
+  unsigned long long window = 0;  /* (w) dedup window in ms */
+  int level = Z_DEFAULT_COMPRESSION; /* (z) output compression */
+
+  struct input *inputs = NULL;
+  struct input *heap[MAX_INPUTS];
+  struct output out;
+  struct seen *seen = NULL, *s, *tmp;
+  int ninputs = 0, nstarted = 0, nheap = 0;
+  bool writer_started = false;
+  unsigned long long merged = 0, duplicates = 0;
+  unsigned long long start = millis_now ();
+  int ret = 0;
+  int i;
+
+  memset (&out, 0, sizeof (out));
+
+  /* turn off error messages, I'll handle them */
+  opterr = 0;
+  while (1)
+    {
+      char c = getopt (argc, argv, args);
+
+      if (c == -1)
+        {
+          break;
+        }
+      switch (c)
+        {
+          case 'o':
+            outname = optarg;
+            break;
+
+          case 'w':
+            window = strtoull (optarg, NULL, 10);
+            break;
+
+          case 'z':
+            level = atoi (optarg);
+            if (level < 1 || level > 9)
+              {
+                fprintf (stderr, "ERROR: level must be between 1 and 9\n");
+                ret = 1;
+                goto cleanup;
+              }
+            break;
+
+          case 'h':
+            fprintf (stderr, "%s", help);
+            ret = 1;
+            goto cleanup;
+
+          default:
+            fprintf (stderr,
+                     "WARNING: unrecognized command line option -%c\n",
+                     optopt);
+        }
+    }
+
+  ninputs = argc - optind;
+  if (outname == NULL || ninputs < 1)
+    {
+      fprintf (stderr, "ERROR: an output and at least one journal "
+                       "are required\n%s", help);
+      ret = 1;
+      goto cleanup;
+    }
+  if (ninputs > MAX_INPUTS)
+    {
+      fprintf (stderr, "ERROR: at most %d journals can be merged\n",
+               MAX_INPUTS);
+      ret = 1;
+      goto cleanup;
+    }
+
+  inputs = (struct input *) calloc (ninputs, sizeof (struct input));
+  if (inputs == NULL)
+    {
+      fprintf (stderr, "ERROR: out of memory\n");
+      ret = 1;
+      goto cleanup;
+    }
+
+  {
+    char mode[16];
+    snprintf (mode, sizeof (mode), "wb%d", level < 0 ? 6 : level);
+    out.file = gzopen (outname, mode);
+  }
+  if (out.file == NULL)
+    {
+      fprintf (stderr, "ERROR: unable to open %s\n", outname);
+      ret = 1;
+      goto cleanup;
+    }
+  gzbuffer (out.file, GZ_BUFFER);
+  out.filename = outname;
+  pthread_mutex_init (&out.lock, NULL);
+  pthread_cond_init (&out.not_empty, NULL);
+  pthread_cond_init (&out.not_full, NULL);
+  for (i = 0; i < NOUT; i++)
+    {
+      out.bufs[i] = (unsigned char *) malloc (OUT_BYTES);
+      if (out.bufs[i] == NULL)
+        {
+          fprintf (stderr, "ERROR: out of memory\n");
+          ret = 1;
+          goto cleanup;
+        }
+    }
+  if (pthread_create (&out.tid, NULL, writer_main, &out))
+    {
+      fprintf (stderr, "ERROR: unable to start writer thread\n");
+      ret = 1;
+      goto cleanup;
+    }
+  writer_started = true;
+
+  for (nstarted = 0; nstarted < ninputs; nstarted++)
+    {
+      struct input *in = &inputs[nstarted];
+      in->filename = argv[optind + nstarted];
+      in->ring = (struct batch *) malloc (NBATCHES * sizeof (struct batch));
+      pthread_mutex_init (&in->lock, NULL);
+      pthread_cond_init (&in->not_empty, NULL);
+      pthread_cond_init (&in->not_full, NULL);
+      if (in->ring == NULL
+          || pthread_create (&in->tid, NULL, reader_main, in))
+        {
+          fprintf (stderr, "ERROR: unable to start reader for %s\n",
+                   in->filename);
+          ret = 1;
+          goto cleanup;
+        }
+    }
+
+  for (i = 0; i < ninputs; i++)
+    {
+      if (input_advance (&inputs[i]))
+        {
+          heap[nheap++] = &inputs[i];
+        }
+    }
+  for (i = nheap / 2 - 1; i >= 0; i--)
+    {
+      heap_down (heap, nheap, i);
+    }
+
+  while (nheap > 0 && ! out.error)
+    {
+      struct input *in = heap[0];
+      const unsigned char *event = in->cur->data + in->cur->off[in->idx];
+      unsigned short size = header_payload_length ((const char *)event);
+      bool keep = true;
+
+      if (window > 0)
+        {
+          const unsigned char *payload = event + HEADER_LENGTH;
+          int input = (int)(in - inputs);
+
+          /* forget what is now outside the window */
+          HASH_ITER (hh, seen, s, tmp)
+            {
+              if (s->ts + window > in->ts)
+                {
+                  break;
+                }
+              HASH_DEL (seen, s);
+              free (s);
+            }
+
+          /* only another receiver's copy is a duplicate, the same
+           * payload again in one journal is a new event (a heartbeat,
+           * say), which then stands for the payload from here on */
+          HASH_FIND (hh, seen, payload, size, s);
+          if (s != NULL && s->input != input)
+            {
+              keep = false;
+              duplicates++;
+            }
+          else
+            {
+              if (s != NULL)
+                {
+                  HASH_DEL (seen, s);
+                }
+              else if ((s = (struct seen *)
+                              malloc (sizeof (*s) + size)) == NULL)
+                {
+                  fprintf (stderr, "ERROR: out of memory\n");
+                  ret = 1;
+                  break;
+                }
+              else
+                {
+                  memcpy (s->payload, payload, size);
+                  s->size = size;
+                }
+              s->ts = in->ts;
+              s->input = input;
+              HASH_ADD_KEYPTR (hh, seen, s->payload, s->size, s);
+            }
+        }
+
+      if (keep)
+        {
+          size_t len = HEADER_LENGTH + size;
+          memcpy (output_reserve (&out, len), event, len);
+          out.lens[out.tail % NOUT] += len;
+          merged++;
+        }
+      in->events++;
+
+      if (! input_advance (in))
+        {
+          heap[0] = heap[--nheap];
+        }
+      heap_down (heap, nheap, 0);
+    }
+
+  for (i = 0; i < ninputs; i++)
+    {
+      if (inputs[i].error)
+        {
+          ret = 1;
+        }
+      fprintf (stderr, "%s has %llu events\n",
+               inputs[i].filename, inputs[i].events);
+    }
+
+cleanup:
+  /* readers may still be waiting for room if we stopped early */
+  for (i = 0; i < nstarted; i++)
+    {
+      struct input *in = &inputs[i];
+      pthread_mutex_lock (&in->lock);
+      while (! in->eof)
+        {
+          in->head = in->tail;
+          pthread_cond_signal (&in->not_full);
+          pthread_cond_wait (&in->not_empty, &in->lock);
+        }
+      pthread_mutex_unlock (&in->lock);
+      pthread_join (in->tid, NULL);
+    }
+  if (writer_started)
+    {
+      output_finish (&out);
+      pthread_join (out.tid, NULL);
+      if (out.error)
+        {
+          ret = 1;
+        }
+    }
+  if (out.file != NULL && gzclose (out.file) != Z_OK)
+    {
+      fprintf (stderr, "ERROR: failure closing journal %s\n", outname);
+      ret = 1;
+    }
+  if (outname != NULL && ret == 0)
+    {
+      fprintf (stderr, "merged %llu events from %d journals into %s "
+               "(%llu duplicates dropped) in %llu milliseconds\n",
+               merged, ninputs, outname, duplicates, millis_now () - start);
+    }
+
+  HASH_ITER (hh, seen, s, tmp)
+    {
+      HASH_DEL (seen, s);
+      free (s);
+    }
+  if (inputs != NULL)
+    {
+      for (i = 0; i < ninputs; i++)
+        {
+          free (inputs[i].ring);
+        }
+      free (inputs);
+    }
+  for (i = 0; i < NOUT; i++)
+    {
+      free (out.bufs[i]);
+    }
+  exit (ret);
+}
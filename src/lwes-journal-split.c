@@ -10,35 +10,171 @@
  * limitations under the License. See accompanying LICENSE file.        *
  *======================================================================*/
 #define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <unistd.h>
 #include <zlib.h>
 #include <lwes.h>
 
 #include "header.h"
+#include "journal_reader.h"
 #include "time_utils.h"
 
-#define MAX_FILE_PARTS 25
+#define MAX_FILE_PARTS  25
+#define MAX_WORKERS     256
+
+/* Output parts are cut into CHUNK_SIZE pieces of uncompressed events,
+ * each compressed on its own by a worker as an independent gzip member.
+ * Concatenated members are a valid gzip file, so the parts are readable
+ * by gzread/zcat exactly as before.
+ */
+#define CHUNK_SIZE      (4*1024*1024)
+#define MAX_INFLIGHT    64
+#define IN_CHUNK        (256*1024)
+#define OUT_CHUNK       (256*1024)
+
+/* Time windows which are still accepting (late) events. */
+#define MAX_OPEN_PARTS  8
+
+/* Input members larger than this (decompressed) are never copied, they
+ * are streamed through the normal path instead of being buffered whole.
+ */
+#define MEMBER_LIMIT    (64*1024*1024)
 
 static const char help[] =
   "lwes-journal-split [options] <journal>"                             "\n"
   ""                                                                   "\n"
   "  where options are:"                                               "\n"
   ""                                                                   "\n"
-  "    -n [one argument]"                                              "\n"
-  "       The number of events per split file."                        "\n"
+  "    -n, --events [one argument]"                                    "\n"
+  "       The number of events per split file.  Defaults to 10000"     "\n"
+  "       when neither -m nor -b is given."                            "\n"
+  ""                                                                   "\n"
+  "    -m, --by-minutes [one argument]"                                "\n"
+  "       Split on receipt time into windows of this many minutes,"    "\n"
+  "       aligned to the epoch (so 5 gives :00, :05, :10, ...)."       "\n"
+  ""                                                                   "\n"
+  "    -b, --bytes [one argument]"                                     "\n"
+  "       Start a new file once this many uncompressed bytes have"     "\n"
+  "       been written to the current one.  Accepts k, m and g"        "\n"
+  "       suffixes."                                                   "\n"
+  ""                                                                   "\n"
+  "    -o, --output-dir [one argument]"                                "\n"
+  "       Directory for the split files (created if missing)."        "\n"
+  "       Defaults to the directory of the journal."                   "\n"
   ""                                                                   "\n"
-  "    -h"                                                             "\n"
+  "    -j, --jobs [one argument]"                                      "\n"
+  "       The number of compression threads.  Defaults to the number"  "\n"
+  "       of online processors."                                       "\n"
+  ""                                                                   "\n"
+  "    -z, --level [one argument]"                                     "\n"
+  "       gzip compression level (1-9), defaults to 6."                "\n"
+  ""                                                                   "\n"
+  "    -c, --copy-members"                                             "\n"
+  "       Copy compressed members of the input straight to the"        "\n"
+  "       output when all of their events belong to the same split"    "\n"
+  "       file, instead of recompressing them.  Not for delta"         "\n"
+  "       encoded journals, which are decoded and recompressed."      "\n"
+  ""                                                                   "\n"
+  "    -h, --help"                                                     "\n"
   "       show this message"                                           "\n"
   ""                                                                   "\n"
+  "  -n, -m and -b may be combined, a new file is started when any"    "\n"
+  "  of the limits is reached."                                        "\n"
+  ""                                                                   "\n"
   "  arguments are specified as -option <value> or -option<value>"     "\n"
   ""                                                                   "\n";
 
+static const struct option long_options[] = {
+  { "events",       required_argument, NULL, 'n' },
+  { "by-minutes",   required_argument, NULL, 'm' },
+  { "bytes",        required_argument, NULL, 'b' },
+  { "output-dir",   required_argument, NULL, 'o' },
+  { "jobs",         required_argument, NULL, 'j' },
+  { "level",        required_argument, NULL, 'z' },
+  { "copy-members", no_argument,       NULL, 'c' },
+  { "help",         no_argument,       NULL, 'h' },
+  { NULL,           0,                 NULL, 0   }
+};
+
+/* An output file.  It is written to a temporary name in the output
+ * directory and linked to <prefix><first>.<last>.gz once its close has
+ * been retired, so a partial part is never visible under a final name.
+ * Parts may share a range (a late event reopening a closed window, or
+ * -b cutting within a millisecond), so one is never replaced: a taken
+ * name gets <prefix><first>.<last>.<n>.gz instead.
+ */
+struct part {
+  char tmpname[PATH_MAX];
+  char name[PATH_MAX];
+  int fd;
+  long long window;
+  unsigned long long start_ts;
+  unsigned long long end_ts;
+  unsigned long long events;
+  unsigned long long bytes;
+  unsigned char *chunk;
+  size_t chunk_len;
+  struct part *next;
+};
+
+typedef enum {
+  JOB_COMPRESS, JOB_RAW, JOB_CLOSE
+} job_kind_t;
+
+typedef enum {
+  JOB_FREE, JOB_PENDING, JOB_DONE
+} job_state_t;
+
+struct job {
+  job_kind_t kind;
+  job_state_t state;
+  struct part *part;
+  unsigned char *in;
+  size_t in_len;
+  unsigned char *out;
+  size_t out_len;
+  int error;
+};
+
+/* Jobs are numbered in submission order, workers take them in that
+ * order and the main thread retires (writes) them in that order, so
+ * events keep their order within every part no matter which worker
+ * finishes first.
+ */
+static struct job jobs[MAX_INFLIGHT];
+static unsigned long job_head = 0;   /* oldest job not yet retired */
+static unsigned long job_tail = 0;   /* next job to submit */
+static unsigned long job_next = 0;   /* next job for a worker */
+static bool workers_done = false;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_finished = PTHREAD_COND_INITIALIZER;
+
+static int level = Z_DEFAULT_COMPRESSION;
+static unsigned long long number = 0;
+static unsigned long long max_bytes = 0;
+static unsigned long long window_ms = 0;
+static char prefix[PATH_MAX];
+static int part_seq = 0;
+static struct part *open_parts = NULL;
+static int nopen = 0;
+static long long max_window = -1;
+static int ret = 0;
+static unsigned long long total_count = 0;
+static unsigned long long members_copied = 0;
+static unsigned long long members_total = 0;
+
 static bool check_num_and_length (const char *word, const size_t len)
 {
   if (strlen (word) != len)
@@ -59,20 +195,691 @@ static bool check_num_and_length (const char *word, const size_t len)
   return true;
 }
 
+static unsigned long long parse_size (const char *arg)
+{
+  char *end;
+  unsigned long long v = strtoull (arg, &end, 10);
+  switch (*end)
+    {
+      case 'k': case 'K': v <<= 10; break;
+      case 'm': case 'M': v <<= 20; break;
+      case 'g': case 'G': v <<= 30; break;
+      default: break;
+    }
+  return v;
+}
+
+static int compress_member (struct job *job)
+{
+  z_stream zs;
+  memset (&zs, 0, sizeof (zs));
+  /* windowBits 15+16 gives a complete gzip member with its own trailer */
+  if (deflateInit2 (&zs, level, Z_DEFLATED, 15+16, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      return -1;
+    }
+  job->out_len = deflateBound (&zs, job->in_len);
+  job->out = (unsigned char *) malloc (job->out_len);
+  if (job->out == NULL)
+    {
+      deflateEnd (&zs);
+      return -1;
+    }
+  zs.next_in = job->in;
+  zs.avail_in = job->in_len;
+  zs.next_out = job->out;
+  zs.avail_out = job->out_len;
+  if (deflate (&zs, Z_FINISH) != Z_STREAM_END)
+    {
+      deflateEnd (&zs);
+      return -1;
+    }
+  job->out_len = zs.total_out;
+  deflateEnd (&zs);
+  return 0;
+}
+
+static void *worker_main (void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock (&job_lock);
+  while (1)
+    {
+      if (job_next < job_tail)
+        {
+          struct job *job = &jobs[job_next % MAX_INFLIGHT];
+          job_next++;
+          pthread_mutex_unlock (&job_lock);
+
+          if (job->kind == JOB_COMPRESS)
+            {
+              job->error = compress_member (job);
+            }
+
+          pthread_mutex_lock (&job_lock);
+          job->state = JOB_DONE;
+          pthread_cond_broadcast (&job_finished);
+        }
+      else if (workers_done)
+        {
+          break;
+        }
+      else
+        {
+          pthread_cond_wait (&job_work, &job_lock);
+        }
+    }
+  pthread_mutex_unlock (&job_lock);
+  return NULL;
+}
+
+static int write_all (int fd, const unsigned char *p, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write (fd, p, len);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+          return -1;
+        }
+      p += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* Links the closed part to the first free name for its range. */
+static void publish_part (struct part *p)
+{
+  int seq;
+
+  for (seq = 0; ; seq++)
+    {
+      int n = seq == 0
+            ? snprintf (p->name, sizeof (p->name), "%s%llu.%llu.gz",
+                        prefix, p->start_ts, p->end_ts)
+            : snprintf (p->name, sizeof (p->name), "%s%llu.%llu.%d.gz",
+                        prefix, p->start_ts, p->end_ts, seq);
+
+      if (n >= (int)sizeof (p->name))
+        {
+          fprintf (stderr, "ERROR: output path %s is too long\n", prefix);
+          ret = 1;
+          return;
+        }
+      if (link (p->tmpname, p->name) == 0)
+        {
+          break;
+        }
+      if (errno != EEXIST)
+        {
+          fprintf (stderr, "ERROR : failed to link %s to %s : %s\n",
+                   p->tmpname, p->name, strerror (errno));
+          ret = 1;
+          return;
+        }
+    }
+  if (unlink (p->tmpname) < 0)
+    {
+      fprintf (stderr, "ERROR : failed to remove %s : %s\n",
+               p->tmpname, strerror (errno));
+      ret = 1;
+    }
+}
+
+/* Wait for the oldest job and do its I/O, only the main thread does
+ * this so the part files need no locking. */
+static void retire_oldest (void)
+{
+  struct job *job = &jobs[job_head % MAX_INFLIGHT];
+  struct part *p;
+
+  pthread_mutex_lock (&job_lock);
+  while (job->state != JOB_DONE)
+    {
+      pthread_cond_wait (&job_finished, &job_lock);
+    }
+  pthread_mutex_unlock (&job_lock);
+
+  p = job->part;
+  switch (job->kind)
+    {
+      case JOB_COMPRESS:
+        if (job->error)
+          {
+            fprintf (stderr, "ERROR: failure compressing %s\n", p->tmpname);
+            ret = 1;
+          }
+        else if (write_all (p->fd, job->out, job->out_len) < 0)
+          {
+            fprintf (stderr, "ERROR: failure writing %s : %s\n",
+                     p->tmpname, strerror (errno));
+            ret = 1;
+          }
+        break;
+
+      case JOB_RAW:
+        if (write_all (p->fd, job->in, job->in_len) < 0)
+          {
+            fprintf (stderr, "ERROR: failure writing %s : %s\n",
+                     p->tmpname, strerror (errno));
+            ret = 1;
+          }
+        break;
+
+      case JOB_CLOSE:
+        if (close (p->fd) < 0)
+          {
+            fprintf (stderr, "ERROR: failure closing %s : %s\n",
+                     p->tmpname, strerror (errno));
+            ret = 1;
+          }
+        fprintf (stderr, "split from %llu to %llu %llu\n",
+                 p->start_ts, p->end_ts, p->events);
+        publish_part (p);
+        free (p);
+        break;
+    }
+
+  free (job->in);
+  free (job->out);
+  job->in = job->out = NULL;
+  job->state = JOB_FREE;
+  job_head++;
+}
+
+/* Takes ownership of in. */
+static void submit (job_kind_t kind, struct part *p,
+                    unsigned char *in, size_t in_len)
+{
+  struct job *job;
+
+  while (job_tail - job_head >= MAX_INFLIGHT)
+    {
+      retire_oldest ();
+    }
+
+  job = &jobs[job_tail % MAX_INFLIGHT];
+  job->kind = kind;
+  job->part = p;
+  job->in = in;
+  job->in_len = in_len;
+  job->out = NULL;
+  job->out_len = 0;
+  job->error = 0;
+
+  pthread_mutex_lock (&job_lock);
+  job->state = JOB_PENDING;
+  job_tail++;
+  pthread_cond_signal (&job_work);
+  pthread_mutex_unlock (&job_lock);
+}
+
+static void flush_chunk (struct part *p)
+{
+  if (p->chunk_len > 0)
+    {
+      submit (JOB_COMPRESS, p, p->chunk, p->chunk_len);
+      p->chunk = NULL;
+      p->chunk_len = 0;
+    }
+}
+
+static struct part *new_part (long long window)
+{
+  struct part *p = (struct part *) calloc (1, sizeof (struct part));
+  if (p == NULL)
+    {
+      fprintf (stderr, "ERROR: out of memory\n");
+      exit (1);
+    }
+  if (snprintf (p->tmpname, sizeof (p->tmpname), "%ssplit-%d-%d.tmp",
+                prefix, (int)getpid (), part_seq++)
+        >= (int)sizeof (p->tmpname))
+    {
+      fprintf (stderr, "ERROR: output path %s is too long\n", prefix);
+      exit (1);
+    }
+  p->fd = open (p->tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (p->fd < 0)
+    {
+      fprintf (stderr, "ERROR: unable to create %s : %s\n",
+               p->tmpname, strerror (errno));
+      exit (1);
+    }
+  p->window = window;
+  p->next = open_parts;
+  open_parts = p;
+  nopen++;
+  return p;
+}
+
+static void close_part (struct part *p)
+{
+  struct part **pp;
+  for (pp = &open_parts; *pp != NULL; pp = &(*pp)->next)
+    {
+      if (*pp == p)
+        {
+          *pp = p->next;
+          nopen--;
+          break;
+        }
+    }
+
+  flush_chunk (p);
+  submit (JOB_CLOSE, p, NULL, 0);
+}
+
+/* The part an event with receipt time ts goes into, opening one if
+ * needed.  When splitting by time the current and previous windows are
+ * kept open so slightly late events still land in their own window.
+ */
+static struct part *part_for (unsigned long long ts)
+{
+  struct part *p;
+  long long window = -1;
+
+  if (window_ms == 0)
+    {
+      return open_parts != NULL ? open_parts : new_part (-1);
+    }
+
+  window = (long long)(ts / window_ms);
+  for (p = open_parts; p != NULL; p = p->next)
+    {
+      if (p->window == window)
+        {
+          return p;
+        }
+    }
+
+  if (window > max_window)
+    {
+      struct part *next;
+      max_window = window;
+      for (p = open_parts; p != NULL; p = next)
+        {
+          next = p->next;
+          if (p->window < window - 1)
+            {
+              close_part (p);
+            }
+        }
+    }
+  while (nopen >= MAX_OPEN_PARTS)
+    {
+      struct part *oldest = open_parts;
+      for (p = open_parts; p != NULL; p = p->next)
+        {
+          if (p->window < oldest->window)
+            {
+              oldest = p;
+            }
+        }
+      close_part (oldest);
+    }
+  return new_part (window);
+}
+
+static void account (struct part *p, unsigned long long ts,
+                     unsigned long long events, unsigned long long bytes,
+                     unsigned long long end_ts)
+{
+  if (p->events == 0 || ts < p->start_ts)
+    {
+      p->start_ts = ts;
+    }
+  if (p->events == 0 || end_ts > p->end_ts)
+    {
+      p->end_ts = end_ts;
+    }
+  p->events += events;
+  p->bytes += bytes;
+  total_count += events;
+}
+
+static bool part_is_full (const struct part *p)
+{
+  return (number > 0 && p->events >= number)
+      || (max_bytes > 0 && p->bytes >= max_bytes);
+}
+
+static void add_event (const unsigned char *event, size_t len)
+{
+  unsigned long long ts =
+    (unsigned long long)header_receipt_time ((const char *)event);
+  struct part *p = part_for (ts);
+
+  if (p->chunk != NULL && p->chunk_len + len > CHUNK_SIZE)
+    {
+      flush_chunk (p);
+    }
+  if (p->chunk == NULL)
+    {
+      p->chunk = (unsigned char *) malloc (CHUNK_SIZE);
+      if (p->chunk == NULL)
+        {
+          fprintf (stderr, "ERROR: out of memory\n");
+          exit (1);
+        }
+    }
+  memcpy (p->chunk + p->chunk_len, event, len);
+  p->chunk_len += len;
+  account (p, ts, 1, len, ts);
+
+  if (part_is_full (p))
+    {
+      close_part (p);
+    }
+}
+
+/* Decompressed data waiting to be split, and what we know about the
+ * compressed member it came from. */
+struct input {
+  const char *filename;
+  int fd;
+  bool copy;
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+  size_t carry;          /* bytes of a partial event at member start */
+  bool spilled;          /* part of this member already went out */
+};
+
+static void add_events (struct input *in)
+{
+  size_t off = 0;
+  while (in->len - off >= HEADER_LENGTH)
+    {
+      size_t elen = HEADER_LENGTH
+        + header_payload_length ((const char *)(in->data + off));
+      if (in->len - off < elen)
+        {
+          break;
+        }
+      add_event (in->data + off, elen);
+      off += elen;
+    }
+  memmove (in->data, in->data + off, in->len - off);
+  in->len -= off;
+}
+
+/* If every event of the member just finished belongs to one part, and
+ * that part would not be closed before the last of them, write the
+ * compressed bytes [start,end) of the input as they are. */
+static bool copy_member (struct input *in, off_t start, off_t end)
+{
+  size_t off = 0, last_len = 0;
+  unsigned long long n = 0, first_ts = 0, min_ts = 0, max_ts = 0;
+  long long window = -1;
+  struct part *p;
+  unsigned char *raw;
+
+  if (in->spilled || in->carry != 0 || in->len == 0)
+    {
+      return false;
+    }
+
+  while (off < in->len)
+    {
+      unsigned long long ts;
+      if (in->len - off < HEADER_LENGTH)
+        {
+          return false;
+        }
+      last_len = HEADER_LENGTH
+        + header_payload_length ((const char *)(in->data + off));
+      if (in->len - off < last_len)
+        {
+          return false;
+        }
+      ts = (unsigned long long)header_receipt_time ((const char *)(in->data + off));
+      if (n == 0)
+        {
+          first_ts = min_ts = max_ts = ts;
+          window = window_ms > 0 ? (long long)(ts / window_ms) : -1;
+        }
+      else if (window_ms > 0 && (long long)(ts / window_ms) != window)
+        {
+          return false;
+        }
+      min_ts = ts < min_ts ? ts : min_ts;
+      max_ts = ts > max_ts ? ts : max_ts;
+      off += last_len;
+      n++;
+    }
+
+  p = part_for (first_ts);
+  if ((number > 0 && p->events + n > number)
+      || (max_bytes > 0 && p->bytes + in->len - last_len >= max_bytes))
+    {
+      return false;
+    }
+
+  raw = (unsigned char *) malloc (end - start);
+  if (raw == NULL || pread (in->fd, raw, end - start, start) != end - start)
+    {
+      free (raw);
+      return false;
+    }
+
+  flush_chunk (p);
+  submit (JOB_RAW, p, raw, end - start);
+  account (p, min_ts, n, in->len, max_ts);
+  members_copied++;
+  in->len = 0;
+
+  if (part_is_full (p))
+    {
+      close_part (p);
+    }
+  return true;
+}
+
+static int on_data (struct input *in, const unsigned char *data, size_t len)
+{
+  if (in->len + len > in->cap)
+    {
+      size_t cap = in->cap ? in->cap : OUT_CHUNK * 4;
+      unsigned char *d;
+      while (cap < in->len + len)
+        {
+          cap *= 2;
+        }
+      d = (unsigned char *) realloc (in->data, cap);
+      if (d == NULL)
+        {
+          return -1;
+        }
+      in->data = d;
+      in->cap = cap;
+    }
+  memcpy (in->data + in->len, data, len);
+  in->len += len;
+
+  if (! in->copy || in->spilled || in->len > MEMBER_LIMIT)
+    {
+      in->spilled = in->copy;
+      add_events (in);
+    }
+  return 0;
+}
+
+static void on_member_end (struct input *in, off_t start, off_t end)
+{
+  members_total++;
+  if (in->copy && ! copy_member (in, start, end))
+    {
+      add_events (in);
+    }
+  in->carry = in->len;
+  in->spilled = false;
+}
+
+/* Inflate the journal one gzip member at a time, tracking the compressed
+ * offsets of each member so they can be copied. */
+static int read_members (struct input *in)
+{
+  z_stream zs;
+  unsigned char *ibuf = (unsigned char *) malloc (IN_CHUNK);
+  unsigned char *obuf = (unsigned char *) malloc (OUT_CHUNK);
+  off_t ibuf_off = 0;        /* file offset of ibuf[0] */
+  off_t read_off = 0;        /* file offset of the next read */
+  off_t member_start = 0;
+  bool in_member = false;
+  int rc = 0;
+
+  memset (&zs, 0, sizeof (zs));
+  if (ibuf == NULL || obuf == NULL || inflateInit2 (&zs, 15+16) != Z_OK)
+    {
+      free (ibuf);
+      free (obuf);
+      return -1;
+    }
+
+  while (1)
+    {
+      int zret;
+      if (zs.avail_in == 0)
+        {
+          ssize_t n = read (in->fd, ibuf, IN_CHUNK);
+          if (n < 0)
+            {
+              rc = -1;
+              break;
+            }
+          if (n == 0)
+            {
+              if (in_member)
+                {
+                  fprintf (stderr, "ERROR: %s is truncated\n", in->filename);
+                  rc = -1;
+                }
+              break;
+            }
+          ibuf_off = read_off;
+          read_off += n;
+          zs.next_in = ibuf;
+          zs.avail_in = n;
+        }
+
+      if (! in_member)
+        {
+          /* anything other than another member after the first one is
+           * trailing garbage (gzip(1) pads with zeros), ignore it */
+          if (member_start > 0 && zs.next_in[0] != 0x1f)
+            {
+              break;
+            }
+          in_member = true;
+        }
+
+      zs.next_out = obuf;
+      zs.avail_out = OUT_CHUNK;
+      zret = inflate (&zs, Z_NO_FLUSH);
+      if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR)
+        {
+          fprintf (stderr, "ERROR: failure reading journal %s : %s\n",
+                   in->filename, zs.msg ? zs.msg : "corrupt data");
+          rc = -1;
+          break;
+        }
+      if (OUT_CHUNK - zs.avail_out > 0
+          && on_data (in, obuf, OUT_CHUNK - zs.avail_out) < 0)
+        {
+          fprintf (stderr, "ERROR: out of memory\n");
+          rc = -1;
+          break;
+        }
+      if (zret == Z_STREAM_END)
+        {
+          off_t member_end = ibuf_off + (zs.next_in - ibuf);
+          on_member_end (in, member_start, member_end);
+          member_start = member_end;
+          in_member = false;
+          inflateReset (&zs);
+        }
+    }
+
+  if (rc == 0 && in->len != 0)
+    {
+      fprintf (stderr, "ERROR: journal %s ends with a partial event\n",
+               in->filename);
+      rc = -1;
+    }
+
+  inflateEnd (&zs);
+  free (ibuf);
+  free (obuf);
+  return rc;
+}
+
+/* A delta encoded journal has no members to copy, its events are
+ * decoded by journal_reader and split as they come. */
+static int read_decoded (struct input *in, struct journal_reader *r)
+{
+  unsigned char *obuf = (unsigned char *) malloc (OUT_CHUNK);
+  int n;
+  int rc = 0;
+
+  if (obuf == NULL)
+    {
+      return -1;
+    }
+
+  while ((n = journal_reader_read (r, obuf, OUT_CHUNK)) > 0)
+    {
+      if (on_data (in, obuf, n) < 0)
+        {
+          fprintf (stderr, "ERROR: out of memory\n");
+          rc = -1;
+          break;
+        }
+    }
+  if (n < 0)
+    {
+      fprintf (stderr, "ERROR: failure reading journal %s\n", in->filename);
+      rc = -1;
+    }
+
+  if (rc == 0 && in->len != 0)
+    {
+      fprintf (stderr, "ERROR: journal %s ends with a partial event\n",
+               in->filename);
+      rc = -1;
+    }
+
+  free (obuf);
+  return rc;
+}
+
 int main(int argc, char **argv)
 {
-  char header[22];
-  unsigned char buf[65535];
-  int ret = 0;
+  struct input in;
+  struct journal_reader *reader = NULL;
+  pthread_t workers[MAX_WORKERS];
+  int nworkers = 0;
+  int jobs_arg = 0;
+  const char *outdir = NULL;
+  bool copy = false;
+  bool number_set = false;
 
-  const char *args = "n:h";
-  int number = 10000;    /* (n) number per file */
+  const char *args = "n:m:b:o:j:z:ch";
+
+  memset (&in, 0, sizeof (in));
+  in.fd = -1;
 
   /* turn off error messages, I'll handle them */
   opterr = 0;
   while (1)
     {
-      char c = getopt (argc, argv, args);
+      int c = getopt_long (argc, argv, args, long_options, NULL);
 
       if (c == -1)
         {
@@ -81,7 +888,38 @@ int main(int argc, char **argv)
       switch (c)
         {
           case 'n':
-            number = atoi(optarg);
+            number = strtoull (optarg, NULL, 10);
+            number_set = true;
+            break;
+
+          case 'm':
+            window_ms = strtoull (optarg, NULL, 10) * 60ULL * 1000ULL;
+            break;
+
+          case 'b':
+            max_bytes = parse_size (optarg);
+            break;
+
+          case 'o':
+            outdir = optarg;
+            break;
+
+          case 'j':
+            jobs_arg = atoi (optarg);
+            break;
+
+          case 'z':
+            level = atoi (optarg);
+            if (level < 1 || level > 9)
+              {
+                fprintf (stderr, "ERROR: level must be between 1 and 9\n");
+                ret = 1;
+                goto cleanup;
+              }
+            break;
+
+          case 'c':
+            copy = true;
             break;
 
           case 'h':
@@ -96,14 +934,19 @@ int main(int argc, char **argv)
         }
     }
 
-  int total_count = 0;
-  int current_count = 0;
+  if (! number_set && window_ms == 0 && max_bytes == 0)
+    {
+      number = 10000;
+    }
 
-  unsigned long long start_file_timestamp = 0ULL;
-  unsigned long long end_file_timestamp = 0ULL;
+  if (optind >= argc)
+    {
+      fprintf (stderr, "ERROR: no journal given\n%s", help);
+      ret = 1;
+      goto cleanup;
+    }
 
   const char *filename = argv[optind];
-  const char *tmpfile = "lwes-journal-split-tmp.gz";
   char newfile[PATH_MAX];
   int newfile_idx = 0;
   char *buffer = strdup(filename);
@@ -159,77 +1002,119 @@ int main(int argc, char **argv)
     }
   free (tofree);
 
-  newfile_idx = strlen (newfile);
-  fprintf (stderr, "newfile prefix is %s of length %d\n",newfile, newfile_idx);
-
-  gzFile tmp = gzopen (tmpfile, "wb");
-  gzFile file = gzopen (filename, "rb");
-
-  /* read a header from the file */
-  while (gzread (file, header, 22) == 22)
+  if (outdir != NULL)
     {
-      unsigned short size = header_payload_length (header);
-      unsigned long long cur_file_timestamp =
-        (unsigned long long)(header_receipt_time (header));
-      if (start_file_timestamp == 0ULL)
+      const char *base = strrchr (newfile, '/');
+      base = base != NULL ? base + 1 : newfile;
+      if (mkdir (outdir, 0755) < 0 && errno != EEXIST)
         {
-          start_file_timestamp = cur_file_timestamp;
-        }
-      end_file_timestamp = cur_file_timestamp;
-      if (gzwrite (tmp, header, 22) != 22)
-        {
-          fprintf (stderr, "ERROR: failure writing journal\n");
-          ret=1;
-          break;
+          fprintf (stderr, "ERROR: unable to create %s : %s\n",
+                   outdir, strerror (errno));
+          ret = 1;
+          goto cleanup;
         }
+      snprintf (prefix, sizeof (prefix), "%s/%s", outdir, base);
+    }
+  else
+    {
+      snprintf (prefix, sizeof (prefix), "%s", newfile);
+    }
 
-      /* read an event from the file */
-      if (gzread (file, buf, size) != size)
-        {
-          fprintf (stderr, "ERROR: failure reading journal\n");
-          ret=1;
-          break;
-        }
-      if (gzwrite (tmp, buf, size) != size)
+  newfile_idx = strlen (prefix);
+  fprintf (stderr, "newfile prefix is %s of length %d\n",prefix, newfile_idx);
+
+  in.filename = filename;
+  in.copy = copy;
+  in.fd = open (filename, O_RDONLY);
+  if (in.fd < 0)
+    {
+      fprintf (stderr, "ERROR: unable to open %s : %s\n",
+               filename, strerror (errno));
+      ret = 1;
+      goto cleanup;
+    }
+  posix_fadvise (in.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  reader = journal_reader_open (filename, 0);
+  if (reader == NULL)
+    {
+      fprintf (stderr, "ERROR: unable to read %s\n", filename);
+      ret = 1;
+      goto cleanup;
+    }
+  if (! journal_reader_delta (reader))
+    {
+      journal_reader_close (reader);
+      reader = NULL;
+    }
+  else if (copy)
+    {
+      fprintf (stderr, "ERROR: %s is delta encoded, its members can not "
+               "be copied, split it without -c\n", filename);
+      ret = 1;
+      goto cleanup;
+    }
+
+  nworkers = jobs_arg > 0 ? jobs_arg : (int)sysconf (_SC_NPROCESSORS_ONLN);
+  if (nworkers < 1)
+    {
+      nworkers = 1;
+    }
+  if (nworkers > MAX_WORKERS)
+    {
+      nworkers = MAX_WORKERS;
+    }
+  for (i = 0; i < nworkers; i++)
+    {
+      if (pthread_create (&workers[i], NULL, worker_main, NULL))
         {
-          fprintf (stderr, "ERROR: failure writing journal\n");
-          ret=1;
+          fprintf (stderr, "ERROR: unable to start worker thread\n");
+          ret = 1;
+          nworkers = i;
           break;
         }
-      current_count++;
-      total_count++;
-      if (current_count == number) {
-        gzclose (tmp);
-        fprintf (stderr, "split from %llu to %llu %d\n",
-                 start_file_timestamp, end_file_timestamp, current_count);
-        char renamedfile[PATH_MAX];
-        snprintf (renamedfile, sizeof (renamedfile), "%s%llu.%llu%s",
-                  newfile,start_file_timestamp,end_file_timestamp, ".gz");
-        if (rename (tmpfile, renamedfile) < 0)
-          {
-            fprintf (stderr, "ERROR : failed to rename %s to %s\n",
-                     tmpfile, renamedfile);
-            ret=1;
-            break;
-          }
-        start_file_timestamp = 0ULL;
-        current_count = 0;
-        tmp = gzopen (tmpfile, "wb");
-      }
     }
-  gzclose (file);
-  gzclose (tmp);
-  char renamedfile[PATH_MAX];
-  snprintf (renamedfile, sizeof (renamedfile), "%s%llu.%llu%s",
-            newfile,start_file_timestamp,end_file_timestamp, ".gz");
-  if (rename (tmpfile, renamedfile) < 0)
+
+  if (nworkers > 0
+      && (reader != NULL ? read_decoded (&in, reader)
+                         : read_members (&in)) < 0)
+    {
+      ret = 1;
+    }
+
+  /* whatever is left gets closed, even on error, so every part that
+   * made it to disk has a proper name */
+  while (open_parts != NULL)
+    {
+      close_part (open_parts);
+    }
+  while (job_head < job_tail)
+    {
+      retire_oldest ();
+    }
+
+  pthread_mutex_lock (&job_lock);
+  workers_done = true;
+  pthread_cond_broadcast (&job_work);
+  pthread_mutex_unlock (&job_lock);
+  for (i = 0; i < nworkers; i++)
     {
-      fprintf (stderr, "ERROR : failed to rename %s to %s\n",
-               tmpfile, renamedfile);
-      ret=1;
+      pthread_join (workers[i], NULL);
     }
-  fprintf (stderr, "%s has %d events\n", filename, total_count);
+
+  if (copy)
+    {
+      fprintf (stderr, "copied %llu of %llu members without recompressing\n",
+               members_copied, members_total);
+    }
+  fprintf (stderr, "%s has %llu events\n", filename, total_count);
 
 cleanup:
+  journal_reader_close (reader);
+  if (in.fd >= 0)
+    {
+      close (in.fd);
+    }
+  free (in.data);
   exit (ret);
 }
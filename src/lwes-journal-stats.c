@@ -11,47 +11,164 @@
  *======================================================================*/
 #define _GNU_SOURCE
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
-#include <zlib.h>
 #include <lwes.h>
 
 #include "header.h"
+#include "journal_reader.h"
 #include "time_utils.h"
 #include "uthash.h"
 
+#define MAX_WORKERS     256
+#define READ_CHUNK      (1024*1024)
+#define GZ_BUFFER       (256*1024)
+
+/* Sizes are kept in a log-linear histogram, values below HIST_LINEAR are
+ * exact, above that each power of two is split into HIST_SUB buckets, so
+ * percentiles are within 1/HIST_SUB (~1.5%) of the true value.
+ */
+#define HIST_LINEAR     128
+#define HIST_SUB_BITS   6
+#define HIST_SUB        (1<<HIST_SUB_BITS)
+#define HIST_MIN_EXP    7          /* log2(HIST_LINEAR) */
+#define HIST_MAX_EXP    17         /* sizes are < 2^17 (65535 + 59) */
+#define HIST_BUCKETS    (HIST_LINEAR + (HIST_MAX_EXP-HIST_MIN_EXP)*HIST_SUB)
+
 static const char help[] =
-  "lwes-journal-stats [options] <journal>"                             "\n"
+  "lwes-journal-stats [options] <journal(s)>"                          "\n"
   ""                                                                   "\n"
   "  where options are:"                                               "\n"
   ""                                                                   "\n"
+  "    -j [one argument]"                                              "\n"
+  "       The number of worker threads, journals are handed out to"    "\n"
+  "       workers one at a time.  Defaults to the number of online"    "\n"
+  "       processors (but never more than the number of journals)."    "\n"
+  ""                                                                   "\n"
+  "    -f [one argument]"                                              "\n"
+  "       Output format, one of 'text' (default), 'tsv' or 'json'."    "\n"
+  ""                                                                   "\n"
   "    -h"                                                             "\n"
   "       show this message"                                           "\n"
   ""                                                                   "\n"
   "  arguments are specified as -option <value> or -option<value>"     "\n"
   ""                                                                   "\n";
 
+typedef enum {
+  FORMAT_TEXT, FORMAT_TSV, FORMAT_JSON
+} format_t;
+
 struct stats_by_event {
   LWES_CHAR name[SHORT_STRING_MAX+1];
   unsigned long long total_events;
   unsigned long long total_bytes;
-  unsigned short min_bytes;
-  unsigned short max_bytes;
+  unsigned int min_bytes;
+  unsigned int max_bytes;
+  unsigned long long hist[HIST_BUCKETS];
   UT_hash_handle hh;
 };
 
-struct stats_by_event *stats = NULL;
+/* Each worker owns one of these, nothing in it is shared until the
+ * worker has been joined, so the hot loop takes no locks. */
+struct worker {
+  pthread_t tid;
+  struct stats_by_event *stats;
+  unsigned long long files;
+  int errors;
+};
+
+static char **gbl_files = NULL;
+static int gbl_num_files = 0;
+static int gbl_next_file = 0;
+
+static unsigned int hist_index (unsigned int v)
+{
+  unsigned int e;
+
+  if (v < HIST_LINEAR)
+    {
+      return v;
+    }
+  e = 31 - __builtin_clz (v);
+  if (e >= HIST_MAX_EXP)
+    {
+      return HIST_BUCKETS - 1;
+    }
+  return HIST_LINEAR
+         + (e - HIST_MIN_EXP) * HIST_SUB
+         + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* smallest value which falls in bucket idx */
+static unsigned int hist_value (unsigned int idx)
+{
+  unsigned int e, sub;
+
+  if (idx < HIST_LINEAR)
+    {
+      return idx;
+    }
+  e = (idx - HIST_LINEAR) / HIST_SUB + HIST_MIN_EXP;
+  sub = (idx - HIST_LINEAR) % HIST_SUB;
+  return (1U << e) | (sub << (e - HIST_SUB_BITS));
+}
+
+static unsigned int percentile (const struct stats_by_event *s, double p)
+{
+  unsigned long long rank =
+    (unsigned long long)(p * (double)s->total_events + 0.5);
+  unsigned long long seen = 0ULL;
+  unsigned int i;
+
+  if (rank == 0ULL)
+    {
+      rank = 1ULL;
+    }
+  for (i = 0; i < HIST_BUCKETS; i++)
+    {
+      seen += s->hist[i];
+      if (seen >= rank)
+        {
+          unsigned int v = hist_value (i);
+          /* the bucket bounds are approximate, the extremes are not */
+          if (v < s->min_bytes) v = s->min_bytes;
+          if (v > s->max_bytes) v = s->max_bytes;
+          return v;
+        }
+    }
+  return s->max_bytes;
+}
+
+static struct stats_by_event *
+find_or_create (struct stats_by_event **stats, const char *name)
+{
+  struct stats_by_event *s = NULL;
+
+  HASH_FIND_STR(*stats, name, s);
+  if (s == NULL) {
+    s = (struct stats_by_event *)malloc(sizeof(struct stats_by_event));
+    memset (s, 0, sizeof (struct stats_by_event));
+    strncpy (s->name, name, SHORT_STRING_MAX);
+    s->min_bytes = UINT_MAX;
+    s->max_bytes = 0;
+    HASH_ADD_STR(*stats, name, s);
+  }
+  return s;
+}
 
-static void upsert_stats (LWES_SHORT_STRING name, size_t bytes) {
+static void upsert_stats (struct stats_by_event **stats,
+                          LWES_SHORT_STRING name, size_t bytes)
+{
   struct stats_by_event *s = NULL;
 
   /* The following fields are often in the header and some tools add them
    * to the end of the event in the lwes serialization format, which gives
-   * 
+   *
    *   int64   ReceiptTime =    1 (short string length)
    *                         + 11 (length of string)
    *                         +  1 (length of type byte)
@@ -66,63 +183,249 @@ static void upsert_stats (LWES_SHORT_STRING name, size_t bytes) {
    */
 
   bytes += 59;
-  HASH_FIND_STR(stats, name, s);
-  if (s == NULL) {
-    s = (struct stats_by_event *)malloc(sizeof(struct stats_by_event));
-    memset (s, 0, sizeof (struct stats_by_event));
-    strncpy (s->name, name, strlen (name));
-    s->total_events = 0;
-    s->total_bytes = 0;
-    s->min_bytes = 65535;
-    s->max_bytes = 0;
-    HASH_ADD_STR(stats, name, s);
-  }
+  s = find_or_create (stats, name);
   s->total_bytes += bytes;
   s->total_events++;
   s->min_bytes = bytes < s->min_bytes ? bytes : s->min_bytes;
   s->max_bytes = bytes > s->max_bytes ? bytes : s->max_bytes;
+  s->hist[hist_index (bytes)]++;
 }
 
-static int name_sort (struct stats_by_event *a, struct stats_by_event *b) {
-  return strcmp (a->name, b->name);
+static void merge_stats (struct stats_by_event *into,
+                         const struct stats_by_event *from)
+{
+  unsigned int i;
+
+  into->total_events += from->total_events;
+  into->total_bytes += from->total_bytes;
+  into->min_bytes = from->min_bytes < into->min_bytes
+                    ? from->min_bytes : into->min_bytes;
+  into->max_bytes = from->max_bytes > into->max_bytes
+                    ? from->max_bytes : into->max_bytes;
+  for (i = 0; i < HIST_BUCKETS; i++)
+    {
+      into->hist[i] += from->hist[i];
+    }
+}
+
+/* Process one journal.  Rather than two reads per event, the
+ * journal is decompressed in large chunks and events are parsed in place.
+ */
+static int process_file (struct stats_by_event **stats, const char *filename)
+{
+  unsigned char *buf = NULL;
+  size_t have = 0;
+  int ret = 0;
+  LWES_CHAR event_name[SHORT_STRING_MAX+1];
+
+  struct journal_reader *file = journal_reader_open (filename, GZ_BUFFER);
+  if (file == NULL)
+    {
+      fprintf (stderr, "ERROR: unable to open %s\n", filename);
+      return 1;
+    }
+
+  buf = (unsigned char *)malloc (READ_CHUNK);
+  if (buf == NULL)
+    {
+      fprintf (stderr, "ERROR: unable to allocate read buffer\n");
+      journal_reader_close (file);
+      return 1;
+    }
+
+  while (1)
+    {
+      size_t offset = 0;
+      int n = journal_reader_read (file, buf + have, READ_CHUNK - have);
+      if (n < 0)
+        {
+          fprintf (stderr, "ERROR: failure reading journal %s\n", filename);
+          ret = 1;
+          break;
+        }
+      if (n == 0)
+        {
+          if (have != 0)
+            {
+              fprintf (stderr, "ERROR: truncated event at end of %s\n",
+                       filename);
+              ret = 1;
+            }
+          break;
+        }
+      have += n;
+
+      /* walk all the complete events in the chunk */
+      while (have - offset >= HEADER_LENGTH)
+        {
+          const char *header = (const char *)(buf + offset);
+          unsigned short size = header_payload_length (header);
+          size_t name_offset = 0;
+
+          if (have - offset < (size_t)HEADER_LENGTH + size)
+            {
+              break;
+            }
+          if (! unmarshall_SHORT_STRING (event_name, SHORT_STRING_MAX+1,
+                                         buf + offset + HEADER_LENGTH, size,
+                                         &name_offset))
+            {
+              fprintf (stderr, "ERROR: failure reading event_name in %s\n",
+                       filename);
+              ret = 1;
+              goto done;
+            }
+          upsert_stats (stats, event_name, size);
+          offset += HEADER_LENGTH + size;
+        }
+
+      /* keep any partial event for the next chunk */
+      memmove (buf, buf + offset, have - offset);
+      have -= offset;
+    }
+
+done:
+  free (buf);
+  journal_reader_close (file);
+  return ret;
+}
+
+static void *worker_main (void *arg)
+{
+  struct worker *w = (struct worker *)arg;
+
+  while (1)
+    {
+      int idx = __sync_fetch_and_add (&gbl_next_file, 1);
+      if (idx >= gbl_num_files)
+        {
+          break;
+        }
+      w->errors += process_file (&w->stats, gbl_files[idx]);
+      w->files++;
+    }
+  return NULL;
 }
 
-static void print_stats () {
+static void free_stats (struct stats_by_event **stats)
+{
   struct stats_by_event *s, *tmp;
-  unsigned long long total_events = 0;
-  unsigned long long total_bytes = 0;
-  unsigned short min_bytes = 65535;
-  unsigned short max_bytes = 0;
-
-  HASH_SORT (stats, name_sort);
-  for (s = stats ; s != NULL; s = (struct stats_by_event *)(s->hh.next)) {
-    fprintf (stdout,"%-30s %10llu events (bytes: %llu/%u/%u total/min/max)\n",
-             s->name,
-             s->total_events,
-             s->total_bytes,
-             s->min_bytes,
-             s->max_bytes);
-    total_bytes += s->total_bytes;
-    total_events += s->total_events;
-    min_bytes = s->min_bytes < min_bytes ? s->min_bytes : min_bytes;
-    max_bytes = s->max_bytes > max_bytes ? s->max_bytes : max_bytes;
-  }
-  fprintf (stdout,"%-30s %10llu events (bytes: %llu/%u/%u total/min/max)\n",
-           "TOTAL", total_events, total_bytes, min_bytes, max_bytes);
-  HASH_ITER(hh, stats, s, tmp) {
-    HASH_DEL(stats, s);
+
+  HASH_ITER(hh, *stats, s, tmp) {
+    HASH_DEL(*stats, s);
     free(s);
   }
 }
 
+static int name_sort (struct stats_by_event *a, struct stats_by_event *b) {
+  return strcmp (a->name, b->name);
+}
+
+static void print_json_string (const char *str)
+{
+  fputc ('"', stdout);
+  for (; *str; str++)
+    {
+      unsigned char c = (unsigned char)*str;
+      if (c == '"' || c == '\\')
+        {
+          fprintf (stdout, "\\%c", c);
+        }
+      else if (c < 0x20)
+        {
+          fprintf (stdout, "\\u%04x", c);
+        }
+      else
+        {
+          fputc (c, stdout);
+        }
+    }
+  fputc ('"', stdout);
+}
+
+static void print_line (format_t format, const struct stats_by_event *s,
+                        const char *name, bool first)
+{
+  unsigned int min_bytes = s->total_events ? s->min_bytes : 0;
+  unsigned int p50 = s->total_events ? percentile (s, 0.50) : 0;
+  unsigned int p90 = s->total_events ? percentile (s, 0.90) : 0;
+  unsigned int p99 = s->total_events ? percentile (s, 0.99) : 0;
+
+  switch (format)
+    {
+      case FORMAT_TEXT:
+        fprintf (stdout,"%-30s %10llu events (bytes: %llu/%u/%u total/min/max"
+                        " %u/%u/%u p50/p90/p99)\n",
+                 name, s->total_events, s->total_bytes,
+                 min_bytes, s->max_bytes, p50, p90, p99);
+        break;
+
+      case FORMAT_TSV:
+        fprintf (stdout, "%s\t%llu\t%llu\t%u\t%u\t%u\t%u\t%u\n",
+                 name, s->total_events, s->total_bytes,
+                 min_bytes, s->max_bytes, p50, p90, p99);
+        break;
+
+      case FORMAT_JSON:
+        fprintf (stdout, "%s\n    {\"name\": ", first ? "" : ",");
+        print_json_string (name);
+        fprintf (stdout, ", \"events\": %llu, \"bytes\": %llu,"
+                         " \"min\": %u, \"max\": %u,"
+                         " \"p50\": %u, \"p90\": %u, \"p99\": %u}",
+                 s->total_events, s->total_bytes,
+                 min_bytes, s->max_bytes, p50, p90, p99);
+        break;
+    }
+}
+
+static void print_stats (struct stats_by_event **stats, format_t format) {
+  struct stats_by_event *s;
+  struct stats_by_event *total =
+    (struct stats_by_event *)calloc (1, sizeof (struct stats_by_event));
+  bool first = true;
+
+  total->min_bytes = UINT_MAX;
+
+  if (format == FORMAT_TSV)
+    {
+      fprintf (stdout, "event\tevents\tbytes\tmin\tmax\tp50\tp90\tp99\n");
+    }
+  if (format == FORMAT_JSON)
+    {
+      fprintf (stdout, "{\n  \"events\": [");
+    }
+
+  HASH_SORT (*stats, name_sort);
+  for (s = *stats ; s != NULL; s = (struct stats_by_event *)(s->hh.next)) {
+    print_line (format, s, s->name, first);
+    merge_stats (total, s);
+    first = false;
+  }
+
+  if (format == FORMAT_JSON)
+    {
+      fprintf (stdout, "\n  ],\n  \"total\":");
+      print_line (format, total, "TOTAL", true);
+      fprintf (stdout, "\n}\n");
+    }
+  else
+    {
+      print_line (format, total, "TOTAL", true);
+    }
+  free (total);
+  free_stats (stats);
+}
+
 int main(int argc, char **argv)
 {
-  char header[22];
-  int buflen = 65535;
-  unsigned char buf[buflen];
   int ret = 0;
+  int num_workers = 0;
+  format_t format = FORMAT_TEXT;
+  struct worker *workers = NULL;
+  struct stats_by_event *stats = NULL;
+  int i;
 
-  const char *args = "h";
+  const char *args = "j:f:h";
 
   /* turn off error messages, I'll handle them */
   opterr = 0;
@@ -136,6 +439,31 @@ int main(int argc, char **argv)
         }
       switch (c)
         {
+          case 'j':
+            num_workers = atoi (optarg);
+            break;
+
+          case 'f':
+            if (strcmp (optarg, "text") == 0)
+              {
+                format = FORMAT_TEXT;
+              }
+            else if (strcmp (optarg, "tsv") == 0)
+              {
+                format = FORMAT_TSV;
+              }
+            else if (strcmp (optarg, "json") == 0)
+              {
+                format = FORMAT_JSON;
+              }
+            else
+              {
+                fprintf (stderr, "ERROR: unknown format %s\n", optarg);
+                ret = 1;
+                goto cleanup;
+              }
+            break;
+
           case 'h':
             fprintf (stderr, "%s", help);
             ret = 1;
@@ -148,41 +476,71 @@ int main(int argc, char **argv)
         }
     }
 
-  const char *filename = argv[optind];
-  gzFile file = gzopen (filename, "rb");
-  if (file == NULL)
+  if (optind >= argc)
     {
-      fprintf (stderr, "ERROR: unable to open %s\n", filename);
+      fprintf (stderr, "ERROR: journal file is required\n");
       ret = 1;
       goto cleanup;
     }
-  LWES_CHAR event_name[SHORT_STRING_MAX+1];
 
-  /* read a header from the file */
-  while (gzread (file, header, 22) == 22)
+  gbl_files = argv + optind;
+  gbl_num_files = argc - optind;
+
+  if (num_workers <= 0)
     {
-      unsigned short size = header_payload_length (header);
-      size_t offset = 0;
+      num_workers = (int)sysconf (_SC_NPROCESSORS_ONLN);
+    }
+  if (num_workers > gbl_num_files)
+    {
+      num_workers = gbl_num_files;
+    }
+  if (num_workers > MAX_WORKERS)
+    {
+      num_workers = MAX_WORKERS;
+    }
+  if (num_workers < 1)
+    {
+      num_workers = 1;
+    }
+
+  workers = (struct worker *)calloc (num_workers, sizeof (struct worker));
+  if (workers == NULL)
+    {
+      fprintf (stderr, "ERROR: unable to allocate workers\n");
+      ret = 1;
+      goto cleanup;
+    }
 
-      /* read an event from the file */
-      if (gzread (file, buf, size) != size)
+  for (i = 0; i < num_workers; i++)
+    {
+      if (pthread_create (&workers[i].tid, NULL, worker_main, &workers[i]))
         {
-          fprintf (stderr, "ERROR: failure reading journal\n");
-          ret=1;
+          fprintf (stderr, "ERROR: unable to start worker %d\n", i);
+          num_workers = i;
+          ret = 1;
           break;
         }
-      if (! unmarshall_SHORT_STRING (event_name, SHORT_STRING_MAX+1, buf, size, &offset))
+    }
+
+  /* join the workers and fold each private table into the result */
+  for (i = 0; i < num_workers; i++)
+    {
+      struct stats_by_event *s, *tmp;
+
+      pthread_join (workers[i].tid, NULL);
+      if (workers[i].errors)
         {
-          fprintf (stderr, "ERROR: failure reading event_name\n");
-          ret=1;
-          break;
+          ret = 1;
         }
-      upsert_stats (event_name, size);
+      HASH_ITER(hh, workers[i].stats, s, tmp) {
+        merge_stats (find_or_create (&stats, s->name), s);
+      }
+      free_stats (&workers[i].stats);
     }
-  gzclose (file);
 
-  print_stats ();
+  print_stats (&stats, format);
 
 cleanup:
+  free (workers);
   exit (ret);
 }
@@ -13,6 +13,7 @@
 
 #include "config.h"
 
+#include "live_stats.h"
 #include "log.h"
 #include "opt.h"
 #include "perror.h"
@@ -181,6 +182,9 @@ int main(int argc, const char* argv[])
   LOG_INF(log, "Starting up - lwes-journaller-%s using %s model\n",
           VERSION, arg_proc_type);
 
+  live_stats_open (1, log);
+  live_stats_server_start (log);
+
   if ( strcmp(arg_proc_type, ARG_PROCESS) == 0 )
     {
       process_model(argv, log);
@@ -196,6 +200,9 @@ int main(int argc, const char* argv[])
       serial_model(log);
     }
 
+  live_stats_server_stop (log);
+  live_stats_close (1, log);
+
   int r = 0;
   if ((r = delete_pid_file()) < 0)
     {
@@ -16,6 +16,8 @@
 
 #include "log.h"
 #include "opt.h"
+#include "shaper.h"
+#include "xport.h"
 
 #if HAVE_LIBGEN_H
 #include <libgen.h>
@@ -31,14 +33,16 @@
 /* Base program name from argv[0]. */
 char*        arg_basename      = 0;
 
-/* Set default queue type, types in preferred order. */
+/* Set default kernel queue type, types in preferred order.  The thread
+ * model defaults to the in-process queue instead, see process_options(). */
 #if HAVE_MQUEUE_H
-const char*  arg_queue_type    = ARG_MQ;
+#define KERNEL_QUEUE_TYPE ARG_MQ
 #elif HAVE_SYS_MSG_H
-const char*  arg_queue_type    = ARG_MSG;
+#define KERNEL_QUEUE_TYPE ARG_MSG
 #else
 #error No kernel message queue support on this platform.
 #endif
+const char*  arg_queue_type    = NULL;
 
 /* Queue parameters. */
 const char*  arg_queue_name    = "/lwes_journal";
@@ -80,9 +84,13 @@ int    arg_site                = 1;
 int         arg_journal_uid    = 0;
 const char* arg_journal_user   = NULL;
 
-/* Queue report interval. */
+/* Was the serial model depth test interval, kept so old command lines
+ * still parse. */
 int    arg_queue_test_interval = 10000;
 
+/* How often the queue depth is sampled. */
+int    arg_depth_interval      = 100;
+
 const char*  arg_pid_file      = "/var/run/lwes-journaller.pid";
 
 /* Journals specified and number of journals specified. */
@@ -94,10 +102,99 @@ char*  arg_disk_journals[10];
  * round intervals starting at beginning of day)
  */
 int    arg_journal_rotate_interval = 0;
+/* Cut journals where the receipt times of events cross an interval,
+ * rather than when the interval timer goes off. */
+int    arg_rotate_event_time   = 0;
+/* Also rotate once a journal holds this many MB of events, or this
+ * many events (0 is no limit).  With --journal-rotate-on-disk the size
+ * is what reached the file, compressed, which trails by what the
+ * compressor holds.
+ */
+int    arg_journal_rotate_size = 0;
+int    arg_journal_rotate_on_disk = 0;
+int    arg_journal_rotate_count = 0;
 int    arg_wakeup_interval_ms = WAKEUP_MS;
 
 int    arg_nodaemonize         = 0;
 
+/* Live stats, shared memory page name (NULL means the queue name with
+ * ".stats" appended, "none" keeps them private) and Unix socket to
+ * serve them on (default off).
+ */
+const char* arg_stats_shm      = NULL;
+const char* arg_stats_socket   = NULL;
+
+/* Port to serve OpenMetrics on at 127.0.0.1, 0 is off. */
+int    arg_metrics_port        = 0;
+
+/* Unix socket for live taps of the journal stream (default off), and
+ * the ring size per subscriber.
+ */
+const char* arg_tap_socket     = NULL;
+int    arg_tap_buffer          = 4*1024*1024;
+
+/* Ingest shaping: events per second and burst per sender IP (0 is
+ * off, a burst of 0 is one second's worth), limits per event type as
+ * "Name=rate[/burst],...", and where to divert events over budget
+ * (default is to drop them).
+ */
+int    arg_sender_rate         = 0;
+int    arg_sender_burst        = 0;
+const char* arg_event_rate     = NULL;
+const char* arg_overflow_journal = NULL;
+
+/* Event types which overtake the bulk of the traffic in the queue, as
+ * "Name,...".
+ */
+const char* arg_critical_events = NULL;
+
+/* Back the event buffers with 2MB huge pages where possible, and the
+ * journal write buffer size in bytes (0 leaves the library default).
+ */
+int    arg_hugepages           = 0;
+int    arg_journal_buffer      = 0;
+
+/* gz journal compression level and strategy, and the queue depth at
+ * which it drops to the burst level (0 is never).
+ */
+int    arg_gz_level            = 6;
+const char* arg_gz_strategy    = ARG_GZ_DEFAULT;
+int    arg_gz_adaptive_depth   = 0;
+int    arg_gz_burst_level      = 1;
+
+/* Journal record encoding: raw 22 byte headers, or delta encoded
+ * (journal_delta.h), under whatever compression the journal type has.
+ */
+const char* arg_journal_encoding = ARG_ENC_RAW;
+
+/* fallocate() each new journal from the sizes of recent ones, and the
+ * free space below which journals go to the fallback directory (0 is
+ * never).
+ */
+int    arg_journal_preallocate = 0;
+int    arg_min_free_mb         = 0;
+const char* arg_fallback_journal_dir = NULL;
+
+/* How the next journal is picked from those on the command line at
+ * each rotation, how many are written at once, and how long one which
+ * failed is left out.
+ */
+const char* arg_journal_placement = ARG_PLACE_RR;
+int    arg_journal_stripe      = 1;
+int    arg_journal_cooldown    = 60;
+
+/* Start write-back of journals every so many MB of events or every so
+ * many milliseconds, and drop what is on disk from the page cache (0 is
+ * never, which leaves it to the kernel).
+ */
+int    arg_journal_sync_mb     = 0;
+int    arg_journal_sync_ms     = 0;
+
+/* Datagrams the serial model reads at once into a journal block, 0 for
+ * one at a time.
+ */
+int    arg_serial_batch        = 0;
+
 /* Print version, then exit. */
 int    arg_version;
 
@@ -121,10 +218,15 @@ int process_options(int argc, const char* argv[], FILE *log)
     { "log-level",     0,  POPT_ARG_INT,    &arg_log_level,      0, "Set the output logging level - OFF=(1), ERROR=(2), WARNING=(4), INFO=(8), PROGRESS=(16)", "mask" },
     { "log-file",      0,  POPT_ARG_STRING, &arg_log_file,       0, "Set the output log file", "file" },
     { "interface",    'I', POPT_ARG_STRING, &arg_interface,      0, "Network interface to listen on", "ip" },
-    { "queue-test-interval", 'q', POPT_ARG_INT, &arg_queue_test_interval, 0, "Queue depth test interval for serial mode (dflt=10000)", "milliseconds" },
+    { "queue-test-interval", 'q', POPT_ARG_INT, &arg_queue_test_interval, 0, "Ignored, see --depth-interval", "milliseconds" },
+    { "depth-interval", 0, POPT_ARG_INT, &arg_depth_interval, 0, "Queue depth sampling interval (dflt=100)", "milliseconds" },
     { "address",      'm', POPT_ARG_STRING, &arg_ip,             0, "IP address", "ip" },
-    { "journal-type", 'j', POPT_ARG_STRING, &arg_journ_type,     0, "Journal type", "{" ARG_GZ "," ARG_FILE "}" },
+    { "journal-type", 'j', POPT_ARG_STRING, &arg_journ_type,     0, "Journal type", "{" ARG_GZ "," ARG_DZ "," ARG_FILE "}" },
     { "journal-rotate-interval", 'i', POPT_ARG_INT, &arg_journal_rotate_interval,     0, "Journal rotation interval in seconds (default off)", 0 },
+    { "rotate-on-event-time", 0, POPT_ARG_NONE, &arg_rotate_event_time, 0, "Cut journals at the interval boundaries of event receipt times", 0 },
+    { "journal-rotate-size", 0, POPT_ARG_INT, &arg_journal_rotate_size, 0, "Rotate journals holding this many MB of events, dflt=0 (no limit)", "MB" },
+    { "journal-rotate-on-disk", 0, POPT_ARG_NONE, &arg_journal_rotate_on_disk, 0, "Measure --journal-rotate-size as written to the file, compressed", 0 },
+    { "journal-rotate-count", 0, POPT_ARG_INT, &arg_journal_rotate_count, 0, "Rotate journals holding this many events, dflt=0 (no limit)", "count" },
     { "pid-file",     'f', POPT_ARG_STRING, &arg_pid_file,       0, "PID file, dflt=NULL", "path" },
     { "port",         'p', POPT_ARG_INT,    &arg_port,           0, "Port number to listen on, dflt=9191", "short" },
     { "thread-type",  't', POPT_ARG_STRING, &arg_proc_type,      0, "Threading model, '" ARG_THREAD "' or '" ARG_PROCESS "' or '" ARG_SERIAL "', dflt="
@@ -137,13 +239,39 @@ int process_options(int argc, const char* argv[], FILE *log)
     { "queue-max-cnt", 0,  POPT_ARG_INT,    &arg_queue_max_cnt,  0, "Max messages for queue, dflt=10000", "int" },
     { "queue-max-sz",  0,  POPT_ARG_INT,    &arg_queue_max_sz,   0, "Max message size for queue, dflt=65535", "int" },
     { "queue-name",   'Q', POPT_ARG_STRING, &arg_queue_name,     0, "Queue name, should start with '/', dflt='/lwes_journal'", "string" },
-    { "queue-type",   'q', POPT_ARG_STRING, &arg_queue_type,     0, "Queue type", "{" ARG_MSG "," ARG_MQ "}" },
+    { "queue-type",   'q', POPT_ARG_STRING, &arg_queue_type,     0, "Queue type, dflt=" ARG_RING " with threads, else " KERNEL_QUEUE_TYPE, "{" ARG_MSG "," ARG_MQ "," ARG_RING "}" },
     { "real-time",    'R', POPT_ARG_NONE,   &arg_rt,             0, "Run threads with real-time priority", 0 },
     { "site",         'n', POPT_ARG_INT,    &arg_site,           0, "Site id", "int" },
     { "sockbuffer",    0,  POPT_ARG_INT,    &arg_sockbuffer,     0, "Receive socket buffer size", "bytes" },
     { "ttl",           0,  POPT_ARG_INT,    &arg_ttl,            0, "Emitting TTL value", "hops" },
     { "wakeup", 'w', POPT_ARG_INT, &arg_wakeup_interval_ms, 0, "How often to break checking for signals", "milliseconds" },
     { "user",          0,  POPT_ARG_STRING, &arg_journal_user,   0, "Owner of journal files", "user" },
+    { "stats-shm",     0,  POPT_ARG_STRING, &arg_stats_shm,      0, "Shared memory name for live stats, 'none' to disable, dflt=<queue-name>.stats", "name" },
+    { "stats-socket",  0,  POPT_ARG_STRING, &arg_stats_socket,   0, "Unix socket serving live stats, dflt=off", "path" },
+    { "metrics-port",  0,  POPT_ARG_INT,    &arg_metrics_port,   0, "Local port serving /metrics in OpenMetrics format, dflt=off", "port" },
+    { "tap-socket",    0,  POPT_ARG_STRING, &arg_tap_socket,     0, "Unix socket streaming a live copy of the journal, dflt=off", "path" },
+    { "tap-buffer",    0,  POPT_ARG_INT,    &arg_tap_buffer,     0, "Buffer per tap subscriber, dflt=4194304", "bytes" },
+    { "sender-rate",   0,  POPT_ARG_INT,    &arg_sender_rate,    0, "Events per second accepted from each sender IP, dflt=off", "events" },
+    { "sender-burst",  0,  POPT_ARG_INT,    &arg_sender_burst,   0, "Burst accepted from each sender IP, dflt=--sender-rate", "events" },
+    { "event-rate",    0,  POPT_ARG_STRING, &arg_event_rate,     0, "Events per second accepted per event type, dflt=off", "Name=rate[/burst],..." },
+    { "overflow-journal", 0, POPT_ARG_STRING, &arg_overflow_journal, 0, "Journal for events over their rate, dflt=drop them", "path" },
+    { "critical-event", 0, POPT_ARG_STRING, &arg_critical_events, 0, "Event types put ahead of the others in the queue", "Name,..." },
+    { "hugepages",     0,  POPT_ARG_NONE,   &arg_hugepages,      0, "Put event buffers in huge pages, reserved ones first, else transparent ones", 0 },
+    { "journal-buffer", 0, POPT_ARG_INT,    &arg_journal_buffer, 0, "Journal write buffer size, dflt=library default", "bytes" },
+    { "gz-level",      0,  POPT_ARG_INT,    &arg_gz_level,       0, "gz journal compression level, 1 (fast) to 9 (small), dflt=6", "level" },
+    { "gz-strategy",   0,  POPT_ARG_STRING, &arg_gz_strategy,    0, "gz journal compression strategy, dflt=" ARG_GZ_DEFAULT, "{" ARG_GZ_DEFAULT "," ARG_GZ_FILTERED "," ARG_GZ_HUFFMAN "," ARG_GZ_RLE "}" },
+    { "gz-adaptive-depth", 0, POPT_ARG_INT, &arg_gz_adaptive_depth, 0, "Events waiting at which gz journals drop to --gz-burst-level, dflt=off", "events" },
+    { "gz-burst-level", 0, POPT_ARG_INT,    &arg_gz_burst_level, 0, "gz journal compression level while events back up, dflt=1", "level" },
+    { "journal-encoding", 0, POPT_ARG_STRING, &arg_journal_encoding, 0, "Journal record encoding, dflt=" ARG_ENC_RAW, "{" ARG_ENC_RAW "," ARG_ENC_DELTA "}" },
+    { "journal-preallocate", 0, POPT_ARG_NONE, &arg_journal_preallocate, 0, "Preallocate each journal file from the sizes of recent ones", 0 },
+    { "min-free-mb",   0,  POPT_ARG_INT,    &arg_min_free_mb,    0, "Journal to the fallback directory below this much free disk, dflt=0 (never)", "MB" },
+    { "fallback-journal-dir", 0, POPT_ARG_STRING, &arg_fallback_journal_dir, 0, "Where journals go while their disk is low, see --min-free-mb", "dir" },
+    { "journal-placement", 0, POPT_ARG_STRING, &arg_journal_placement, 0, "How the next journal is picked at rotation, dflt=" ARG_PLACE_RR, "{" ARG_PLACE_RR "," ARG_PLACE_SPACE "," ARG_PLACE_LATENCY "}" },
+    { "journal-stripe", 0, POPT_ARG_INT,    &arg_journal_stripe, 0, "Journals written at once, batches spread over them, dflt=1", "count" },
+    { "journal-cooldown", 0, POPT_ARG_INT,  &arg_journal_cooldown, 0, "Seconds a journal which failed is not used, dflt=60", "seconds" },
+    { "journal-sync-mb", 0, POPT_ARG_INT,   &arg_journal_sync_mb, 0, "Write journals back every this many MB of events, dflt=0 (never)", "MB" },
+    { "journal-sync-ms", 0, POPT_ARG_INT,   &arg_journal_sync_ms, 0, "Write journals back every this many milliseconds, dflt=0 (never)", "milliseconds" },
+    { "serial-batch", 0, POPT_ARG_INT,      &arg_serial_batch,   0, "Datagrams the serial model reads and journals at once, dflt=0 (one at a time)", "count" },
     { "version",      'v', POPT_ARG_NONE,   &arg_version,        0, "Display version, then exit", 0 },
     { "xport-type",   'x', POPT_ARG_STRING, &arg_xport,          0, "Transport, dflt=udp", "{" ARG_UDP ", ...}" },
 #ifdef HAVE_MONDEMAND
@@ -237,6 +365,12 @@ int process_options(int argc, const char* argv[], FILE *log)
       arg_journal_uid = geteuid();
     }
 
+  if ( arg_queue_type == NULL )
+    {
+      arg_queue_type = strcmp(arg_proc_type, ARG_THREAD) == 0
+                     ? ARG_RING : KERNEL_QUEUE_TYPE;
+    }
+
   if ( arg_version )
     {
       printf("The packet journaller is a program for recording LWES\n"
@@ -270,6 +404,9 @@ int process_options(int argc, const char* argv[], FILE *log)
 #endif
 #if HAVE_SYS_MSG_H
              "msg "
+#endif
+#if HAVE_PTHREAD_H
+             "ring "
 #endif
              ";\n"
 
@@ -321,6 +458,37 @@ int process_options(int argc, const char* argv[], FILE *log)
               "  arg_ttl == %d\n"
               "  arg_journal_user == %s\n"
               "  arg_journal_uid == %d\n"
+              "  arg_stats_shm == %s\n"
+              "  arg_stats_socket == %s\n"
+              "  arg_metrics_port == %d\n"
+              "  arg_depth_interval == %d\n"
+              "  arg_tap_socket == %s\n"
+              "  arg_tap_buffer == %d\n"
+              "  arg_sender_rate == %d\n"
+              "  arg_sender_burst == %d\n"
+              "  arg_event_rate == %s\n"
+              "  arg_overflow_journal == %s\n"
+              "  arg_critical_events == %s\n"
+              "  arg_hugepages == %d\n"
+              "  arg_journal_buffer == %d\n"
+              "  arg_gz_level == %d\n"
+              "  arg_gz_strategy == %s\n"
+              "  arg_gz_adaptive_depth == %d\n"
+              "  arg_gz_burst_level == %d\n"
+              "  arg_journal_encoding == %s\n"
+              "  arg_journal_preallocate == %d\n"
+              "  arg_min_free_mb == %d\n"
+              "  arg_fallback_journal_dir == %s\n"
+              "  arg_journal_placement == %s\n"
+              "  arg_journal_stripe == %d\n"
+              "  arg_journal_cooldown == %d\n"
+              "  arg_journal_sync_mb == %d\n"
+              "  arg_journal_sync_ms == %d\n"
+              "  arg_serial_batch == %d\n"
+              "  arg_rotate_event_time == %d\n"
+              "  arg_journal_rotate_size == %d\n"
+              "  arg_journal_rotate_on_disk == %d\n"
+              "  arg_journal_rotate_count == %d\n"
 #ifdef HAVE_MONDEMAND
               "  arg_mondemand_host == %s\n"
               "  arg_mondemand_ip == %s\n"
@@ -351,7 +519,38 @@ int process_options(int argc, const char* argv[], FILE *log)
               arg_site,
               arg_ttl,
               arg_journal_user,
-              arg_journal_uid
+              arg_journal_uid,
+              arg_stats_shm,
+              arg_stats_socket,
+              arg_metrics_port,
+              arg_depth_interval,
+              arg_tap_socket,
+              arg_tap_buffer,
+              arg_sender_rate,
+              arg_sender_burst,
+              arg_event_rate,
+              arg_overflow_journal,
+              arg_critical_events,
+              arg_hugepages,
+              arg_journal_buffer,
+              arg_gz_level,
+              arg_gz_strategy,
+              arg_gz_adaptive_depth,
+              arg_gz_burst_level,
+              arg_journal_encoding,
+              arg_journal_preallocate,
+              arg_min_free_mb,
+              arg_fallback_journal_dir,
+              arg_journal_placement,
+              arg_journal_stripe,
+              arg_journal_cooldown,
+              arg_journal_sync_mb,
+              arg_journal_sync_ms,
+              arg_serial_batch,
+              arg_rotate_event_time,
+              arg_journal_rotate_size,
+              arg_journal_rotate_on_disk,
+              arg_journal_rotate_count
 #ifdef HAVE_MONDEMAND
              , arg_mondemand_host,
                arg_mondemand_ip,
@@ -407,6 +606,168 @@ int process_options(int argc, const char* argv[], FILE *log)
       ++bad_options;
     }
 
+  if ( arg_rotate_event_time && arg_journal_rotate_interval == 0 )
+    {
+      LOG_ER(log, "--rotate-on-event-time needs --journal-rotate-interval\n");
+      ++bad_options;
+    }
+
+  /* the lanes would reorder events across the interval boundaries */
+  if ( arg_rotate_event_time && arg_critical_events != NULL )
+    {
+      LOG_WARN(log, "--critical-event is ignored with "
+               "--rotate-on-event-time\n");
+    }
+
+  if ( arg_journal_rotate_size < 0 || arg_journal_rotate_count < 0 )
+    {
+      LOG_ER(log, "--journal-rotate-size and --journal-rotate-count should "
+             "not be negative\n");
+      ++bad_options;
+    }
+
+  if ( arg_journal_rotate_on_disk && arg_journal_rotate_size == 0 )
+    {
+      LOG_ER(log, "--journal-rotate-on-disk needs --journal-rotate-size\n");
+      ++bad_options;
+    }
+
+  /* journals are named by their interval, several in one would collide */
+  if ( arg_rotate_event_time
+       && (arg_journal_rotate_size > 0 || arg_journal_rotate_count > 0) )
+    {
+      LOG_ER(log, "--rotate-on-event-time can not be used with "
+             "--journal-rotate-size or --journal-rotate-count\n");
+      ++bad_options;
+    }
+
+  if ( arg_depth_interval <= 0 )
+    {
+      LOG_ER(log, "--depth-interval should be positive\n");
+      ++bad_options;
+    }
+
+  if ( arg_tap_buffer < 65536 )
+    {
+      LOG_ER(log, "--tap-buffer should be at least 65536\n");
+      ++bad_options;
+    }
+
+  if ( arg_sender_rate < 0 )
+    {
+      LOG_ER(log, "--sender-rate should not be negative\n");
+      ++bad_options;
+    }
+
+  if ( arg_sender_burst < 0 || arg_sender_burst > SHAPER_MAX_BURST )
+    {
+      LOG_ER(log, "--sender-burst should be between 0 and %d\n",
+             SHAPER_MAX_BURST);
+      ++bad_options;
+    }
+
+  if ( arg_journal_buffer < 0 )
+    {
+      LOG_ER(log, "--journal-buffer should not be negative\n");
+      ++bad_options;
+    }
+
+  if ( arg_gz_level < 1 || arg_gz_level > 9
+       || arg_gz_burst_level < 1 || arg_gz_burst_level > 9 )
+    {
+      LOG_ER(log, "--gz-level and --gz-burst-level should be between 1 and 9\n");
+      ++bad_options;
+    }
+
+  if (    strcmp(arg_gz_strategy, ARG_GZ_DEFAULT) != 0
+       && strcmp(arg_gz_strategy, ARG_GZ_FILTERED) != 0
+       && strcmp(arg_gz_strategy, ARG_GZ_HUFFMAN) != 0
+       && strcmp(arg_gz_strategy, ARG_GZ_RLE) != 0 )
+    {
+      LOG_ER(log, "unrecognized --gz-strategy \"%s\", try \"" ARG_GZ_DEFAULT
+             "\", \"" ARG_GZ_FILTERED "\", \"" ARG_GZ_HUFFMAN "\" or \""
+             ARG_GZ_RLE "\"\n", arg_gz_strategy);
+      ++bad_options;
+    }
+
+  if ( arg_gz_adaptive_depth < 0 )
+    {
+      LOG_ER(log, "--gz-adaptive-depth should not be negative\n");
+      ++bad_options;
+    }
+
+  if (    strcmp(arg_journal_encoding, ARG_ENC_RAW) != 0
+       && strcmp(arg_journal_encoding, ARG_ENC_DELTA) != 0 )
+    {
+      LOG_ER(log, "unrecognized --journal-encoding \"%s\", try \""
+             ARG_ENC_RAW "\" or \"" ARG_ENC_DELTA "\"\n",
+             arg_journal_encoding);
+      ++bad_options;
+    }
+
+  if ( arg_min_free_mb < 0 )
+    {
+      LOG_ER(log, "--min-free-mb should not be negative\n");
+      ++bad_options;
+    }
+
+  if ( arg_fallback_journal_dir && arg_min_free_mb == 0 )
+    {
+      LOG_ER(log, "--fallback-journal-dir is only used with --min-free-mb\n");
+      ++bad_options;
+    }
+
+  if (    strcmp(arg_journal_placement, ARG_PLACE_RR) != 0
+       && strcmp(arg_journal_placement, ARG_PLACE_SPACE) != 0
+       && strcmp(arg_journal_placement, ARG_PLACE_LATENCY) != 0 )
+    {
+      LOG_ER(log, "unrecognized --journal-placement \"%s\", try \""
+             ARG_PLACE_RR "\", \"" ARG_PLACE_SPACE "\" or \""
+             ARG_PLACE_LATENCY "\"\n", arg_journal_placement);
+      ++bad_options;
+    }
+
+  if ( arg_journal_stripe < 1 || arg_journal_stripe > arg_njournalls )
+    {
+      LOG_ER(log, "--journal-stripe should be between 1 and the number of "
+             "journals (%d)\n", arg_njournalls);
+      ++bad_options;
+    }
+
+  if ( arg_journal_cooldown < 0 )
+    {
+      LOG_ER(log, "--journal-cooldown should not be negative\n");
+      ++bad_options;
+    }
+
+  if ( arg_journal_sync_mb < 0 || arg_journal_sync_ms < 0 )
+    {
+      LOG_ER(log, "--journal-sync-mb and --journal-sync-ms should not be "
+             "negative\n");
+      ++bad_options;
+    }
+
+  if ( arg_serial_batch < 0 || arg_serial_batch > XPORT_BATCH_MAX )
+    {
+      LOG_ER(log, "--serial-batch should be between 0 and %d\n",
+             XPORT_BATCH_MAX);
+      ++bad_options;
+    }
+
+  if ( arg_metrics_port < 0 || arg_metrics_port > 65535 )
+    {
+      LOG_ER(log, "--metrics-port should be between 0 and 65535\n");
+      ++bad_options;
+    }
+
+  if ( strcmp(arg_queue_type, ARG_RING) == 0
+       && strcmp(arg_proc_type, ARG_THREAD) != 0 )
+    {
+      LOG_ER(log, "--queue-type " ARG_RING " only works with --thread-type "
+             ARG_THREAD "\n");
+      ++bad_options;
+    }
+
   if ( strcmp(arg_xport, "udp") != 0 )
     {
       LOG_ER(log, "unrecognized transport type \"%s\", try \"udp\"\n",
@@ -20,10 +20,15 @@ extern int            arg_args;
 extern char*          arg_basename;
 extern const char*    arg_interface;
 extern int            arg_queue_test_interval;
+extern int            arg_depth_interval;
 extern const char*    arg_ip;
 extern char**         arg_journalls;
 extern char*          arg_disk_journals[10];
 extern int            arg_journal_rotate_interval;
+extern int            arg_rotate_event_time;
+extern int            arg_journal_rotate_size;
+extern int            arg_journal_rotate_on_disk;
+extern int            arg_journal_rotate_count;
 extern char*          arg_journ_name;
 extern const char*    arg_journ_type;
 extern int            arg_log_level;
@@ -45,6 +50,32 @@ extern int            arg_journal_uid;
 extern int            arg_version;
 extern const char*    arg_xport;
 extern int            arg_wakeup_interval_ms;
+extern const char*    arg_stats_shm;
+extern const char*    arg_stats_socket;
+extern int            arg_metrics_port;
+extern const char*    arg_tap_socket;
+extern int            arg_tap_buffer;
+extern int            arg_sender_rate;
+extern int            arg_sender_burst;
+extern const char*    arg_event_rate;
+extern const char*    arg_overflow_journal;
+extern const char*    arg_critical_events;
+extern int            arg_hugepages;
+extern int            arg_journal_buffer;
+extern int            arg_gz_level;
+extern const char*    arg_gz_strategy;
+extern int            arg_gz_adaptive_depth;
+extern int            arg_gz_burst_level;
+extern const char*    arg_journal_encoding;
+extern int            arg_journal_preallocate;
+extern int            arg_min_free_mb;
+extern const char*    arg_fallback_journal_dir;
+extern const char*    arg_journal_placement;
+extern int            arg_journal_stripe;
+extern int            arg_journal_cooldown;
+extern int            arg_journal_sync_mb;
+extern int            arg_journal_sync_ms;
+extern int            arg_serial_batch;
 
 #ifdef HAVE_MONDEMAND
 extern const char*    arg_mondemand_host;
@@ -63,16 +94,37 @@ extern const char*    arg_mondemand_program_id;
 /* arg_queue_type: */
 #define ARG_MQ      "mq"
 #define ARG_MSG     "msg"
+#define ARG_RING    "ring"
 
 /* arg_journ_type: */
 #define ARG_GZ      "gz"
 #define ARG_FILE    "file"
+#define ARG_DZ      "dz"
+
+/* arg_gz_strategy: */
+#define ARG_GZ_DEFAULT  "default"
+#define ARG_GZ_FILTERED "filtered"
+#define ARG_GZ_HUFFMAN  "huffman"
+#define ARG_GZ_RLE      "rle"
+
+/* arg_journal_encoding: */
+#define ARG_ENC_RAW     "raw"
+#define ARG_ENC_DELTA   "delta"
+
+/* arg_journal_placement: */
+#define ARG_PLACE_RR      "rr"
+#define ARG_PLACE_SPACE   "space"
+#define ARG_PLACE_LATENCY "latency"
 
 /* arg_xport: */
 #define ARG_UDP     "udp"
 
 #define WAKEUP_MS   100
 
+/* With --rotate-on-event-time, how long past its end an interval's
+ * journal waits for its last events when no newer ones come. */
+#define EVENT_TIME_GRACE_MS 2000
+
 int process_options(int argc, const char* argv[], FILE *log);
 void options_destructor (void);
 
@@ -33,18 +33,57 @@
  *
  * close() -- closes a queue, return 0 on success, -1 on error
  *
- * read() -- reads "count" bytes from a queue into "buf", return the
- * number of bytes read on success, -1 on error
+ * read() -- reads "count" bytes from a queue into "buf", always from the
+ * highest priority lane with anything in it, return the number of bytes
+ * read on success, -1 on error
  *
- * write() -- writes "count" bytes from "buf" to a queue, return the
- * number of bytes written on success, -1 on error
+ * write() -- writes "count" bytes from "buf" to a queue on one of the
+ * priority lanes below, return the number of bytes written on success,
+ * -1 on error
  *
- * alloc() -- return a buffer suitable for use with read and write
+ * read_many() -- reads up to "n" messages into "msgs", waiting for
+ * the first one as read() does but not for the rest, return the number
+ * of messages read, or a negative value as read() does
+ *
+ * write_many() -- writes the "n" messages in "msgs", return the number
+ * of messages written, or a negative value as write() does if not even
+ * the first one could be written
+ *
+ * Queues which pass buffers rather than copy them may swap the "buf"s
+ * of the messages for other buffers from alloc() in both of these.
+ *
+ * depth() -- return the number of messages waiting in the queue, or a
+ * negative value on error.  This may cost a system call, so it is
+ * sampled on a timer rather than called for every message.
+ *
+ * alloc() -- return a buffer suitable for use with read and write, or
+ * NULL once a stage holds QUEUE_BATCH_MAX of them
  *
  * dealloc() -- free a buffer returned by alloc().
  *
  */
 
+/* Priority lanes: control events (rotations) overtake everything, so
+ * they act on time however deep the queue is, events named with
+ * --critical-event overtake the bulk of the traffic.  Order within a
+ * lane is kept.  With --rotate-on-event-time everything goes in the
+ * bulk lane, as journals are then cut in receipt order. */
+#define QUEUE_LANE_BULK     0
+#define QUEUE_LANE_CRITICAL 1
+#define QUEUE_LANE_CONTROL  2
+#define QUEUE_LANES         3
+
+/* Most messages per read_many() or write_many() call. */
+#define QUEUE_BATCH_MAX     32
+
+/* One message of a batch.  buf comes from alloc(), count is its size
+ * going into read_many() and the message length coming out of it. */
+struct queue_msg {
+  void*  buf;
+  size_t count;
+  int    lane;                  /* for write_many() */
+};
+
 struct queue;
 
 struct queue_vtbl {
@@ -53,8 +92,11 @@ struct queue_vtbl {
   int   (*open)         (struct queue* this_queue, int flags);
   int   (*close)        (struct queue* this_queue);
 
-  int   (*read)         (struct queue* this_queue, void* buf, size_t count, int* pending);
-  int   (*write)        (struct queue* this_queue, const void* buf, size_t count);
+  int   (*read)         (struct queue* this_queue, void* buf, size_t count);
+  int   (*write)        (struct queue* this_queue, const void* buf, size_t count, int lane);
+  int   (*read_many)    (struct queue* this_queue, struct queue_msg* msgs, int n);
+  int   (*write_many)   (struct queue* this_queue, struct queue_msg* msgs, int n);
+  int   (*depth)        (struct queue* this_queue);
 
   void* (*alloc)        (struct queue* this_queue, size_t* newcount);
   void  (*dealloc)      (struct queue* this_queue, void* buf);
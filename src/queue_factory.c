@@ -17,6 +17,7 @@
 
 #include "queue_msg.h"
 #include "queue_mqueue.h"
+#include "queue_ring.h"
 
 #include "log.h"
 #include "opt.h"
@@ -54,10 +55,23 @@ int queue_factory (struct queue* this_queue, FILE *log)
           LOG_INF(log, "Using POSIX mqueue.\n");
         }
     }
+  else if ( strcmp(arg_queue_type, ARG_RING) == 0 )
+    {
+      if ( queue_ring_ctor(this_queue, arg_queue_name,
+                           arg_queue_max_sz, arg_queue_max_cnt, log) < 0 )
+        {
+          LOG_ER(log, "Failed to set up the in-process queue.\n");
+          return -1;
+        }
+      else
+        {
+          LOG_INF(log, "Using in-process queue.\n");
+        }
+    }
   else
     {
-      LOG_ER(log, "Unrecognized queue type '%s', try \"" ARG_MSG "\" or "
-                   "\"" ARG_MQ "\".\n", arg_queue_type);
+      LOG_ER(log, "Unrecognized queue type '%s', try \"" ARG_MSG "\", "
+                   "\"" ARG_MQ "\" or \"" ARG_RING "\".\n", arg_queue_type);
       return -1;
     }
 
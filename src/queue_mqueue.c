@@ -16,6 +16,7 @@
 #include "queue.h"
 #include "queue_mqueue.h"
 
+#include "bufpool.h"
 #include "perror.h"
 #include "opt.h"
 #include "sig.h"
@@ -32,22 +33,19 @@
 #include <string.h>
 #include <time.h>
 
-/* The following is for Solaris. */
-#if !defined(MQ_PRIO_MAX) && defined(_POSIX_MQ_PRIO_MAX)
-#define MQ_PRIO_MAX _POSIX_MQ_PRIO_MAX
-#endif
-
 struct priv {
   char*         path;
   mqd_t         mq;
   size_t        max_sz;
   size_t        max_cnt;
+  struct bufpool* pool;         /* the stage's message buffers */
 };
 
 static void destructor (struct queue* this_queue)
 {
   struct priv* ppriv = (struct priv*)this_queue->priv;
 
+  bufpool_destroy (ppriv->pool);
   free (ppriv->path);
   free (ppriv);
 
@@ -107,11 +105,9 @@ static int xclose (struct queue* this_queue)
   return QUEUE_OK;
 }
 
-static int xread (struct queue* this_queue, void* buf,
-                  size_t count, int* pending)
+static int xread (struct queue* this_queue, void* buf, size_t count)
 {
   struct priv* ppriv = (struct priv*)this_queue->priv;
-  struct mq_attr attr;
   int mq_rec_rtrn;
   unsigned int pri;
 
@@ -147,14 +143,6 @@ static int xread (struct queue* this_queue, void* buf,
         }
     }
 
-  if ( mq_getattr (ppriv->mq, &attr) < 0 )
-    {
-      /* failed to get attributes */
-      return QUEUE_ERROR;
-    }
-
-  *pending = attr.mq_curmsgs;
-
   if (mq_rec_rtrn < 0)
     {
       return QUEUE_READ_ERROR;
@@ -165,7 +153,8 @@ static int xread (struct queue* this_queue, void* buf,
     }
 }
 
-static int xwrite (struct queue* this_queue, const void* buf, size_t count)
+static int xwrite (struct queue* this_queue, const void* buf, size_t count,
+                   int lane)
 {
   struct priv* ppriv = (struct priv*)this_queue->priv;
 
@@ -180,7 +169,9 @@ static int xwrite (struct queue* this_queue, const void* buf, size_t count)
       return QUEUE_CLOSED_ERROR;
     }
 
-  if ( 0 != mq_send (ppriv->mq, buf, count, MQ_PRIO_MAX-1) )
+  /* mq_receive() takes the oldest message of the highest priority, so
+   * the lane is the priority as it is. */
+  if ( 0 != mq_send (ppriv->mq, buf, count, lane) )
     {
       /* send error */
       return QUEUE_WRITE_ERROR;
@@ -189,17 +180,99 @@ static int xwrite (struct queue* this_queue, const void* buf, size_t count)
   return QUEUE_OK;
 }
 
+static int xread_many (struct queue* this_queue, struct queue_msg* msgs,
+                       int n)
+{
+  struct priv* ppriv = (struct priv*)this_queue->priv;
+  struct mq_attr attr;
+  struct timespec now = { 0, 0 };  /* long past, so never wait */
+  unsigned int pri;
+  int ret, i;
+
+  if ( (ret = xread (this_queue, msgs[0].buf, msgs[0].count)) < 0 )
+    {
+      return ret;
+    }
+  msgs[0].count = ret;
+
+  /* One mq_getattr() tells how many more there are, so the rest of the
+   * batch never waits, and nothing is asked for that isn't there. */
+  if ( n > 1 && mq_getattr (ppriv->mq, &attr) == 0 )
+    {
+      if ( attr.mq_curmsgs < n - 1 )
+        {
+          n = attr.mq_curmsgs + 1;
+        }
+    }
+  else
+    {
+      n = 1;
+    }
+
+  for ( i = 1; i < n; ++i )
+    {
+      if ( (ret = mq_timedreceive (ppriv->mq, msgs[i].buf, msgs[i].count,
+                                   &pri, &now)) < 0 )
+        {
+          break;
+        }
+      msgs[i].count = ret;
+    }
+
+  return i;
+}
+
+static int xwrite_many (struct queue* this_queue,
+                        struct queue_msg* msgs, int n)
+{
+  int ret, i;
+
+  for ( i = 0; i < n; ++i )
+    {
+      if ( (ret = xwrite (this_queue, msgs[i].buf, msgs[i].count,
+                          msgs[i].lane)) < 0 )
+        {
+          return i ? i : ret;
+        }
+    }
+
+  return n;
+}
+
+static int xdepth (struct queue* this_queue)
+{
+  struct priv* ppriv = (struct priv*)this_queue->priv;
+  struct mq_attr attr;
+
+  if ( (mqd_t)-1 == ppriv->mq )
+    {
+      return QUEUE_CLOSED_ERROR;
+    }
+  if ( mq_getattr (ppriv->mq, &attr) < 0 )
+    {
+      /* failed to get attributes */
+      return QUEUE_ERROR;
+    }
+
+  return attr.mq_curmsgs;
+}
+
 static void* alloc (struct queue* this_queue, size_t* newcount)
 {
-  void *data = malloc (*newcount = ((struct priv*)this_queue->priv)->max_sz);
-  memset(data, 0, *newcount);
+  struct priv* ppriv = (struct priv*)this_queue->priv;
+  void *data = bufpool_get (ppriv->pool);
+
+  *newcount = ppriv->max_sz;
+  if ( data )
+    {
+      memset(data, 0, *newcount);
+    }
   return data;
 }
 
 static void dealloc (struct queue* this_queue, void* buf)
 {
-  (void) this_queue; /* appease -Wall -Werror */
-  free (buf);
+  bufpool_release (((struct priv*)this_queue->priv)->pool, buf);
 }
 
 int queue_mqueue_ctor (struct queue* this_queue,
@@ -212,6 +285,7 @@ int queue_mqueue_ctor (struct queue* this_queue,
       destructor,
       xopen, xclose,
       xread, xwrite,
+      xread_many, xwrite_many, xdepth,
       alloc, dealloc
   };
 
@@ -241,6 +315,14 @@ int queue_mqueue_ctor (struct queue* this_queue,
   ppriv->max_sz = max_sz;
   ppriv->max_cnt = max_cnt;
 
+  /* One block for the buffers of a batch, huge pages with --hugepages. */
+  if ( 0 == (ppriv->pool = bufpool_create (QUEUE_BATCH_MAX, max_sz, log)) )
+    {
+      free(ppriv->path);
+      free(ppriv);
+      return QUEUE_MEM_ERROR;
+    }
+
   this_queue->vtbl = &vtbl;
   this_queue->priv = ppriv;
 
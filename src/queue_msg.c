@@ -16,6 +16,7 @@
 #include "queue.h"
 #include "queue_msg.h"
 
+#include "bufpool.h"
 #include "perror.h"
 
 #if HAVE_SYS_MSG_H
@@ -36,9 +37,13 @@ struct priv {
   size_t        max_sz;
   size_t        max_cnt;
   int           flags;
+  struct bufpool* pool;         /* the stage's message buffers */
 };
 
-#define MSG_TYPE 1  /* Must be positive non-zero. */
+/* Message types must be positive non-zero.  msgrcv() with a negative
+ * type takes the lowest type first, so the control lane gets 1 and the
+ * bulk lane QUEUE_LANES. */
+#define MSG_TYPE(lane)  (QUEUE_LANES - (lane))
 
 struct local_msgbuf {
   long mtype;    /* Type of received/sent message. */
@@ -55,6 +60,7 @@ static void destructor (struct queue* this_queue)
       msgctl (ppriv->mq, IPC_RMID, NULL); /* We ignore errors at this point. */
     }
 
+  bufpool_destroy (ppriv->pool);
   free (ppriv->path);
   free (ppriv);
 
@@ -137,13 +143,11 @@ static int xclose (struct queue* this_queue)
   return QUEUE_OK;
 }
 
-static int xread (struct queue* this_queue, void* buf,
-                  size_t count, int* pending)
+static int xread (struct queue* this_queue, void* buf, size_t count)
 {
   struct priv* ppriv = (struct priv*)this_queue->priv;
 
   struct local_msgbuf* mp;
-  struct msqid_ds ds;
   int msgrcv_ret;
 
   if ( 0 == buf )
@@ -171,7 +175,8 @@ static int xread (struct queue* this_queue, void* buf,
   mp = (struct local_msgbuf*)(((char*)buf) - sizeof(mp->mtype));
 
   /* Receive bytes. */
-  if ( (msgrcv_ret = msgrcv(ppriv->mq, mp, count, MSG_TYPE, 0)) < 0 )
+  if ( (msgrcv_ret = msgrcv(ppriv->mq, mp, count,
+                            -MSG_TYPE(QUEUE_LANE_BULK), 0)) < 0 )
     {
       switch ( errno )
         {
@@ -187,13 +192,6 @@ static int xread (struct queue* this_queue, void* buf,
         }
     }
 
-  if ( msgctl(ppriv->mq, IPC_STAT, &ds) )
-    {
-      return QUEUE_ERROR;
-    }
-
-  *pending =  ds.msg_qnum;
-
   if ( msgrcv_ret < 0 )
     {
       return QUEUE_READ_ERROR;
@@ -204,7 +202,8 @@ static int xread (struct queue* this_queue, void* buf,
     }
 }
 
-static int xwrite (struct queue* this_queue, const void* buf, size_t count)
+static int xwrite (struct queue* this_queue, const void* buf, size_t count,
+                   int lane)
 {
   int retry = 99;
   struct priv* ppriv = (struct priv*)this_queue->priv;
@@ -236,7 +235,7 @@ static int xwrite (struct queue* this_queue, const void* buf, size_t count)
 
   mp = (struct local_msgbuf*)(((char*)buf) - sizeof(mp->mtype));
 
-  mp->mtype = MSG_TYPE;  /* Must be positive non-zero. */
+  mp->mtype = MSG_TYPE(lane);
 
   while ( ((msgsnd_ret = msgsnd(ppriv->mq, mp, count, IPC_NOWAIT)) < 0)
           && retry )
@@ -272,11 +271,75 @@ static int xwrite (struct queue* this_queue, const void* buf, size_t count)
     }
 }
 
+static int xread_many (struct queue* this_queue, struct queue_msg* msgs,
+                       int n)
+{
+  struct priv* ppriv = (struct priv*)this_queue->priv;
+  int ret, i;
+
+  if ( (ret = xread (this_queue, msgs[0].buf, msgs[0].count)) < 0 )
+    {
+      return ret;
+    }
+  msgs[0].count = ret;
+
+  /* The rest of the batch only if it is already there. */
+  for ( i = 1; i < n; ++i )
+    {
+      struct local_msgbuf* mp =
+        (struct local_msgbuf*)(((char*)msgs[i].buf) - sizeof(mp->mtype));
+
+      if ( msgs[i].count > ppriv->max_sz
+           || (ret = msgrcv(ppriv->mq, mp, msgs[i].count,
+                            -MSG_TYPE(QUEUE_LANE_BULK), IPC_NOWAIT)) < 0 )
+        {
+          break;
+        }
+      msgs[i].count = ret;
+    }
+
+  return i;
+}
+
+static int xwrite_many (struct queue* this_queue,
+                        struct queue_msg* msgs, int n)
+{
+  int ret, i;
+
+  for ( i = 0; i < n; ++i )
+    {
+      if ( (ret = xwrite (this_queue, msgs[i].buf, msgs[i].count,
+                          msgs[i].lane)) < 0 )
+        {
+          return i ? i : ret;
+        }
+    }
+
+  return n;
+}
+
+static int xdepth (struct queue* this_queue)
+{
+  struct priv* ppriv = (struct priv*)this_queue->priv;
+  struct msqid_ds ds;
+
+  if ( -1 == ppriv->mq )
+    {
+      return QUEUE_CLOSED_ERROR;
+    }
+  if ( msgctl(ppriv->mq, IPC_STAT, &ds) )
+    {
+      return QUEUE_ERROR;
+    }
+
+  return ds.msg_qnum;
+}
+
 static void* alloc (struct queue* this_queue, size_t* newcount)
 {
   struct local_msgbuf* mp;
   struct priv* ppriv = (struct priv*)this_queue->priv;
-  char* ret = (char*)malloc(ppriv->max_sz + sizeof(mp->mtype));
+  char* ret = (char*)bufpool_get(ppriv->pool);
 
   if ( ret )
     {
@@ -291,8 +354,7 @@ static void dealloc (struct queue* this_queue, void* buf)
 {
   struct local_msgbuf* mp =
     (struct local_msgbuf*)((char*)buf - sizeof(mp->mtype));
-  (void)this_queue; /* appease -Wall -Werror */
-  free(mp);
+  bufpool_release(((struct priv*)this_queue->priv)->pool, mp);
 }
 
 int queue_msg_ctor (struct queue* this_queue,
@@ -305,6 +367,7 @@ int queue_msg_ctor (struct queue* this_queue,
       destructor,
       xopen, xclose,
       xread, xwrite,
+      xread_many, xwrite_many, xdepth,
       alloc, dealloc
   };
 
@@ -341,6 +404,17 @@ int queue_msg_ctor (struct queue* this_queue,
   ppriv->max_sz = max_sz;
   ppriv->max_cnt = max_cnt;
 
+  /* One block for the buffers of a batch, huge pages with --hugepages. */
+  ppriv->pool = bufpool_create(QUEUE_BATCH_MAX,
+                               max_sz + sizeof(((struct local_msgbuf*)0)->mtype),
+                               log);
+  if ( 0 == ppriv->pool )
+    {
+      free(ppriv->path);
+      free(ppriv);
+      return QUEUE_MEM_ERROR;
+    }
+
   this_queue->vtbl = &vtbl;
   this_queue->priv = ppriv;
 
@@ -0,0 +1,447 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#include "config.h"
+
+#include "queue.h"
+#include "queue_ring.h"
+
+#include "log.h"
+#include "opt.h"
+#include "sig.h"
+
+#if HAVE_PTHREAD_H
+
+#include "bufpool.h"
+#include "ringbuf.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* What goes through a lane. */
+struct entry {
+  uint32_t      handle;
+  uint32_t      count;
+};
+
+struct ring {
+  pthread_mutex_t   lock;
+  pthread_cond_t    ready;          /* the reader waits for messages */
+  pthread_cond_t    space;          /* the writer waits for slots */
+  int               reader_waiting;
+  int               writer_waiting;
+
+  struct bufpool*   pool;           /* slots are only taken under lock */
+  size_t            max_sz;
+  ringbuf*          lane[QUEUE_LANES];
+  int               depth;
+  int               users;
+};
+
+static struct ring*     shared = NULL;
+static pthread_mutex_t  shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ring_free (struct ring *r)
+{
+  int l;
+
+  for ( l = 0; l < QUEUE_LANES; ++l )
+    {
+      if ( r->lane[l] != NULL )
+        {
+          ringbuf_free (r->lane[l]);
+        }
+    }
+  bufpool_destroy (r->pool);
+  pthread_cond_destroy (&r->ready);
+  pthread_cond_destroy (&r->space);
+  pthread_mutex_destroy (&r->lock);
+  free (r);
+}
+
+static struct ring* ring_new (size_t max_sz, size_t max_cnt, FILE *log)
+{
+  /* the batches both threads hold, and one to swap in */
+  size_t slots = max_cnt + 2 * QUEUE_BATCH_MAX + 1;
+  struct ring *r;
+  int l;
+
+  r = (struct ring *) calloc (1, sizeof (*r));
+  if ( r == NULL )
+    {
+      LOG_ER (log, "Failed to allocate %d bytes for queue data\n",
+              sizeof (*r));
+      return NULL;
+    }
+  pthread_mutex_init (&r->lock, NULL);
+  pthread_cond_init (&r->ready, NULL);
+  pthread_cond_init (&r->space, NULL);
+  r->max_sz = max_sz;
+
+  if ( (r->pool = bufpool_create (slots, max_sz, log)) == NULL )
+    {
+      ring_free (r);
+      return NULL;
+    }
+
+  /* A lane can hold every slot, so putting a handle never fails. */
+  for ( l = 0; l < QUEUE_LANES; ++l )
+    {
+      if ( (r->lane[l] = ringbuf_new (slots * sizeof (struct entry))) == NULL )
+        {
+          ring_free (r);
+          return NULL;
+        }
+    }
+
+  return r;
+}
+
+static void deadline (struct timespec *ts)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  ts->tv_sec = tv.tv_sec + arg_wakeup_interval_ms / 1000;
+  ts->tv_nsec = tv.tv_usec * 1000 + arg_wakeup_interval_ms % 1000 * 1000000;
+  if ( ts->tv_nsec >= 1000000000 )
+    {
+      ts->tv_sec += 1;
+      ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Under lock.  Waits for a slot while the pool is empty, NULL if it
+ * is still empty after a wakeup interval. */
+static void* take_slot (struct ring *r)
+{
+  void *slot = bufpool_get (r->pool);
+
+  if ( slot == NULL )
+    {
+      struct timespec ts;
+
+      deadline (&ts);
+      r->writer_waiting = 1;
+      while ( (slot = bufpool_get (r->pool)) == NULL
+              && pthread_cond_timedwait (&r->space, &r->lock, &ts) == 0 )
+        ;
+      r->writer_waiting = 0;
+    }
+  return slot;
+}
+
+/* Under lock. */
+static void release_slot (struct ring *r, void *slot)
+{
+  bufpool_release (r->pool, slot);
+  if ( r->writer_waiting )
+    {
+      pthread_cond_signal (&r->space);
+    }
+}
+
+static int put (struct ring *r, struct queue_msg *msgs, int n, int copy)
+{
+  int i;
+
+  pthread_mutex_lock (&r->lock);
+  for ( i = 0; i < n; ++i )
+    {
+      struct entry e;
+      int lane = msgs[i].lane;
+      void *slot;
+
+      if ( msgs[i].buf == NULL || msgs[i].count > r->max_sz )
+        {
+          break;
+        }
+      if ( (slot = take_slot (r)) == NULL )
+        {
+          break;
+        }
+
+      if ( copy || ! bufpool_owns (r->pool, msgs[i].buf) )
+        {
+          memcpy (slot, msgs[i].buf, msgs[i].count);
+          e.handle = bufpool_handle (r->pool, slot);
+        }
+      else
+        {
+          /* the message stays where it is, the caller gets a new slot */
+          e.handle = bufpool_handle (r->pool, msgs[i].buf);
+          msgs[i].buf = slot;
+        }
+      e.count = msgs[i].count;
+
+      if ( lane < 0 || lane >= QUEUE_LANES )
+        {
+          lane = QUEUE_LANE_BULK;
+        }
+      ringbuf_put (r->lane[lane], &e, sizeof (e));
+      ++r->depth;
+    }
+  if ( i > 0 && r->reader_waiting )
+    {
+      pthread_cond_signal (&r->ready);
+    }
+  pthread_mutex_unlock (&r->lock);
+
+  return i ? i : QUEUE_WRITE_ERROR;
+}
+
+static int get (struct ring *r, struct queue_msg *msgs, int n, int copy)
+{
+  int lane = QUEUE_LANES - 1;
+  int i = 0;
+
+  pthread_mutex_lock (&r->lock);
+  if ( r->depth == 0 )
+    {
+      struct timespec ts;
+
+      deadline (&ts);
+      r->reader_waiting = 1;
+      while ( r->depth == 0 && ! gbl_done
+              && pthread_cond_timedwait (&r->ready, &r->lock, &ts) == 0 )
+        ;
+      r->reader_waiting = 0;
+      if ( r->depth == 0 )
+        {
+          pthread_mutex_unlock (&r->lock);
+          return QUEUE_INTR;
+        }
+    }
+
+  /* Highest lane first, each lane in order. */
+  while ( i < n && lane >= 0 )
+    {
+      struct entry e;
+      char *data;
+      void *slot;
+
+      if ( ringbuf_get_next_chunk (r->lane[lane], &data) == 0 )
+        {
+          --lane;
+          continue;
+        }
+      /* lanes hold whole entries, they never wrap in the middle of one */
+      memcpy (&e, data, sizeof (e));
+      ringbuf_mark_consumed (r->lane[lane], sizeof (e));
+      --r->depth;
+
+      slot = bufpool_buf (r->pool, e.handle);
+      if ( copy || ! bufpool_owns (r->pool, msgs[i].buf) )
+        {
+          if ( e.count > msgs[i].count )
+            {
+              e.count = msgs[i].count;
+            }
+          memcpy (msgs[i].buf, slot, e.count);
+          release_slot (r, slot);
+        }
+      else
+        {
+          /* give back the one returned last time */
+          release_slot (r, msgs[i].buf);
+          msgs[i].buf = slot;
+        }
+      msgs[i].count = e.count;
+      ++i;
+    }
+  pthread_mutex_unlock (&r->lock);
+
+  return i;
+}
+
+static void destructor (struct queue* this_queue)
+{
+  struct ring *r = (struct ring *)this_queue->priv;
+
+  pthread_mutex_lock (&shared_lock);
+  if ( --r->users == 0 )
+    {
+      ring_free (r);
+      shared = NULL;
+    }
+  pthread_mutex_unlock (&shared_lock);
+
+  this_queue->vtbl = 0;
+  this_queue->priv = 0;
+}
+
+static int xopen (struct queue* this_queue, int flags)
+{
+  (void) this_queue; /* appease -Wall -Werror */
+  (void) flags;      /* appease -Wall -Werror */
+
+  return QUEUE_OK;
+}
+
+static int xclose (struct queue* this_queue)
+{
+  (void) this_queue; /* appease -Wall -Werror */
+
+  return QUEUE_OK;
+}
+
+static int xread (struct queue* this_queue, void* buf, size_t count)
+{
+  struct queue_msg m;
+  int ret;
+
+  if ( 0 == buf )
+    {
+      /* empty buffer */
+      return QUEUE_MEM_ERROR;
+    }
+
+  m.buf = buf;
+  m.count = count;
+  if ( (ret = get ((struct ring *)this_queue->priv, &m, 1, 1)) < 0 )
+    {
+      return ret;
+    }
+  return m.count;
+}
+
+static int xwrite (struct queue* this_queue, const void* buf, size_t count,
+                   int lane)
+{
+  struct queue_msg m;
+
+  if ( 0 == buf )
+    {
+      /* empty buffer */
+      return QUEUE_MEM_ERROR;
+    }
+
+  m.buf = (void *)buf;
+  m.count = count;
+  m.lane = lane;
+  if ( put ((struct ring *)this_queue->priv, &m, 1, 1) < 0 )
+    {
+      return QUEUE_WRITE_ERROR;
+    }
+  return QUEUE_OK;
+}
+
+static int xread_many (struct queue* this_queue, struct queue_msg* msgs,
+                       int n)
+{
+  return get ((struct ring *)this_queue->priv, msgs, n, 0);
+}
+
+static int xwrite_many (struct queue* this_queue, struct queue_msg* msgs,
+                        int n)
+{
+  return put ((struct ring *)this_queue->priv, msgs, n, 0);
+}
+
+static int xdepth (struct queue* this_queue)
+{
+  struct ring *r = (struct ring *)this_queue->priv;
+  int depth;
+
+  pthread_mutex_lock (&r->lock);
+  depth = r->depth;
+  pthread_mutex_unlock (&r->lock);
+
+  return depth;
+}
+
+static void* alloc (struct queue* this_queue, size_t* newcount)
+{
+  struct ring *r = (struct ring *)this_queue->priv;
+  void *data;
+
+  pthread_mutex_lock (&r->lock);
+  data = bufpool_get (r->pool);
+  pthread_mutex_unlock (&r->lock);
+
+  *newcount = r->max_sz;
+  if ( data != NULL )
+    {
+      memset (data, 0, *newcount);
+    }
+  return data;
+}
+
+static void dealloc (struct queue* this_queue, void* buf)
+{
+  struct ring *r = (struct ring *)this_queue->priv;
+
+  if ( buf != NULL )
+    {
+      pthread_mutex_lock (&r->lock);
+      release_slot (r, buf);
+      pthread_mutex_unlock (&r->lock);
+    }
+}
+
+int queue_ring_ctor (struct queue* this_queue,
+                     const char*   path,
+                     size_t        max_sz,
+                     size_t        max_cnt,
+                     FILE *        log)
+{
+  static struct queue_vtbl vtbl = {
+      destructor,
+      xopen, xclose,
+      xread, xwrite,
+      xread_many, xwrite_many, xdepth,
+      alloc, dealloc
+  };
+
+  (void) path; /* appease -Wall -Werror */
+
+  this_queue->vtbl = 0;
+  this_queue->priv = 0;
+
+  pthread_mutex_lock (&shared_lock);
+  if ( shared == NULL && (shared = ring_new (max_sz, max_cnt, log)) == NULL )
+    {
+      pthread_mutex_unlock (&shared_lock);
+      return QUEUE_MEM_ERROR;
+    }
+  ++shared->users;
+  this_queue->priv = shared;
+  pthread_mutex_unlock (&shared_lock);
+
+  this_queue->vtbl = &vtbl;
+
+  return QUEUE_OK;
+}
+
+#else  /* if HAVE_PTHREAD_H */
+
+int queue_ring_ctor (struct queue* this_queue,
+                     const char*   path,
+                     size_t        max_sz,
+                     size_t        max_cnt,
+                     FILE *        log)
+{
+  this_queue->vtbl = 0;
+  this_queue->priv = 0;
+  (void)path;     /* appease -Wall -Werror */
+  (void)max_sz;   /* appease -Wall -Werror */
+  (void)max_cnt;  /* appease -Wall -Werror */
+  (void)log;      /* appease -Wall -Werror */
+
+  return QUEUE_ERROR;
+}
+
+#endif /* HAVE_PTHREAD_H */
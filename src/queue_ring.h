@@ -0,0 +1,39 @@
+/*======================================================================*
+ * Copyright (c) 2008, Yahoo! Inc. All rights reserved.                 *
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#ifndef QUEUE_RING_DOT_H
+#define QUEUE_RING_DOT_H
+
+#include <stdio.h>
+
+/* In-process queue for the thread model.
+ *
+ * Messages live in slots of a buffer pool (see bufpool.h), and only
+ * slot handles go through the queue, so an event is copied once, into
+ * the slot it is received in, and read by the journal writer where it
+ * is.  write_many() takes the slots of the batch and hands back fresh
+ * ones, read_many() hands out the slots of the messages and takes back
+ * the ones it returned last time.  read() and write() copy.
+ *
+ * All the queue objects of a process share one queue; the pool has
+ * room for "max_cnt" messages waiting plus the batches in the hands of
+ * the two threads, a writer blocks while it is empty.
+ */
+
+int queue_ring_ctor (struct queue* this_queue,
+                     const char*   path,
+                     size_t        max_sz,
+                     size_t        max_cnt,
+                     FILE *        log);
+
+#endif /* QUEUE_RING_DOT_H */
@@ -16,11 +16,13 @@
 #include "queue_to_journal.h"
 
 #include "journal.h"
+#include "journal_place.h"
 #include "log.h"
 #include "opt.h"
 #include "queue.h"
 #include "sig.h"
 #include "stats.h"
+#include "tap.h"
 #include "perror.h"
 #include "xport.h"
 #include "stats.h"
@@ -30,45 +32,211 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 struct dequeuer_stats dst ;
 
-static int rotate(struct journal* jrn, int jcurr, FILE *log)
+/* --rotate-on-event-time: start of the interval being journalled, 0
+ * before the first event, and whether its journals were closed for
+ * want of newer events. */
+static time_t interval = 0;
+static int    idle = 0;
+
+/* Every journal of the stripe is closed before any is picked again,
+ * so with one journal it is reopened and with --journal-stripe of all
+ * of them each goes on in turn. */
+static void rotate(struct journal_place* place, int* stripe, FILE *log)
 {
   unsigned long long t0 = millis_now (), t1;
+  int k;
 
-  if ( jrn[jcurr].vtbl->close(&jrn[jcurr], log) < 0 )
+  for ( k = 0; k < arg_journal_stripe; ++k )
     {
-      LOG_ER(log, "Can't close journal  \"%s\".\n", arg_journalls[jcurr]);
-      exit(EXIT_FAILURE);
+      if ( stripe[k] >= 0 )
+        {
+          journal_place_close(place, stripe[k], log);
+        }
     }
-
-  jcurr = (jcurr + 1) % arg_njournalls;
-
-  if ( jrn[jcurr].vtbl->open(&jrn[jcurr], O_WRONLY, log) < 0 )
+  for ( k = 0; k < arg_journal_stripe; ++k )
     {
-      LOG_ER(log, "Failed to open the journal \"%s\".\n", arg_journalls[jcurr]);
-      exit(EXIT_FAILURE);
+      if ( (stripe[k] = journal_place_open(place, log)) < 0 )
+        {
+          LOG_ER(log, "No journal could be opened, events are lost until "
+                 "one can be.\n");
+        }
     }
 
   t1 = millis_now ();
+  dequeuer_stats_record_rotation (&dst, t1-t0);
   LOG_INF(log, "Rotated in %0.2f seconds\n", (t1-t0)/1000000.);
+}
+
+/* Where the current interval ends, and the next one begins. */
+static time_t interval_next(void)
+{
+  return interval_end(interval, arg_journal_rotate_interval);
+}
+
+/* The interval for an event received at receipt: never one before the
+ * current, where a clock stepping back would put it, and past the
+ * current once that was closed, as the event is too late for it. */
+static time_t event_interval(unsigned long long receipt)
+{
+  time_t t = interval_start(receipt, arg_journal_rotate_interval);
+
+  if ( t < interval )
+    {
+      t = interval;
+    }
+  if ( idle && t == interval )
+    {
+      t = interval_end(t, arg_journal_rotate_interval);
+    }
+  return t;
+}
+
+/* Closes the journals of the interval, named for it up to end, and
+ * opens those of the next unless idle. */
+static void close_interval(struct journal_place* place, int* stripe,
+                           time_t end, FILE *log)
+{
+  int k;
+
+  for ( k = 0; k < arg_journal_stripe; ++k )
+    {
+      if ( stripe[k] >= 0 )
+        {
+          struct journal* jrn = &place->jrn[stripe[k]];
+          jrn->vtbl->set_range(jrn, interval, end);
+        }
+    }
+
+  if ( gbl_done )
+    {
+      return;
+    }
+
+  dequeuer_stats_rotate(&dst, log);
+  dequeuer_stats_flush (&dst);
+  if ( ! idle )
+    {
+      LOG_INF(log, "About to rotate journal for the interval from %ld.\n",
+              (long)interval);
+      rotate(place, stripe, log);
+      return;
+    }
+
+  LOG_INF(log, "No events past the interval from %ld, closing its "
+          "journal.\n", (long)interval);
+  for ( k = 0; k < arg_journal_stripe; ++k )
+    {
+      if ( stripe[k] >= 0 )
+        {
+          journal_place_close(place, stripe[k], log);
+          stripe[k] = -1;
+        }
+    }
+}
+
+/* Whether --journal-rotate-size or --journal-rotate-count is reached,
+ * by any journal of the stripe for the size, by them all together for
+ * the count. */
+static int rotation_due(struct journal_place* place, int* stripe, FILE *log)
+{
+  int k;
+
+  if ( arg_journal_rotate_count > 0
+       && dst.packets_written_since_last_rotate >= arg_journal_rotate_count )
+    {
+      LOG_INF(log, "Journal holds %lld events, rotating.\n",
+              dst.packets_written_since_last_rotate);
+      return 1;
+    }
+  if ( arg_journal_rotate_size == 0 )
+    {
+      return 0;
+    }
+  for ( k = 0; k < arg_journal_stripe; ++k )
+    {
+      if ( stripe[k] >= 0 )
+        {
+          struct journal* jrn = &place->jrn[stripe[k]];
+          long long size = jrn->vtbl->written(jrn, arg_journal_rotate_on_disk);
 
-  return jcurr;
+          if ( size >= arg_journal_rotate_size * 1024LL * 1024LL )
+            {
+              LOG_INF(log, "Journal holds %lld bytes%s, rotating.\n", size,
+                      arg_journal_rotate_on_disk ? " on disk" : "");
+              return 1;
+            }
+        }
+    }
+  return 0;
+}
+
+/* Events the journals took, then lost when they were closed. */
+static void count_lost(struct journal_place* place)
+{
+  if ( place->lost > 0 )
+    {
+      dequeuer_stats_record_loss(&dst, place->lost);
+      place->lost = 0;
+    }
+}
+
+/* Writes to the journal of stripe k.  Should that fail the journal is
+ * left out and the write goes once more to another one. */
+static int write_stripe(struct journal_place* place, int* stripe, int k,
+                        void* buf, int len, FILE *log)
+{
+  int attempt;
+  int ret = -1;
+
+  for ( attempt = 0; attempt < 2 && ret != len; ++attempt )
+    {
+      struct timeval t0, t1;
+      int j = stripe[k];
+
+      if ( j < 0 && (j = stripe[k] = journal_place_open(place, log)) < 0 )
+        {
+          break;
+        }
+
+      micro_now (&t0);
+      ret = place->jrn[j].vtbl->write(&place->jrn[j], buf, len);
+      micro_now (&t1);
+
+      if ( ret == len )
+        {
+          journal_place_record(place, j, len, micro_timediff(&t0, &t1));
+        }
+      else
+        {
+          journal_place_failed(place, j, log);
+          stripe[k] = -1;
+        }
+    }
+  return ret;
 }
 
 int queue_to_journal(FILE *log)
 {
   struct queue que;
   struct journal* jrn;
+  struct journal_place place;
+  int* stripe;
   int jc;
-  int jcurr = 0;
+  int k = 0;
+  struct queue_msg msgs[QUEUE_BATCH_MAX];
   void* buf = NULL ;
   size_t bufsiz;
   int pending = 0;
+  int batch = 1;
+  int i;
   unsigned long long t0, receive_time, max_receive_time=0,
-      total_receive_time=0, write_time, max_write_time=0, total_write_time=0;
+      total_receive_time=0, write_time, max_write_time=0, total_write_time=0,
+      now, receipt, depth_due = 0;
 
   dequeuer_stats_ctor(&dst);
 
@@ -98,44 +266,115 @@ int queue_to_journal(FILE *log)
         }
     }
 
-  if ( jrn[jcurr].vtbl->open(&jrn[jcurr], O_WRONLY, log) < 0 )
+  stripe = (int*)malloc(arg_journal_stripe * sizeof(int));
+  if ( 0 == stripe || journal_place_init(&place, jrn, arg_njournalls, log) < 0 )
     {
-      LOG_ER(log, "Failed to open the journal \"%s\".\n",
-             arg_journalls[jcurr]);
+      LOG_ER(log, "Failed to allocate space for journal placement.\n");
       exit(EXIT_FAILURE);
     }
 
-  buf = que.vtbl->alloc(&que, &bufsiz);
-  if ( NULL == buf )
+  /* Going on with some of the journals beats not starting at all. */
+  for ( k = 0, jc = 0; k < arg_journal_stripe; ++k )
+    {
+      if ( (stripe[k] = journal_place_open(&place, log)) >= 0 )
+        {
+          ++jc;
+        }
+    }
+  if ( jc == 0 )
     {
-      LOG_ER(log, "unable to allocate %d bytes for message buffer.\n", bufsiz);
+      LOG_ER(log, "Failed to open any of the journals.\n");
       exit(EXIT_FAILURE);
     }
-  memset(buf, 0, bufsiz);
+  k = 0;
 
-  /* Read a packet from the queue, write it to the journal. */
+  for ( i = 0; i < QUEUE_BATCH_MAX; ++i )
+    {
+      msgs[i].buf = que.vtbl->alloc(&que, &bufsiz);
+      if ( NULL == msgs[i].buf )
+        {
+          LOG_ER(log, "unable to allocate %d bytes for message buffer.\n",
+                 bufsiz);
+          exit(EXIT_FAILURE);
+        }
+      memset(msgs[i].buf, 0, bufsiz);
+    }
+
+  tap_start(log);
+
+  /* Read a batch of packets from the queue, write them to the journal. */
   while ( ! gbl_done )
     {
-      int que_read_ret;
-      int jrn_write_ret;
+      int nread;
 
-      /* 0 out part of the the event name so if we get a rotate event
+      count_lost(&place);
+
+      /* 0 out part of the the event names so if we get a rotate event
        * the program will not continually rotate */
-      memset(buf, 0, HEADER_LENGTH+20);
+      for ( i = 0; i < batch; ++i )
+        {
+          memset(msgs[i].buf, 0, HEADER_LENGTH+20);
+          msgs[i].count = bufsiz;
+        }
 
       t0 = millis_now ();
-      que_read_ret = que.vtbl->read(&que, buf, bufsiz, &pending);
-      if (que_read_ret >= 0)
+      nread = que.vtbl->read_many(&que, msgs, batch);
+      now = millis_now ();
+
+      /* The depth is sampled rather than asked for with every read,
+       * which would double the system calls per message.  It also sets
+       * the batch size: single reads while the queue is about empty,
+       * where a batch would only cost an extra system call, batches of
+       * up to what is waiting once it backs up. */
+      if ( now >= depth_due )
+        {
+          int depth = que.vtbl->depth(&que);
+          if ( depth >= 0 )
+            {
+              pending = depth;
+              dequeuer_stats_record_depth(&dst, pending);
+              /* an interval is closed once nothing newer turns up and
+               * those of its events which were received are written */
+              if ( arg_rotate_event_time && ! idle && interval != 0
+                   && pending == 0
+                   && now >= interval_next() * 1000ULL + EVENT_TIME_GRACE_MS )
+                {
+                  idle = 1;
+                  close_interval(&place, stripe, interval_next(), log);
+                }
+              for ( jc = 0; jc < arg_journal_stripe; ++jc )
+                {
+                  if ( stripe[jc] < 0 )
+                    {
+                      if ( ! idle )
+                        {
+                          stripe[jc] = journal_place_open(&place, log);
+                        }
+                    }
+                  else
+                    {
+                      jrn[stripe[jc]].vtbl->backlog(&jrn[stripe[jc]],
+                                                   pending, log);
+                    }
+                }
+              batch = pending < 2 ? 1
+                    : pending < QUEUE_BATCH_MAX ? pending : QUEUE_BATCH_MAX;
+            }
+          depth_due = now + arg_depth_interval;
+        }
+
+      if (nread > 0)
         {
-          receive_time = millis_now () - t0;
+          receive_time = now - t0;
           max_receive_time =
             max_receive_time < receive_time ? receive_time : max_receive_time;
           total_receive_time += receive_time;
-          dequeuer_stats_record(&dst, que_read_ret-HEADER_LENGTH, pending);
         }
-      else if (que_read_ret == QUEUE_INTR )
+      else if (nread == QUEUE_INTR )
         {
-          /* ignore expected interrupts */
+          /* ignore expected interrupts, but still look for rotations and
+           * shutdown below */
+          nread = 0;
         }
       else
         {
@@ -143,88 +382,176 @@ int queue_to_journal(FILE *log)
           continue; /* no event, so do not process the rest */
         }
 
-      // is this a command event?
-      if ( header_is_rotate(buf) || gbl_rotate_dequeue || gbl_done )
+      /* an interrupted read goes through once, without a message */
+      for ( i = 0; i < nread || (i == 0 && nread == 0); ++i )
         {
-          if (header_is_rotate (buf))
+          int que_read_ret = nread ? (int)msgs[i].count : QUEUE_INTR;
+          int jrn_write_ret;
+          int last = nread == 0 || i == nread - 1;
+
+          buf = msgs[i].buf;
+          if (que_read_ret >= 0)
             {
-              // is it a new enough Command::Rotate, or masked out?
-              memcpy(&dst.latest_rotate_header, buf, HEADER_LENGTH);
-              dst.rotation_type = LJ_RT_EVENT;
+              dequeuer_stats_record(&dst, que_read_ret-HEADER_LENGTH, pending);
             }
 
-          /* if we are shutting down the destructor will flush stats,
-           * so skip so we don't get duplicate events sent to mondemand
-           * if it is enabled, it will also rotate in the journal destructor
-           * so rotate here as well.
-           */
-          if (! gbl_done )
+          /* Journals are cut where an event starts a new interval, the
+           * interval timer, SIGHUP and Command::Rotate cut nothing. */
+          if ( arg_rotate_event_time )
             {
-              dequeuer_stats_rotate(&dst, log);
-              dequeuer_stats_flush (&dst);
-              LOG_INF(log, "About to rotate journal (%d pending).\n", pending);
-              jcurr = rotate(jrn,jcurr,log);
+              if ( que_read_ret >= 0 )
+                {
+                  time_t t = event_interval(header_receipt_time (buf));
+
+                  if ( t != interval && interval != 0 )
+                    {
+                      if ( idle )
+                        {
+                          rotate(&place, stripe, log);
+                          idle = 0;
+                        }
+                      else
+                        {
+                          close_interval(&place, stripe, interval_next(),
+                                         log);
+                        }
+                    }
+                  interval = t;
+                }
+              if (gbl_rotate_dequeue)
+                {
+                  CAS_OFF(gbl_rotate_dequeue);
+                }
             }
+          // is this a command event?
+          else if ( header_is_rotate(buf) || gbl_rotate_dequeue
+                    || (gbl_done && last) )
+            {
+              if (header_is_rotate (buf))
+                {
+                  // is it a new enough Command::Rotate, or masked out?
+                  memcpy(&dst.latest_rotate_header, buf, HEADER_LENGTH);
+                  dst.rotation_type = LJ_RT_EVENT;
+                }
+
+              /* if we are shutting down the destructor will flush stats,
+               * so skip so we don't get duplicate events sent to mondemand
+               * if it is enabled, it will also rotate in the journal
+               * destructor so rotate here as well.
+               */
+              if (! gbl_done )
+                {
+                  dequeuer_stats_rotate(&dst, log);
+                  dequeuer_stats_flush (&dst);
+                  LOG_INF(log, "About to rotate journal (%d pending).\n",
+                          pending);
+                  rotate(&place, stripe, log);
+                }
 
-          LOG_INF(log, "Maximum receive time was %0.2f seconds;"
-                  " total receive time was %0.2f seconds\n",
-                  max_receive_time/1000000., total_receive_time/1000000.);
-          LOG_INF(log, "Maximum write time was %0.2f seconds;"
-                  " total write time was %0.2f seconds\n",
-                  max_write_time/1000000., total_write_time/1000000.);
-          max_receive_time = 0;
-          max_write_time = 0;
-          total_receive_time = 0;
-          total_write_time = 0;
-
-          if (gbl_rotate_dequeue)
+              LOG_INF(log, "Maximum receive time was %0.2f seconds;"
+                      " total receive time was %0.2f seconds\n",
+                      max_receive_time/1000000., total_receive_time/1000000.);
+              LOG_INF(log, "Maximum write time was %0.2f seconds;"
+                      " total write time was %0.2f seconds\n",
+                      max_write_time/1000000., total_write_time/1000000.);
+              max_receive_time = 0;
+              max_write_time = 0;
+              total_receive_time = 0;
+              total_write_time = 0;
+
+              if (gbl_rotate_dequeue)
+                {
+                  CAS_OFF(gbl_rotate_dequeue);
+                }
+            }
+
+          if (gbl_rotate_dequeue_log)
             {
-              CAS_OFF(gbl_rotate_dequeue);
+              log = get_log (log);
+              CAS_OFF(gbl_rotate_dequeue_log);
             }
-        }
 
-      if (gbl_rotate_dequeue_log)
+          if (que_read_ret != QUEUE_INTR)
+            {
+              t0 = millis_now ();
+              /* Write the packet out to the journal. */
+              if ( (jrn_write_ret =
+                      write_stripe(&place, stripe, k, buf, que_read_ret, log))
+                   != que_read_ret )
+                {
+                  LOG_ER(log, "Journal write error -- attempted to write "
+                         "%d bytes, write returned %d.\n",
+                         que_read_ret, jrn_write_ret);
+                  dequeuer_stats_record_loss(&dst, 1);
+                }
+              else
+                {
+                  tap_publish(buf, que_read_ret);
+                }
+              now = millis_now ();
+              write_time = now - t0;
+              receipt = header_receipt_time (buf);
+              dequeuer_stats_record_latency (&dst,
+                                             now > receipt ? now - receipt : 0);
+              max_write_time =
+                max_write_time < write_time ? write_time : max_write_time;
+              total_write_time += write_time;
+            }
+        } /* for each message of the batch */
+
+      /* by size or count, looked at once a batch */
+      if ( ! arg_rotate_event_time && ! gbl_done && nread > 0
+           && (arg_journal_rotate_size > 0 || arg_journal_rotate_count > 0)
+           && rotation_due(&place, stripe, log) )
         {
-          log = get_log (log);
-          CAS_OFF(gbl_rotate_dequeue_log);
+          dequeuer_stats_rotate(&dst, log);
+          dequeuer_stats_flush (&dst);
+          rotate(&place, stripe, log);
         }
 
-      if (que_read_ret != QUEUE_INTR)
+      /* each batch to the next journal of the stripe */
+      k = (k + 1) % arg_journal_stripe;
+    } /* while ( ! gbl_done) */
+
+  /* the last interval's journals are named for as far as it went */
+  if ( arg_rotate_event_time && interval != 0 && ! idle )
+    {
+      time_t end = time(NULL);
+      if ( end > interval_next() )
         {
-          t0 = millis_now ();
-          /* Write the packet out to the journal. */
-          if ( (jrn_write_ret = jrn[jcurr].vtbl->write(&jrn[jcurr],
-                                                       buf, que_read_ret))
-               != que_read_ret )
-            {
-              LOG_ER(log, "Journal write error -- attempted to write %d bytes, "
-                     "write returned %d.\n", que_read_ret, jrn_write_ret);
-              dequeuer_stats_record_loss(&dst);
-            }
-          write_time = millis_now () - t0;
-          max_write_time =
-            max_write_time < write_time ? write_time : max_write_time;
-          total_write_time += write_time;
+          end = interval_next();
         }
-    } /* while ( ! gbl_done) */
+      close_interval(&place, stripe, end, log);
+    }
 
-  if ( jrn[jcurr].vtbl->close(&jrn[jcurr], log) < 0 )
+  for ( k = 0; k < arg_journal_stripe; ++k )
     {
-      LOG_ER(log, "Can't close journal  \"%s\".\n", arg_journalls[jcurr]);
+      if ( stripe[k] >= 0 )
+        {
+          journal_place_close(&place, stripe[k], log);
+        }
     }
+  count_lost(&place);
+  journal_place_destroy(&place);
+  free(stripe);
   for ( jc=0; jc<arg_njournalls; ++jc )
     {
       jrn[jc].vtbl->destructor(&jrn[jc],log);
     }
   free(jrn);
 
+  tap_stop(log);
+
   /* Empty the journaller system queue upon shutdown */
   int max = arg_queue_max_cnt;
-  while ( (que.vtbl->read(&que, buf, bufsiz, &pending) >= 0)
+  while ( (que.vtbl->read(&que, msgs[0].buf, bufsiz) >= 0)
           && max-- )
     ;
 
-  que.vtbl->dealloc(&que, buf);
+  for ( i = 0; i < QUEUE_BATCH_MAX; ++i )
+    {
+      que.vtbl->dealloc(&que, msgs[i].buf);
+    }
   que.vtbl->destructor(&que);
 
   dequeuer_stats_rotate(&dst, log);
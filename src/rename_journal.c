@@ -20,6 +20,7 @@
 #include "perror.h"
 #include "opt.h"
 
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
@@ -27,18 +28,19 @@
 #include <time.h>
 #include <unistd.h>
 
-int rename_journal(const char* path, time_t* last_rotate, FILE *log)
+static int name_journal(const char* path, time_t stamp, time_t start,
+                        time_t end, FILE *log)
 {
   char empty[1] = "";
   char* ext;
   char base[PATH_MAX];
   char newpath[PATH_MAX];
   char timebfr[100];        /* Needs to be big enough for strftime below */
-  time_t now = time(NULL);  /* get current time */
-  struct tm tm_now;
+  struct tm tm_stamp;
+  int seq;
 
   if ( strftime(timebfr, sizeof(timebfr), "%Y%m%d%H%M%S",
-                localtime_r(&now, &tm_now)) == 0 )
+                localtime_r(&stamp, &tm_stamp)) == 0 )
     {
       LOG_ER(log, "strftime failed in rename_journal(\"%s\", ...)\n", path);
       return -1;
@@ -55,17 +57,42 @@ int rename_journal(const char* path, time_t* last_rotate, FILE *log)
       ext = empty;
     }
 
-  snprintf(newpath, sizeof(newpath), "%s.%s.%ld.%ld%s",
-           base, timebfr, *last_rotate, now, ext);
-  *last_rotate = now;
+  /* Rotating by size or count closes several journals a second, so
+   * the name may be taken: link() refuses to replace it where rename()
+   * would not, and a sequence number is added until a name is free. */
+  for ( seq = 0; ; ++seq )
+    {
+      int n = seq == 0
+            ? snprintf(newpath, sizeof(newpath), "%s.%s.%ld.%ld%s",
+                       base, timebfr, start, end, ext)
+            : snprintf(newpath, sizeof(newpath), "%s.%s.%ld.%ld.%d%s",
+                       base, timebfr, start, end, seq, ext);
+
+      if ( n >= (int)sizeof(newpath) )
+        {
+          LOG_ER(log, "rename: journal name for '%s' is too long\n", path);
+          return -1;
+        }
+      if ( link(path, newpath) == 0 )
+        {
+          break;
+        }
+      if ( errno != EEXIST )
+        {
+          char buf[100] ;
+          LOG_ER(log,"rename: %s: - '%s' -> '%s'\n",
+                 strerror_r(errno,buf,sizeof(buf)), path, newpath);
+          return -1;
+        }
+    }
 
   LOG_INF(log, "Naming new journal file \"%s\".\n", newpath);
 
-  if ( rename(path, newpath) < 0 )
+  if ( unlink(path) < 0 )
     {
       char buf[100] ;
-      LOG_ER(log,"rename: %s: - '%s' -> '%s'\n",
-             strerror_r(errno,buf,sizeof(buf)), path, newpath);
+      LOG_ER(log,"rename: %s: - '%s' could not be removed\n",
+             strerror_r(errno,buf,sizeof(buf)), path);
       return -1;
     }
 
@@ -79,3 +106,20 @@ int rename_journal(const char* path, time_t* last_rotate, FILE *log)
 
   return 0;
 }
+
+int rename_journal(const char* path, time_t* last_rotate, FILE *log)
+{
+  time_t now = time(NULL);  /* get current time */
+  time_t start = *last_rotate;
+
+  *last_rotate = now;
+  return name_journal(path, now, start, now, log);
+}
+
+/* Stamped with the start, so an interval's journal sorts and globs by
+ * the interval it is for. */
+int rename_journal_range(const char* path, time_t start, time_t end,
+                         FILE *log)
+{
+  return name_journal(path, start, start, end, log);
+}
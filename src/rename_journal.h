@@ -19,4 +19,9 @@
 
 int rename_journal (const char* path, time_t* last_rotate, FILE *log);
 
+/* Names the journal for the events it holds, received from start up to
+ * end, in the same form. */
+int rename_journal_range (const char* path, time_t start, time_t end,
+                          FILE *log);
+
 #endif /* RENAME_JOURNAL_DOT_H */
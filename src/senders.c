@@ -0,0 +1,443 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#include "config.h"
+
+#include "senders.h"
+
+#include "header.h"
+#include "live_stats.h"
+#include "log.h"
+
+#include <lwes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Seqlock around changes readers must see whole: the writer makes the
+ * counter odd, changes things, and makes it even again. */
+#define SEQ_BEGIN(s)                                                      \
+  do {                                                                    \
+    __atomic_store_n (&(s), (s) + 1, __ATOMIC_RELAXED);                   \
+    __atomic_thread_fence (__ATOMIC_RELEASE);                             \
+  } while (0)
+#define SEQ_END(s)    __atomic_store_n (&(s), (s) + 1, __ATOMIC_RELEASE)
+
+static unsigned int slot_of (uint32_t ip)
+{
+  return (ip * 2654435761u) >> 20 & (SENDER_SLOTS - 1);
+}
+
+static struct sender* sender_find (struct sender_table *t, uint32_t ip,
+                                   int insert)
+{
+  unsigned int i = slot_of (ip);
+  int probes;
+
+  /* bounded, a reader racing a rebuild may see a table with no holes */
+  for ( probes = 0; probes < SENDER_SLOTS; ++probes )
+    {
+      struct sender *s = &t->slot[i];
+      uint32_t sip = LIVE_GET (s->ip);
+
+      if ( sip == ip )
+        {
+          return s;
+        }
+      if ( sip == 0 )
+        {
+          if ( ! insert || t->used >= SENDER_MAX_USED )
+            {
+              return NULL;
+            }
+          LIVE_ADD (t->used, 1);
+          /* the IP goes in last, it is what makes the slot visible */
+          __atomic_store_n (&s->ip, ip, __ATOMIC_RELEASE);
+          return s;
+        }
+      i = (i + 1) & (SENDER_SLOTS - 1);
+    }
+  return NULL;
+}
+
+/* Space-Saving: a tracked sender counts up, a new one takes over the
+ * smallest counter and inherits its count as the possible error. */
+static void topk_record (struct sender_table *t, uint32_t ip)
+{
+  struct sender_count *c = t->topk;
+  struct sender_count *min;
+  int i;
+
+  for ( i = 0; i < (int)t->topk_used; ++i )
+    {
+      if ( c[i].ip == ip )
+        {
+          LIVE_ADD (c[i].count, 1);
+          return;
+        }
+    }
+
+  SEQ_BEGIN (t->topk_seq);
+  if ( t->topk_used < SENDER_TOPK )
+    {
+      min = &c[t->topk_used];
+      LIVE_SET (min->ip, ip);
+      LIVE_SET (min->count, 1);
+      LIVE_SET (min->error, 0);
+      LIVE_ADD (t->topk_used, 1);
+    }
+  else
+    {
+      min = &c[0];
+      for ( i = 1; i < SENDER_TOPK; ++i )
+        {
+          if ( c[i].count < min->count )
+            {
+              min = &c[i];
+            }
+        }
+      LIVE_SET (min->ip, ip);
+      LIVE_SET (min->error, min->count);
+      LIVE_ADD (min->count, 1);
+    }
+  SEQ_END (t->topk_seq);
+}
+
+/* The count in a heartbeat is what the emitter sent since its previous
+ * one, so from the first heartbeat on, whatever was sent but did not
+ * arrive is the loss.  Several emitters behind one address make it an
+ * estimate. */
+static void heartbeat_record (struct sender *s, const void *buf, size_t len)
+{
+  struct lwes_event_deserialize_tmp tmp;
+  struct lwes_event *event = lwes_event_create_no_name (NULL);
+  LWES_INT_64 count;
+
+  if ( event == NULL )
+    {
+      return;
+    }
+  if ( lwes_event_from_bytes (event,
+                              (LWES_BYTE_P)buf + HEADER_LENGTH,
+                              len - HEADER_LENGTH, 0, &tmp)
+         == (int)(len - HEADER_LENGTH)
+       && lwes_event_get_INT_64 (event, "count", &count) == 0 )
+    {
+      if ( s->heartbeats == 0 )
+        {
+          LIVE_SET (s->base_packets, s->packets);
+        }
+      else
+        {
+          /* heartbeats themselves are not in the count */
+          uint64_t received = s->packets - s->base_packets - s->heartbeats;
+          LIVE_ADD (s->emitted, count);
+          LIVE_SET (s->lost,
+                    s->emitted > received ? s->emitted - received : 0);
+        }
+      LIVE_ADD (s->heartbeats, 1);
+    }
+  lwes_event_destroy (event);
+}
+
+void senders_record (const void *buf, size_t len)
+{
+  struct sender_table *t = &gbl_live_stats->senders;
+  const char *hdr = (const char *)buf;
+  uint32_t ip = header_sender_ip (hdr);
+  struct sender *s;
+
+  if ( ip == 0 )
+    {
+      return;
+    }
+
+  s = sender_find (t, ip, 1);
+  if ( s == NULL )
+    {
+      LIVE_ADD (t->overflow_packets, 1);
+    }
+  else
+    {
+      uint64_t now = header_receipt_time (hdr);
+
+      if ( s->packets == 0 )
+        {
+          LIVE_SET (s->first_seen, now);
+        }
+      LIVE_SET (s->last_seen, now);
+      LIVE_SET (s->port, header_sender_port (hdr));
+      LIVE_SET (s->site, header_site_id (hdr));
+      LIVE_ADD (s->packets, 1);
+      LIVE_ADD (s->bytes, len - HEADER_LENGTH);
+
+      if ( len > HEADER_LENGTH
+           && toknam_eq ((const unsigned char *)hdr + HEADER_LENGTH,
+                         (const unsigned char *)HEARTBEAT_EVENT) )
+        {
+          heartbeat_record (s, buf, len);
+        }
+    }
+
+  topk_record (t, ip);
+}
+
+/* Copy the sketch as one consistent picture, heaviest first. */
+static int topk_copy (struct sender_table *t, struct sender_count *out)
+{
+  uint64_t seq;
+  int n, i, j;
+
+  do
+    {
+      seq = __atomic_load_n (&t->topk_seq, __ATOMIC_ACQUIRE);
+      n = LIVE_GET (t->topk_used);
+      for ( i = 0; i < n; ++i )
+        {
+          out[i].ip = LIVE_GET (t->topk[i].ip);
+          out[i].count = LIVE_GET (t->topk[i].count);
+          out[i].error = LIVE_GET (t->topk[i].error);
+        }
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while ( (seq & 1) || seq != LIVE_GET (t->topk_seq) );
+
+  for ( i = 1; i < n; ++i )
+    {
+      struct sender_count c = out[i];
+      for ( j = i; j > 0 && out[j-1].count < c.count; --j )
+        {
+          out[j] = out[j-1];
+        }
+      out[j] = c;
+    }
+
+  return n;
+}
+
+/* Copy a table row, or return 0 if the sender is not in it. */
+static int sender_copy (struct sender_table *t, uint32_t ip,
+                        struct sender *out)
+{
+  uint64_t seq;
+  int found;
+
+  do
+    {
+      struct sender *s;
+
+      seq = __atomic_load_n (&t->seq, __ATOMIC_ACQUIRE);
+      s = sender_find (t, ip, 0);
+      found = s != NULL;
+      if ( found )
+        {
+          out->ip = ip;
+          out->port = LIVE_GET (s->port);
+          out->site = LIVE_GET (s->site);
+          out->packets = LIVE_GET (s->packets);
+          out->bytes = LIVE_GET (s->bytes);
+          out->first_seen = LIVE_GET (s->first_seen);
+          out->last_seen = LIVE_GET (s->last_seen);
+          out->heartbeats = LIVE_GET (s->heartbeats);
+          out->lost = LIVE_GET (s->lost);
+        }
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while ( (seq & 1) || seq != LIVE_GET (t->seq) );
+
+  return found;
+}
+
+static const char* ip_formatted (uint32_t ip, char *buf)
+{
+  struct in_addr addr;
+  addr.s_addr = ip;
+  return inet_ntop (AF_INET, &addr, buf, INET_ADDRSTRLEN);
+}
+
+void senders_rotate (FILE *log, uint64_t since)
+{
+  struct sender_table *t = &gbl_live_stats->senders;
+  struct sender_count top[SENDER_TOPK];
+  struct sender *keep;
+  int n, i, kept = 0;
+
+  n = topk_copy (t, top);
+  LOG_INF (log, "Senders: %d tracked, %lld packets from untracked senders.\n",
+           (int) t->used, (long long) t->overflow_packets);
+  for ( i = 0; i < n && i < 10; ++i )
+    {
+      char ip[INET_ADDRSTRLEN];
+      struct sender s;
+
+      memset (&s, 0, sizeof (s));
+      sender_copy (t, top[i].ip, &s);
+      LOG_INF (log, " top sender %s:%d site %d: %lld packets since last "
+               "rotate (+/- %lld), %lld packets %lld bytes in all, "
+               "%lld lost.\n",
+               ip_formatted (top[i].ip, ip), s.port, s.site,
+               (long long) top[i].count, (long long) top[i].error,
+               (long long) s.packets, (long long) s.bytes,
+               (long long) s.lost);
+    }
+
+  /* Start the sketch over, and rebuild the table with only the senders
+   * heard from since the previous rotation, so it never fills up with
+   * long gone emitters. */
+  SEQ_BEGIN (t->topk_seq);
+  LIVE_SET (t->topk_used, 0);
+  memset (t->topk, 0, sizeof (t->topk));
+  SEQ_END (t->topk_seq);
+
+  keep = (struct sender *) malloc (sizeof (t->slot));
+  if ( keep == NULL )
+    {
+      return;
+    }
+  for ( i = 0; i < SENDER_SLOTS; ++i )
+    {
+      if ( t->slot[i].ip != 0 && t->slot[i].last_seen >= since )
+        {
+          keep[kept++] = t->slot[i];
+        }
+    }
+
+  SEQ_BEGIN (t->seq);
+  memset (t->slot, 0, sizeof (t->slot));
+  LIVE_SET (t->used, 0);
+  for ( i = 0; i < kept; ++i )
+    {
+      *sender_find (t, keep[i].ip, 1) = keep[i];
+    }
+  SEQ_END (t->seq);
+
+  free (keep);
+}
+
+#define SN_APPEND(...)                                                    \
+  do {                                                                    \
+    int r = snprintf (buf + n, n < len ? len - n : 0, __VA_ARGS__);       \
+    if ( r > 0 ) n += r;                                                  \
+  } while (0)
+
+int senders_snapshot (char *buf, size_t len)
+{
+  struct sender_table *t = &gbl_live_stats->senders;
+  struct sender_count top[SENDER_TOPK];
+  size_t n = 0;
+  int k, i;
+
+  if ( len > 0 )
+    {
+      buf[0] = '\0';
+    }
+
+  SN_APPEND ("senders_tracked %llu\n"
+             "senders_overflow_packets %llu\n",
+             (unsigned long long) LIVE_GET (t->used),
+             (unsigned long long) LIVE_GET (t->overflow_packets));
+
+  k = topk_copy (t, top);
+  for ( i = 0; i < k; ++i )
+    {
+      char ip[INET_ADDRSTRLEN];
+      struct sender s;
+
+      memset (&s, 0, sizeof (s));
+      sender_copy (t, top[i].ip, &s);
+      SN_APPEND ("sender %s port %d site %d recent_packets %llu "
+                 "recent_error %llu packets %llu bytes %llu "
+                 "first_seen %llu last_seen %llu lost %llu\n",
+                 ip_formatted (top[i].ip, ip), s.port, s.site,
+                 (unsigned long long) top[i].count,
+                 (unsigned long long) top[i].error,
+                 (unsigned long long) s.packets,
+                 (unsigned long long) s.bytes,
+                 (unsigned long long) s.first_seen,
+                 (unsigned long long) s.last_seen,
+                 (unsigned long long) s.lost);
+    }
+
+  return (int) n;
+}
+
+int senders_openmetrics (char *buf, size_t len)
+{
+  struct sender_table *t = &gbl_live_stats->senders;
+  struct sender_count top[SENDER_TOPK];
+  struct sender s[SENDER_TOPK];
+  char ip[SENDER_TOPK][INET_ADDRSTRLEN];
+  size_t n = 0;
+  int k, i;
+
+  if ( len > 0 )
+    {
+      buf[0] = '\0';
+    }
+
+  SN_APPEND ("# TYPE lwes_journaller_senders_tracked gauge\n"
+             "# HELP lwes_journaller_senders_tracked Senders in the table.\n"
+             "lwes_journaller_senders_tracked %llu\n"
+             "# TYPE lwes_journaller_senders_overflow_packets counter\n"
+             "# HELP lwes_journaller_senders_overflow_packets Packets from "
+             "senders the full table could not track.\n"
+             "lwes_journaller_senders_overflow_packets_total %llu\n",
+             (unsigned long long) LIVE_GET (t->used),
+             (unsigned long long) LIVE_GET (t->overflow_packets));
+
+  /* only the heaviest senders, which keeps the label set bounded */
+  k = topk_copy (t, top);
+  for ( i = 0; i < k; ++i )
+    {
+      memset (&s[i], 0, sizeof (s[i]));
+      sender_copy (t, top[i].ip, &s[i]);
+      ip_formatted (top[i].ip, ip[i]);
+    }
+
+  SN_APPEND ("# TYPE lwes_journaller_sender_recent_packets gauge\n"
+             "# HELP lwes_journaller_sender_recent_packets Packets since "
+             "the last rotation from the heaviest senders, an upper "
+             "bound.\n");
+  for ( i = 0; i < k; ++i )
+    {
+      SN_APPEND ("lwes_journaller_sender_recent_packets{sender=\"%s\"} "
+                 "%llu\n", ip[i], (unsigned long long) top[i].count);
+    }
+  SN_APPEND ("# TYPE lwes_journaller_sender_packets counter\n"
+             "# HELP lwes_journaller_sender_packets Packets received from "
+             "the heaviest senders.\n");
+  for ( i = 0; i < k; ++i )
+    {
+      SN_APPEND ("lwes_journaller_sender_packets_total{sender=\"%s\"} "
+                 "%llu\n", ip[i], (unsigned long long) s[i].packets);
+    }
+  SN_APPEND ("# TYPE lwes_journaller_sender_bytes counter\n"
+             "# HELP lwes_journaller_sender_bytes Bytes received from "
+             "the heaviest senders.\n");
+  for ( i = 0; i < k; ++i )
+    {
+      SN_APPEND ("lwes_journaller_sender_bytes_total{sender=\"%s\"} "
+                 "%llu\n", ip[i], (unsigned long long) s[i].bytes);
+    }
+  SN_APPEND ("# TYPE lwes_journaller_sender_lost gauge\n"
+             "# HELP lwes_journaller_sender_lost Packets the heaviest "
+             "senders' heartbeats say were sent but never arrived.\n");
+  for ( i = 0; i < k; ++i )
+    {
+      SN_APPEND ("lwes_journaller_sender_lost{sender=\"%s\"} %llu\n",
+                 ip[i], (unsigned long long) s[i].lost);
+    }
+
+  return (int) n;
+}
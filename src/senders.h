@@ -0,0 +1,82 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#ifndef SENDERS_DOT_H
+#define SENDERS_DOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Per-sender traffic accounting.
+ *
+ * The enqueuer keeps an open addressing table keyed by sender IP with
+ * packets, bytes, first and last seen, the latest port and site ID,
+ * and an estimate of the packets lost on the way, from the counts in
+ * the senders' System::Heartbeat events.  Next to it a Space-Saving
+ * sketch of SENDER_TOPK counters finds the heaviest senders since the
+ * last rotation, however many senders there are.
+ *
+ * Both live in the live stats page, written only by the enqueuer.  Each
+ * has a sequence counter, odd while the enqueuer is changing it, so
+ * readers in the stats server can take consistent copies.
+ */
+
+#define SENDER_SLOTS        4096        /* power of two */
+#define SENDER_MAX_USED     (SENDER_SLOTS / 4 * 3)
+#define SENDER_TOPK         32
+
+struct sender {
+  uint32_t ip;                  /* network byte order, 0 is a free slot */
+  uint16_t port;                /* latest seen */
+  uint16_t site;                /* latest seen */
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t first_seen;          /* msec */
+  uint64_t last_seen;           /* msec */
+  uint64_t heartbeats;
+  uint64_t emitted;             /* sum of heartbeat counts */
+  uint64_t base_packets;        /* packets at the first heartbeat */
+  uint64_t lost;                /* emitted but never received */
+};
+
+struct sender_count {
+  uint32_t ip;
+  uint32_t pad;
+  uint64_t count;               /* packets, possibly over-estimated */
+  uint64_t error;               /* by at most this much */
+};
+
+struct sender_table {
+  uint64_t seq;
+  uint64_t used;
+  uint64_t overflow_packets;    /* from senders the full table missed */
+  struct sender slot[SENDER_SLOTS];
+
+  uint64_t topk_seq;
+  uint64_t topk_used;
+  struct sender_count topk[SENDER_TOPK];
+};
+
+/* Account for one packet, buf is the journal header and payload. */
+void senders_record (const void *buf, size_t len);
+
+/* Log the heaviest senders, restart the sketch and forget senders not
+ * seen since the previous rotation at since (msec). */
+void senders_rotate (FILE *log, uint64_t since);
+
+/* Format the table and the sketch as "name value" lines, or as
+ * OpenMetrics, returns the length as snprintf does. */
+int  senders_snapshot (char *buf, size_t len);
+int  senders_openmetrics (char *buf, size_t len);
+
+#endif /* SENDERS_DOT_H */
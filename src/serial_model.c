@@ -13,46 +13,53 @@
 
 #include "config.h"
 
+#include "hugemem.h"
 #include "journal.h"
 #include "log.h"
 #include "opt.h"
+#include "senders.h"
 #include "serial_model.h"
 #include "sig.h"
 #include "stats.h"
+#include "tap.h"
 #include "time_utils.h"
 #include "xport.h"
 
 #include <fcntl.h>
-#include <lwes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define BUFLEN               (65535)
-#define SERIAL_DEPTH_COMMAND ("\026Internal::Queue::Depth")
 
 struct xport             xpt;
-unsigned char            buf[BUFLEN];
+unsigned char*           buf;
 int                      buflen;
 struct journal           jrn;
 struct enqueuer_stats    est;
 struct dequeuer_stats    dst;
 unsigned long long       tm;
-struct lwes_emitter*     emitter   = NULL;
-/* these are used for doing a depth test, which every depth_dtm milliseconds
- * sends an event SERIAL_DEPTH_COMMAND to this journaller, and later takes
- * that and uses it to estimate how many events were in the operating system
- * queue
- */
+/* when the receive socket backlog is sampled next */
 unsigned long long       depth_tm  = 0;
-unsigned long long       depth_dtm = 10000;
-/* count is the total number of events received by this journaller */
-unsigned long long       count     = 0;
-/* pending is the number of events received between sending and receiving
- * a queue depth test event.  It represents the number of events in 
- * the recv buffer of the operating system.
- */
-unsigned long long       pending   = 0;
+/* estimated number of events in the receive socket, as of the latest
+ * sample */
+int                      pending   = 0;
+
+/* With --serial-batch datagrams are read BUFLEN apart into block, each
+ * behind room for its header, which is stamped in place.  They are then
+ * packed down behind the previous one, so the journal gets a run of
+ * events as it would have one at a time, in one write. */
+unsigned char*           block;
+struct xport_msg         msgs[XPORT_BATCH_MAX];
+/* dz samples and delta encodes each event, those get them one at a time */
+int                      block_writes;
+
+/* --rotate-on-event-time: start of the interval being journalled, 0
+ * before the first event, and whether its journal was closed for want
+ * of newer events */
+time_t                   interval  = 0;
+int                      idle      = 0;
 
 static void serial_open_journal(FILE *log);
 
@@ -63,8 +70,6 @@ static void serial_ctor(FILE *log)
   install_interval_rotate_handlers(log, 1);
   install_log_rotate_signal_handlers(log, 1, SIGUSR1);
 
-  depth_dtm = arg_queue_test_interval;
-
   if ( enqueuer_stats_ctor (&est) < 0 )
     {
       LOG_ER(log, "Failed to create initialize enqueuer stats.\n");
@@ -77,7 +82,24 @@ static void serial_ctor(FILE *log)
       exit(EXIT_FAILURE);
     }
 
-  memset(buf, 0, BUFLEN);           /* Clear the message. */
+  /* hugemem_alloc() memory is clear */
+  if ( (buf = (unsigned char*)hugemem_alloc(BUFLEN, log)) == NULL )
+    {
+      LOG_ER(log, "unable to allocate %d bytes for message buffer.\n",
+             BUFLEN);
+      exit(EXIT_FAILURE);
+    }
+
+  if ( arg_serial_batch > 0
+       && (block = (unsigned char*)hugemem_alloc((size_t)arg_serial_batch
+                                                 * BUFLEN, log)) == NULL )
+    {
+      LOG_ER(log, "unable to allocate %d bytes for message buffers.\n",
+             arg_serial_batch * BUFLEN);
+      exit(EXIT_FAILURE);
+    }
+  block_writes = strcmp(arg_journ_type, ARG_DZ) != 0
+                 && strcmp(arg_journal_encoding, ARG_ENC_RAW) == 0;
 
   if ( (xport_factory(&xpt, log) < 0) || (xpt.vtbl->open(&xpt, O_RDONLY) < 0) )
     {
@@ -100,9 +122,7 @@ static void serial_ctor(FILE *log)
 
   serial_open_journal(log);
 
-  emitter = lwes_emitter_create( (LWES_CONST_SHORT_STRING) arg_ip,
-                                 (LWES_CONST_SHORT_STRING) NULL, //arg_interface,
-                                 (LWES_U_INT_32) arg_port, 0, 60 );
+  tap_start(log);
 }
 
 static void serial_open_journal(FILE *log)
@@ -114,6 +134,18 @@ static void serial_open_journal(FILE *log)
     }
 }
 
+/* Events the journal took, then lost as a later write or the close
+ * failed. */
+static void serial_lost(void)
+{
+  int lost = jrn.vtbl->lost(&jrn);
+
+  if (lost > 0)
+    {
+      dequeuer_stats_record_loss(&dst, lost);
+    }
+}
+
 static void serial_close_journal(int is_rotate_event, FILE *log)
 {
   if (gbl_done || gbl_rotate_enqueue || is_rotate_event)
@@ -136,7 +168,8 @@ static void serial_close_journal(int is_rotate_event, FILE *log)
       CAS_OFF(gbl_rotate_dequeue);
     }
 
-  if (jrn.vtbl->close(&jrn, log) < 0) {
+  if (! idle && jrn.vtbl->close(&jrn, log) < 0) {
+    serial_lost();
     LOG_ER(log, "Can't close journal  \"%s\".\n", arg_journalls[0]);
     exit(EXIT_FAILURE);
   }
@@ -144,11 +177,154 @@ static void serial_close_journal(int is_rotate_event, FILE *log)
 
 static void serial_rotate(int is_rotate_event, FILE *log)
 {
+  unsigned long long t0 = millis_now ();
+
   serial_close_journal(is_rotate_event, log);
   serial_open_journal(log);
+  dequeuer_stats_record_rotation(&dst, millis_now () - t0);
+}
+
+/* Rotations asked for by Command::Rotate or a signal; with
+ * --rotate-on-event-time journals are only cut at event time. */
+static void serial_rotate_requested(int is_rotate_event, FILE *log)
+{
+  if (! is_rotate_event && ! gbl_rotate_dequeue && ! gbl_rotate_enqueue)
+    {
+      return;
+    }
+  if (arg_rotate_event_time)
+    {
+      CAS_OFF(gbl_rotate_dequeue);
+      CAS_OFF(gbl_rotate_enqueue);
+      return;
+    }
+  serial_rotate(is_rotate_event, log);
+}
+
+/* Rotates once the journal holds --journal-rotate-size or
+ * --journal-rotate-count, as rotation_due() in queue_to_journal.c. */
+static void serial_rotate_due(FILE *log)
+{
+  long long size;
+
+  if (arg_rotate_event_time || gbl_done)
+    {
+      return;
+    }
+  if (arg_journal_rotate_count > 0
+      && dst.packets_written_since_last_rotate >= arg_journal_rotate_count)
+    {
+      LOG_INF(log, "Journal holds %lld events, rotating.\n",
+              dst.packets_written_since_last_rotate);
+      serial_rotate(1, log);
+    }
+  else if (arg_journal_rotate_size > 0
+           && (size = jrn.vtbl->written(&jrn, arg_journal_rotate_on_disk))
+              >= arg_journal_rotate_size * 1024LL * 1024LL)
+    {
+      LOG_INF(log, "Journal holds %lld bytes%s, rotating.\n", size,
+              arg_journal_rotate_on_disk ? " on disk" : "");
+      serial_rotate(1, log);
+    }
+}
+
+/* Where the current interval ends, and the next one begins. */
+static time_t serial_interval_end(void)
+{
+  return interval_end(interval, arg_journal_rotate_interval);
+}
+
+/* The interval for an event, as event_interval() in queue_to_journal.c,
+ * or 0 without --rotate-on-event-time. */
+static time_t serial_interval(unsigned char* ev)
+{
+  time_t t;
+
+  if (! arg_rotate_event_time)
+    {
+      return 0;
+    }
+  t = interval_start(header_receipt_time((const char*)ev),
+                     arg_journal_rotate_interval);
+  if (t < interval)
+    {
+      t = interval;
+    }
+  if (idle && t == interval)
+    {
+      t = interval_end(t, arg_journal_rotate_interval);
+    }
+  return t;
+}
+
+/* Closes the interval's journal, named for it up to end, and opens the
+ * next one unless it is closed for idleness. */
+static void serial_close_interval(time_t end, int reopen, FILE *log)
+{
+  jrn.vtbl->set_range(&jrn, interval, end);
+  if (reopen)
+    {
+      LOG_INF(log, "About to rotate journal for the interval from %ld.\n",
+              (long)interval);
+      serial_rotate(1, log);
+    }
+  else
+    {
+      LOG_INF(log, "No events past the interval from %ld, closing its "
+              "journal.\n", (long)interval);
+      serial_close_journal(1, log);
+      idle = 1;
+    }
+}
+
+/* Events of interval t are next. */
+static void serial_next_interval(time_t t, FILE *log)
+{
+  if (interval != 0 && idle)
+    {
+      serial_open_journal(log);
+      idle = 0;
+    }
+  else if (interval != 0)
+    {
+      serial_close_interval(serial_interval_end(), 1, log);
+    }
+  interval = t;
+}
+
+/* The serial model has no queue, its backlog is the receive socket.
+ * The kernel charges each datagram waiting there its whole buffer,
+ * roughly the datagram plus SKB_OVERHEAD bytes, which turns the backlog
+ * in bytes into an estimate of the events waiting.
+ */
+#define SKB_OVERHEAD 768
+
+static void serial_sample_backlog(FILE *log)
+{
+  struct xport_backlog bl;
+  long long avg;
+
+  if (xpt.vtbl->backlog(&xpt, &bl) < 0)
+    {
+      return;
+    }
+  enqueuer_stats_record_backlog(&est, bl.bytes, bl.drops);
+
+  avg = est.packets_received_total
+          ? est.bytes_received_total / est.packets_received_total
+          : 0;
+  pending = bl.bytes / (avg + SKB_OVERHEAD);
+  dequeuer_stats_record_depth(&dst, pending);
+
+  if (arg_rotate_event_time && ! idle && interval != 0 && pending == 0
+      && tm >= serial_interval_end() * 1000ULL + EVENT_TIME_GRACE_MS)
+    {
+      serial_close_interval(serial_interval_end(), 0, log);
+    }
+  jrn.vtbl->backlog(&jrn, pending, log);
 }
 
-static int serial_read(void)
+static int serial_read(FILE *log)
 {
   unsigned long addr;
   short port;
@@ -160,13 +336,19 @@ static int serial_read(void)
   int xpt_read_ret =
       xpt.vtbl->read(&xpt, buf+HEADER_LENGTH, BUFLEN-HEADER_LENGTH, &addr, &port);
 
+  tm = millis_now ();
+  if (tm >= depth_tm)
+    {
+      serial_sample_backlog(log);
+      depth_tm = tm + arg_depth_interval;
+    }
+
   if (xpt_read_ret >= 0)
     {
-      tm     = millis_now ();
       buflen = xpt_read_ret + HEADER_LENGTH;
       enqueuer_stats_record_datagram(&est, buflen);
       header_add(buf, xpt_read_ret, tm, addr, port);
-      ++count;
+      senders_record(buf, buflen);
       return 0;
     }
   else if (xpt_read_ret == XPORT_INTR)
@@ -182,93 +364,176 @@ static int serial_read(void)
     }
 }
 
-static int serial_handle_depth_test()
+/* Reads up to --serial-batch datagrams into block, how many or as
+ * serial_read(). */
+static int serial_read_batch(FILE *log)
 {
-  /* check for the serial depth event */
-  if (toknam_eq((unsigned char *)buf + HEADER_LENGTH,
-                (unsigned char *)SERIAL_DEPTH_COMMAND))
-    {
-      struct lwes_event_deserialize_tmp event_tmp;
-      int                               bytes_read;
-      struct lwes_event*                event = lwes_event_create_no_name(NULL);
-
-      /* don't include these internal events in our stats */
-      enqueuer_stats_erase_datagram(&est, buflen);
-
-      /* we should have one, so deserialize it */
-      bytes_read = lwes_event_from_bytes(event,
-                                         (LWES_BYTE_P)&buf[HEADER_LENGTH],
-                                         buflen-HEADER_LENGTH,
-                                         0, &event_tmp);
-      if (bytes_read != buflen-HEADER_LENGTH)
-        {
-          LOG_ER(NULL, "Only able to read %d bytes; expected %d\n", bytes_read, buflen);
-        }
-      else
-        {
-          /* get the previous count */
-          LWES_U_INT_64 previous_count;
-          lwes_event_get_U_INT_64(event, "count", &previous_count);
-          /* determine the difference and remove one for this special event */
-          pending  = count - previous_count - 1;
-          LOG_INF(NULL, "Depth test reports a buffer length of %lld events.\n", pending);
-        }
+  int i, n;
+
+  for ( i = 0; i < arg_serial_batch; ++i )
+    {
+      unsigned char* slot = block + (size_t)i * BUFLEN;
 
-      lwes_event_destroy(event);
-      return 1;
+      /* as in serial_read() */
+      memset(slot, 0, HEADER_LENGTH+20);
+      msgs[i].buf = slot + HEADER_LENGTH;
+      msgs[i].count = BUFLEN-HEADER_LENGTH;
     }
-  else
+
+  n = xpt.vtbl->read_many(&xpt, msgs, arg_serial_batch);
+
+  tm = millis_now ();
+  if (tm >= depth_tm)
     {
-      return 0;
+      serial_sample_backlog(log);
+      depth_tm = tm + arg_depth_interval;
+    }
+
+  if (n == -1)
+    {
+      enqueuer_stats_record_socket_error(&est);
     }
+  return n;
 }
 
-/* this code attempts to determine if there are any events in the operating
- * system queue by sending an event with the current received count
- * and later checking it
- */
-static void serial_send_buffer_depth_test(void)
+/* Stats and the tap for an event the journal took, or didn't. */
+static void serial_written(unsigned char* ev, int len, int ok,
+                           unsigned long long now)
 {
-  struct lwes_event *event =
-      lwes_event_create( (struct lwes_event_type_db *) NULL,
-                         (LWES_SHORT_STRING) SERIAL_DEPTH_COMMAND+1);
-  if (event == NULL) return;
-  if (lwes_event_set_U_INT_64(event,"count",count) < 0)
+  unsigned long long receipt = header_receipt_time ((const char*)ev);
+
+  if (ok)
     {
-      LOG_ER(NULL, "Unable to add count to depth event");
+      tap_publish(ev, len);
     }
   else
     {
-      lwes_emitter_emitto((char*) "127.0.0.1", NULL, arg_port, emitter, event);
+      dequeuer_stats_record_loss(&dst, 1);
+      serial_lost();
     }
-  lwes_event_destroy(event);
 
-  depth_tm = millis_now ();
+  dequeuer_stats_record(&dst, len, pending);
+  dequeuer_stats_record_latency(&dst, now > receipt ? now - receipt : 0);
 }
 
-static void serial_write(void)
+static void serial_write(unsigned char* ev, int len)
 {
   /* Write the packet out to the journal. */
-  int jrn_write_ret = jrn.vtbl->write(&jrn, buf, buflen);
+  int jrn_write_ret = jrn.vtbl->write(&jrn, ev, len);
+
+  if (jrn_write_ret != len)
+    {
+      LOG_ER(NULL, "Journal write error -- attempted to write %d bytes, "
+             "write returned %d.\n", len, jrn_write_ret);
+    }
+  serial_written(ev, len, jrn_write_ret == len, millis_now ());
+}
+
+#define EVENT_LENGTH(ev) \
+  (HEADER_LENGTH + header_payload_length((const char*)(ev)))
 
-  if (jrn_write_ret != buflen)
+/* The packed events from start to end. */
+static void serial_write_block(unsigned char* start, unsigned char* end)
+{
+  int len = end - start;
+  int jrn_write_ret;
+  unsigned long long now;
+  unsigned char* ev;
+
+  if (len == 0)
+    {
+      return;
+    }
+  if (! block_writes)
+    {
+      for (ev = start; ev < end; ev += EVENT_LENGTH(ev))
+        {
+          serial_write(ev, EVENT_LENGTH(ev));
+        }
+      return;
+    }
+
+  jrn_write_ret = jrn.vtbl->write(&jrn, start, len);
+  now = millis_now ();
+  if (jrn_write_ret != len)
     {
       LOG_ER(NULL, "Journal write error -- attempted to write %d bytes, "
-             "write returned %d.\n", buflen, jrn_write_ret);
-      dequeuer_stats_record_loss(&dst);
+             "write returned %d.\n", len, jrn_write_ret);
     }
+  for (ev = start; ev < end; ev += EVENT_LENGTH(ev))
+    {
+      serial_written(ev, EVENT_LENGTH(ev), jrn_write_ret == len, now);
+    }
+}
+
+static void serial_batch(FILE *log)
+{
+  int n = serial_read_batch(log);
+  unsigned char* start = block;
+  unsigned char* end = block;
+  int i;
+
+  for (i = 0; i < n; ++i)
+    {
+      unsigned char* slot = block + (size_t)i * BUFLEN;
+      int len = msgs[i].count + HEADER_LENGTH;
+      int is_rotate_event = header_is_rotate(slot);
+      time_t t;
+
+      enqueuer_stats_record_datagram(&est, len);
+      header_add(slot, msgs[i].count, tm, msgs[i].addr, msgs[i].port);
+      senders_record(slot, len);
 
-  dequeuer_stats_record(&dst, buflen, pending);
+      if ((t = serial_interval(slot)) != interval)
+        {
+          serial_write_block(start, end);
+          start = end;
+          serial_next_interval(t, log);
+        }
+      if (slot != end)
+        {
+          memmove(end, slot, len);
+        }
+      end += len;
+
+      /* the rotate event goes in the journal it closes, as it always has */
+      if (is_rotate_event)
+        {
+          memcpy(&dst.latest_rotate_header, end - len, HEADER_LENGTH);
+          dst.rotation_type = LJ_RT_EVENT;
+          serial_write_block(start, end);
+          serial_rotate_requested(1, log);
+          start = end;
+        }
+    }
+  serial_write_block(start, end);
+  serial_rotate_requested(0, log);
+  serial_rotate_due(log);
 }
 
 static void serial_dtor(FILE *log)
 {
+  /* the last interval's journal is named for as far as it went */
+  if (arg_rotate_event_time && interval != 0 && ! idle)
+    {
+      time_t end = time(NULL);
+      if (end > serial_interval_end())
+        {
+          end = serial_interval_end();
+        }
+      jrn.vtbl->set_range(&jrn, interval, end);
+    }
   serial_close_journal(0, log);
-  lwes_emitter_destroy(emitter);
+  tap_stop(log);
   xpt.vtbl->destructor(&xpt);
   jrn.vtbl->destructor(&jrn, log);
   enqueuer_stats_dtor(&est);
   dequeuer_stats_dtor(&dst);
+  hugemem_free(buf, BUFLEN);
+  if (block)
+    {
+      hugemem_free(block, (size_t)arg_serial_batch * BUFLEN);
+    }
 }
 
 void serial_model(FILE *log)
@@ -277,31 +542,37 @@ void serial_model(FILE *log)
 
   do {
     int is_rotate_event = 0;
-    int read_ret = serial_read();
+    int read_ret;
+    if (arg_serial_batch > 0) {
+      serial_batch(log);
+      if (gbl_rotate_main_log) {
+        log = get_log (log);
+      }
+      continue;
+    }
+    read_ret = serial_read(log);
     /* -1 is an error we don't deal with, so just skip out of the loop */
     if (read_ret == -1)             continue;
-    /* depth tests are not written to the journal */
-    if (serial_handle_depth_test()) continue;
     /* XPORT_INTR from read means we were interrupted and should not
      * write, so write when we are not interrupted, this is for backward
      * compatibility when we didn't do rotation signals correctly here
      */
-    if (read_ret != XPORT_INTR ) serial_write();
+    if (read_ret != XPORT_INTR ) {
+      time_t t = serial_interval(buf);
+      if (t != interval) serial_next_interval(t, log);
+      serial_write(buf, buflen);
+    }
     /* check for rotation event, or signal's and rotate if necessary */
     if (header_is_rotate(buf)) {
       memcpy(&dst.latest_rotate_header, buf, HEADER_LENGTH) ;
       dst.rotation_type = LJ_RT_EVENT;
       is_rotate_event = 1;
     }
-    if (is_rotate_event || gbl_rotate_dequeue || gbl_rotate_enqueue) {
-      serial_rotate(is_rotate_event, log);
-      is_rotate_event = 0;
-    }
+    serial_rotate_requested(is_rotate_event, log);
+    serial_rotate_due(log);
     if (gbl_rotate_main_log) {
       log = get_log (log);
     }
-    /* maybe send depth test */
-    if (tm >= depth_tm + depth_dtm) serial_send_buffer_depth_test();
   }
   while (!gbl_done);
 
@@ -0,0 +1,253 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#include "config.h"
+
+#include "shaper.h"
+
+#include "header.h"
+#include "log.h"
+#include "opt.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* One event is 1000 tokens, so rates in events per second refill
+ * exactly "rate" tokens per millisecond. */
+#define TOKENS_PER_EVENT 1000
+
+struct bucket {
+  uint32_t key;                 /* sender IP, 0 is a free slot */
+  uint32_t tokens;
+  uint64_t last;                /* msec of the latest refill */
+};
+
+struct event_limit {
+  unsigned char name[256];      /* length byte first, as in events */
+  uint64_t rate;
+  uint64_t cap;
+  struct bucket b;
+};
+
+static struct bucket senders[SHAPER_SLOTS];
+static int senders_used;
+static uint64_t sender_rate;
+static uint64_t sender_cap;
+
+static struct event_limit events[SHAPER_MAX_EVENTS];
+static int nevents;
+
+static int shaping;
+
+/* Bring a bucket up to date, returns its tokens.  Long idle buckets
+ * simply fill up, the multiplication could overflow otherwise. */
+static uint64_t refill (struct bucket *b, uint64_t rate, uint64_t cap,
+                        uint64_t now)
+{
+  uint64_t tokens = b->tokens;
+
+  if ( now > b->last )
+    {
+      uint64_t elapsed = now - b->last;
+      if ( elapsed > (cap - tokens) / rate )
+        {
+          tokens = cap;
+        }
+      else
+        {
+          tokens += elapsed * rate;
+        }
+      b->last = now;
+    }
+  return tokens;
+}
+
+static struct bucket* sender_bucket (uint32_t ip, uint64_t now)
+{
+  unsigned int i = (ip * 2654435761u) >> 20 & (SHAPER_SLOTS - 1);
+  struct bucket *reuse = NULL;
+
+  if ( ip == 0 )
+    {
+      return NULL;
+    }
+
+  for ( ;; )
+    {
+      struct bucket *b = &senders[i];
+
+      if ( b->key == ip )
+        {
+          return b;
+        }
+      if ( b->key == 0 )
+        {
+          break;
+        }
+      if ( reuse == NULL && now > b->last
+           && now - b->last > (sender_cap - b->tokens) / sender_rate )
+        {
+          reuse = b;
+        }
+      i = (i + 1) & (SHAPER_SLOTS - 1);
+    }
+
+  /* Not there.  Prefer a full bucket on the way, so the probe chains
+   * stay as they are, then a free slot if the table has room. */
+  if ( reuse == NULL )
+    {
+      if ( senders_used >= SHAPER_MAX_USED )
+        {
+          return NULL;
+        }
+      reuse = &senders[i];
+      ++senders_used;
+    }
+  reuse->key = ip;
+  reuse->tokens = sender_cap;
+  reuse->last = now;
+  return reuse;
+}
+
+/* "Name=rate" or "Name=rate/burst", separated by commas. */
+static int parse_event_rates (const char *spec, FILE *log)
+{
+  char *copy = strdup (spec);
+  char *save = NULL;
+  char *tok;
+
+  if ( copy == NULL )
+    {
+      return -1;
+    }
+
+  for ( tok = strtok_r (copy, ",", &save);
+        tok != NULL;
+        tok = strtok_r (NULL, ",", &save) )
+    {
+      struct event_limit *e;
+      char *eq = strchr (tok, '=');
+      char *end;
+      long rate, burst;
+      size_t len;
+
+      if ( eq == NULL || eq == tok || nevents == SHAPER_MAX_EVENTS )
+        {
+          LOG_ER (log, "--event-rate: can't use \"%s\"\n", tok);
+          free (copy);
+          return -1;
+        }
+      len = eq - tok;
+      rate = strtol (eq + 1, &end, 10);
+      burst = rate;
+      if ( *end == '/' )
+        {
+          burst = strtol (end + 1, &end, 10);
+        }
+      if ( *end != '\0' || len > 255 || rate <= 0
+           || burst <= 0 || burst > SHAPER_MAX_BURST )
+        {
+          LOG_ER (log, "--event-rate: can't use \"%s\"\n", tok);
+          free (copy);
+          return -1;
+        }
+
+      e = &events[nevents++];
+      e->name[0] = (unsigned char) len;
+      memcpy (e->name + 1, tok, len);
+      e->rate = rate;
+      e->cap = (uint64_t) burst * TOKENS_PER_EVENT;
+      e->b.tokens = e->cap;
+      LOG_INF (log, "Shaping %s to %ld events per second, bursts of %ld.\n",
+               tok, rate, burst);
+    }
+
+  free (copy);
+  return 0;
+}
+
+int shaper_init (FILE *log)
+{
+  if ( arg_sender_rate > 0 )
+    {
+      int burst = arg_sender_burst > 0 ? arg_sender_burst : arg_sender_rate;
+      if ( burst > SHAPER_MAX_BURST )
+        {
+          burst = SHAPER_MAX_BURST;
+        }
+      sender_rate = arg_sender_rate;
+      sender_cap = (uint64_t) burst * TOKENS_PER_EVENT;
+      LOG_INF (log, "Shaping each sender to %d events per second, "
+               "bursts of %d.\n", arg_sender_rate, burst);
+    }
+
+  if ( arg_event_rate != NULL && parse_event_rates (arg_event_rate, log) )
+    {
+      return -1;
+    }
+
+  shaping = sender_rate > 0 || nevents > 0;
+  return 0;
+}
+
+int shaper_admit (const void *buf, uint64_t now)
+{
+  const unsigned char *name = (const unsigned char *)buf + HEADER_LENGTH;
+  struct bucket *sb = NULL;
+  struct event_limit *el = NULL;
+  uint64_t stokens = 0, etokens = 0;
+  int i;
+
+  if ( ! shaping )
+    {
+      return 1;
+    }
+
+  if ( sender_rate > 0 )
+    {
+      /* a full table lets new senders through unshaped */
+      sb = sender_bucket (header_sender_ip ((const char *)buf), now);
+      if ( sb != NULL )
+        {
+          stokens = refill (sb, sender_rate, sender_cap, now);
+          sb->tokens = stokens;
+        }
+    }
+
+  for ( i = 0; i < nevents; ++i )
+    {
+      if ( toknam_eq (name, events[i].name) )
+        {
+          el = &events[i];
+          etokens = refill (&el->b, el->rate, el->cap, now);
+          el->b.tokens = etokens;
+          break;
+        }
+    }
+
+  if ( ( sb != NULL && stokens < TOKENS_PER_EVENT )
+       || ( el != NULL && etokens < TOKENS_PER_EVENT ) )
+    {
+      /* never hold back a rotation */
+      return header_is_rotate ((void *)buf);
+    }
+
+  if ( sb != NULL )
+    {
+      sb->tokens -= TOKENS_PER_EVENT;
+    }
+  if ( el != NULL )
+    {
+      el->b.tokens -= TOKENS_PER_EVENT;
+    }
+  return 1;
+}
@@ -0,0 +1,43 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#ifndef SHAPER_DOT_H
+#define SHAPER_DOT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Ingest shaping.
+ *
+ * Token buckets per sender IP (--sender-rate, --sender-burst) and per
+ * event type (--event-rate), checked by the enqueuer before the queue
+ * write so one runaway emitter can't fill the queue for everyone.
+ *
+ * Only the enqueuer thread touches the buckets, so they need no locks.
+ * A sender bucket is 16 bytes in an open addressing table, four to a
+ * cache line.  When the table is full, buckets which have refilled
+ * completely are reused, they hold nothing worth keeping.
+ */
+
+#define SHAPER_SLOTS        4096        /* power of two */
+#define SHAPER_MAX_USED     (SHAPER_SLOTS / 4 * 3)
+#define SHAPER_MAX_EVENTS   32
+#define SHAPER_MAX_BURST    4000000     /* tokens are kept in 1/1000ths */
+
+/* Parse the limits, returns 0 on success, -1 if --event-rate is bad. */
+int  shaper_init (FILE *log);
+
+/* Returns 1 if the event (header plus payload) is within its budgets,
+ * and takes its tokens, 0 if it is over.  now is in msec. */
+int  shaper_admit (const void *buf, uint64_t now);
+
+#endif /* SHAPER_DOT_H */
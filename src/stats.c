@@ -15,8 +15,10 @@
 
 #include "stats.h"
 
+#include "live_stats.h"
 #include "log.h"
 #include "lwes_mondemand.h"
+#include "senders.h"
 #include "time_utils.h"
 
 #include <string.h>  /* memset */
@@ -42,6 +44,7 @@ int enqueuer_stats_ctor (struct enqueuer_stats* st)
 
   st->start_time = time (NULL);
   st->last_rotate = st->start_time;
+  st->socket_drops = -1LL;
   md_enqueuer_create (st);
 
   return 0;
@@ -55,6 +58,9 @@ void enqueuer_stats_dtor (struct enqueuer_stats* st)
 void enqueuer_stats_record_socket_error (struct enqueuer_stats* st)
 {
   ++st->socket_errors_since_last_rotate;
+
+  LIVE_ADD (gbl_live_stats->enq.socket_errors_total, 1);
+  LIVE_ADD (gbl_live_stats->enq.socket_errors_since_last_rotate, 1);
 }
 
 void enqueuer_stats_record_datagram (struct enqueuer_stats* st, int bytes)
@@ -63,6 +69,11 @@ void enqueuer_stats_record_datagram (struct enqueuer_stats* st, int bytes)
   st->bytes_received_total             += bytes;
   ++st->packets_received_since_last_rotate;
   ++st->packets_received_total;
+
+  LIVE_ADD (gbl_live_stats->enq.bytes_received_total, bytes);
+  LIVE_ADD (gbl_live_stats->enq.bytes_received_since_last_rotate, bytes);
+  LIVE_ADD (gbl_live_stats->enq.packets_received_total, 1);
+  LIVE_ADD (gbl_live_stats->enq.packets_received_since_last_rotate, 1);
 }
 
 void enqueuer_stats_erase_datagram (struct enqueuer_stats* st, int bytes)
@@ -71,6 +82,44 @@ void enqueuer_stats_erase_datagram (struct enqueuer_stats* st, int bytes)
   st->bytes_received_total             -= bytes;
   --st->packets_received_since_last_rotate;
   --st->packets_received_total;
+
+  LIVE_ADD (gbl_live_stats->enq.bytes_received_total, -bytes);
+  LIVE_ADD (gbl_live_stats->enq.bytes_received_since_last_rotate, -bytes);
+  LIVE_ADD (gbl_live_stats->enq.packets_received_total, -1);
+  LIVE_ADD (gbl_live_stats->enq.packets_received_since_last_rotate, -1);
+}
+
+/* Called for an event over its rate, dropped or diverted. */
+void enqueuer_stats_record_shaped (struct enqueuer_stats* st, int diverted)
+{
+  if ( diverted )
+    {
+      ++st->shaped_diverted_since_last_rotate;
+      LIVE_ADD (gbl_live_stats->enq.shaped_diverted_total, 1);
+    }
+  else
+    {
+      ++st->shaped_dropped_since_last_rotate;
+      LIVE_ADD (gbl_live_stats->enq.shaped_dropped_total, 1);
+    }
+}
+
+/* Called with every backlog sample of the receive socket. */
+void enqueuer_stats_record_backlog (struct enqueuer_stats* st,
+                                    long long bytes, long long drops)
+{
+  st->socket_backlog_bytes = bytes;
+  if ( bytes > st->socket_backlog_hiwat_since_last_rotate )
+    {
+      st->socket_backlog_hiwat_since_last_rotate = bytes;
+    }
+  st->socket_drops = drops;
+
+  LIVE_SET (gbl_live_stats->enq.socket_backlog_bytes, bytes);
+  if ( drops >= 0 )
+    {
+      LIVE_SET (gbl_live_stats->enq.socket_drops_total, drops);
+    }
 }
 
 void enqueuer_stats_rotate(struct enqueuer_stats* st, FILE *log)
@@ -89,6 +138,34 @@ void enqueuer_stats_rotate(struct enqueuer_stats* st, FILE *log)
   LOG_INF(log,"Socket read errors since last rotate: %lld\n",
               st->socket_errors_since_last_rotate);
 
+  if ( st->socket_drops >= 0 )
+    {
+      long long drops = st->socket_drops - st->socket_drops_at_last_rotate;
+      if ( drops )
+        {
+          LOG_ER(log,"*** %lld packets dropped by the kernel in this journal ***\n",
+                 drops);
+        }
+      LOG_INF(log,"Socket backlog since last rotate: %lld bytes at most,"
+              " %lld packets dropped by the kernel.\n",
+              st->socket_backlog_hiwat_since_last_rotate, drops);
+      st->socket_drops_at_last_rotate = st->socket_drops;
+    }
+  else
+    {
+      LOG_INF(log,"Socket backlog since last rotate: %lld bytes at most.\n",
+              st->socket_backlog_hiwat_since_last_rotate);
+    }
+
+  if ( st->shaped_dropped_since_last_rotate
+       || st->shaped_diverted_since_last_rotate )
+    {
+      LOG_WARN(log,"Over their rate since last rotate: %lld events dropped,"
+               " %lld diverted to the overflow journal.\n",
+               st->shaped_dropped_since_last_rotate,
+               st->shaped_diverted_since_last_rotate);
+    }
+
   LOG_INF(log,"Events read since last rotate:\n");
   LOG_INF(log," %lld bytes, %lld packets received.\n",
           st->bytes_received_since_last_rotate,
@@ -106,10 +183,21 @@ void enqueuer_stats_rotate(struct enqueuer_stats* st, FILE *log)
 
   md_enqueuer_stats (st);
 
+  senders_rotate (log, (uint64_t)st->last_rotate * 1000);
+
   st->socket_errors_since_last_rotate = 0LL;
   st->bytes_received_since_last_rotate = 0LL;
   st->packets_received_since_last_rotate = 0LL;
+  st->socket_backlog_hiwat_since_last_rotate = 0LL;
+  st->shaped_dropped_since_last_rotate = 0LL;
+  st->shaped_diverted_since_last_rotate = 0LL;
   st->last_rotate = now;
+
+  LIVE_SET (gbl_live_stats->enq.socket_errors_since_last_rotate, 0);
+  LIVE_SET (gbl_live_stats->enq.bytes_received_since_last_rotate, 0);
+  LIVE_SET (gbl_live_stats->enq.packets_received_since_last_rotate, 0);
+  LIVE_ADD (gbl_live_stats->enq.rotations, 1);
+  LIVE_SET (gbl_live_stats->enq.last_rotate, now);
 }
 
 void enqueuer_stats_report (struct enqueuer_stats* st, FILE *log)
@@ -144,6 +232,7 @@ int dequeuer_stats_ctor (struct dequeuer_stats* st)
   st->hiq_start = st->start_time;
   st->last_rotate = st->start_time;
   st->rotation_type = LJ_RT_NONE;
+  st->depth_slot_secs = 1;
   md_dequeuer_create (st);
 
   return 0;
@@ -201,11 +290,76 @@ void dequeuer_stats_record (struct dequeuer_stats* st, int bytes, int pending)
     {
       st->hiq_since_last_rotate = st->hiq ;
     }
+
+  LIVE_ADD (gbl_live_stats->deq.bytes_written_total, bytes);
+  LIVE_ADD (gbl_live_stats->deq.bytes_written_since_last_rotate, bytes);
+  LIVE_ADD (gbl_live_stats->deq.packets_written_total, 1);
+  LIVE_ADD (gbl_live_stats->deq.packets_written_since_last_rotate, 1);
+  LIVE_SET (gbl_live_stats->deq.hiq_since_last_rotate,
+            st->hiq_since_last_rotate);
+}
+
+void dequeuer_stats_record_loss (struct dequeuer_stats* st, int events)
+{
+  st->loss_since_last_rotate += events;
+
+  LIVE_ADD (gbl_live_stats->deq.loss_total, events);
+  LIVE_ADD (gbl_live_stats->deq.loss_since_last_rotate, events);
+}
+
+/* Called with every depth sample, builds the high water mark timeline
+ * logged at rotation. */
+void dequeuer_stats_record_depth (struct dequeuer_stats* st, int depth)
+{
+  int slot = (time (NULL) - st->last_rotate) / st->depth_slot_secs;
+
+  while ( slot >= DEPTH_TIMELINE_SLOTS )
+    {
+      int i;
+      for ( i = 0; i < DEPTH_TIMELINE_SLOTS / 2; ++i )
+        {
+          st->depth_timeline[i] =
+            st->depth_timeline[2*i] > st->depth_timeline[2*i+1]
+              ? st->depth_timeline[2*i] : st->depth_timeline[2*i+1];
+        }
+      memset (st->depth_timeline + DEPTH_TIMELINE_SLOTS / 2, 0,
+              sizeof (st->depth_timeline) / 2);
+      st->depth_slots = (st->depth_slots + 1) / 2;
+      st->depth_slot_secs *= 2;
+      slot = (time (NULL) - st->last_rotate) / st->depth_slot_secs;
+    }
+  if ( slot < 0 )
+    {
+      slot = 0;
+    }
+
+  if ( depth > st->depth_timeline[slot] )
+    {
+      st->depth_timeline[slot] = depth;
+    }
+  if ( slot >= st->depth_slots )
+    {
+      st->depth_slots = slot + 1;
+    }
+  st->depth = depth;
+
+  LIVE_SET (gbl_live_stats->deq.queue_depth, depth);
 }
 
-void dequeuer_stats_record_loss (struct dequeuer_stats* st)
+/* Time from receipt of an event to its journal write. */
+void dequeuer_stats_record_latency (struct dequeuer_stats* st,
+                                    unsigned long long ms)
 {
-  st->loss_since_last_rotate += 1;
+  (void)st; /* appease -Wall -Werror */
+  live_histogram_record (&gbl_live_stats->deq.latency, ms);
+}
+
+/* Time spent closing a journal and opening the next. */
+void dequeuer_stats_record_rotation (struct dequeuer_stats* st,
+                                     unsigned long long ms)
+{
+  (void)st; /* appease -Wall -Werror */
+  live_histogram_record (&gbl_live_stats->deq.rotate, ms);
 }
 
 
@@ -237,6 +391,20 @@ void dequeuer_stats_rotate(struct dequeuer_stats* st, FILE *log)
           st->packets_written_in_burst_since_last_rotate,
           st->bytes_written_in_burst_since_last_rotate);
 
+  if ( st->depth_slots > 0 )
+    {
+      char timeline[DEPTH_TIMELINE_SLOTS * 12];
+      int i, n = 0;
+
+      for ( i = 0; i < st->depth_slots && n < (int)sizeof(timeline); ++i )
+        {
+          n += snprintf (timeline + n, sizeof(timeline) - n, " %d",
+                         st->depth_timeline[i]);
+        }
+      LOG_INF(log, "Queue depth high water marks since last rotate, "
+              "every %d seconds:%s\n", st->depth_slot_secs, timeline);
+    }
+
   if (st->rotation_type == LJ_RT_EVENT) {
     LOG_INF(log, "Command::Rotate from IP %s traversed the queue in %ld ms\n",
             header_sender_ip_formatted(st->latest_rotate_header),
@@ -262,6 +430,16 @@ void dequeuer_stats_rotate(struct dequeuer_stats* st, FILE *log)
   st->loss_since_last_rotate = 0LL;
   st->last_rotate = now;
   st->rotation_type = LJ_RT_NONE;
+  memset (st->depth_timeline, 0, sizeof(st->depth_timeline));
+  st->depth_slots = 0;
+  st->depth_slot_secs = 1;
+
+  LIVE_SET (gbl_live_stats->deq.bytes_written_since_last_rotate, 0);
+  LIVE_SET (gbl_live_stats->deq.packets_written_since_last_rotate, 0);
+  LIVE_SET (gbl_live_stats->deq.loss_since_last_rotate, 0);
+  LIVE_SET (gbl_live_stats->deq.hiq_since_last_rotate, 0);
+  LIVE_ADD (gbl_live_stats->deq.rotations, 1);
+  LIVE_SET (gbl_live_stats->deq.last_rotate, now);
 }
 
 void dequeuer_stats_report (struct dequeuer_stats* st, FILE *log)
@@ -28,6 +28,11 @@ typedef enum {
     LJ_RT_NONE, LJ_RT_EVENT
 } lj_rotation_t;
 
+/* Number of slots in the per-rotation queue depth timeline; when a
+ * rotation outlasts them, neighbouring slots are merged and the slot
+ * width doubles. */
+#define DEPTH_TIMELINE_SLOTS 60
+
 struct enqueuer_stats {
   long long socket_errors_since_last_rotate;
 
@@ -37,6 +42,14 @@ struct enqueuer_stats {
   long long packets_received_total;
   long long packets_received_since_last_rotate;
 
+  long long socket_backlog_bytes;       /* Latest sampled receive backlog. */
+  long long socket_backlog_hiwat_since_last_rotate;
+  long long socket_drops;               /* Kernel drops, -1 if unknown. */
+  long long socket_drops_at_last_rotate;
+
+  long long shaped_dropped_since_last_rotate;   /* Over their rate. */
+  long long shaped_diverted_since_last_rotate;  /* Sent to --overflow-journal. */
+
   time_t start_time;
   time_t last_rotate;
 #ifdef HAVE_MONDEMAND
@@ -63,6 +76,11 @@ struct dequeuer_stats {
 
   int hiq_since_last_rotate;    /* Highest high water mark since last rotate. */
 
+  int depth;                    /* Latest sampled queue depth. */
+  int depth_timeline[DEPTH_TIMELINE_SLOTS]; /* High water mark per slot. */
+  int depth_slots;              /* Slots used since last rotate. */
+  int depth_slot_secs;          /* Width of a slot. */
+
   long long bytes_written_in_burst_since_last_rotate;
   long long packets_written_in_burst_since_last_rotate;
 
@@ -81,13 +99,22 @@ void enqueuer_stats_dtor (struct enqueuer_stats* stats);
 void enqueuer_stats_record_socket_error (struct enqueuer_stats* stats);
 void enqueuer_stats_record_datagram (struct enqueuer_stats* stats, int bytes);
 void enqueuer_stats_erase_datagram (struct enqueuer_stats* stats, int bytes);
+void enqueuer_stats_record_shaped (struct enqueuer_stats* stats, int diverted);
+void enqueuer_stats_record_backlog (struct enqueuer_stats* stats,
+                                    long long bytes, long long drops);
 void enqueuer_stats_rotate (struct enqueuer_stats* st, FILE *log);
 void enqueuer_stats_report (struct enqueuer_stats* stats, FILE *log);
 void enqueuer_stats_flush (struct enqueuer_stats* stats);
 
 int dequeuer_stats_ctor (struct dequeuer_stats* stats);
 void dequeuer_stats_record (struct dequeuer_stats* stats, int bytes, int pending);
-void dequeuer_stats_record_loss (struct dequeuer_stats* stats);
+void dequeuer_stats_record_loss (struct dequeuer_stats* stats,
+                                 int events);
+void dequeuer_stats_record_depth (struct dequeuer_stats* stats, int depth);
+void dequeuer_stats_record_latency (struct dequeuer_stats* stats,
+                                    unsigned long long ms);
+void dequeuer_stats_record_rotation (struct dequeuer_stats* stats,
+                                     unsigned long long ms);
 void dequeuer_stats_rotate (struct dequeuer_stats* stats, FILE *log);
 void dequeuer_stats_report (struct dequeuer_stats* stats, FILE *log);
 void dequeuer_stats_flush (struct dequeuer_stats* stats);
@@ -0,0 +1,489 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include "tap.h"
+
+#include "header.h"
+#include "log.h"
+#include "opt.h"
+#include "perror.h"
+#include "sig.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#if HAVE_PTHREAD_H
+
+#include <pthread.h>
+
+#include "ringbuf.h"
+
+/* How often the tap thread moves data from the rings to the sockets
+ * while anyone is subscribed; the journal writer never wakes it. */
+#define TAP_FLUSH_MS 10
+
+enum tap_state { TAP_FREE, TAP_HELLO, TAP_ACTIVE };
+
+struct subscriber {
+  pthread_mutex_t     lock;         /* guards ring and active */
+  int                 active;       /* the journal writer may publish */
+  ringbuf*            ring;
+
+  /* Owned by the tap thread. */
+  enum tap_state      state;
+  int                 fd;
+  char                hello[512];
+  size_t              hello_len;
+  int                 blocked;      /* socket full, wait for POLLOUT */
+  unsigned long long  sent;
+
+  /* Filter, set before the subscriber goes active. */
+  int                 nnames;
+  unsigned char       names[TAP_MAX_NAMES][256]; /* length, then name */
+
+  unsigned long long  dropped;      /* written by the journal writer */
+};
+
+static struct subscriber  subs[TAP_MAX_SUBSCRIBERS];
+static int                tap_active = 0;
+static int                listen_fd = -1;
+static pthread_t          tap_tid;
+static int                tap_running = 0;
+static FILE*              tap_log = NULL;
+
+static int matches (const struct subscriber *s,
+                    const unsigned char *name, size_t avail)
+{
+  int i;
+
+  if ( s->nnames == 0 )
+    {
+      return 1;
+    }
+  if ( avail == 0 || (size_t)name[0] + 1 > avail )
+    {
+      return 0;
+    }
+  for ( i = 0; i < s->nnames; ++i )
+    {
+      if ( s->names[i][0] == name[0]
+           && memcmp (s->names[i] + 1, name + 1, name[0]) == 0 )
+        {
+          return 1;
+        }
+    }
+  return 0;
+}
+
+void tap_publish (const void *buf, size_t len)
+{
+  const unsigned char *name = (const unsigned char *)buf + HEADER_LENGTH;
+  size_t avail = len > HEADER_LENGTH ? len - HEADER_LENGTH : 0;
+  int i;
+
+  if ( __atomic_load_n (&tap_active, __ATOMIC_RELAXED) == 0 )
+    {
+      return;
+    }
+
+  for ( i = 0; i < TAP_MAX_SUBSCRIBERS; ++i )
+    {
+      struct subscriber *s = &subs[i];
+
+      if ( ! __atomic_load_n (&s->active, __ATOMIC_RELAXED) )
+        {
+          continue;
+        }
+      if ( pthread_mutex_trylock (&s->lock) != 0 )
+        {
+          /* the tap thread is on this ring right now, never wait */
+          __atomic_add_fetch (&s->dropped, 1, __ATOMIC_RELAXED);
+          continue;
+        }
+      if ( s->active && matches (s, name, avail)
+           && ringbuf_put (s->ring, buf, len) < 0 )
+        {
+          __atomic_add_fetch (&s->dropped, 1, __ATOMIC_RELAXED);
+        }
+      pthread_mutex_unlock (&s->lock);
+    }
+}
+
+static void subscriber_close (struct subscriber *s)
+{
+  if ( s->state == TAP_ACTIVE )
+    {
+      pthread_mutex_lock (&s->lock);
+      s->active = 0;
+      ringbuf_free (s->ring);
+      s->ring = NULL;
+      pthread_mutex_unlock (&s->lock);
+      __atomic_sub_fetch (&tap_active, 1, __ATOMIC_RELAXED);
+
+      LOG_INF (tap_log, "Tap subscriber on fd %d left, %llu bytes sent, "
+               "%llu events dropped.\n", s->fd, s->sent,
+               __atomic_load_n (&s->dropped, __ATOMIC_RELAXED));
+    }
+  close (s->fd);
+  s->fd = -1;
+  s->state = TAP_FREE;
+}
+
+/* Parse the subscription line and start publishing to s. */
+static void subscriber_activate (struct subscriber *s, char *line)
+{
+  char *tok, *save = NULL;
+
+  s->nnames = 0;
+  for ( tok = strtok_r (line, " ,\t\r", &save);
+        tok != NULL && s->nnames < TAP_MAX_NAMES;
+        tok = strtok_r (NULL, " ,\t\r", &save) )
+    {
+      size_t n = strlen (tok);
+      if ( n > 255 )
+        {
+          continue;
+        }
+      s->names[s->nnames][0] = (unsigned char) n;
+      memcpy (s->names[s->nnames] + 1, tok, n);
+      ++s->nnames;
+    }
+
+  s->ring = ringbuf_new (arg_tap_buffer);
+  if ( s->ring == NULL )
+    {
+      LOG_ER (tap_log, "Unable to allocate %d bytes for a tap subscriber.\n",
+              arg_tap_buffer);
+      subscriber_close (s);
+      return;
+    }
+  s->dropped = 0;
+  s->sent = 0;
+  s->blocked = 0;
+  s->state = TAP_ACTIVE;
+
+  pthread_mutex_lock (&s->lock);
+  s->active = 1;
+  pthread_mutex_unlock (&s->lock);
+  __atomic_add_fetch (&tap_active, 1, __ATOMIC_RELAXED);
+
+  LOG_INF (tap_log, "Tap subscriber on fd %d joined, %d event names.\n",
+           s->fd, s->nnames);
+}
+
+static void subscriber_read (struct subscriber *s)
+{
+  char junk[512];
+  ssize_t r;
+
+  if ( s->state == TAP_HELLO )
+    {
+      char *nl;
+
+      r = read (s->fd, s->hello + s->hello_len,
+                sizeof (s->hello) - 1 - s->hello_len);
+      if ( r <= 0 )
+        {
+          if ( r < 0 && errno == EAGAIN )
+            {
+              return;
+            }
+          subscriber_close (s);
+          return;
+        }
+      s->hello_len += r;
+      s->hello[s->hello_len] = '\0';
+      nl = strchr (s->hello, '\n');
+      if ( nl != NULL )
+        {
+          *nl = '\0';
+          subscriber_activate (s, s->hello);
+        }
+      else if ( s->hello_len == sizeof (s->hello) - 1 )
+        {
+          subscriber_close (s);
+        }
+      return;
+    }
+
+  /* Anything more from an active subscriber is ignored, but end of file
+   * means it went away. */
+  r = read (s->fd, junk, sizeof (junk));
+  if ( r == 0 || ( r < 0 && errno != EAGAIN ) )
+    {
+      subscriber_close (s);
+    }
+}
+
+static void subscriber_flush (struct subscriber *s)
+{
+  for ( ;; )
+    {
+      char *data;
+      size_t len;
+      ssize_t w;
+
+      /* The writer only fills free space, so the pending chunk can be
+       * sent without holding the lock. */
+      pthread_mutex_lock (&s->lock);
+      len = ringbuf_get_next_chunk (s->ring, &data);
+      pthread_mutex_unlock (&s->lock);
+      if ( len == 0 )
+        {
+          s->blocked = 0;
+          return;
+        }
+
+      w = send (s->fd, data, len, MSG_NOSIGNAL|MSG_DONTWAIT);
+      if ( w < 0 )
+        {
+          if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+              s->blocked = 1;
+              return;
+            }
+          subscriber_close (s);
+          return;
+        }
+
+      pthread_mutex_lock (&s->lock);
+      ringbuf_mark_consumed (s->ring, w);
+      pthread_mutex_unlock (&s->lock);
+      s->sent += w;
+    }
+}
+
+static void tap_accept (void)
+{
+  int fd = accept (listen_fd, NULL, NULL);
+  int i;
+
+  if ( fd < 0 )
+    {
+      return;
+    }
+  for ( i = 0; i < TAP_MAX_SUBSCRIBERS; ++i )
+    {
+      if ( subs[i].state == TAP_FREE )
+        {
+          fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+          subs[i].fd = fd;
+          subs[i].hello_len = 0;
+          subs[i].state = TAP_HELLO;
+          return;
+        }
+    }
+
+  LOG_WARN (tap_log, "Too many tap subscribers, turning one away.\n");
+  close (fd);
+}
+
+static void* tap_main (void *arg)
+{
+  struct pollfd pfd[TAP_MAX_SUBSCRIBERS + 1];
+  int owner[TAP_MAX_SUBSCRIBERS + 1];
+  int i;
+  (void)arg; /* appease -Wall -Werror */
+
+#ifdef HAVE_PTHREAD_SETNAME_NP_2
+  pthread_setname_np (pthread_self(), "tap");
+#endif
+#ifdef HAVE_PTHREAD_SETNAME_NP_1
+  pthread_setname_np ("tap");
+#endif
+
+  while ( ! gbl_done )
+    {
+      int n = 0;
+
+      pfd[n].fd = listen_fd;
+      pfd[n].events = POLLIN;
+      owner[n++] = -1;
+      for ( i = 0; i < TAP_MAX_SUBSCRIBERS; ++i )
+        {
+          if ( subs[i].state != TAP_FREE )
+            {
+              pfd[n].fd = subs[i].fd;
+              pfd[n].events = POLLIN | (subs[i].blocked ? POLLOUT : 0);
+              owner[n++] = i;
+            }
+        }
+
+      if ( poll (pfd, n, tap_active ? TAP_FLUSH_MS : arg_wakeup_interval_ms)
+           < 0 )
+        {
+          continue;
+        }
+
+      for ( i = 1; i < n; ++i )
+        {
+          struct subscriber *s = &subs[owner[i]];
+
+          if ( pfd[i].revents & (POLLERR|POLLHUP|POLLNVAL) )
+            {
+              subscriber_close (s);
+            }
+          else if ( pfd[i].revents & POLLIN )
+            {
+              subscriber_read (s);
+            }
+        }
+      if ( pfd[0].revents & POLLIN )
+        {
+          tap_accept ();
+        }
+
+      for ( i = 0; i < TAP_MAX_SUBSCRIBERS; ++i )
+        {
+          if ( subs[i].state == TAP_ACTIVE )
+            {
+              subscriber_flush (&subs[i]);
+            }
+        }
+    }
+
+  for ( i = 0; i < TAP_MAX_SUBSCRIBERS; ++i )
+    {
+      if ( subs[i].state != TAP_FREE )
+        {
+          subscriber_close (&subs[i]);
+        }
+    }
+
+  return NULL;
+}
+
+int tap_start (FILE *log)
+{
+  struct sockaddr_un addr;
+  sigset_t all, old;
+  int i;
+
+  if ( arg_tap_socket == NULL )
+    {
+      return 0;
+    }
+  tap_log = log;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if ( strlen (arg_tap_socket) >= sizeof (addr.sun_path) )
+    {
+      LOG_ER (log, "Tap socket path \"%s\" is too long.\n", arg_tap_socket);
+      return -1;
+    }
+  strcpy (addr.sun_path, arg_tap_socket);
+
+  listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if ( listen_fd < 0 )
+    {
+      PERROR (log, "socket");
+      return -1;
+    }
+  unlink (arg_tap_socket);
+  if ( bind (listen_fd, (struct sockaddr *)&addr, sizeof (addr)) < 0
+       || listen (listen_fd, TAP_MAX_SUBSCRIBERS) < 0 )
+    {
+      PERROR (log, "bind");
+      LOG_ER (log, "Unable to listen on tap socket \"%s\".\n",
+              arg_tap_socket);
+      close (listen_fd);
+      listen_fd = -1;
+      return -1;
+    }
+
+  for ( i = 0; i < TAP_MAX_SUBSCRIBERS; ++i )
+    {
+      memset (&subs[i], 0, sizeof (subs[i]));
+      pthread_mutex_init (&subs[i].lock, NULL);
+      subs[i].fd = -1;
+      subs[i].state = TAP_FREE;
+    }
+
+  /* signals are for the threads of the process model in use, never
+   * for this one */
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  if ( pthread_create (&tap_tid, NULL, tap_main, NULL) != 0 )
+    {
+      PERROR (log, "pthread_create(tap)");
+      pthread_sigmask (SIG_SETMASK, &old, NULL);
+      close (listen_fd);
+      listen_fd = -1;
+      unlink (arg_tap_socket);
+      return -1;
+    }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  tap_running = 1;
+
+  LOG_INF (log, "Tap listening on \"%s\".\n", arg_tap_socket);
+  return 0;
+}
+
+void tap_stop (FILE *log)
+{
+  int i;
+
+  if ( ! tap_running )
+    {
+      return;
+    }
+  if ( pthread_join (tap_tid, NULL) != 0 )
+    {
+      PERROR (log, "pthread_join(tap)");
+    }
+  tap_running = 0;
+
+  close (listen_fd);
+  listen_fd = -1;
+  unlink (arg_tap_socket);
+  for ( i = 0; i < TAP_MAX_SUBSCRIBERS; ++i )
+    {
+      pthread_mutex_destroy (&subs[i].lock);
+    }
+}
+
+#else
+
+int tap_start (FILE *log)
+{
+  if ( arg_tap_socket != NULL )
+    {
+      LOG_WARN (log, "No POSIX thread support, --tap-socket ignored.\n");
+    }
+  return 0;
+}
+
+void tap_stop (FILE *log)
+{
+  (void)log; /* appease -Wall -Werror */
+}
+
+void tap_publish (const void *buf, size_t len)
+{
+  (void)buf; /* appease -Wall -Werror */
+  (void)len; /* appease -Wall -Werror */
+}
+
+#endif
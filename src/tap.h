@@ -0,0 +1,42 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+#ifndef TAP_DOT_H
+#define TAP_DOT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Live tap of the journal stream.
+ *
+ * Local clients connect to the Unix socket named by --tap-socket and
+ * send one line: the event names they want, separated by spaces or
+ * commas, or an empty line for everything.  From then on they receive
+ * every matching event exactly as it is written to the journal, header
+ * and payload, so what they save is an uncompressed journal.
+ *
+ * Each subscriber has a ring of --tap-buffer bytes.  The journal writer
+ * only ever try-locks a ring and drops the event for that subscriber
+ * when the ring is busy or full, so a slow subscriber can't hold up
+ * journaling.
+ */
+
+#define TAP_MAX_SUBSCRIBERS 16
+#define TAP_MAX_NAMES       16
+
+int  tap_start (FILE *log);
+void tap_stop (FILE *log);
+
+/* Offer an event (header plus payload) to the subscribers. */
+void tap_publish (const void *buf, size_t len);
+
+#endif /* TAP_DOT_H */
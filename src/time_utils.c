@@ -109,3 +109,21 @@ millis_now (void)
   micro_now(&t);
   return millis_timestamp (&t);
 }
+
+time_t
+interval_start (unsigned long long ms, const unsigned int interval)
+{
+  time_t t = ms / 1000;
+  time_t second_in_day = t - t / 86400 * 86400;
+
+  return t - second_in_day + second_in_day / interval * interval;
+}
+
+time_t
+interval_end (time_t start, const unsigned int interval)
+{
+  time_t day_end = start - start % 86400 + 86400;
+
+  return start + (time_t)interval < day_end ? start + (time_t)interval
+                                            : day_end;
+}
@@ -38,4 +38,15 @@ micro_timestamp (struct timeval *val);
 unsigned long long
 millis_now (void);
 
+/* Start of the interval the time ms falls in, rounded in the day as
+ * time_to_next_round_interval() does; seconds since the epoch. */
+time_t
+interval_start (unsigned long long ms, const unsigned int interval);
+
+/* End of the interval from start, which is where the next begins: the
+ * day ends the last interval of the day early when interval does not
+ * divide it. */
+time_t
+interval_end (time_t start, const unsigned int interval);
+
 #endif /* TIME_UTILS_DOT_H */
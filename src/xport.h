@@ -19,8 +19,27 @@
 
 #define XPORT_INTR -2
 
+/* Most datagrams read_many() takes at once. */
+#define XPORT_BATCH_MAX 32
+
 struct xport;
 
+/* Receive backlog of a transport, as far as the platform can tell it,
+ * -1 where it can't. */
+struct xport_backlog {
+  long long bytes;      /* Waiting to be read, as the kernel accounts it. */
+  long long drops;      /* Dropped by the kernel since the open. */
+};
+
+/* A datagram for read_many(): count is the room at buf going in, the
+ * datagram's length coming out. */
+struct xport_msg {
+  void*         buf;
+  size_t        count;
+  unsigned long addr;
+  short         port;
+};
+
 struct xport_vtbl {
   void  (*destructor) (struct xport* this_xport);
 
@@ -29,7 +48,14 @@ struct xport_vtbl {
 
   int   (*read)       (struct xport* this_xport, void* buf, size_t count,
                        unsigned long* addr, short* port);
+  /* Waits for a datagram as read() does, then takes those already
+   * waiting as well, up to n; how many were read, or as read(). */
+  int   (*read_many)  (struct xport* this_xport, struct xport_msg* msgs,
+                       int n);
   int   (*write)      (struct xport* this_xport, const void* buf, size_t count);
+
+  /* Cheap, but still a system call, so sample it on a timer. */
+  int   (*backlog)    (struct xport* this_xport, struct xport_backlog* bl);
 };
 
 struct xport {
@@ -16,9 +16,12 @@
 #include "xport_to_queue.h"
 
 #include "header.h"
+#include "journal.h"
 #include "opt.h"
 #include "perror.h"
 #include "queue.h"
+#include "senders.h"
+#include "shaper.h"
 #include "sig.h"
 #include "xport.h"
 #include "stats.h"
@@ -27,19 +30,105 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 static void skd(FILE *log);
 
 struct enqueuer_stats est ;
 
+#define MAX_CRITICAL_EVENTS 32
+
+/* --critical-event names, with their length bytes as in events. */
+static unsigned char critical_events[MAX_CRITICAL_EVENTS][256];
+static int ncritical_events = 0;
+
+static void parse_critical_events(FILE *log)
+{
+  char *copy, *save = NULL, *tok;
+
+  if ( arg_critical_events == NULL
+       || (copy = strdup(arg_critical_events)) == NULL )
+    {
+      return;
+    }
+
+  for ( tok = strtok_r(copy, ", ", &save);
+        tok != NULL;
+        tok = strtok_r(NULL, ", ", &save) )
+    {
+      size_t len = strlen(tok);
+      if ( len > 255 || ncritical_events == MAX_CRITICAL_EVENTS )
+        {
+          LOG_WARN(log, "Ignoring critical event \"%s\".\n", tok);
+          continue;
+        }
+      critical_events[ncritical_events][0] = (unsigned char)len;
+      memcpy(critical_events[ncritical_events] + 1, tok, len);
+      ++ncritical_events;
+    }
+
+  free(copy);
+}
+
+/* Longest an event waits in a batch for the rest of it, in msec. */
+#define QUEUE_BATCH_HOLD_MS 10
+
+static void queue_write_batch(struct queue *que, struct queue_msg *msgs,
+                              int n, FILE *log)
+{
+  int written = que->vtbl->write_many(que, msgs, n);
+
+  if ( written < n )
+    {
+      LOG_ER(log, "Queue write error attempting to write %d of %d messages.\n",
+             n - (written > 0 ? written : 0), n);
+    }
+  else
+    {
+      LOG_PROG(log, "Queue write of %d messages.\n", n);
+    }
+}
+
+static int queue_lane(unsigned char *buf)
+{
+  int i;
+
+  /* Cut at event time, journals need events dequeued in the order
+   * they came: one overtaking the backlog into the next interval would
+   * close the interval with its events still queued. */
+  if ( arg_rotate_event_time )
+    {
+      return QUEUE_LANE_BULK;
+    }
+  if ( header_is_rotate(buf) )
+    {
+      return QUEUE_LANE_CONTROL;
+    }
+  for ( i = 0; i < ncritical_events; ++i )
+    {
+      if ( toknam_eq(buf + HEADER_LENGTH, critical_events[i]) )
+        {
+          return QUEUE_LANE_CRITICAL;
+        }
+    }
+  return QUEUE_LANE_BULK;
+}
+
 int xport_to_queue(FILE *log)
 {
   struct xport xpt;
   struct queue que;
+  struct journal ovf;
+  int ovf_open = 0;
 
+  struct queue_msg msgs[QUEUE_BATCH_MAX];
   unsigned char* buf = 0;
   size_t bufsiz;
+  int batch = 1;
+  int nheld = 0;
+  int i;
+  unsigned long long backlog_due = 0, held_since = 0;
 
   enqueuer_stats_ctor(&est);
 
@@ -62,23 +151,47 @@ int xport_to_queue(FILE *log)
       exit(EXIT_FAILURE);
     }
 
-  buf = (unsigned char*)que.vtbl->alloc(&que, &bufsiz);
-  if ( 0 == buf )
+  parse_critical_events(log);
+
+  if ( shaper_init(log) < 0 )
     {
-      LOG_ER(log, "unable to allocate %d bytes for message buffer.\n", bufsiz);
+      LOG_ER(log, "Failed to set up ingest shaping.\n");
       exit(EXIT_FAILURE);
     }
-  memset(buf, 0, bufsiz);
 
-  /* Read a packet from the transport, write it to the queue. */
-  while ( ! gbl_done )
+  if ( arg_overflow_journal != NULL )
     {
-      int que_write_ret;
+      if ( (journal_factory(&ovf, arg_overflow_journal, log) < 0)
+           || (ovf.vtbl->open(&ovf, O_WRONLY, log) < 0) )
+        {
+          LOG_ER(log, "Failed to open the overflow journal \"%s\".\n",
+                 arg_overflow_journal);
+          exit(EXIT_FAILURE);
+        }
+      ovf_open = 1;
+    }
 
+  for ( i = 0; i < QUEUE_BATCH_MAX; ++i )
+    {
+      msgs[i].buf = que.vtbl->alloc(&que, &bufsiz);
+      if ( 0 == msgs[i].buf )
+        {
+          LOG_ER(log, "unable to allocate %d bytes for message buffer.\n",
+                 bufsiz);
+          exit(EXIT_FAILURE);
+        }
+      memset(msgs[i].buf, 0, bufsiz);
+    }
+
+  /* Read packets from the transport, write them to the queue. */
+  while ( ! gbl_done )
+    {
       unsigned long long tm;
       unsigned long addr;
       short port;
 
+      buf = (unsigned char*)msgs[nheld].buf;
+
       /* 0 out part of the the event name so if we get a rotate event
        * the program will not continually rotate */
       memset(buf, 0, HEADER_LENGTH+20);
@@ -87,11 +200,27 @@ int xport_to_queue(FILE *log)
                                         buf + HEADER_LENGTH,
                                         bufsiz - HEADER_LENGTH,
                                         &addr, &port);
+      tm = millis_now ();
+      if ( tm >= backlog_due )
+        {
+          struct xport_backlog bl;
+          if ( xpt.vtbl->backlog(&xpt, &bl) == 0 )
+            {
+              enqueuer_stats_record_backlog(&est, bl.bytes, bl.drops);
+            }
+          /* Batch the queue writes only while the dequeuer is behind. */
+          if ( (i = que.vtbl->depth(&que)) >= 0 )
+            {
+              batch = i < 2 ? 1 : i < QUEUE_BATCH_MAX ? i : QUEUE_BATCH_MAX;
+            }
+          backlog_due = tm + arg_depth_interval;
+        }
+
       if (xpt_read_ret >= 0 )
         {
-          tm = millis_now ();
           enqueuer_stats_record_datagram(&est, xpt_read_ret + HEADER_LENGTH);
           header_add(buf, xpt_read_ret, tm, addr, port);
+          senders_record(buf, xpt_read_ret + HEADER_LENGTH);
         }
       else if (xpt_read_ret == XPORT_INTR)
         {
@@ -115,6 +244,15 @@ int xport_to_queue(FILE *log)
             {
               enqueuer_stats_rotate(&est, log);
               enqueuer_stats_flush (&est);
+              if ( ovf_open
+                   && ( ovf.vtbl->close(&ovf, log) < 0
+                        || ovf.vtbl->open(&ovf, O_WRONLY, log) < 0 ) )
+                {
+                  LOG_ER(log, "Failed to rotate the overflow journal \"%s\", "
+                         "dropping events over their rate from now on.\n",
+                         arg_overflow_journal);
+                  ovf_open = 0;
+                }
             }
           if (gbl_rotate_enqueue)
             {
@@ -130,23 +268,54 @@ int xport_to_queue(FILE *log)
 
       if (xpt_read_ret != XPORT_INTR)
         {
-          if ( (que_write_ret = que.vtbl->write(&que,
-                                                buf,
-                                                xpt_read_ret + HEADER_LENGTH)) < 0 )
+          /* Over its sender's or its type's rate: it does not go in
+           * the queue, so it can't crowd out everybody else's. */
+          if ( ! shaper_admit(buf, tm) )
             {
-              LOG_ER(log, "Queue write error attempting to write %d bytes.\n",
-                     xpt_read_ret + HEADER_LENGTH);
-              continue;
+              int diverted = ovf_open
+                && ovf.vtbl->write(&ovf, buf, xpt_read_ret + HEADER_LENGTH)
+                     == xpt_read_ret + HEADER_LENGTH;
+              enqueuer_stats_record_shaped(&est, diverted);
             }
           else
             {
-              LOG_PROG(log, "Queue write of %d bytes.\n",
-                       xpt_read_ret + HEADER_LENGTH);
+              msgs[nheld].count = xpt_read_ret + HEADER_LENGTH;
+              msgs[nheld].lane = queue_lane(buf);
+              if ( nheld++ == 0 )
+                {
+                  held_since = tm;
+                }
             }
         }
+
+      /* A batch never holds an event for long, and an idle transport,
+       * a rotation or shutdown send what there is right away. */
+      if ( nheld > 0
+           && ( nheld >= batch
+                || xpt_read_ret == XPORT_INTR
+                || header_is_rotate(buf)
+                || gbl_done
+                || tm - held_since >= QUEUE_BATCH_HOLD_MS ) )
+        {
+          queue_write_batch(&que, msgs, nheld, log);
+          nheld = 0;
+        }
     }
 
-  que.vtbl->dealloc(&que, buf);
+  if ( nheld > 0 )
+    {
+      queue_write_batch(&que, msgs, nheld, log);
+    }
+
+  for ( i = 0; i < QUEUE_BATCH_MAX; ++i )
+    {
+      que.vtbl->dealloc(&que, msgs[i].buf);
+    }
+
+  if ( arg_overflow_journal != NULL )
+    {
+      ovf.vtbl->destructor(&ovf, log);
+    }
 
   xpt.vtbl->destructor(&xpt);
   que.vtbl->destructor(&que);
@@ -15,10 +15,12 @@
 
 #include "opt.h"
 #include "sig.h"
+#include "live_stats.h"
 #include "log.h"
 #include "xport_to_queue.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 int main(int argc, const char* argv[])
 {
@@ -34,12 +36,23 @@ int main(int argc, const char* argv[])
         exit(EXIT_FAILURE);
     }
 
+  /* The other end of the queue is another program. */
+  if ( strcmp(arg_queue_type, ARG_RING) == 0 )
+    {
+      LOG_ER(log, "--queue-type " ARG_RING " needs both ends in one "
+             "process, use lwes-journaller.\n");
+      exit(EXIT_FAILURE);
+    }
+
   install_termination_signal_handlers (log);
   install_rotate_signal_handlers (log);
   install_log_rotate_signal_handlers (log, 0, SIGUSR1);
 
+  live_stats_open (0, log);
+
   int r = xport_to_queue (log);
 
+  live_stats_close (0, log);
   close_log (log);
 
   return r;
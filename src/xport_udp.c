@@ -11,6 +11,7 @@
  * limitations under the License. See accompanying LICENSE file.        *
  *======================================================================*/
 
+#define _GNU_SOURCE     /* recvmmsg() */
 #include "config.h"
 
 #include "xport.h"
@@ -20,13 +21,22 @@
 #include "opt.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <lwes.h>
 
+#if HAVE_LINUX_SOCK_DIAG_H
+#include <linux/sock_diag.h>
+#endif
+
 struct ppriv {
   char *address;
   short port;
@@ -106,6 +116,66 @@ static int xread (struct xport* this_xport, void* buf, size_t count,
   return recvfrom_ret;
 }
 
+static int xread_many (struct xport* this_xport, struct xport_msg* msgs,
+                       int n)
+{
+#if HAVE_RECVMMSG
+  struct ppriv* ppriv=
+    (struct ppriv *)this_xport->priv;
+  struct mmsghdr hdr[XPORT_BATCH_MAX];
+  struct iovec iov[XPORT_BATCH_MAX];
+  struct sockaddr_in from[XPORT_BATCH_MAX];
+  struct pollfd pfd;
+  int i, r;
+
+  n = n < XPORT_BATCH_MAX ? n : XPORT_BATCH_MAX;
+
+  /* the wait is the same as lwes_net_recv_bytes_by() */
+  pfd.fd = ppriv->conn.socketfd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if ( (r = poll (&pfd, 1, arg_wakeup_interval_ms)) <= 0 )
+    {
+      return r == 0 || errno == EINTR ? XPORT_INTR : -1;
+    }
+
+  memset (hdr, 0, n * sizeof(hdr[0]));
+  for ( i = 0; i < n; ++i )
+    {
+      iov[i].iov_base = msgs[i].buf;
+      iov[i].iov_len = msgs[i].count;
+      hdr[i].msg_hdr.msg_iov = &iov[i];
+      hdr[i].msg_hdr.msg_iovlen = 1;
+      hdr[i].msg_hdr.msg_name = &from[i];
+      hdr[i].msg_hdr.msg_namelen = sizeof(from[i]);
+    }
+
+  if ( (r = recvmmsg (pfd.fd, hdr, n, MSG_DONTWAIT, NULL)) < 0 )
+    {
+      return errno == EAGAIN || errno == EINTR ? XPORT_INTR : -1;
+    }
+
+  for ( i = 0; i < r; ++i )
+    {
+      msgs[i].count = hdr[i].msg_len;
+      msgs[i].addr = from[i].sin_addr.s_addr;
+      msgs[i].port = ntohs(from[i].sin_port);
+    }
+  return r;
+#else
+  int r;
+
+  (void)n; /* appease -Wall -Werror */
+
+  if ( (r = xread (this_xport, msgs[0].buf, msgs[0].count,
+                   &msgs[0].addr, &msgs[0].port)) < 0 )
+    {
+      return r;
+    }
+  msgs[0].count = r;
+  return 1;
+#endif
+}
 
 static int xwrite (struct xport* this_xport, const void* buf, size_t count)
 {
@@ -115,6 +185,38 @@ static int xwrite (struct xport* this_xport, const void* buf, size_t count)
   return lwes_net_send_bytes (&ppriv->conn, (LWES_BYTE_P)buf, count);
 }
 
+static int xbacklog (struct xport* this_xport, struct xport_backlog* bl)
+{
+  struct ppriv* ppriv=
+    (struct ppriv *)this_xport->priv;
+  int next = 0;
+
+#if HAVE_LINUX_SOCK_DIAG_H && defined(SO_MEMINFO)
+  uint32_t mem[SK_MEMINFO_VARS];
+  socklen_t len = sizeof(mem);
+
+  /* Everything queued on the socket and the drop counter in one call. */
+  if ( getsockopt (ppriv->conn.socketfd, SOL_SOCKET, SO_MEMINFO,
+                   mem, &len) == 0 )
+    {
+      bl->bytes = mem[SK_MEMINFO_RMEM_ALLOC];
+      bl->drops = mem[SK_MEMINFO_DROPS];
+      return 0;
+    }
+#endif
+
+  /* For UDP this is only the size of the next datagram, which at least
+   * tells an empty socket from a busy one. */
+  if ( ioctl (ppriv->conn.socketfd, FIONREAD, &next) < 0 )
+    {
+      return -1;
+    }
+  bl->bytes = next;
+  bl->drops = -1;
+
+  return 0;
+}
+
 int xport_udp_ctor (struct xport* this_xport,
                     const char*   address,
                     const char*   iface,
@@ -124,7 +226,8 @@ int xport_udp_ctor (struct xport* this_xport,
   static struct xport_vtbl vtbl = {
       destructor,
       xopen, xclose,
-      xread, xwrite
+      xread, xread_many, xwrite,
+      xbacklog
   };
 
   struct ppriv* ppriv;
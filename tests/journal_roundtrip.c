@@ -0,0 +1,418 @@
+/*======================================================================*
+ * Copyright (c) 2010-2016, OpenX Inc.   All rights reserved.           *
+ *                                                                      *
+ * Licensed under the New BSD License (the "License"); you may not use  *
+ * this file except in compliance with the License.  Unless required    *
+ * by applicable law or agreed to in writing, software distributed      *
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT        *
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.     *
+ * See the License for the specific language governing permissions and  *
+ * limitations under the License. See accompanying LICENSE file.        *
+ *======================================================================*/
+
+/* Writes file, gz and dz journals, raw and delta encoded, and checks
+ * that journal_reader gives back exactly the headers and events that
+ * went in. */
+
+#include "config.h"
+
+#include "header.h"
+#include "journal.h"
+#include "journal_delta.h"
+#include "journal_reader.h"
+#include "opt.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NEVENTS         20000
+#define NSENDERS        (JOURNAL_DELTA_SENDERS_MAX + 36)
+#define BIG_PAYLOAD     60000
+
+static unsigned long seed = 1;
+
+static unsigned long next_random (void)
+{
+  seed = seed * 1103515245UL + 12345UL;
+  return (seed >> 16) & 0x7fff;
+}
+
+static void put_be (unsigned char *p, unsigned long long v, int n)
+{
+  while ( n-- > 0 )
+    {
+      p[n] = (unsigned char)v;
+      v >>= 8;
+    }
+}
+
+/* Events with senders enough to fill a delta block's table, receipt
+ * times which now and then step back, payloads from empty to nearly
+ * the largest a header can give, of a few event types for dz. */
+static unsigned char* make_events (size_t *len)
+{
+  unsigned char *buf =
+    (unsigned char *) malloc (NEVENTS * 512 + 4 * BIG_PAYLOAD);
+  unsigned char *p = buf;
+  unsigned long long ts = 1700000000000ULL;
+  int i;
+
+  if ( buf == NULL )
+    {
+      return NULL;
+    }
+
+  for ( i = 0; i < NEVENTS; ++i )
+    {
+      unsigned long sender = next_random () % NSENDERS;
+      size_t size = next_random () % 400;
+      size_t j;
+
+      if ( i % 5000 == 17 )
+        {
+          size = BIG_PAYLOAD;
+        }
+      if ( i % 97 == 0 )
+        {
+          ts -= next_random () % 1000;
+        }
+      else
+        {
+          ts += next_random () % 50;
+        }
+
+      put_be (p, size, 2);
+      put_be (p + RECEIPT_TIME_OFFSET, ts, 8);
+      put_be (p + SENDER_IP_OFFSET, 0x0a000000UL + sender, 4);
+      put_be (p + SENDER_PORT_OFFSET, 1024 + sender, 2);
+      put_be (p + SITE_ID_OFFSET, sender % 3, 2);
+      put_be (p + EXTENSION_OFFSET, i % 7 == 0 ? next_random () : 0, 4);
+      p += HEADER_LENGTH;
+
+      for ( j = 0; j < size; ++j )
+        {
+          p[j] = j % 3 == 0 ? (unsigned char)next_random () : 'a' + j % 26;
+        }
+      if ( size >= 16 )
+        {
+          p[0] = 12;
+          memcpy (p + 1, "Test::Event", 11);
+          p[12] = '0' + i % 4;
+        }
+      p += size;
+    }
+
+  *len = p - buf;
+  return buf;
+}
+
+#define NJOURNALS       2
+#define NSAMESECOND     3
+
+static int compare_paths (const void *a, const void *b)
+{
+  return strcmp ((const char *)a, (const char *)b);
+}
+
+/* The journals as renamed at their close, all the files in dir but
+ * the dz dictionary, in name order, which is the order of their
+ * ranges. */
+static int find_journals (const char *dir, char paths[][PATH_MAX], int want)
+{
+  DIR *d = opendir (dir);
+  struct dirent *e;
+  int found = 0;
+
+  if ( d == NULL )
+    {
+      return -1;
+    }
+  while ( (e = readdir (d)) != NULL )
+    {
+      size_t n = strlen (e->d_name);
+      if ( e->d_name[0] == '.'
+           || (n > 5 && strcmp (e->d_name + n - 5, ".dict") == 0) )
+        {
+          continue;
+        }
+      if ( found < want )
+        {
+          snprintf (paths[found], PATH_MAX, "%s/%s", dir, e->d_name);
+        }
+      ++found;
+    }
+  closedir (d);
+  if ( found == want )
+    {
+      qsort (paths, found, PATH_MAX, compare_paths);
+    }
+  return found == want ? 0 : -1;
+}
+
+static void clean (const char *dir)
+{
+  DIR *d = opendir (dir);
+  struct dirent *e;
+  char path[PATH_MAX];
+
+  if ( d != NULL )
+    {
+      while ( (e = readdir (d)) != NULL )
+        {
+          if ( e->d_name[0] != '.' )
+            {
+              snprintf (path, sizeof (path), "%s/%s", dir, e->d_name);
+              unlink (path);
+            }
+        }
+      closedir (d);
+    }
+  rmdir (dir);
+}
+
+static int write_events (struct journal *jrn,
+                         const unsigned char *events, size_t len)
+{
+  const unsigned char *p;
+
+  if ( jrn->vtbl->open (jrn, O_WRONLY, stderr) < 0 )
+    {
+      return -1;
+    }
+  /* event by event, as the journaller writes them */
+  for ( p = events; p < events + len;
+        p += HEADER_LENGTH + header_payload_length ((const char *)p) )
+    {
+      int size = HEADER_LENGTH + header_payload_length ((const char *)p);
+      if ( jrn->vtbl->write (jrn, (void *)p, size) != size )
+        {
+          return -1;
+        }
+    }
+  return 0;
+}
+
+static int write_journal (struct journal *jrn, time_t start,
+                          const unsigned char *events, size_t len)
+{
+  if ( write_events (jrn, events, len) < 0 )
+    {
+      return -1;
+    }
+  /* named for a range of its own, so the journals can't collide */
+  jrn->vtbl->set_range (jrn, start, start + 60);
+  return jrn->vtbl->close (jrn, stderr);
+}
+
+static int read_journal (const char *path, const unsigned char *events,
+                         size_t len)
+{
+  struct journal_reader *r = journal_reader_open (path, 0);
+  unsigned char *back = (unsigned char *) malloc (len + 1);
+  size_t got = 0;
+  int n = -1;
+
+  /* odd sized reads, so headers and payloads are split across them */
+  while ( r != NULL && back != NULL
+          && (n = journal_reader_read (r, back + got,
+                                       got + 4093 <= len + 1
+                                       ? 4093 : len + 1 - got)) > 0 )
+    {
+      got += n;
+    }
+  journal_reader_close (r);
+
+  if ( n < 0 || got != len || memcmp (back, events, len) != 0 )
+    {
+      fprintf (stderr, "%s: read back %lu bytes of %lu, %s\n", path,
+               (unsigned long)got, (unsigned long)len,
+               n < 0 ? "then an error" :
+               got == len ? "which differ" : "short");
+      free (back);
+      return -1;
+    }
+  free (back);
+  return 0;
+}
+
+/* Two journals from one journal object: for dz the second is
+ * compressed with the dictionary trained on the first. */
+static int roundtrip (const char *type, const char *encoding,
+                      const unsigned char *events, size_t len)
+{
+  char dir[] = "/tmp/journal_roundtrip.XXXXXX";
+  char name[PATH_MAX];
+  char paths[NJOURNALS][PATH_MAX];
+  struct journal jrn;
+  int i, ret = -1;
+
+  arg_journ_type = type;
+  arg_journal_encoding = encoding;
+
+  if ( mkdtemp (dir) == NULL )
+    {
+      perror ("mkdtemp");
+      return -1;
+    }
+  snprintf (name, sizeof (name), "%s/all.log.%s", dir, type);
+
+  if ( journal_factory (&jrn, name, stderr) < 0 )
+    {
+      fprintf (stderr, "%s %s: can't make a journal\n", type, encoding);
+      goto done;
+    }
+  for ( i = 0; i < NJOURNALS; ++i )
+    {
+      if ( write_journal (&jrn, 1700000000 + i * 60, events, len) < 0 )
+        {
+          fprintf (stderr, "%s %s: can't write %s\n", type, encoding, name);
+          jrn.vtbl->destructor (&jrn, stderr);
+          goto done;
+        }
+    }
+  jrn.vtbl->destructor (&jrn, stderr);
+
+  if ( find_journals (dir, paths, NJOURNALS) < 0 )
+    {
+      fprintf (stderr, "%s %s: the journals are not in %s\n",
+               type, encoding, dir);
+      goto done;
+    }
+  for ( i = 0; i < NJOURNALS; ++i )
+    {
+      if ( read_journal (paths[i], events, len) < 0 )
+        {
+          goto done;
+        }
+    }
+  printf ("%s %s: %d journals of %lu bytes\n", type, encoding, NJOURNALS,
+          (unsigned long)len);
+  ret = 0;
+
+done:
+  clean (dir);
+  return ret;
+}
+
+/* The length of the first n events. */
+static size_t first_events (const unsigned char *events, int n)
+{
+  const unsigned char *p = events;
+
+  while ( n-- > 0 )
+    {
+      p += HEADER_LENGTH + header_payload_length ((const char *)p);
+    }
+  return p - events;
+}
+
+/* Journals rotated by size or count are closed several a second,
+ * under the same name but for a sequence number: none of them may be
+ * renamed over another. */
+static int same_second (const char *type, const unsigned char *events,
+                        size_t len)
+{
+  char dir[] = "/tmp/journal_roundtrip.XXXXXX";
+  char name[PATH_MAX];
+  char paths[NSAMESECOND][PATH_MAX];
+  struct journal jrn;
+  time_t before, after;
+  int i, tries, ret = -1;
+
+  arg_journ_type = type;
+  arg_journal_encoding = ARG_ENC_RAW;
+
+  /* retried should a second tick over between the closes */
+  for ( tries = 0; ; ++tries )
+    {
+      if ( mkdtemp (strcpy (dir, "/tmp/journal_roundtrip.XXXXXX")) == NULL )
+        {
+          perror ("mkdtemp");
+          return -1;
+        }
+      snprintf (name, sizeof (name), "%s/all.log.%s", dir, type);
+
+      if ( journal_factory (&jrn, name, stderr) < 0 )
+        {
+          fprintf (stderr, "%s: can't make a journal\n", type);
+          goto done;
+        }
+      before = time (NULL);
+      for ( i = 0; i < NSAMESECOND; ++i )
+        {
+          if ( write_events (&jrn, events, len) < 0
+               || jrn.vtbl->close (&jrn, stderr) < 0 )
+            {
+              fprintf (stderr, "%s: can't write %s\n", type, name);
+              jrn.vtbl->destructor (&jrn, stderr);
+              goto done;
+            }
+        }
+      after = time (NULL);
+      jrn.vtbl->destructor (&jrn, stderr);
+      if ( before == after || tries == 4 )
+        {
+          break;
+        }
+      clean (dir);
+    }
+
+  if ( find_journals (dir, paths, NSAMESECOND) < 0 )
+    {
+      fprintf (stderr, "%s: %d journals closed in one second are not all"
+               " in %s\n", type, NSAMESECOND, dir);
+      goto done;
+    }
+  for ( i = 0; i < NSAMESECOND; ++i )
+    {
+      if ( read_journal (paths[i], events, len) < 0 )
+        {
+          goto done;
+        }
+    }
+  printf ("%s: %d journals closed in one second\n", type, NSAMESECOND);
+  ret = 0;
+
+done:
+  clean (dir);
+  return ret;
+}
+
+int main (void)
+{
+  static const char *types[] = { ARG_FILE, ARG_GZ, ARG_DZ };
+  static const char *encodings[] = { ARG_ENC_RAW, ARG_ENC_DELTA };
+  unsigned char *events;
+  size_t len;
+  int failed = 0;
+  unsigned int t, e;
+
+  if ( (events = make_events (&len)) == NULL )
+    {
+      fprintf (stderr, "out of memory\n");
+      return 1;
+    }
+
+  for ( t = 0; t < sizeof (types) / sizeof (types[0]); ++t )
+    {
+      for ( e = 0; e < sizeof (encodings) / sizeof (encodings[0]); ++e )
+        {
+          if ( roundtrip (types[t], encodings[e], events, len) < 0 )
+            {
+              ++failed;
+            }
+        }
+      if ( same_second (types[t], events, first_events (events, 100)) < 0 )
+        {
+          ++failed;
+        }
+    }
+
+  free (events);
+  return failed ? 1 : 0;
+}